@@ -28,6 +28,7 @@ class scene_t;
 class colorOutput_t;
 class progressBar_t;
 class imageHandler_t;
+class threadPool_t;
 
 class YAFRAYCORE_EXPORT renderEnvironment_t
 {
@@ -55,6 +56,7 @@ class YAFRAYCORE_EXPORT renderEnvironment_t
 		background_t* 	getBackground(const std::string &name)const;
 		integrator_t* 	getIntegrator(const std::string &name)const;
 		scene_t * 		getScene() { return curren_scene; };
+		threadPool_t &	getThreadPool() const { return *threadPool; } //!< worker threads shared by all render and preprocessing tasks
 		
 		light_t* 		createLight		(const std::string &name, paraMap_t &params);
 		light_t*	 	removeLight		(const std::string &name);
@@ -70,7 +72,7 @@ class YAFRAYCORE_EXPORT renderEnvironment_t
 		shaderNode_t* 	createShaderNode(const std::string &name, paraMap_t &params);
 		volumeHandler_t* createVolumeH(const std::string &name, const paraMap_t &params);
 		VolumeRegion*	createVolumeRegion(const std::string &name, paraMap_t &params);
-		imageFilm_t*	createImageFilm(const paraMap_t &params, colorOutput_t &output);
+		imageFilm_t*	createImageFilm(const paraMap_t &params, colorOutput_t &output, int numViews = 1);
 		imageHandler_t* createImageHandler(const std::string &name, paraMap_t &params, bool addToTable = true);
 		void 			setScene(scene_t *scene) { curren_scene=scene; };
 		bool			setupScene(scene_t &scene, const paraMap_t &params, colorOutput_t &output, progressBar_t *pb = nullptr);
@@ -136,6 +138,7 @@ class YAFRAYCORE_EXPORT renderEnvironment_t
 		scene_t *curren_scene;
 		renderPasses_t renderPasses;
 		colorOutput_t *output2; //secondary color output to export to file at the same time it's exported to Blender
+		threadPool_t *threadPool;
 };
 
 __END_YAFRAY
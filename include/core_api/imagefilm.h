@@ -31,6 +31,7 @@
 #include <core_api/environment.h>
 #include <utilities/image_buffers.h>
 #include <utilities/tiled_array.h>
+#include <atomic>
 
 #ifdef HAVE_OPENCV
 #include <opencv2/photo/photo.hpp>
@@ -50,6 +51,29 @@ __BEGIN_YAFRAY
 class progressBar_t;
 class renderPasses_t;
 class colorPasses_t;
+class serialQueue_t;
+class mappedFile_t;
+
+#define IMAGE_FILM_LOCK_STRIPES 64 //!< rows of the film are protected by this many mutexes, row y by y % IMAGE_FILM_LOCK_STRIPES
+#define IMAGE_FILM_MAPPED_TILE_BITS 5 //!< out of core passes are stored in tiles of 32x32 pixels, a whole number of 4KB pages each
+
+/*!	Samples of the area a render thread is working on, including the filter border
+	around it, for all image and auxiliary passes. addSample() accumulates here
+	without locking and imageFilm_t::mergeArea() adds the result to the film.
+*/
+struct tileBuffer_t
+{
+	void reset(int xMin, int yMin, int xMax, int yMax, int passes)
+	{
+		x0 = xMin; y0 = yMin;
+		w = xMax - xMin; h = yMax - yMin;
+		nPasses = passes;
+		data.assign((size_t)w * h * nPasses, pixel_t());
+	}
+	pixel_t &operator()(int pass, int x, int y) { return data[((size_t)pass * h + (y - y0)) * w + (x - x0)]; }
+	int x0 = 0, y0 = 0, w = 0, h = 0, nPasses = 0;
+	std::vector<pixel_t> data;
+};
 
 // Image types define
 #define IF_IMAGE 1
@@ -88,10 +112,13 @@ class YAFRAYCORE_EXPORT imageFilm_t
 			LANCZOS
 		};
 
-		/*! imageFilm_t Constructor */
+		/*! imageFilm_t Constructor
+			\param views number of camera views rendered together, the film holds them side by side
+				and numView of the outputs is taken from the pixel column
+			\param outOfCoreDir if not empty, the passes are kept in memory-mapped files in this directory instead of RAM */
 		imageFilm_t(int width, int height, int xstart, int ystart, colorOutput_t &out, float filterSize=1.0, filterType filt=BOX,
 		renderEnvironment_t *e = nullptr, bool showSamMask = false, int tSize = 32,
-		imageSpliter_t::tilesOrderType tOrder=imageSpliter_t::LINEAR, bool pmA = false);
+		imageSpliter_t::tilesOrderType tOrder=imageSpliter_t::LINEAR, bool pmA = false, int views = 1, const std::string &outOfCoreDir = "");
 		/*! imageFilm_t Destructor */
 		~imageFilm_t();
 		/*! Initialize imageFilm for new rendering, i.e. set pixels black etc */
@@ -102,19 +129,33 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		int nextPass(int numView, bool adaptive_AA, std::string integratorName, bool skipNextPass = false);
 		/*! Return the next area to be rendered
 			CAUTION! This method MUST be threadsafe!
+			\param threadID render thread asking for work, selects its tile queue
 			\return false if no area is left to be handed out, true otherwise */
-		bool nextArea(int numView, renderArea_t &a);
-		/*! Indicate that all pixels inside the area have been sampled for this pass */
+		bool nextArea(int numView, renderArea_t &a, int threadID = 0);
+		/*! Add the samples collected in the tile buffer of area a to the film.
+			Pixels only reachable from inside a are added without locking, the filter border shared with
+			neighbouring areas under the row locks. Thread safe, must be called before finishArea() */
+		void mergeArea(renderArea_t &a);
+		/*! Indicate that all pixels inside the area have been sampled for this pass.
+			The area is copied and handed to the output thread, outputs and autosaves never run on the calling thread */
 		void finishArea(int numView, renderArea_t &a);
-		/*! Output all pixels to the color output */
+		/*! Output all pixels to the color output, after everything queued for the output thread is done */
 		void flush(int numView, int flags = IF_ALL, colorOutput_t *out = nullptr);
+		/*! Wait until the output thread has finished all queued area outputs and autosaves */
+		void waitForOutput();
 		/*! query if sample (x,y) was flagged to need more samples.
 			IMPORTANT! You may only call this after you have called nextPass(true, ...), otherwise
 			no such flags have been created !! */
 		bool doMoreSamples(int x, int y) const;
+		/*! Relative standard error of the mean brightness of a pixel, estimated from the sample moments of the PASS_INT_AA_NOISE pass */
+		static float pixelNoise(const pixel_t &moments);
+		/*! Color written to the outputs for a pixel of a pass of the given internal type, before the color space conversion.
+			Passes holding a plain sampled color are black unless image is set */
+		static colorA_t passColor(intPassTypes_t intPassType, const pixel_t &pixel, bool image = true);
 		/*!	Add image sample; dx and dy describe the position in the pixel (x,y).
 			IMPORTANT: when a is given, all samples within a are assumed to come from the same thread!
 			use a=0 for contributions outside the area associated with current thread!
+			Samples of an area with a tile buffer only show up in the film after mergeArea().
 		*/
 		void addSample(colorPasses_t &colorPasses, int x, int y, float dx, float dy, const renderArea_t *a = nullptr, int numSample = 0, int AA_pass_number = 0, float inv_AA_max_possible_samples = 0.1f);
 		/*!	Add light density sample; dx and dy describe the position in the pixel (x,y).
@@ -134,27 +175,42 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		void setPremult2(bool premult);
 		/*! Sets the adaptative AA sampling threshold */
 		void setAAThreshold(float thresh){ AA_thesh=thresh; }
+		/*! Sets the relative noise a pixel has to reach to stop being resampled, 0 uses the AA threshold instead.
+			Needs the PASS_INT_AA_NOISE auxiliary pass for the sample moments */
+		void setAANoiseTarget(float target){ AA_noise_target = target; }
+		float getAANoiseTarget() const { return AA_noise_target; }
 		/*! Sets a custom progress bar in the image film */
 		void setProgressBar(progressBar_t *pb);
 		/*! The following methods set the strings used for the parameters badge rendering */
-		int getTotalPixels() const { return w*h; };
+		int getTotalPixels() const { return w * (regionY1 - regionY0); }; //!< pixels rendered by this computer node
 		void setAANoiseParams(bool detect_color_noise, int dark_detection_type, float dark_threshold_factor, int variance_edge_size, int variance_pixels, float clamp_samples);
 		/*! Methods for rendering the parameters badge; Note that FreeType lib is needed to render text */
 		void drawRenderSettings(std::stringstream & ss);
         float dark_threshold_curve_interpolate(float pixel_brightness);
         int getWidth() const { return w; }
         int getHeight() const { return h; }
+        int getNumViews() const { return numViews; }
+        int getViewWidth() const { return viewWidth; }
+        int getViewOfColumn(int x) const { return x / viewWidth; } //!< view rendered at film column x (relative to getCX0()) when getNumViews() > 1
         int getCX0() const { return cx0; }
         int getCY0() const { return cy0; }
         int getTileSize() const { return tileSize; }
+        void setProgressive(bool enable) { progressive = enable; } //!< split the frame into interleaved blocks of full scanlines instead of tiles
+        bool isProgressive() const { return progressive; }
         int getCurrentPass() const { return nPass; }
         int getNumPasses() const { return nPasses; }
         bool getBackgroundResampling() const { return backgroundResampling; }
+        bool isOutOfCore() const { return !mappedPasses.empty(); }
         void setBackgroundResampling(bool background_resampling) { backgroundResampling = background_resampling; }
         unsigned int getComputerNode() const { return computerNode; }
         unsigned int getBaseSamplingOffset() const { return baseSamplingOffset + computerNode * 100000; } //We give to each computer node a "reserved space" of 100,000 samples
         unsigned int getSamplingOffset() const { return samplingOffset; }
         void setComputerNode(unsigned int computer_node) { computerNode = computer_node; }
+        //! number of computer nodes rendering the samples of every pixel, each node its share
+        void setSamplesNodes(int nodes) { samplesNodes = nodes; }
+        int getSamplesNodes() const { return samplesNodes; }
+        //! only render the film rows [y0, y1), the rest of the film stays empty for the other computer nodes to fill
+        void setRenderRegion(int y0, int y1) { regionY0 = y0; regionY1 = y1; }
         void setBaseSamplingOffset(unsigned int offset) { baseSamplingOffset = offset; }
         void setSamplingOffset(unsigned int offset) { samplingOffset = offset; }
 		
@@ -172,7 +228,10 @@ class YAFRAYCORE_EXPORT imageFilm_t
         void resetImagesAutoSaveTimer() { imagesAutoSaveTimer = 0.0; }
 
         void setFilmFileSaveLoad(int film_file_save_load) { filmFileSaveLoad = film_file_save_load; }
+        int getFilmFileSaveLoad() const { return filmFileSaveLoad; }
         void setFilmFileSaveBinaryFormat(bool binary_format) { filmFileSaveBinaryFormat = binary_format; }
+        bool getFilmFileSaveBinaryFormat() const { return filmFileSaveBinaryFormat; }
+        void setFilmFileSaveCompressed(bool compressed) { filmFileSaveCompressed = compressed; }
         void setFilmAutoSaveIntervalType(int interval_type) { filmAutoSaveIntervalType = interval_type; }
         void setFilmAutoSaveIntervalSeconds(double interval_seconds) { filmAutoSaveIntervalSeconds = interval_seconds; }
         void setFilmAutoSaveIntervalPasses(int interval_passes) { filmAutoSaveIntervalPasses = interval_passes; }
@@ -181,7 +240,7 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		void generateDebugFacesEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement = 0, colorOutput_t * out2 = nullptr, int out2displacement = 0);
 		void generateToonAndDebugObjectEdges(int numView, int idxPass, int xstart, int width, int ystart, int height, bool drawborder, colorOutput_t * out1, int out1displacement = 0, colorOutput_t * out2 = nullptr, int out2displacement = 0);
 		
-		rgba2DImage_t * getImagePassFromIntPassType(int intPassType);
+		passImage_t * getImagePassFromIntPassType(int intPassType);
         int getImagePassIndexFromIntPassType(int intPassType);
         int getAuxImagePassIndexFromIntPassType(int intPassType);
         
@@ -194,15 +253,47 @@ class YAFRAYCORE_EXPORT imageFilm_t
 #endif
 
 	protected:
-		std::vector<rgba2DImage_t*> imagePasses; //!< rgba color buffers for the render passes
-		std::vector<rgba2DImage_t*> auxImagePasses; //!< rgba color buffers for the auxiliary image passes
+		//! How addSample() accumulates a sample into a pass of the film
+		enum passAccumulate_t
+		{
+			ACCUMULATE_FILTERED,	//!< the sample color splatted with the filter weights
+			ACCUMULATE_AA_SAMPLES,	//!< sample counter spread evenly over the filter footprint
+			ACCUMULATE_AA_NOISE,	//!< brightness moments of the pixel the sample was taken in
+			ACCUMULATE_RENDER_TIME,	//!< render time of the pixel the sample was taken in
+		};
+		struct passSlot_t
+		{
+			passAccumulate_t accumulate;
+			int colorIndex; //!< index of the internal pass in colorPasses_t
+		};
+
+		void outputArea(int numView, int x0, int y0, int areaW, int areaH, const std::vector<pixel_t> &pixels);
+		void flushPasses(int numView, int flags, colorOutput_t *out, const std::vector<passImage_t*> &passes);
+		bool queueAutoSave(int numView, colorOutput_t *imagesOut, bool saveFilm);
+		//! copy row y to the autosave snapshot if it has not been, the caller holds its rowMutex stripe
+		void preserveRow(int y);
+		void copyRowToSnapshot(int y);
+		bool rowNeedsSnapshot(int y) const { return snapshotActive.load() && !snapshotRowCopied[y].load(std::memory_order_acquire); }
+		int rowStripe(int y) const { return (y + cy0) % IMAGE_FILM_LOCK_STRIPES; } //!< lock stripe of film row y
+		passImage_t* newPass(std::vector<std::pair<passImage_t*, mappedFile_t*>> &mapped, int channels, bool halfPrecision);
+		void clearPass(passImage_t *pass);
+		void releaseArea(int x0, int y0, int x1, int y1);
+		void releasePasses(const std::vector<std::pair<passImage_t*, mappedFile_t*>> &mapped);
+		int viewOffset(int numView) const { return (numViews > 1) ? numView * viewWidth : 0; } //!< first film column of a view
+		int viewOfColumn(int x, int numView) const { return (numViews > 1) ? x / viewWidth : numView; }
+
+		std::vector<passImage_t*> imagePasses; //!< color buffers for the render passes, with the channels and precision each pass declares
+		std::vector<passImage_t*> auxImagePasses; //!< color buffers for the auxiliary image passes
+		std::vector<passSlot_t> passPlan; //!< how to accumulate into the image passes followed by the auxiliary ones, compiled once from the render passes
+		std::vector<int> planColors; //!< colorPasses_t indices the filtered slots read, each once
 		rgb2DImage_nw_t *densityImage; //!< storage for z-buffer channel
 		rgba2DImage_nw_t *dpimage; //!< render parameters badge image
 		tiledBitArray2D_t<3> *flags = nullptr; //!< flags for adaptive AA sampling;
 		int dpHeight; //!< height of the rendering parameters badge;
 		int w, h, cx0, cx1, cy0, cy1;
-		int area_cnt, completed_cnt;
-		volatile int next_area;
+		int numViews, viewWidth; //!< views side by side, w = numViews * viewWidth
+		int area_cnt;
+		int completed_pixels; //!< pixels of finished areas in this pass, tiles may be split so areas are not counted
 		colorSpaces_t colorSpace = RAW_MANUAL_GAMMA;
 		float gamma = 1.f;
 		colorSpaces_t colorSpace2 = RAW_MANUAL_GAMMA;	//For optional secondary file output
@@ -214,22 +305,43 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		int AA_variance_edge_size;
 		int AA_variance_pixels;
 		float AA_clamp_samples;
+		float AA_noise_target = 0.f;
 		float filterw, tableScale;
 		float *filterTable;
 		colorOutput_t *output;
 		// Thread mutes for shared access
-		std::mutex imageMutex, splitterMutex, outMutex, densityImageMutex;
+		std::mutex outMutex;
+		std::mutex densityRowMutex[IMAGE_FILM_LOCK_STRIPES]; //!< protect the density image row by row, light path splats land anywhere on it
+		std::mutex statusMutex; //!< progress bar and autosave timers of finishArea()
+		std::mutex rowMutex[IMAGE_FILM_LOCK_STRIPES]; //!< protect the image passes row by row
+		std::vector<tileBuffer_t> tileBuffers; //!< one per render thread
+		serialQueue_t *outputQueue = nullptr; //!< output thread writing finished areas and autosaves
+		/*!	Copy on write snapshot of the film for autosaving: while active, every row is copied
+			to the snapshot before it is written to for the first time, the output thread copies the rest */
+		std::vector<passImage_t*> snapshotPasses, snapshotAuxPasses;
+		std::vector<std::atomic<bool>> snapshotRowCopied;
+		std::atomic<int> rowLockFreeWriters[IMAGE_FILM_LOCK_STRIPES]; //!< threads merging safe areas into rows of the stripe without the row lock
+		std::atomic<bool> snapshotActive { false };
+		std::atomic<bool> autoSaveQueued { false }; //!< an autosave is waiting for or being written by the output thread
+		bool filmSaveFromSnapshot = false; //!< save() writes the snapshot, only set on the output thread
+		unsigned int snapshotSamplingOffset = 0;
+		std::string outOfCoreDir; //!< directory of the memory-mapped pass files, empty = passes in RAM
+		std::vector<std::pair<passImage_t*, mappedFile_t*>> mappedPasses; //!< passes of the film kept out of core and their files
+		std::vector<std::pair<passImage_t*, mappedFile_t*>> mappedSnapshotPasses; //!< the same for the autosave snapshot
+		int regionY0 = 0, regionY1 = 0; //!< film rows rendered, the whole film unless setRenderRegion() was called
 		bool split = true;
-		bool abort = false;
+		std::atomic<bool> abort { false };
 		bool estimateDensity = false;
-		int numDensitySamples = 0;
+		std::atomic<int> numDensitySamples { 0 };
 		imageSpliter_t *splitter = nullptr;
+		tileScheduler_t scheduler; //!< hands out the tiles of splitter to the render threads
 		progressBar_t *pbar = nullptr;
 		renderEnvironment_t *env;
 		int nPass;
 		bool showMask;
 		int tileSize;
 		imageSpliter_t::tilesOrderType tilesOrder;
+		bool progressive = false;
 		bool premultAlpha;
 		bool premultAlpha2 = false;	//For optional secondary file output
 		int nPasses;
@@ -239,6 +351,7 @@ class YAFRAYCORE_EXPORT imageFilm_t
         unsigned int baseSamplingOffset = 0;	//Base sampling offset, in case of multi-computer rendering each should have a different offset so they don't "repeat" the same samples (user configurable)
         unsigned int samplingOffset = 0;	//To ensure sampling after loading the image film continues and does not repeat already done samples
         unsigned int computerNode = 0;	//Computer node in multi-computer render environments/render farms
+        int samplesNodes = 1;	//Computer nodes sharing the samples of the pixels, so the subpixel positions have to come from the offset sequences
 
 		//Options for AutoSaving output images
 		int imagesAutoSaveIntervalType = AUTOSAVE_NONE;
@@ -249,7 +362,8 @@ class YAFRAYCORE_EXPORT imageFilm_t
 
 		//Options for Saving/AutoSaving/Loading the internal imageFilm image buffers
 		int filmFileSaveLoad = FILM_FILE_NONE;
-		bool filmFileSaveBinaryFormat = true;
+		bool filmFileSaveBinaryFormat = true;	//Chunked binary film file (see filmFile_t) instead of a Boost text archive
+		bool filmFileSaveCompressed = false;	//Deflate the chunks of binary film files
 		int filmAutoSaveIntervalType = AUTOSAVE_NONE;
 		double filmAutoSaveIntervalSeconds = 300.0;
 		double filmAutoSaveTimer = 0.0; //Internal timer for Film AutoSave
@@ -276,7 +390,7 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		};
 		
 		//IMPORTANT: change the FILM_STRUCTURE_VERSION string if there are significant changes in the film structure
-		#define FILM_STRUCTURE_VERSION "1.0"
+		#define FILM_STRUCTURE_VERSION "2.0"
 		
 		filmload_check_t filmload_check;
         
@@ -285,11 +399,11 @@ class YAFRAYCORE_EXPORT imageFilm_t
 		{
 			Y_DEBUG<<"FilmSave computerNode="<<computerNode<<" baseSamplingOffset="<<baseSamplingOffset<<" samplingOffset="<<samplingOffset<<yendl;
 			ar & BOOST_SERIALIZATION_NVP(filmload_check);
-			ar & BOOST_SERIALIZATION_NVP(samplingOffset);
+			ar & boost::serialization::make_nvp("samplingOffset", filmSaveFromSnapshot ? snapshotSamplingOffset : samplingOffset);
 			ar & BOOST_SERIALIZATION_NVP(baseSamplingOffset);
 			ar & BOOST_SERIALIZATION_NVP(computerNode);
-			ar & BOOST_SERIALIZATION_NVP(imagePasses);
-			ar & BOOST_SERIALIZATION_NVP(auxImagePasses);
+			ar & boost::serialization::make_nvp("imagePasses", filmSaveFromSnapshot ? snapshotPasses : imagePasses);
+			ar & boost::serialization::make_nvp("auxImagePasses", filmSaveFromSnapshot ? snapshotAuxPasses : auxImagePasses);
 		}
 		template<class Archive> void load(Archive & ar, const unsigned int version)
 		{
@@ -5,6 +5,10 @@
 #include <yafray_config.h>
 
 #include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <cmath>
 
 #include <boost/archive/xml_iarchive.hpp>
@@ -18,6 +22,8 @@
 
 __BEGIN_YAFRAY
 
+struct tileBuffer_t;
+
 struct renderArea_t
 {
 	renderArea_t(int x,int y,int w,int h):X(x),Y(y),W(w),H(h),
@@ -54,6 +60,7 @@ struct renderArea_t
 //	std::vector<colorA_t> image;
 //	std::vector<float> depth;
 	std::vector<bool> resample;
+	tileBuffer_t *accum = nullptr; //!< samples of this area are collected here until imageFilm_t::mergeArea(), set by imageFilm_t::nextArea()
 
 	friend class boost::serialization::access;
 	template<class Archive> void serialize(Archive & ar, const unsigned int version)
@@ -83,11 +90,16 @@ class imageSpliter_t
 	public:
 		enum tilesOrderType { LINEAR, RANDOM, CENTRE_RANDOM };
 		imageSpliter_t() {};
-		imageSpliter_t(int w, int h, int x0,int y0, int bsize, tilesOrderType torder, int nthreads);
+		imageSpliter_t(int w, int h, int x0,int y0, int bsize, tilesOrderType torder): imageSpliter_t(w, h, x0, y0, bsize, bsize, torder) {}
+		//! split into blocks of bw x bh pixels, e.g. blocks of full scanlines with bw = w
+		imageSpliter_t(int w, int h, int x0,int y0, int bw, int bh, tilesOrderType torder) : imageSpliter_t(w, h, x0, y0, bw, bh, torder, 1) {}
+		/*! split views images of w x h placed side by side, starting at x0. Every view is split the same way and
+			the tiles at the same position of all views follow each other, so the views are rendered interleaved */
+		imageSpliter_t(int w, int h, int x0,int y0, int bw, int bh, tilesOrderType torder, int views);
 		/* return the n-th area to be rendered.
 			\return false if n is out of range, true otherwise
 		*/
-		bool getArea(int n, renderArea_t &area);
+		bool getArea(int n, renderArea_t &area) const;
 
 		bool empty()const {return regions.empty();};
 		int size()const {return regions.size();};
@@ -121,6 +133,46 @@ class imageSpliter_t
 		}
 };
 
+#define IMAGE_SPLITTER_MIN_TILE_SIZE 4 //!< tileScheduler_t does not split tiles below this width/height
+
+/*!	Hands out the tiles of a pass to the render threads.
+	Each thread has its own queue, filled round robin with the tiles of the
+	splitter at the start of the pass, and takes tiles from its front.
+	A thread whose queue ran empty steals from the back of the fullest queue,
+	trying each other queue once before it gives up.
+	Once fewer tiles than threads are left, tiles are split into smaller
+	tiles before they are handed out, so the last expensive tiles of a pass
+	are shared by several threads instead of keeping one busy alone.
+	CAUTION! nextArea() is called by all render threads at the same time.
+*/
+class tileScheduler_t
+{
+	public:
+		tileScheduler_t(): remaining(0), nThreads(1), minSize(4) {}
+		/*! start a pass with all the tiles of splitter.
+			\param minTileSize tiles are not split below this size in pixels */
+		void reset(const imageSpliter_t &splitter, int threads, int minTileSize);
+		/*! get the next area for thread threadID (0 <= threadID < threads)
+			\return false if all tiles of the pass have been handed out */
+		bool nextArea(int threadID, renderArea_t &area);
+
+	protected:
+		struct tile_t { int x, y, w, h; };
+		struct queue_t
+		{
+			queue_t(): count(0) {}
+			std::mutex m;
+			std::deque<tile_t> tiles;
+			std::atomic<int> count; //!< tiles.size(), readable without locking m
+		};
+		bool take(int threadID, tile_t &t);
+		bool steal(int threadID, tile_t &t);
+		void split(int threadID, tile_t &t);
+		std::vector<std::unique_ptr<queue_t>> queues;
+		std::atomic<int> remaining; //!< tiles in all queues
+		int nThreads, minSize;
+};
+
 class imageSpliterCentreSorter_t {
       int imageW, imageH, imageX0, imageY0;
 public:
@@ -72,8 +72,13 @@ class YAFRAYCORE_EXPORT surfaceIntegrator_t: public integrator_t
 		virtual void cleanup() {}
 //		virtual bool setupSampler(sampler_t &sam);
 		virtual colorA_t integrate(renderState_t &state, diffRay_t &ray, colorPasses_t &colPasses, int additionalDepth = 0 /*, sampler_t &sam*/) const = 0;
+		/*! true if render() can take all views side by side in one film, shooting each tile with the camera of its view */
+		virtual bool canRenderViewsInterleaved() const { return false; }
 	protected:
 		surfaceIntegrator_t() {} //don't use...
+		/*! the accelerators keep track of a limited number of transparent shadow hits,
+			returns shadowDepth clamped to it, with a warning if it was above */
+		static int clampShadowDepth(int shadowDepth);
 };
 
 class YAFRAYCORE_EXPORT volumeIntegrator_t: public integrator_t
@@ -33,6 +33,33 @@ class diffRay_t: public ray_t
 		vector3d_t xdir, ydir;
 };
 
+/*! 4 rays in structure of arrays layout for packet traversal.
+	Unused lanes of partial packets repeat the first ray and are
+	masked out by the caller.
+*/
+class rayPacket4_t
+{
+public:
+	rayPacket4_t(const ray_t *rays, int n)
+	{
+		for(int i=0; i<4; ++i)
+		{
+			const ray_t &r = rays[(i < n) ? i : 0];
+			for(int axis=0; axis<3; ++axis)
+			{
+				from[axis][i] = r.from[axis];
+				dir[axis][i] = r.dir[axis];
+				invDir[axis][i] = (r.dir[axis] != 0.f) ? 1.f/r.dir[axis] : 1e30f;
+			}
+			tmin[i] = r.tmin;
+		}
+	}
+	float from[3][4];
+	float dir[3][4];
+	float invDir[3][4]; //!< zero direction components get a huge positive inverse
+	float tmin[4];
+};
+
 __END_YAFRAY
 
 #endif //Y_RAY_H
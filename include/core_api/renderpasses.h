@@ -184,9 +184,17 @@ enum intPassTypes_t
 	PASS_INT_DEBUG_DUDX_DVDX,
 	PASS_INT_DEBUG_DUDY_DVDY,
 	PASS_INT_DEBUG_DUDXY_DVDXY,
+	PASS_INT_AA_NOISE,
+	PASS_INT_DEBUG_RENDER_TIME,
 	PASS_INT_TOTAL_PASSES			//IMPORTANT: KEEP THIS ALWAYS IN THE LAST POSITION
 };
 
+enum intPassPrecision_t	//Precision of the channels of an internal pass in the film files, the image film accumulates all passes in float
+{
+	PASS_INT_PRECISION_FLOAT,		//32 bit float
+	PASS_INT_PRECISION_HALF			//16 bit float, only for passes with values around [0, 1] used for display
+};
+
 
 
 class YAFRAYCORE_EXPORT extPass_t  //Render pass to be exported, for example, to Blender, and mapping to the internal YafaRay render passes generated in different points of the rendering process
@@ -235,6 +243,8 @@ class YAFRAYCORE_EXPORT renderPasses_t
         intPassTypes_t intPassTypeFromExtPassIndex(int extPassIndex) const;
         intPassTypes_t intPassTypeFromAuxPassIndex(int auxPassIndex) const;
         externalPassTileTypes_t tileType(int extPassIndex) const;
+        static int intPassChannels(intPassTypes_t intPassType);	//Channels the image film stores for an internal pass: 0 (weight only), 1 (gray), 2 (R, G), 3 (RGB) or 4 (RGBA)
+        static intPassPrecision_t intPassPrecision(intPassTypes_t intPassType);	//Precision of the channels the film files store for an internal pass
 
 		void set_pass_mask_obj_index(float new_obj_index);	//Object Index used for masking in/out in the Mask Render Passes
 		void set_pass_mask_mat_index(float new_mat_index);	//Material Index used for masking in/out in the Mask Render Passes
@@ -36,7 +36,11 @@ class ray_t;
 class diffRay_t;
 class primitive_t;
 class triKdTree_t;
+struct kdTreeStats_t;
 template<class T> class kdTree_t;
+template<class T> class bvhTree_t;
+class triInstanceTree_t;
+class triBlasCache_t;
 class triangle_t;
 class background_t;
 class light_t;
@@ -45,6 +49,7 @@ class volumeIntegrator_t;
 class imageFilm_t;
 class random_t;
 class renderEnvironment_t;
+class threadPool_t;
 
 typedef unsigned int objID_t;
 
@@ -180,31 +185,57 @@ class YAFRAYCORE_EXPORT scene_t
 		surfaceIntegrator_t* getSurfIntegrator() const { return surfIntegrator; }
 		void setVolIntegrator(volumeIntegrator_t *v);
 		void setAntialiasing(int numSamples, int numPasses, int incSamples, double threshold, float resampled_floor, float sample_multiplier_factor, float light_sample_multiplier_factor, float indirect_sample_multiplier_factor, bool detect_color_noise, int dark_detection_type, float dark_threshold_factor, int variance_edge_size, int variance_pixels, float clamp_samples, float clamp_indirect);
+		/*! render the whole frame with one sample per pixel and iteration until the time budget or sample cap is reached
+			\param timeBudget wall clock seconds, <= 0 = no limit
+			\param maxSamples samples per pixel, <= 0 = as many as the AA settings would take */
+		void setProgressive(bool enable, float timeBudget, int maxSamples);
 		void setNumThreads(int threads);
 		void setNumThreadsPhotons(int threads_photons);
 		void setMode(int m){ mode = m; }
+		void setAccelerator(int a);
+		int getAccelerator() const { return accelerator; }
+		/*! directory for cached kd-trees, an empty string disables the cache */
+		void setAccelCacheDir(const std::string &dir) { accelCacheDir = dir; }
+		/*! give each mesh its own tree below a top level tree, so after geometry changes
+			only the trees of changed meshes have to be rebuilt */
+		void setAccelPerObject(bool perObject);
+		/*! kd-tree build parameters of the scene trees: traversal cost relative to a primitive
+			intersection, bonus for cutting off empty space and primitives per leaf (<=0 = auto) */
+		void setAccelKdParams(float costRatio, float emptyBonus, int leafSize);
+		/*! quality report of the scene kd-tree, nullptr if it was not built as kd-tree.
+			A summary of it goes to the render settings of the log and the badge */
+		const kdTreeStats_t* getAccelStats() const;
 		background_t* getBackground() const;
 		triangleObject_t* getMesh(objID_t id) const;
 		object3d_t* getObject(objID_t id) const;
 		std::vector<VolumeRegion*> getVolumes() const { return volumes; }
 		const camera_t* getCamera() const { return camera; }
+		//! camera of a view when all views are rendered side by side in one film, the current camera otherwise
+		const camera_t* getViewCamera(int view) const { return views.empty() ? camera : views[view]; }
 		imageFilm_t* getImageFilm() const { return imageFilm; }
 		bound_t getSceneBound() const;
 		int getNumThreads() const { return nthreads; }
 		int getNumThreadsPhotons() const { return nthreads_photons; }
+		threadPool_t &getThreadPool() const; //!< worker threads of the render environment
 		int getSignals() const;
 		//! only for backward compatibility!
 		void getAAParameters(int &samples, int &passes, int &inc_samples, float &threshold, float &resampled_floor, float &sample_multiplier_factor, float &light_sample_multiplier_factor, float &indirect_sample_multiplier_factor, bool &detect_color_noise, int &dark_detection_type, float &dark_threshold_factor, int &variance_edge_size, int &variance_pixels, float &clamp_samples, float &clamp_indirect) const;
+		void getProgressiveParameters(bool &enable, float &timeBudget, int &maxSamples) const;
 		bool intersect(const ray_t &ray, surfacePoint_t &sp) const;
 		bool intersect(const diffRay_t &ray, surfacePoint_t &sp) const;
 		bool isShadowed(renderState_t &state, const ray_t &ray, float &obj_index, float &mat_index) const;
 		bool isShadowed(renderState_t &state, const ray_t &ray, int maxDepth, color_t &filt, float &obj_index, float &mat_index) const;
+		/*! shadow test of up to 4 rays as one packet, rays with the same origin and similar directions
+			(like the shadow rays of the samples of one light) traverse the tree together.
+			returns the bit mask of the shadowed rays, obj_index/mat_index are written per ray like in isShadowed() */
+		int isShadowed4(renderState_t &state, const ray_t *rays, int nRays, float *obj_index, float *mat_index) const;
 		const renderPasses_t* getRenderPasses() const;
 		bool pass_enabled(intPassTypes_t intPassType) const;
 
 		enum sceneState { READY, GEOMETRY, OBJECT, VMAP };
 		enum changeFlags { C_NONE=0, C_GEOM=1, C_LIGHT= 1<<1, C_OTHER=1<<2,
 							C_ALL=C_GEOM|C_LIGHT|C_OTHER };
+		enum accelType { ACCEL_KDTREE=0, ACCEL_BVH=1 };
 
 		std::vector<light_t *> lights;
 		volumeIntegrator_t *volIntegrator;
@@ -223,9 +254,14 @@ class YAFRAYCORE_EXPORT scene_t
         std::map< std::string, material_t * > materials;
 		std::vector<VolumeRegion *> volumes;
         camera_t *camera;
+		std::vector<camera_t *> views; //!< cameras of the views rendered together, empty when they are rendered one after another
 		imageFilm_t *imageFilm;
 		triKdTree_t *tree; //!< kdTree for triangle-only mode
 		kdTree_t<primitive_t> *vtree; //!< kdTree for universal mode
+		bvhTree_t<triangle_t> *bvh; //!< BVH for triangle-only mode
+		bvhTree_t<primitive_t> *vbvh; //!< BVH for universal mode
+		triInstanceTree_t *itree; //!< two level tree of the mesh instances (triangle-only mode)
+		triBlasCache_t *blasCache; //!< bottom level trees of the two level tree, kept across updates
 		background_t *background;
 		surfaceIntegrator_t *surfIntegrator;
 		bound_t sceneBound; //!< bounding box of all (finite) scene geometry
@@ -244,9 +280,17 @@ class YAFRAYCORE_EXPORT scene_t
 		int AA_variance_pixels;
 		float AA_clamp_samples;
 		float AA_clamp_indirect;
+		bool progressive = false;
+		float progressiveTime = 0.f; //!< time budget of a progressive render in seconds
+		int progressiveSamples = 0; //!< sample cap of a progressive render
 		int nthreads;
 		int nthreads_photons;
 		int mode; //!< sets the scene mode (triangle-only, virtual primitives)
+		int accelerator; //!< acceleration structure to build (accelType)
+		std::string accelCacheDir; //!< where built kd-trees are saved and looked up, keyed by geometry
+		bool accelPerObject; //!< trace all meshes through the two level tree
+		float kdCostRatio, kdEmptyBonus; //!< kd-tree build parameters
+		int kdLeafSize;
 		int signals;
 		const renderEnvironment_t *env;	//!< reference to the environment to which this scene belongs to
 		mutable std::mutex sig_mutex;
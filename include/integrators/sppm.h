@@ -65,6 +65,7 @@ class YAFRAYPLUGIN_EXPORT SPPM: public mcIntegrator_t
 		/*! render a tile; only required by default implementation of render() */
 		virtual bool renderTile(int numView, renderArea_t &a, int n_samples, int offset, bool adaptive, int threadID, int AA_pass_number = 0);
 		virtual bool preprocess(); //not used for now
+		virtual bool canRenderViewsInterleaved() const { return false; } //!< the photon passes are driven by its own render loop
 		// not used now
 		virtual void prePass(int samples, int offset, bool adaptive);
 		/*! not used now, use traceGatherRay instead*/
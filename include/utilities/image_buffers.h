@@ -27,6 +27,8 @@
 #include <yafray_config.h>
 #include <core_api/color.h>
 #include <vector>
+#include <algorithm>
+#include <cstring>
 #include <stdint.h>
 
 #include <boost/archive/xml_iarchive.hpp>
@@ -35,6 +37,7 @@
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/serialization/nvp.hpp>
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/split_member.hpp>
 
 __BEGIN_YAFRAY
 
@@ -81,6 +84,49 @@ class pixelGray_t
 	}
 };
 
+//! IEEE 754 half precision float bits of f, rounded to nearest even, without OpenEXR
+inline uint16_t floatToHalf(float f)
+{
+	uint32_t x;
+	std::memcpy(&x, &f, sizeof(float));
+	const uint16_t sign = (x >> 16) & 0x8000;
+	const uint32_t absx = x & 0x7FFFFFFF;
+
+	if(absx >= 0x7F800000) return sign | 0x7C00 | (absx > 0x7F800000 ? 0x0200 : 0);	//Inf and NaN
+	if(absx >= 0x477FF000) return sign | 0x7C00;	//rounds above 65504, overflows to Inf
+	if(absx < 0x38800000)	//below the smallest normal half, 2^-14
+	{
+		if(absx <= 0x33000000) return sign;	//2^-25 and less round to zero
+		const uint32_t mant = (absx & 0x007FFFFF) | 0x00800000;
+		const uint32_t shift = 126 - (absx >> 23);
+		uint32_t h = mant >> shift;
+		const uint32_t rem = mant & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+		if(rem > halfway || (rem == halfway && (h & 1))) ++h;
+		return sign | h;
+	}
+	uint32_t h = (absx - 0x38000000) >> 13;
+	const uint32_t rem = absx & 0x1FFF;
+	if(rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;
+	return sign | h;
+}
+
+inline float halfToFloat(uint16_t h)
+{
+	const uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+	const uint32_t exponent = (h >> 10) & 0x1F, mant = h & 0x03FF;
+	uint32_t x;
+	if(exponent == 0x1F) x = sign | 0x7F800000 | (mant << 13);
+	else if(exponent != 0) x = sign | ((exponent + 112) << 23) | (mant << 13);
+	else
+	{
+		const float f = mant * (1.f / 16777216.f);	//subnormals are multiples of 2^-24
+		return sign ? -f : f;
+	}
+	float f;
+	std::memcpy(&f, &x, sizeof(float));
+	return f;
+}
+
 class rgba8888_t
 {
 	public:
@@ -403,6 +449,217 @@ protected:
 	}
 };
 
+/*! Weighted image buffer of a render pass, storing only the channels the pass has plus the weight.
+	Pixels are read and written as pixel_t:
+	- 0 channels: weight only, the color reads as 0
+	- 1 channel: gray, read as (v, v, v) with alpha equal to the weight, i.e. opaque once normalized
+	- 2 channels: R and G, B and alpha read as 0
+	- 3 channels: RGB, alpha equal to the weight as for gray
+	- 4 channels: RGBA
+	The weighted sums are accumulated in float. Half precision only applies to the records of
+	getRecords() and addRecords(), i.e. to the film files. Their channels hold the normalized values
+	(the sums divided by the weight) and are multiplied back by the float weight when added, so the
+	range and precision do not depend on how many samples the pixel has. Half keeps about 3 significant
+	digits and overflows above 65504, so it is only meant for passes with values around [0, 1]. */
+class passImage_t
+{
+public:
+	passImage_t() {}
+
+	passImage_t(int w, int h, int nChannels, bool halfPrecision) : width(w), height(h), channels(nChannels), half(halfPrecision)
+	{
+		pixelWords = pixelBytes(channels, false) / sizeof(uint16_t);
+		data.resize((size_t) width * height * pixelWords);
+		pixels = data.data();
+	}
+
+	/*! buffer in external, zero filled storage (e.g. a memory-mapped file) of tiledStorageBytes(), laid out in
+		square tiles of 2^logTileSize pixels so a tile is one contiguous block. The storage is not owned and
+		such buffers are not serialized. */
+	passImage_t(int w, int h, int nChannels, bool halfPrecision, void *storage, int logTileSize) : width(w), height(h), channels(nChannels), half(halfPrecision), tileBits(logTileSize)
+	{
+		pixelWords = pixelBytes(channels, false) / sizeof(uint16_t);
+		pixels = (uint16_t *) storage;
+		xTiles = (width + (1 << tileBits) - 1) >> tileBits;
+	}
+
+	//! bytes per pixel or record, a multiple of 4 so the weights stay aligned
+	static size_t pixelBytes(int nChannels, bool halfPrecision)
+	{
+		return (sizeof(float) + nChannels * (halfPrecision ? sizeof(uint16_t) : sizeof(float)) + 3) & ~(size_t) 3;
+	}
+
+	static size_t tiledStorageBytes(int w, int h, int nChannels, int logTileSize)
+	{
+		size_t tileSide = (size_t) 1 << logTileSize;
+		return ((w + tileSide - 1) >> logTileSize) * ((h + tileSide - 1) >> logTileSize) * tileSide * tileSide * pixelBytes(nChannels, false);
+	}
+
+	inline pixel_t operator()(int x, int y) const
+	{
+		const uint16_t *p = pixel(x, y);
+		pixel_t pix;
+		std::memcpy(&pix.weight, p, sizeof(float));
+		float c[4] = { 0.f, 0.f, 0.f, 0.f };
+		getChannels(p + 2, c);
+		switch(channels)
+		{
+			case 0: break;
+			case 1: pix.col = colorA_t(c[0], pix.weight); break;
+			case 2: pix.col = colorA_t(c[0], c[1], 0.f, 0.f); break;
+			case 3: pix.col = colorA_t(c[0], c[1], c[2], pix.weight); break;
+			default: pix.col = colorA_t(c[0], c[1], c[2], c[3]); break;
+		}
+		return pix;
+	}
+
+	inline float getWeight(int x, int y) const
+	{
+		float weight;
+		std::memcpy(&weight, pixel(x, y), sizeof(float));
+		return weight;
+	}
+
+	inline void set(int x, int y, const pixel_t &pix)
+	{
+		uint16_t *p = pixel(x, y);
+		std::memcpy(p, &pix.weight, sizeof(float));
+		const float c[4] = { pix.col.R, pix.col.G, pix.col.B, pix.col.A };
+		setChannels(p + 2, c);
+	}
+
+	//! accumulate the weighted color and the weight of pix, only the stored channels are touched
+	inline void add(int x, int y, const pixel_t &pix)
+	{
+		uint16_t *p = pixel(x, y);
+		float weight;
+		std::memcpy(&weight, p, sizeof(float));
+		weight += pix.weight;
+		std::memcpy(p, &weight, sizeof(float));
+		if(channels == 0) return;
+
+		float c[4] = { 0.f, 0.f, 0.f, 0.f };
+		getChannels(p + 2, c);
+		c[0] += pix.col.R;
+		c[1] += pix.col.G;
+		c[2] += pix.col.B;
+		c[3] += pix.col.A;
+		setChannels(p + 2, c);
+	}
+
+	//! write the records of the n pixels of row y starting at x, getRecordBytes() each: the weight and the channels, normalized in half precision
+	void getRecords(int x, int y, int n, void *dst) const
+	{
+		const size_t bytes = getRecordBytes();
+		if(!xTiles && !half)
+		{
+			std::memcpy(dst, pixel(x, y), n * bytes);
+			return;
+		}
+		uint16_t *q = (uint16_t *) dst;
+		const int recordWords = bytes / sizeof(uint16_t);
+		for(int i = 0; i < n; ++i, q += recordWords)
+		{
+			const uint16_t *p = pixel(x + i, y);
+			std::memset(q, 0, bytes);
+			std::memcpy(q, p, sizeof(float));
+			float weight, c[4];
+			std::memcpy(&weight, p, sizeof(float));
+			getChannels(p + 2, c);
+			const float norm = (weight != 0.f) ? 1.f / weight : 1.f;
+			if(half) for(int j = 0; j < channels; ++j) q[2 + j] = floatToHalf(c[j] * norm);
+			else std::memcpy(q + 2, c, channels * sizeof(float));
+		}
+	}
+
+	//! accumulate n records as written by getRecords() into row y starting at x
+	void addRecords(int x, int y, int n, const void *src)
+	{
+		const uint16_t *q = (const uint16_t *) src;
+		const int recordWords = getRecordBytes() / sizeof(uint16_t);
+		for(int i = 0; i < n; ++i, q += recordWords)
+		{
+			uint16_t *p = pixel(x + i, y);
+			float weight, addWeight;
+			std::memcpy(&weight, p, sizeof(float));
+			std::memcpy(&addWeight, q, sizeof(float));
+			weight += addWeight;
+			std::memcpy(p, &weight, sizeof(float));
+			if(channels == 0) continue;
+
+			float c[4], d[4];
+			getChannels(p + 2, c);
+			if(half) for(int j = 0; j < channels; ++j) d[j] = halfToFloat(q[2 + j]) * ((addWeight != 0.f) ? addWeight : 1.f);
+			else std::memcpy(d, q + 2, channels * sizeof(float));
+			for(int j = 0; j < channels; ++j) c[j] += d[j];
+			setChannels(p + 2, c);
+		}
+	}
+
+	void clear()
+	{
+		std::fill(pixels, pixels + (isTiled() ? tiledStorageBytes(width, height, channels, tileBits) / sizeof(uint16_t) : data.size()), 0);
+	}
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getChannels() const { return channels; }
+	bool isHalf() const { return half; } //!< precision of the records
+	size_t getRecordBytes() const { return pixelBytes(channels, half); }
+	size_t getBytes() const { return (size_t) width * height * pixelWords * sizeof(uint16_t); } //!< size of the pixels, without the tile padding
+
+	bool isTiled() const { return xTiles != 0; }
+	//! first pixel of the tile containing pixel (x, y), only for buffers in external storage
+	const void *getTile(int x, int y) const { return pixels + ((((size_t) (y >> tileBits) * xTiles + (x >> tileBits)) << (2 * tileBits)) * pixelWords); }
+	size_t getTileBytes() const { return (pixelWords * sizeof(uint16_t)) << (2 * tileBits); }
+
+protected:
+	inline const uint16_t *pixel(int x, int y) const { return pixels + pixelIndex(x, y) * pixelWords; }
+	inline uint16_t *pixel(int x, int y) { return pixels + pixelIndex(x, y) * pixelWords; }
+
+	inline size_t pixelIndex(int x, int y) const
+	{
+		if(!xTiles) return (size_t) y * width + x;
+		const int mask = (1 << tileBits) - 1;
+		return (((size_t) (y >> tileBits) * xTiles + (x >> tileBits)) << (2 * tileBits)) + ((y & mask) << tileBits) + (x & mask);
+	}
+
+	inline void getChannels(const uint16_t *p, float *c) const { std::memcpy(c, p, channels * sizeof(float)); }
+	inline void setChannels(uint16_t *p, const float *c) const { std::memcpy(p, c, channels * sizeof(float)); }
+
+	int width = 0;
+	int height = 0;
+	int channels = 4;
+	bool half = false; //!< records in half precision
+	int pixelWords = 0; //!< 16 bit words per pixel: the weight, the float channels and padding
+	std::vector<uint16_t> data; //!< own storage, rows one after the other
+	uint16_t *pixels = nullptr; //!< data or the external tiled storage
+	int tileBits = 0;
+	int xTiles = 0; //!< tiles per row of the external storage, 0 for own storage
+
+	friend class boost::serialization::access;
+	template<class Archive> void save(Archive & ar, const unsigned int version) const
+	{
+		ar & BOOST_SERIALIZATION_NVP(width);
+		ar & BOOST_SERIALIZATION_NVP(height);
+		ar & BOOST_SERIALIZATION_NVP(channels);
+		ar & BOOST_SERIALIZATION_NVP(half);
+		ar & BOOST_SERIALIZATION_NVP(data);
+	}
+	template<class Archive> void load(Archive & ar, const unsigned int version)
+	{
+		ar & BOOST_SERIALIZATION_NVP(width);
+		ar & BOOST_SERIALIZATION_NVP(height);
+		ar & BOOST_SERIALIZATION_NVP(channels);
+		ar & BOOST_SERIALIZATION_NVP(half);
+		ar & BOOST_SERIALIZATION_NVP(data);
+		pixelWords = pixelBytes(channels, false) / sizeof(uint16_t);
+		pixels = data.data();
+		tileBits = xTiles = 0;
+	}
+	BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+
 typedef generic2DBuffer_t<pixel_t> 		rgba2DImage_t; //!< Weighted RGBA image buffer typedef
 typedef generic2DBuffer_t<pixelGray_t> 	gray2DImage_t; //!< Weighted monochromatic image buffer typedef
 typedef generic2DBuffer_t<color_t> 		rgb2DImage_nw_t; //!< Non-weighted RGB (96bit/pixel) image buffer typedef
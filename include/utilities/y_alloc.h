@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <vector>
 #include <algorithm>
+#include <new>
 #if defined(__FreeBSD__)
 	#include <stdlib.h>
 #elif !defined(WIN32) && !defined(__APPLE__)
@@ -13,6 +14,11 @@
 #elif defined (__MINGW32__) //Added by DarkTide to enable mingw32 compliation
 	#include <malloc.h>
 #endif
+#if defined(_WIN32)
+	#include <malloc.h>
+#elif defined(__linux__)
+	#include <sys/mman.h>
+#endif
 
 __BEGIN_YAFRAY
 
@@ -22,13 +28,45 @@ typedef unsigned int u_int32;
 #define alloca _alloca
 #endif
 
+#define Y_HUGE_PAGE_SIZE (2*1024*1024)
+
+//! allocate size bytes aligned to bound (a power of two), free with y_free()
 inline void * y_memalign(size_t bound, size_t size)
 {
-	return new unsigned char [size];
+	void *ptr = nullptr;
+	if(bound < sizeof(void *)) bound = sizeof(void *);
+#if defined(_WIN32)
+	ptr = _aligned_malloc(size ? size : 1, bound);
+#else
+	if(posix_memalign(&ptr, bound, size ? size : 1) != 0) ptr = nullptr;
+#endif
+	if(!ptr) throw std::bad_alloc();
+	return ptr;
+}
+
+/*! like y_memalign, but blocks of at least one huge page get aligned to it and are
+	marked for transparent huge pages where the system supports them.
+	Meant for big arrays with random access like tree nodes, to save TLB misses */
+inline void * y_memalign_huge(size_t bound, size_t size)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if(size >= Y_HUGE_PAGE_SIZE)
+	{
+		size_t padded = (size + Y_HUGE_PAGE_SIZE - 1) & ~((size_t)Y_HUGE_PAGE_SIZE - 1);
+		void *ptr = y_memalign(Y_HUGE_PAGE_SIZE, padded);
+		madvise(ptr, padded, MADV_HUGEPAGE); // only a hint, the block is fine without it
+		return ptr;
+	}
+#endif
+	return y_memalign(bound, size);
 }
 
 inline void y_free(void *ptr) {
-	delete [] (unsigned char *)ptr;
+#if defined(_WIN32)
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
 }
 
 
@@ -82,8 +120,8 @@ public:
 			y_free(availableBlocks[i]);
 	}
 	void *Alloc(u_int32 sz) {
-		// Round up _sz_ to minimum machine alignment
-		sz = ((sz + 7) & (~7));
+		// Round up _sz_ to the SSE alignment
+		sz = ((sz + 15) & (~15));
 		if (curBlockPos + sz > blockSize) {
 			// Get new block of memory for _MemoryArena_
 			usedBlocks.push_back(currentBlock);
@@ -0,0 +1,78 @@
+#ifndef __Y_BVH_H
+#define __Y_BVH_H
+
+#include <yafray_config.h>
+
+#include <algorithm>
+
+#include <utilities/y_alloc.h>
+#include <core_api/bound.h>
+#include <core_api/object3d.h>
+#include <yafraycore/meshtypes.h>
+
+__BEGIN_YAFRAY
+
+struct renderState_t;
+
+#define BVH_EMPTY_CHILD 0xffffffff
+
+// ============================================================
+/*! 4-wide BVH node, the child bounds are stored as structure of arrays
+	so the four slab tests can be done at once with SIMD instructions.
+	A child with nPrims > 0 is a leaf referencing prims [child, child+nPrims)
+	of the primitive array, with nPrims == 0 it is the index of an interior
+	node, unused children are BVH_EMPTY_CHILD and have an inverted bound.
+	Size is 128 bytes, two cache lines.
+*/
+struct bvhNode4_t
+{
+	float bMin[3][4]; //!< lower bound of the 4 children, per axis
+	float bMax[3][4]; //!< upper bound of the 4 children, per axis
+	u_int32 child[4];
+	u_int32 nPrims[4];
+};
+
+// ============================================================
+/*! Bounding volume hierarchy with 4 children per node built with binned SAH.
+	Provides the same intersection interface as the kd-trees, each primitive is
+	referenced only once, so no duplicate hits need to be filtered.
+*/
+template<class T> class YAFRAYCORE_EXPORT bvhTree_t
+{
+public:
+	bvhTree_t(const T **v, int np, int leafSize=4, float cost_ratio=0.35);
+	bool Intersect(const ray_t &ray, float dist, T **tr, float &Z, intersectData_t &data) const;
+	bool IntersectS(const ray_t &ray, float dist, T **tr, float shadow_bias) const;
+	//! inst is the instance whose object space the ray is in, if any (only for triangles)
+	bool IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, T **tr, color_t &filt, float shadow_bias, const triangleObjectInstance_t *inst = nullptr) const;
+	bound_t getBound(){ return treeBound; }
+	~bvhTree_t();
+private:
+	struct buildRange_t
+	{
+		u_int32 begin, end;
+		bound_t bound; //!< bound of the primitives
+		bound_t centroidBound; //!< bound of the primitive centroids
+		float area() const;
+	};
+	bool splitRange(const buildRange_t &range, buildRange_t &left, buildRange_t &right);
+	u_int32 buildNode(const buildRange_t &range, int depth);
+	void makeRange(u_int32 begin, u_int32 end, buildRange_t &range) const;
+
+	float 		costRatio; 	//!< node traversal cost divided by primitive intersection cost
+	u_int32 	nextFreeNode, allocatedNodesCount, totalPrims;
+	unsigned int maxLeafSize;
+	bound_t 	treeBound; 	//!< overall space the tree encloses
+	bvhNode4_t 	*nodes;
+	const T 	**prims; //!< primitives, ordered by leaf
+
+	// temporary build data
+	u_int32 	*primIdx;
+	bound_t 	*allBounds;
+	point3d_t 	*centroids;
+	int 		nLeaves, maxDepthReached;
+};
+
+__END_YAFRAY
+
+#endif	//__Y_BVH_H
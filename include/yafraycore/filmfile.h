@@ -0,0 +1,107 @@
+#ifndef Y_FILMFILE_H
+#define Y_FILMFILE_H
+
+#include <yafray_config.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <iosfwd>
+
+__BEGIN_YAFRAY
+
+class passImage_t;
+class threadPool_t;
+
+#define FILM_FILE_TILE_SIZE 64 //!< side of the square tiles the passes are split into, one chunk per pass and tile
+#define FILM_FILE_FORMAT_VERSION 3
+
+/*!	Chunked binary film file. After a small header come the formats of the passes, the film
+	parameters, a table with the position of every chunk and the chunks themselves: the pixel
+	records of one tile of one pass as written by passImage_t::getRecords(). Chunks are
+	independent, so they are written and read by several threads at once, and uncompressed
+	chunks start on a 4KB boundary so the file can be memory-mapped. Compressed chunks are
+	deflated after grouping the bytes of the records by their position (all first bytes, all
+	second bytes...), which makes similar float values compress much better. Multi-byte values
+	are stored in the byte order of the machine, like the Boost binary archives.
+	The parameters are name and value strings telling how to output the film (its render
+	passes, views and color space), so films can be merged into images without the scene.
+*/
+class YAFRAYCORE_EXPORT filmFile_t
+{
+	public:
+		struct header_t
+		{
+			char magic[8];
+			uint32_t formatVersion;
+			uint32_t compressed;
+			char filmStructureVersion[16];
+			int32_t w, h, cx0, cx1, cy0, cy1;
+			uint32_t numPasses, numAuxPasses;
+			uint32_t samplingOffset, baseSamplingOffset, computerNode;
+			uint32_t tileSize;
+		};
+		struct passFormat_t
+		{
+			int32_t channels;
+			int32_t half;
+		};
+		typedef std::vector<std::pair<std::string, std::string>> params_t;
+
+		//! true if the file starts with the signature of a chunked film file
+		static bool isFilmFile(const std::string &path);
+		/*! write passes (the render passes followed by the auxiliary ones) with the film data of header,
+			its signature, version and sizes are filled in here
+			\param maxTasks at most this many threads of pool write at the same time, 0 = all of them */
+		static bool save(const std::string &path, header_t header, const params_t &params, const std::vector<const passImage_t*> &passes, bool compress, threadPool_t &pool, int maxTasks = 0);
+
+		/*! start writing a file in parts, for passes too big to keep whole: the pixels are written
+			with writeTileRows() and the file is complete after finish() */
+		bool create(const std::string &path, header_t header, const params_t &params, const std::vector<passFormat_t> &formats, bool compress);
+		/*! write the tile rows [tileY0, tileY1) from passes, which are as wide as the film and start at the first row of tileY0
+			\param maxTasks at most this many threads of pool write at the same time, 0 = all of them */
+		bool writeTileRows(const std::vector<const passImage_t*> &passes, int tileY0, int tileY1, threadPool_t &pool, int maxTasks = 0);
+		//! write the chunk table of a file started with create()
+		bool finish();
+
+		//! read the header and the tables of a file, the pixels are read by addTo() or addTileRows()
+		bool open(const std::string &path);
+		const header_t &getHeader() const { return header; }
+		const params_t &getParams() const { return params; }
+		//! value of a parameter, empty if the film does not have it
+		std::string getParam(const std::string &name) const;
+		//! formats of the render passes followed by the auxiliary ones
+		const std::vector<passFormat_t> &getPassFormats() const { return formats; }
+		//! rows of tiles the passes are split into
+		int getTileRows() const { return (header.h + FILM_FILE_TILE_SIZE - 1) / FILM_FILE_TILE_SIZE; }
+		/*! accumulate the pixels of the file into passes, which must have the size and formats of the saved ones.
+			All the chunks are read before adding any, so the passes are left untouched when it fails */
+		bool addTo(const std::vector<passImage_t*> &passes, threadPool_t &pool, int maxTasks = 0) const { return addTileRows(passes, 0, getTileRows(), pool, maxTasks); }
+		//! like addTo() for the tile rows [tileY0, tileY1), passes are as wide as the film and start at the first row of tileY0
+		bool addTileRows(const std::vector<passImage_t*> &passes, int tileY0, int tileY1, threadPool_t &pool, int maxTasks = 0) const;
+
+	protected:
+		struct chunk_t
+		{
+			uint64_t offset;
+			uint64_t bytes; //!< smaller than the raw size of the tile when compressed
+		};
+		//! pixel area of tile t of a w x h pass
+		static void tileArea(int t, int w, int h, int &x0, int &y0, int &tw, int &th);
+		//! index of the k-th chunk of the tile rows [tileY0, tileY1), they go pass after pass
+		size_t tileRowsChunk(size_t k, int tileY0, int tileY1) const;
+		//! read chunk i into raw as uncompressed records, packed is scratch space
+		bool readChunk(std::ifstream &ifs, size_t i, std::vector<char> &raw, std::vector<char> &packed) const;
+
+		std::string path;
+		header_t header;
+		params_t params;
+		std::vector<passFormat_t> formats;
+		std::vector<chunk_t> chunks;
+		uint64_t chunkTableOffset = 0, fileEnd = 0;	//!< while writing
+};
+
+__END_YAFRAY
+
+#endif // Y_FILMFILE_H
@@ -0,0 +1,113 @@
+#ifndef __Y_INSTANCETREE_H
+#define __Y_INSTANCETREE_H
+
+#include <yafray_config.h>
+
+#include <vector>
+#include <map>
+
+#include <utilities/y_alloc.h>
+#include <core_api/bound.h>
+#include <core_api/matrix4.h>
+#include <yafraycore/meshtypes.h>
+
+__BEGIN_YAFRAY
+
+struct renderState_t;
+class triKdTree_t;
+class threadPool_t;
+template<class T> class bvhTree_t;
+
+// ============================================================
+/*! bottom level tree of a mesh, in object space of the mesh.
+	It is shared by all instances of that mesh.
+*/
+struct instanceBlas_t
+{
+	instanceBlas_t(): tree(nullptr), bvh(nullptr), leafSize(0), costRatio(0.f), emptyBonus(0.f) {}
+	triKdTree_t *tree;
+	bvhTree_t<triangle_t> *bvh;
+	bound_t bound;
+	int leafSize; //!< kd-tree build parameters the tree was built with
+	float costRatio, emptyBonus;
+};
+
+/*! The bottom level trees of the meshes. The scene keeps them across
+	updates, so only meshes that are new or were sent again get a new tree.
+*/
+class YAFRAYCORE_EXPORT triBlasCache_t
+{
+public:
+	~triBlasCache_t() { clear(); }
+	/*! the tree of obj, built if it is missing, of the wrong type or built with other kd-tree parameters.
+		built tells whether it had to be built */
+	const instanceBlas_t *get(triangleObject_t *obj, bool useBvh, int leafSize, float costRatio, float emptyBonus,
+		int numThreads, threadPool_t *pool, bool &built);
+	//! drop the tree of a mesh that changed or is deleted
+	void remove(const triangleObject_t *obj);
+	void clear();
+	size_t size() const { return blasList.size(); }
+private:
+	std::map<const triangleObject_t *, instanceBlas_t *> blasList;
+};
+
+/*! an instance or an untransformed mesh as seen by the top level tree */
+struct instanceRecord_t
+{
+	const triangleObject_t *obj; //!< the instance, or the mesh itself if not transformed
+	const instanceBlas_t *blas;
+	bool transformed;
+	matrix4x4_t worldToObj;
+	bound_t bound; //!< world space bound of the instance
+};
+
+/*! top level tree nodes; leaves reference instances [first, first+count),
+	interior nodes have their left child right behind them */
+struct instanceNode_t
+{
+	bound_t bound;
+	u_int32 first, count;
+	u_int32 rightChild;
+};
+
+// ============================================================
+/*! Two level acceleration structure for instanced triangle meshes,
+	and optionally for the plain meshes too.
+	The top level is a binary BVH over the instance bounds, rays reaching
+	an instance are transformed into object space and traced against the
+	bottom level tree of its base mesh. So memory and build time only
+	grow with the number of instances and the number of unique base meshes.
+	Plain meshes are traced against their own tree without transformation,
+	as their trees are kept in a triBlasCache_t only changed meshes need
+	a new one when the scene is updated, the top level is always rebuilt.
+	The ray direction is not normalized on transformation, so hit distances
+	are the same in world and object space.
+*/
+class YAFRAYCORE_EXPORT triInstanceTree_t
+{
+public:
+	triInstanceTree_t(const std::vector<const triangleObjectInstance_t *> &instances, const std::vector<triangleObject_t *> &objects,
+		triBlasCache_t &blasCache, bool useBvh, int leafSize=1, float costRatio=0.8, float emptyBonus=0.33,
+		int numThreads=1, threadPool_t *pool=nullptr);
+	/*! inst is set to the hit instance, or nullptr if the hit mesh is not an instance */
+	bool Intersect(const ray_t &ray, float dist, const triangle_t **tr, const triangleObjectInstance_t **inst, float &Z, intersectData_t &data) const;
+	bool IntersectS(const ray_t &ray, float dist, const triangle_t **tr, const triangleObjectInstance_t **inst, float shadow_bias) const;
+	/*! the transparency depth limit applies per instance */
+	bool IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, const triangle_t **tr, const triangleObjectInstance_t **inst, color_t &filt, float shadow_bias) const;
+	bound_t getBound() const { return treeBound; }
+private:
+	u_int32 buildNode(u_int32 first, u_int32 count);
+	const ray_t &transformRay(const instanceRecord_t &rec, const ray_t &ray, ray_t &localRay) const;
+	const triangleObjectInstance_t *instanceOf(const instanceRecord_t &rec) const
+	{
+		return rec.transformed ? (const triangleObjectInstance_t *)rec.obj : nullptr;
+	}
+
+	std::vector<instanceRecord_t> records;
+	std::vector<instanceNode_t> nodes;
+	bound_t treeBound;
+};
+
+__END_YAFRAY
+
+#endif	//__Y_INSTANCETREE_H
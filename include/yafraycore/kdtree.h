@@ -4,6 +4,10 @@
 #include <yafray_config.h>
 
 #include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+#include <cstdint>
 
 #include <utilities/y_alloc.h>
 #include <core_api/bound.h>
@@ -12,12 +16,51 @@
 
 __BEGIN_YAFRAY
 
-extern int Kd_inodes, Kd_leaves, _emptyKd_leaves, Kd_prims;
-
 struct renderState_t;
+struct kdBuildContext_t;
+class threadPool_t;
 
 #define PRIM_DAT_SIZE 32
 
+// ============================================================
+/*! Precomputed intersection data of up to 4 triangles of a leaf, in
+	structure of arrays layout so a ray can be tested against all 4 at once.
+	Leaves of 2 or more triangles store them as a contiguous array of these,
+	so the triangle_t itself only gets touched for hits.
+	Unused slots are zeroed and have no triangle, the traversal masks them
+	out by the primitive count of the leaf.
+	Size is 192 bytes, the arena keeps them 16 byte aligned.
+*/
+struct kdTriangle4_t
+{
+	void set(int i, const triangle_t *t)
+	{
+		point3d_t a;
+		vector3d_t e1, e2;
+		float eps;
+		t->getIntersectionData(a, e1, e2, eps);
+		for(int axis=0; axis<3; ++axis)
+		{
+			v0[axis][i] = a[axis];
+			edge1[axis][i] = e1[axis];
+			edge2[axis][i] = e2[axis];
+		}
+		epsilon[i] = eps;
+		tri[i] = (triangle_t *)t;
+	}
+	void clear(int i)
+	{
+		for(int axis=0; axis<3; ++axis) v0[axis][i] = edge1[axis][i] = edge2[axis][i] = 0.f;
+		epsilon[i] = 0.f;
+		tri[i] = nullptr;
+	}
+	float v0[3][4]; //!< first vertex
+	float edge1[3][4];
+	float edge2[3][4];
+	float epsilon[4]; //!< intersection bias of the triangles
+	triangle_t *tri[4];
+};
+
 // ============================================================
 /*! kd-tree nodes, kept as small as possible
     double precision float and/or 64 bit system: 12bytes
@@ -26,27 +69,25 @@ struct renderState_t;
 class kdTreeNode
 {
 public:
-	void createLeaf(u_int32 *primIdx, int np, const triangle_t **prims, MemoryArena &arena)
+	void createLeaf(const u_int32 *primIdx, int np, const triangle_t **prims, MemoryArena &arena)
 	{
-		primitives = 0;
+		triangles = nullptr;
 		flags = np << 2;
 		flags |= 3;
-		if(np>1)
-		{
-			primitives = (triangle_t **)arena.Alloc(np * sizeof(triangle_t *));
-			for(int i=0;i<np;i++) primitives[i] = (triangle_t *)prims[primIdx[i]];
-			Kd_prims+=np; //stat
-		}
-		else if(np==1)
+		if(np == 1) onePrimitive = (triangle_t *)prims[primIdx[0]];
+		else if(np > 1)
 		{
-			onePrimitive = (triangle_t *)prims[primIdx[0]];
-			Kd_prims++; //stat
+			int nGroups = (np + 3) / 4;
+			triangles = (kdTriangle4_t *)arena.Alloc(nGroups * sizeof(kdTriangle4_t));
+			for(int i=0; i<nGroups*4; i++)
+			{
+				if(i < np) triangles[i/4].set(i%4, prims[primIdx[i]]);
+				else triangles[i/4].clear(i%4);
+			}
 		}
-		else _emptyKd_leaves++; //stat
-		Kd_leaves++; //stat
 	}
 	void createInterior(int axis, float d)
-	{	division = d; flags = (flags & ~3) | axis; Kd_inodes++; }
+	{	division = d; flags = (flags & ~3) | axis; }
 	float 	SplitPos() const { return division; }
 	int 	SplitAxis() const { return flags & 3; }
 	int 	nPrimitives() const { return flags >> 2; }
@@ -54,15 +95,100 @@ public:
 	u_int32	getRightChild() const { return (flags >> 2); }
 	void 	setRightChild(u_int32 i) { flags = (flags&3) | (i << 2); }	
 	
+	//! number of kdTriangle4_t groups of a leaf, single primitive leaves have none
+	int 	nGroups() const { int np = nPrimitives(); return (np > 1) ? (np + 3) / 4 : 0; }
+	triangle_t *primitive(int k) const { return (nPrimitives() == 1) ? onePrimitive : triangles[k/4].tri[k%4]; }
+	
 	union
 	{
 		float 			division;		//!< interior: division plane position
-		triangle_t** 	primitives;		//!< leaf: list of primitives
-		triangle_t*		onePrimitive;	//!< leaf: direct inxex of one primitive
+		triangle_t*		onePrimitive;	//!< leaf: direct pointer to primitive if only one
+		kdTriangle4_t*	triangles;		//!< leaf: intersection data of the primitives, in groups of 4
 	};
 	u_int32	flags;		//!< 2bits: isLeaf, axis; 30bits: nprims (leaf) or index of right child
 };
 
+inline size_t kdLeafBytes(const kdTreeNode &n) { return n.nGroups() * sizeof(kdTriangle4_t); }
+
+#define KD_STATS_LEAF_SIZES 17 //!< leaf size histogram bins, the last one counts all larger leaves too
+
+// ============================================================
+/*! Quality report of a kd-tree. Every tree owns one, so building
+	several trees at the same time does not mix their numbers up.
+	The structure part is taken from the finished node array by
+	collect(), the build counters are kept by each build thread
+	and merged in addBuildCounters(). */
+
+struct YAFRAYCORE_EXPORT kdTreeStats_t
+{
+	kdTreeStats_t();
+	void addBuildCounters(const kdTreeStats_t &s);
+	//! write the report to the log, name tells the trees apart
+	void print(const std::string &name) const;
+
+	/*! walk the tree from the root with its bounds, costRatio is the
+		node traversal cost relative to one primitive intersection */
+	template<class N> void collect(const N *nodes, const bound_t &treeBound, float costRatio)
+	{
+		struct todo_t { const N *node; bound_t bound; int depth; };
+		std::vector<todo_t> stack;
+		stack.push_back({nodes, treeBound, 0});
+		sahCostRatio = costRatio;
+		float rootArea = halfArea(treeBound);
+		if(rootArea <= 0.f) rootArea = 1.f;
+		while(!stack.empty())
+		{
+			todo_t td = stack.back();
+			stack.pop_back();
+			const N *n = td.node;
+			float p = halfArea(td.bound) / rootArea; // probability a ray through the tree bound hits the node
+			if((int)depthHistogram.size() <= td.depth) depthHistogram.resize(td.depth+1, 0);
+			if(td.depth > treeDepth) treeDepth = td.depth;
+			if(n->IsLeaf())
+			{
+				u_int32 np = n->nPrimitives();
+				++leaves;
+				++depthHistogram[td.depth];
+				++leafSizeHistogram[std::min(np, (u_int32)KD_STATS_LEAF_SIZES-1)];
+				if(np == 0) ++emptyLeaves;
+				leafPrims += np;
+				leafBytes += kdLeafBytes(*n);
+				sahCost += p * np;
+				continue;
+			}
+			++interiorNodes;
+			sahCost += p * costRatio;
+			int axis = n->SplitAxis();
+			bound_t left = td.bound, right = td.bound;
+			left.g[axis] = right.a[axis] = n->SplitPos();
+			stack.push_back({&nodes[n->getRightChild()], right, td.depth+1});
+			stack.push_back({n+1, left, td.depth+1});
+		}
+		nodeBytes = (size_t)(interiorNodes + leaves) * sizeof(N);
+	}
+	static float halfArea(const bound_t &b)
+	{
+		float x = b.g.x - b.a.x, y = b.g.y - b.a.y, z = b.g.z - b.a.z;
+		return x*y + y*z + z*x;
+	}
+
+	// structure of the finished tree
+	u_int32 totalPrims, interiorNodes, leaves, emptyLeaves, leafPrims;
+	int treeDepth;
+	float sahCost, sahCostRatio; //!< expected cost of a ray through the tree, in primitive intersections
+	std::vector<u_int32> depthHistogram; //!< leaves per depth
+	u_int32 leafSizeHistogram[KD_STATS_LEAF_SIZES]; //!< leaves per primitive count
+	size_t nodeBytes, leafBytes;
+	// build parameters
+	float costRatio, eBonus;
+	int maxDepth, maxLeafSize;
+	// build counters
+	u_int32 clipped, nullClipped, earlyOut, depthLimitReached, badSplits;
+	// build time per phase in seconds
+	double boundsTime, buildTime, layoutTime, statsTime;
+	bool fromCache;
+};
+
 /*! Serves to store the lower and upper bound edges of the primitives
 	for the cost funtion */
 
@@ -96,6 +222,46 @@ struct KdToDo
 	float tmin, tmax;
 };
 
+/*! Stack elements of the packet traversal */
+struct KdPacketToDo
+{
+	const kdTreeNode *node;
+	float tmin[4], tmax[4];
+	int active; //!< mask of the rays that enter the node
+};
+
+#define KD_MAX_STACK 64 //!< deepest tree the traversal stacks can take, the builds and the cache loader stop there
+#define KD_MAX_SHADOW_HITS 64
+#define KD_MIN_TRANSMISSION 1e-4f
+
+/*! Transparent primitives already crossed by a shadow ray. Kept on the
+	stack of IntersectTS, so each thread has its own and filtering the hits
+	of primitives referenced by several leaves never touches the allocator.
+	The list only grows up to the shadow depth, so a linear search is
+	cheaper than any set. */
+template<class T> struct shadowHits_t
+{
+	shadowHits_t(): n(0) {}
+	bool contains(const T *p) const
+	{
+		for(int i=0; i<n; ++i) if(hits[i] == p) return true;
+		return false;
+	}
+	//! true if no more hits may be filtered, the ray counts as blocked then
+	bool full(int maxDepth) const { return n >= maxDepth || n >= KD_MAX_SHADOW_HITS; }
+	void add(const T *p) { hits[n++] = p; }
+	const T *hits[KD_MAX_SHADOW_HITS];
+	int n;
+};
+
+//! filt dropped so low that the shadow ray can be considered blocked
+inline bool transmissionExhausted(const color_t &filt) { return filt.maximum() < KD_MIN_TRANSMISSION; }
+
+/*! transparency of a transparent shadow hit on tri at hit, traced along dir.
+	The trees of instances are traced in object space, with inst the hit is moved
+	back to world space, where the materials are evaluated */
+YAFRAYCORE_EXPORT color_t shadowHitTransparency(renderState_t &state, const triangle_t *tri, const triangleObjectInstance_t *inst, const point3d_t &hit, const vector3d_t &dir, intersectData_t &data);
+
 class splitCost_t
 {
 public:
@@ -122,45 +288,67 @@ class bin_t
 
 // ============================================================
 /*! This class holds a complete kd-tree with building and
-	traversal funtions
+	traversal funtions.
+	The build splits independent subtrees of the first levels into tasks
+	of the given thread pool, the resulting tree is identical to a single
+	threaded build.
 */
 class YAFRAYCORE_EXPORT triKdTree_t
 {
 public:
 	triKdTree_t(const triangle_t **v, int np, int depth=-1, int leafSize=2,
-			float cost_ratio=0.35, float emptyBonus=0.33);
+			float cost_ratio=0.35, float emptyBonus=0.33, int numThreads=1, threadPool_t *pool=nullptr);
 	bool Intersect(const ray_t &ray, float dist, triangle_t **tr, float &Z, intersectData_t &data) const;
 //	bool IntersectDBG(const ray_t &ray, float dist, triangle_t **tr, float &Z) const;
 	bool IntersectS(const ray_t &ray, float dist, triangle_t **tr, float shadow_bias) const;
-	bool IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, color_t &filt, float shadow_bias) const;
+	//! inst is the instance whose object space the ray is in, if any
+	bool IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, color_t &filt, float shadow_bias, const triangleObjectInstance_t *inst = nullptr) const;
+	/*! packet version of IntersectS for the rays selected by mask, the rays should be coherent
+		(same direction signs), otherwise they are traced one by one.
+		Returns the mask of the shadowed rays */
+	int IntersectS4(const rayPacket4_t &rays, int mask, const float *dist, triangle_t **tr, float shadow_bias) const;
 //	bool IntersectO(const point3d_t &from, const vector3d_t &ray, float dist, triangle_t **tr, float &Z) const;
 	bound_t getBound(){ return treeBound; }
+	const kdTreeStats_t &getStats() const { return stats; }
 	~triKdTree_t();
+
+	/*! key of the on-disk cache, a hash of the triangle geometry and the build parameters */
+	static uint64_t cacheKey(const triangle_t **v, int np, int depth=-1, int leafSize=2, float cost_ratio=0.35, float emptyBonus=0.33);
+	/*! load a tree saved with saveCache() for the triangles v, in the same order as when saved.
+		returns nullptr if the file does not exist or was written for a different key */
+	static triKdTree_t *loadCache(const std::string &fileName, uint64_t key, const triangle_t **v, int np, float cost_ratio=0.35);
+	/*! write the nodes and the leaf triangle indices (relative to v) to a cache file */
+	bool saveCache(const std::string &fileName, uint64_t key, const triangle_t **v) const;
 private:
-	void pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, splitCost_t &split);
-	void minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx,
-		const bound_t *allBounds, boundEdge *edges[3], splitCost_t &split);
-	int buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
-		u_int32 *leftPrims, u_int32 *rightPrims, boundEdge *edges[3],
+	triKdTree_t(): nextFreeNode(0), allocatedNodesCount(0), totalPrims(0), threadPool(nullptr), nodes(nullptr), prims(nullptr), allBounds(nullptr) {}
+	void pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, float emptyBonus, bool parallel, splitCost_t &split) const;
+	void pigeonAxisCost(int axis, u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, float emptyBonus, splitCost_t &split) const;
+	void minimalCost(kdBuildContext_t &ctx, u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx,
+		const bound_t *pBounds, float emptyBonus, splitCost_t &split) const;
+	//! reorder the finished nodes into page sized treelets
+	void optimizeLayout();
+	//! fill the structure part of stats from the finished tree
+	void collectStats(float emptyBonus);
+	int buildTree(kdBuildContext_t &ctx, u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
+		u_int32 *leftPrims, u_int32 *rightPrims,
 		u_int32 rightMemSize, int depth, int badRefines );
 	
 	float 		costRatio; 	//!< node traversal cost divided by primitive intersection cost
 	float 		eBonus; 	//!< empty bonus
 	u_int32 	nextFreeNode, allocatedNodesCount, totalPrims;
 	int 		maxDepth;
+	int 		maxParallelDepth; //!< number of tree levels whose subtrees get built by separate tasks
+	threadPool_t *threadPool; //!< runs the tasks of the parallel levels, nullptr = build on the calling thread
 	unsigned int maxLeafSize;
 	bound_t 	treeBound; 	//!< overall space the tree encloses
 	MemoryArena primsArena;
+	std::vector<MemoryArena *> subtreeArenas; //!< leaf lists allocated by the subtree build threads
 	kdTreeNode 	*nodes;
+	kdTreeStats_t stats;
 	
 	// those are temporary actually, to keep argument counts bearable
 	const triangle_t **prims;
 	bound_t *allBounds;
-	int *clip; // indicate clip plane(s) for current level
-	char *cdata; // clipping data...
-	
-	// some statistics:
-	int depthLimitReached, NumBadSplits;
 };
 
 
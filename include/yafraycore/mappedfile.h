@@ -0,0 +1,40 @@
+#ifndef Y_MAPPEDFILE_H
+#define Y_MAPPEDFILE_H
+
+#include <yafray_config.h>
+
+#include <string>
+#include <cstddef>
+
+__BEGIN_YAFRAY
+
+/*!	A zero filled temporary file mapped into memory, as backing storage for buffers
+	too big to be kept in RAM. The operating system pages its contents in on access
+	and writes them back under memory pressure, release() does the same on purpose
+	for parts that will not be needed for a while, so the resident set stays bounded.
+	The file is removed on creation already and disappears with the mapping.
+	Only supported on POSIX systems, isMapped() is false otherwise or on errors.
+*/
+class YAFRAYCORE_EXPORT mappedFile_t
+{
+	public:
+		mappedFile_t(const std::string &dir, size_t bytes);
+		~mappedFile_t();
+		bool isMapped() const { return data != nullptr; }
+		void *getData() const { return data; }
+		size_t getSize() const { return size; }
+		//! write back the pages fully inside [ptr, ptr+bytes) and drop them from memory, the contents stay in the file
+		void release(const void *ptr, size_t bytes);
+		void releaseAll() { release(data, size); }
+		//! set the whole file back to zeros, freeing its disk space
+		void zero();
+
+	protected:
+		void *data = nullptr;
+		size_t size = 0;
+		int fd = -1;
+};
+
+__END_YAFRAY
+
+#endif // Y_MAPPEDFILE_H
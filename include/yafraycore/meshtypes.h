@@ -77,6 +77,7 @@ class YAFRAYCORE_EXPORT triangleObject_t: public object3d_t
 		triangle_t* addTriangle(const triangle_t &t);
 		
 		virtual void finish();
+		virtual bool isInstance() const { return false; }
 
         inline virtual vector3d_t getVertexNormal(int index) const
         {
@@ -110,10 +111,17 @@ class YAFRAYCORE_EXPORT triangleObjectInstance_t: public triangleObject_t
 		triangleObjectInstance_t(triangleObject_t *base, matrix4x4_t obj2World);
 		/*! the number of primitives the object holds. Primitive is an element
 			that by definition can perform ray-triangle intersection */
-		virtual int numPrimitives() const { return triangles.size(); }
+		virtual int numPrimitives() const { return mBase->triangles.size(); }
+		/*! the world space triangles are only created when requested here
+			(e.g. for mesh lights), ray tracing uses the base mesh through triInstanceTree_t */
 		virtual int getPrimitives(const triangle_t **prims);
 		
 		virtual void finish();
+		virtual bool isInstance() const { return true; }
+		triangleObject_t* getBase() const { return mBase; }
+		const matrix4x4_t& getObjToWorld() const { return objToWorld; }
+		//! surface point in world space of a hit on a triangle of the base mesh
+		void getSurface(surfacePoint_t &sp, const triangle_t *baseTri, const point3d_t &hit, intersectData_t &data) const;
 
         inline virtual vector3d_t getVertexNormal(int index) const
         {
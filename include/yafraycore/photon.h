@@ -166,7 +166,8 @@ class YAFRAYCORE_EXPORT photonMap_t
 		void swapVector(std::vector<photon_t> &vec) { photons.swap(vec); updated=false; }
 		void appendVector(std::vector<photon_t> &vec, unsigned int curr) { photons.insert(std::end(photons), std::begin(vec), std::end(vec)); updated=false; paths += curr;}
 		void reserveMemory(size_t numPhotons) { photons.reserve(numPhotons); }
-		void updateTree();
+		//! rebuild the lookup tree, using pool for the top levels of the build if given
+		void updateTree(threadPool_t *pool = nullptr);
 		void clear(){ photons.clear(); delete tree; tree = nullptr; updated=false; }
 		bool ready() const { return updated; }
 	//	void gather(const point3d_t &P, std::vector< foundPhoton_t > &found, unsigned int K, float &sqRadius) const;
@@ -5,6 +5,7 @@
 
 #include <utilities/y_alloc.h>
 #include <core_api/bound.h>
+#include <yafraycore/threadpool.h>
 #include <algorithm>
 #include <vector>
 
@@ -69,7 +70,8 @@ class pointKdTree
 {
 	public:
 		pointKdTree() {};
-		pointKdTree(const std::vector<T> &dat, const std::string &mapName, int numThreads=1);
+		/*! \param pool worker threads for the top levels of the build, nullptr = build on the calling thread */
+		pointKdTree(const std::vector<T> &dat, const std::string &mapName, int numThreads=1, threadPool_t *pool=nullptr);
 		~pointKdTree(){ if(nodes) y_free(nodes); }
 		template<class LookupProc> void lookup(const point3d_t &p, const LookupProc &proc, float &maxDistSquared) const;
 		double lookupStat()const{ return double(Y_PROCS)/double(Y_LOOKUPS); } //!< ratio of photons tested per lookup call
@@ -88,6 +90,7 @@ class pointKdTree
 		bound_t treeBound;
 		mutable unsigned int Y_LOOKUPS, Y_PROCS;
 		int maxLevelThreads = 0;  //max level where we will launch threads. We will try to launch at least as many threads as scene threads parameter
+		threadPool_t *threadPool = nullptr;
 		std::mutex mutx;
 
 		friend class boost::serialization::access;
@@ -115,7 +118,7 @@ class pointKdTree
 };
 
 template<class T>
-pointKdTree<T>::pointKdTree(const std::vector<T> &dat, const std::string &mapName, int numThreads)
+pointKdTree<T>::pointKdTree(const std::vector<T> &dat, const std::string &mapName, int numThreads, threadPool_t *pool): threadPool(pool)
 {
 	Y_LOOKUPS=0; Y_PROCS=0;
 	nextFreeNode = 0;
@@ -137,10 +140,11 @@ pointKdTree<T>::pointKdTree(const std::vector<T> &dat, const std::string &mapNam
 	
 	for(u_int32 i=1; i<nElements; ++i) treeBound.include(dat[i].pos);
 	
+	if(!threadPool) numThreads = 1;
 	maxLevelThreads = (int) std::ceil(std::log2((float) numThreads)); //in how many pkdtree levels we will spawn threads, so we create at least as many threads as scene threads parameter (or more)
-	int realThreads = (int) pow(2.f, maxLevelThreads); //real amount of threads we will create during pkdtree creation depending on the maximum level where we will generate threads
+	int realTasks = (int) pow(2.f, maxLevelThreads); //amount of subtrees built in parallel depending on the maximum level where we split the work into tasks
 	
-	Y_INFO << "pointKdTree: Starting " << mapName << " recusive tree build for " << nElements << " elements [using " << realThreads << " threads]" << yendl;
+	Y_INFO << "pointKdTree: Starting " << mapName << " recusive tree build for " << nElements << " elements [using " << realTasks << " tasks]" << yendl;
 
 	buildTree(0, nElements, treeBound, elements);
 	
@@ -186,17 +190,15 @@ void pointKdTree<T>::buildTreeWorker(u_int32 start, u_int32 end, bound_t &nodeBo
 		//<< recurse below child >>
 		uint32_t nextFreeNode1 = 0;
 		kdNode<T> * nodes1 = (kdNode<T> *)y_memalign(64, 4 * (splitEl - start)*sizeof(kdNode<T>));
-		std::thread * belowWorker = new std::thread(&pointKdTree<T>::buildTreeWorker, this, start, splitEl, std::ref(boundL), prims, level, std::ref(nextFreeNode1), nodes1);
+		taskGroup_t belowWorker;
+		threadPool->run(belowWorker, [&]{ buildTreeWorker(start, splitEl, boundL, prims, level, nextFreeNode1, nodes1); });
 
-		//<< recurse above child >>
+		//<< recurse above child, on this thread >>
 		uint32_t nextFreeNode2 = 0;
 		kdNode<T> * nodes2 = (kdNode<T> *)y_memalign(64, 4 * (end - splitEl)*sizeof(kdNode<T>));
-		std::thread * aboveWorker = new std::thread(&pointKdTree<T>::buildTreeWorker, this, splitEl, end, std::ref(boundR), prims, level, std::ref(nextFreeNode2), nodes2);
+		buildTreeWorker(splitEl, end, boundR, prims, level, nextFreeNode2, nodes2);
 
-		belowWorker->join();
-		aboveWorker->join();
-		delete belowWorker;
-		delete aboveWorker;
+		threadPool->wait(belowWorker);
 
 		if (nodes1)
 		{
@@ -13,8 +13,6 @@
 
 __BEGIN_YAFRAY
 
-extern int Kd_inodes, Kd_leaves, _emptyKd_leaves, Kd_prims, _clip, _bad_clip, _null_clip, _early_out;
-
 struct renderState_t;
 
 #define PRIM_DAT_SIZE 32
@@ -36,18 +34,14 @@ public:
 		{
 			primitives = (T **)arena.Alloc(np * sizeof(T *));
 			for(int i=0;i<np;i++) primitives[i] = (T *)prims[primIdx[i]];
-			Kd_prims+=np; //stat
 		}
 		else if(np==1)
 		{
 			onePrimitive = (T *)prims[primIdx[0]];
-			Kd_prims++; //stat
 		}
-		else _emptyKd_leaves++; //stat
-		Kd_leaves++; //stat
 	}
 	void createInterior(int axis, float d)
-	{	division = d; flags = (flags & ~3) | axis; Kd_inodes++; }
+	{	division = d; flags = (flags & ~3) | axis; }
 	float 	SplitPos() const { return division; }
 	int 	SplitAxis() const { return flags & 3; }
 	int 	nPrimitives() const { return flags >> 2; }
@@ -64,6 +58,8 @@ public:
 	u_int32	flags;		//!< 2bits: isLeaf, axis; 30bits: nprims (leaf) or index of right child
 };
 
+template<class T> inline size_t kdLeafBytes(const rkdTreeNode<T> &n) { return (n.nPrimitives() > 1) ? n.nPrimitives() * sizeof(T *) : 0; }
+
 /*! Stack elements for the custom stack of the recursive traversal */
 template<class T> struct rKdStack
 {
@@ -88,6 +84,7 @@ public:
 	bool IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, T **tr, color_t &filt, float shadow_bias) const;
 //	bool IntersectO(const point3d_t &from, const vector3d_t &ray, float dist, T **tr, float &Z) const;
 	bound_t getBound(){ return treeBound; }
+	const kdTreeStats_t &getStats() const { return stats; }
 	~kdTree_t();
 private:
 	void pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, splitCost_t &split);
@@ -112,8 +109,7 @@ private:
 	int *clip; // indicate clip plane(s) for current level
 	char *cdata; // clipping data...
 	
-	// some statistics:
-	int depthLimitReached, NumBadSplits;
+	kdTreeStats_t stats;
 };
 
 
@@ -0,0 +1,100 @@
+#ifndef Y_THREADPOOL_H
+#define Y_THREADPOOL_H
+
+#include <yafray_config.h>
+
+#include <utilities/threadUtils.h>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <exception>
+
+__BEGIN_YAFRAY
+
+/*! Tasks of one job that are still queued or running, see threadPool_t::wait() */
+class taskGroup_t
+{
+	friend class threadPool_t;
+	public:
+		taskGroup_t(): pending(0) {}
+		bool done() const { return pending == 0; }
+	protected:
+		std::atomic<int> pending;
+		std::exception_ptr error; //!< first exception thrown by a task, guarded by the mutex of the pool
+};
+
+/*!	Persistent worker threads owned by the render environment.
+	Rendering, photon shooting and photon tree builds submit their work here
+	instead of creating std::threads for every pass or map, so they share
+	one concurrency limit and threads only get created when the limit changes.
+	A thread waiting for a task group runs the queued tasks of that group
+	meanwhile, so tasks may submit and wait for sub-tasks (recursive tree
+	builds) safely, without picking up long unrelated work like a whole
+	photon map build while the caller only waits for a few small tasks.
+*/
+class YAFRAYCORE_EXPORT threadPool_t
+{
+	public:
+		threadPool_t(int threads = 1);
+		~threadPool_t();
+		/*! change the number of worker threads, must not be called while tasks are queued or running
+			\param pin bind worker i to logical CPU i (only supported on Linux) */
+		void resize(int threads, bool pin = false);
+		int size() const { return (int)workers.size(); }
+		//! queue a task belonging to group
+		void run(taskGroup_t &group, std::function<void()> task);
+		/*! return once all tasks of group have finished, running its queued tasks meanwhile.
+			If a task of group threw, the first exception is rethrown here */
+		void wait(taskGroup_t &group);
+		/*! call body(i) for all i in [begin, end) and wait for them to finish.
+			\param maxTasks at most this many indices run at the same time, 0 = all workers plus the calling thread */
+		void parallelFor(int begin, int end, const std::function<void(int)> &body, int maxTasks = 0);
+
+	protected:
+		struct task_t
+		{
+			std::function<void()> func;
+			taskGroup_t *group;
+		};
+		//! run the oldest queued task, of group only if given
+		bool runOne(std::unique_lock<std::mutex> &lk, const taskGroup_t *group = nullptr);
+		void workerLoop(int id);
+		void stop();
+		std::vector<std::thread> workers;
+		std::deque<task_t> tasks;
+		std::mutex m;
+		std::condition_variable taskAvailable, taskDone;
+		bool quit = false;
+		bool pinned = false;
+};
+
+/*!	A single thread running queued tasks one after the other in submission order,
+	for work that has to stay sequential but must not block the submitting thread
+	(image output and film autosave while rendering).
+*/
+class YAFRAYCORE_EXPORT serialQueue_t
+{
+	public:
+		serialQueue_t();
+		~serialQueue_t();
+		//! queue a task behind all previously pushed ones
+		void push(std::function<void()> task);
+		//! return once all queued tasks have finished, must not be called from a queued task
+		void wait();
+		//! true when called from a queued task
+		bool inWorker() const { return std::this_thread::get_id() == worker.get_id(); }
+
+	protected:
+		void workerLoop();
+		std::thread worker;
+		std::deque<std::function<void()>> tasks;
+		std::mutex m;
+		std::condition_variable taskAvailable, idle;
+		bool busy = false;
+		bool quit = false;
+};
+
+__END_YAFRAY
+
+#endif // Y_THREADPOOL_H
@@ -7,6 +7,10 @@
 #include <core_api/primitive.h>
 //#include <core_api/object3d.h>
 
+#if defined(__SSE__) || defined(_M_X64)
+	#include <xmmintrin.h>
+#endif
+
 __BEGIN_YAFRAY
 
 #define Y_MIN3(a,b,c) ( ((a)>(b)) ? ( ((b)>(c))?(c):(b)):( ((a)>(c))?(c):(a)) )
@@ -34,6 +38,17 @@ class YAFRAYCORE_EXPORT triangle_t
 		triangle_t(): pa(-1), pb(-1), pc(-1), na(-1), nb(-1), nc(-1), mesh(nullptr), intersectionBiasFactor(0.f), edge1(0.f), edge2(0.f) { /* Empty */ }
         triangle_t(int ia, int ib, int ic, triangleObject_t* m): pa(ia), pb(ib), pc(ic), na(-1), nb(-1), nc(-1), mesh(m), intersectionBiasFactor(0.f), edge1(0.f), edge2(0.f) {  updateIntersectionCachedValues(); }
 		virtual bool intersect(const ray_t &ray, float *t, intersectData_t &data) const;
+		//! the values the intersection test uses, for acceleration structures keeping their own copy
+		virtual void getIntersectionData(point3d_t &a, vector3d_t &e1, vector3d_t &e2, float &epsilon) const;
+		//! fill the intersection data of a hit at barycentric coordinates u, v
+		void setIntersectData(float u, float v, intersectData_t &data) const
+		{
+			data.b1 = u;
+			data.b2 = v;
+			data.b0 = 1 - u - v;
+			data.edge1 = &edge1;
+			data.edge2 = &edge2;
+		}
 		virtual bound_t getBound() const;
 		virtual bool intersectsBound(exBound_t &eb) const;
 		virtual bool clippingSupport() const{ return true; }
@@ -80,8 +95,9 @@ class YAFRAYCORE_EXPORT triangleInstance_t: public triangle_t
 
 	public:
 		triangleInstance_t(): mBase(nullptr), mesh(nullptr) { }
-        triangleInstance_t(triangle_t* base, triangleObjectInstance_t* m): mBase(base), mesh(m) { updateIntersectionCachedValues();}
+        triangleInstance_t(const triangle_t* base, const triangleObjectInstance_t* m): mBase(base), mesh(m) { updateIntersectionCachedValues();}
 		virtual bool intersect(const ray_t &ray, float *t, intersectData_t &data) const;
+		virtual void getIntersectionData(point3d_t &a, vector3d_t &e1, vector3d_t &e2, float &epsilon) const;
 		virtual bound_t getBound() const;
 		virtual bool intersectsBound(exBound_t &eb) const;
 		virtual bool clippingSupport() const { return true; }
@@ -63,14 +63,84 @@ inline bool triangle_t::intersect(const ray_t &ray, float *t, intersectData_t &d
 
 	if(*t < epsilon) return false;
 
-	data.b1 = u;
-	data.b2 = v;
-	data.b0 = 1 - u - v;
-	data.edge1 = &edge1;
-	data.edge2 = &edge2;
+	setIntersectData(u, v, data);
 	return true;
 }
 
+/*! Tomas Möller and Ben Trumbore ray intersection scheme for one triangle
+	and the 4 rays of a packet, with the same operations and tolerances as
+	the single ray version. Returns the mask of the hit rays, t, u (b1) and v (b2)
+	are written for all lanes.
+*/
+inline int triIntersect4(const point3d_t &a, const vector3d_t &edge1, const vector3d_t &edge2, float epsilon,
+						const rayPacket4_t &rays, int mask, float *t, float *u, float *v)
+{
+#if defined(__SSE__) || defined(_M_X64)
+	const __m128 dx = _mm_loadu_ps(rays.dir[0]), dy = _mm_loadu_ps(rays.dir[1]), dz = _mm_loadu_ps(rays.dir[2]);
+	const __m128 e1x = _mm_set1_ps(edge1.x), e1y = _mm_set1_ps(edge1.y), e1z = _mm_set1_ps(edge1.z);
+	const __m128 e2x = _mm_set1_ps(edge2.x), e2y = _mm_set1_ps(edge2.y), e2z = _mm_set1_ps(edge2.z);
+	const __m128 eps = _mm_set1_ps(epsilon);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 valid = _mm_or_ps(_mm_cmple_ps(det, _mm_sub_ps(zero, eps)), _mm_cmpge_ps(det, eps));
+	if(!(_mm_movemask_ps(valid) & mask)) return 0;
+
+	__m128 invDet = _mm_div_ps(one, det);
+	__m128 tx = _mm_sub_ps(_mm_loadu_ps(rays.from[0]), _mm_set1_ps(a.x));
+	__m128 ty = _mm_sub_ps(_mm_loadu_ps(rays.from[1]), _mm_set1_ps(a.y));
+	__m128 tz = _mm_sub_ps(_mm_loadu_ps(rays.from[2]), _mm_set1_ps(a.z));
+	__m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+	if(!(_mm_movemask_ps(valid) & mask)) return 0;
+
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+	__m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+	__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(tt, eps));
+
+	_mm_storeu_ps(t, tt);
+	_mm_storeu_ps(u, uu);
+	_mm_storeu_ps(v, vv);
+	return _mm_movemask_ps(valid) & mask;
+#else
+	int hits = 0;
+	for(int i=0; i<4; ++i)
+	{
+		if(!(mask & (1 << i))) continue;
+		vector3d_t dir(rays.dir[0][i], rays.dir[1][i], rays.dir[2][i]);
+		vector3d_t pvec = dir ^ edge2;
+		float det = edge1 * pvec;
+		if(det > -epsilon && det < epsilon) continue;
+		float inv_det = 1.f / det;
+		vector3d_t tvec(rays.from[0][i] - a.x, rays.from[1][i] - a.y, rays.from[2][i] - a.z);
+		u[i] = (tvec*pvec) * inv_det;
+		if (u[i] < 0.f || u[i] > 1.f) continue;
+		vector3d_t qvec = tvec^edge1;
+		v[i] = (dir*qvec) * inv_det;
+		if ((v[i]<0.f) || ((u[i]+v[i])>1.f) ) continue;
+		t[i] = edge2 * qvec * inv_det;
+		if(t[i] < epsilon) continue;
+		hits |= 1 << i;
+	}
+	return hits;
+#endif
+}
+
+inline void triangle_t::getIntersectionData(point3d_t &a, vector3d_t &e1, vector3d_t &e2, float &epsilon) const
+{
+	a = mesh->getVertex(pa);
+	e1 = edge1;
+	e2 = edge2;
+	epsilon = intersectionBiasFactor;
+}
+
 inline bound_t triangle_t::getBound() const
 {
     point3d_t const& a = mesh->getVertex(pa);
@@ -144,14 +214,18 @@ inline bool triangleInstance_t::intersect(const ray_t &ray, float *t, intersectD
 
 	if(*t < epsilon) return false;
 
-	data.b1 = u;
-	data.b2 = v;
-	data.b0 = 1 - u - v;
-	data.edge1 = &edge1;
-	data.edge2 = &edge2;
+	setIntersectData(u, v, data);
 	return true;
 }
 
+inline void triangleInstance_t::getIntersectionData(point3d_t &a, vector3d_t &e1, vector3d_t &e2, float &epsilon) const
+{
+	a = mesh->getVertex(mBase->pa);
+	e1 = edge1;
+	e2 = edge2;
+	epsilon = intersectionBiasFactor;
+}
+
 inline bound_t triangleInstance_t::getBound() const
 {
     point3d_t const& a = mesh->getVertex(mBase->pa);
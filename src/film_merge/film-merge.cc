@@ -0,0 +1,247 @@
+#include <yafray_config.h>
+#include <cstdlib>
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+
+#include <core_api/environment.h>
+#include <core_api/imagefilm.h>
+#include <yafraycore/filmfile.h>
+#include <yafraycore/threadpool.h>
+#include <yafraycore/imageOutput.h>
+#include <utilities/image_buffers.h>
+#include <utilities/console_utils.h>
+
+using namespace::yafaray;
+
+/*! Adds up the film files saved by the computer nodes of a multi-computer render (see the
+	yafaray-xml --node options) and writes the images like the render itself would. The films
+	keep the render passes, views and color space they were rendered with, so the scene is not
+	needed. */
+int main(int argc, char *argv[])
+{
+	session.setPathYafaRayXml(boost::filesystem::system_complete(argv[0]).parent_path().string());
+
+	//any number of films, so every argument that is not an option is taken as a clean one
+	const int cleanArgs = std::max(2, argc - 1);
+	cliParser_t parse(argc, argv, cleanArgs, cleanArgs - 2, "You need to set the output filename and at least one film file.");
+
+	parse.setAppName("YafaRay film merge",
+	"[OPTIONS]... <output filename> <film file>...\n<output filename> : The filename of the merged image without extension.\n<film file> : Binary film files (.film) saved by the computer nodes, all of the same render.");
+
+	parse.setOption("pp","plugin-path", false, "Path to load plugins.");
+	parse.setOption("vl","verbosity-level", false, "Set console verbosity level, options are:\n                                       \"mute\" (Prints nothing)\n                                       \"error\" (Prints only errors)\n                                       \"warning\" (Prints also warnings)\n                                       \"params\" (Prints also render param messages)\n                                       \"info\" (Prints also basi info messages)\n                                       \"verbose\" (Prints additional info messages)\n                                       \"debug\" (Prints debug messages if any)\n");
+	parse.setOption("ccd","console-colors-disabled", true, "If specified, disables the Console colors ANSI codes, useful for some 3rd party software that cannot handle ANSI codes well.");
+
+	parse.parseCommandLine();
+
+	yafLog.setConsoleLogColorsEnabled(!parse.getFlag("ccd"));
+
+	std::string verbLevel = parse.getOptionString("vl");
+	if(verbLevel.empty()) yafLog.setConsoleMasterVerbosity("info");
+	else yafLog.setConsoleMasterVerbosity(verbLevel);
+
+	std::unique_ptr<renderEnvironment_t> env(new renderEnvironment_t());
+
+	std::string ppath = parse.getOptionString("pp");
+	if(env->getPluginPath(ppath))
+	{
+		Y_INFO << "The plugins path is: " << ppath << yendl;
+		env->loadPlugins(ppath);
+	}
+	else
+	{
+		Y_ERROR << "Getting plugins path from render environment failed!" << yendl;
+		parse.printError();
+		parse.printUsage();
+		return 1;
+	}
+
+	std::vector<std::string> formats = env->listImageHandlers();
+
+	std::string formatString = "";
+	for(size_t i = 0; i < formats.size(); i++)
+	{
+		formatString.append("                                       " + formats[i]);
+		if(i < formats.size() - 1) formatString.append("\n");
+	}
+
+	parse.setOption("h","help", true, "Displays this help text.");
+	parse.setOption("op","output-path", false, "Uses the path in <value> as merged image output path.");
+	parse.setOption("f","format", false, "Sets the output image format, available formats are:\n\n" + formatString + "\n                                       Default: tga.\n");
+	parse.setOption("ml","multilayer", true, "Enables multi-layer image output (only in certain formats as EXR)");
+	parse.setOption("t","threads", false, "Number of threads reading the films, for auto selection use -1.");
+	parse.setOption("a","with-alpha", true, "Enables saving the image with alpha channel.");
+	parse.setOption("s","save-film", true, "Also saves the merged film next to the image, so it can be resumed or merged again.");
+
+	bool parseOk = parse.parseCommandLine();
+
+	if(parse.getFlag("h"))
+	{
+		parse.printUsage();
+		return 0;
+	}
+
+	if(!parseOk)
+	{
+		parse.printError();
+		parse.printUsage();
+		return 0;
+	}
+
+	std::string format = parse.getOptionString("f");
+	if(format.empty()) format = "tga";
+	std::string outputPath = parse.getOptionString("op");
+	int threads = parse.getOptionInteger("t");
+	if(threads < -1) threads = -1;
+
+	std::vector<std::string> args = parse.getCleanArgs();
+	const std::string outName = args[0] + "." + format;
+
+	// Set the full output path with filename
+	if(outputPath.empty()) outputPath = outName;
+	else if(outputPath.at(outputPath.length() - 1) == '/') outputPath += outName;
+	else outputPath += "/" + outName;
+
+	//all the films must come from the same render
+	std::vector<filmFile_t> films(args.size() - 1);
+	for(size_t i = 0; i < films.size(); ++i)
+	{
+		if(!films[i].open(args[i + 1])) return 1;
+
+		const filmFile_t::header_t &h0 = films[0].getHeader(), &hi = films[i].getHeader();
+		bool same = std::string(h0.filmStructureVersion) == hi.filmStructureVersion;
+		same = same && h0.w == hi.w && h0.h == hi.h && h0.cx0 == hi.cx0 && h0.cy0 == hi.cy0;
+		same = same && h0.numPasses == hi.numPasses && h0.numAuxPasses == hi.numAuxPasses;
+		same = same && films[0].getParams() == films[i].getParams();
+		for(size_t idx = 0; same && idx < films[0].getPassFormats().size(); ++idx)
+		{
+			same = films[0].getPassFormats()[idx].channels == films[i].getPassFormats()[idx].channels && films[0].getPassFormats()[idx].half == films[i].getPassFormats()[idx].half;
+		}
+		if(!same)
+		{
+			Y_ERROR << "FilmMerge: \"" << args[i + 1] << "\" does not match the film of \"" << args[1] << "\"" << yendl;
+			return 1;
+		}
+		if(films[i].getHeader().computerNode == films[0].getHeader().computerNode && i > 0) Y_WARNING << "FilmMerge: \"" << args[i + 1] << "\" was rendered by the same computer node as \"" << args[1] << "\", they may have repeated the same samples" << yendl;
+	}
+
+	const filmFile_t &film = films[0];
+	const filmFile_t::header_t &header = film.getHeader();
+	if(film.getParams().empty())
+	{
+		Y_ERROR << "FilmMerge: \"" << args[1] << "\" does not tell how to output its passes, it was saved by an older version" << yendl;
+		return 1;
+	}
+
+	paraMap_t passParams;
+	for(const auto &param : film.getParams())
+	{
+		if(param.first.compare(0, 5, "pass_") == 0) passParams[param.first] = param.second;
+	}
+	env->setupRenderPasses(passParams);
+	renderPasses_t renderPasses = *env->getRenderPasses();
+	if(renderPasses.extPassesSize() != (int) header.numPasses)
+	{
+		Y_ERROR << "FilmMerge: the render passes of the films cannot be rebuilt" << yendl;
+		return 1;
+	}
+
+	const int numViews = std::max(1, std::atoi(film.getParam("views").c_str()));
+	const int viewWidth = header.w / numViews;
+	renderPasses.view_names.clear();
+	for(int view = 0; view < numViews; ++view) renderPasses.view_names.push_back(film.getParam("view_" + std::to_string(view)));
+
+	colorSpaces_t colorSpace = RAW_MANUAL_GAMMA;
+	const std::string colorSpaceString = film.getParam("color_space");
+	if(colorSpaceString == "sRGB") colorSpace = SRGB;
+	else if(colorSpaceString == "XYZ") colorSpace = XYZ_D65;
+	else if(colorSpaceString == "LinearRGB") colorSpace = LINEAR_RGB;
+	const float gamma = std::atof(film.getParam("gamma").c_str());
+	const bool premultAlpha = film.getParam("premult") == "true";
+
+	threadPool_t &pool = env->getThreadPool();
+	pool.resize(threads == -1 ? std::thread::hardware_concurrency() : threads);
+
+	//the merged film has the samples of all the nodes, so a render resumed from it continues after all of them
+	unsigned int samplingOffset = 0, baseSamplingOffset = 0;
+	for(size_t i = 0; i < films.size(); ++i)
+	{
+		Y_INFO << "FilmMerge: adding \"" << args[i + 1] << "\" (computer node " << films[i].getHeader().computerNode << ")" << yendl;
+		samplingOffset += films[i].getHeader().samplingOffset;
+		baseSamplingOffset = std::max(baseSamplingOffset, films[i].getHeader().baseSamplingOffset);
+	}
+
+	//write the images like imageFilm_t::flush(), without the parameters badge
+	paraMap_t ihParams;
+	ihParams["type"] = format;
+	ihParams["width"] = viewWidth;
+	ihParams["height"] = header.h;
+	ihParams["alpha_channel"] = parse.getFlag("a");
+	ihParams["img_multilayer"] = parse.getFlag("ml");
+
+	imageHandler_t *ih = env->createImageHandler("outFile", ihParams);
+	if(!ih) return 1;
+
+	imageOutput_t *out = new imageOutput_t(ih, outputPath, 0, 0);
+
+	bool ok = true;
+	const bool saveFilm = parse.getFlag("s");
+	filmFile_t mergedFilm;
+	if(saveFilm)
+	{
+		filmFile_t::header_t merged = header;
+		merged.samplingOffset = samplingOffset;
+		merged.baseSamplingOffset = baseSamplingOffset;
+		const std::string filmPath = outputPath.substr(0, outputPath.size() - format.size() - 1) + ".film";
+		Y_INFO << "FilmMerge: saving the merged film to \"" << filmPath << "\"" << yendl;
+		ok = mergedFilm.create(filmPath, merged, film.getParams(), film.getPassFormats(), header.compressed != 0);
+	}
+
+	//the films are added one row of tiles at a time, so only that part of the passes is kept in memory
+	std::vector<passImage_t*> passes;
+	for(const auto &passFormat : film.getPassFormats()) passes.push_back(new passImage_t(header.w, FILM_FILE_TILE_SIZE, passFormat.channels, passFormat.half != 0));
+
+	std::vector<colorA_t> colExtPasses(header.numPasses, colorA_t(0.f));
+	//the image output keeps one view at a time, so the films are read again for every view
+	for(int view = 0; ok && view < numViews; ++view)
+	{
+		const int viewX0 = view * viewWidth;
+		for(int tileY = 0; ok && tileY < film.getTileRows(); ++tileY)
+		{
+			for(auto pass : passes) pass->clear();
+			for(size_t i = 0; ok && i < films.size(); ++i) ok = films[i].addTileRows(passes, tileY, tileY + 1, pool);
+			if(!ok) break;
+
+			const int y0 = tileY * FILM_FILE_TILE_SIZE;
+			for(int j = y0; j < std::min(header.h, y0 + FILM_FILE_TILE_SIZE); ++j)
+			{
+				for(int i = viewX0; i < viewX0 + viewWidth; ++i)
+				{
+					for(size_t idx = 0; idx < colExtPasses.size(); ++idx)
+					{
+						colExtPasses[idx] = imageFilm_t::passColor(renderPasses.intPassTypeFromExtPassIndex(idx), (*passes[idx])(i, j - y0));
+						colExtPasses[idx].clampRGB0();
+						colExtPasses[idx].ColorSpace_from_linearRGB(colorSpace, gamma);
+						if(premultAlpha && idx == 0) colExtPasses[idx].alphaPremultiply();
+						if(colExtPasses[idx].A < 0.f) colExtPasses[idx].A = 0.f;
+						else if(colExtPasses[idx].A > 1.f) colExtPasses[idx].A = 1.f;
+					}
+					out->putPixel(view, i - viewX0, j, &renderPasses, colExtPasses);
+				}
+			}
+
+			if(saveFilm && view == 0) ok = mergedFilm.writeTileRows(std::vector<const passImage_t*>(passes.begin(), passes.end()), tileY, tileY + 1, pool);
+		}
+		if(ok) out->flush(view, &renderPasses);
+	}
+	if(ok && saveFilm) ok = mergedFilm.finish();
+
+	for(auto pass : passes) delete pass;
+	delete out;
+	env->clearAll();
+
+	return ok ? 0 : 1;
+}
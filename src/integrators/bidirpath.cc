@@ -116,6 +116,7 @@ public:
 	virtual bool preprocess();
 	virtual void cleanup();
 	virtual colorA_t integrate(renderState_t &state, diffRay_t &ray, colorPasses_t &colorPasses, int additionalDepth = 0) const;
+	virtual bool canRenderViewsInterleaved() const { return false; } //!< light paths are connected to the single camera set in preprocess
 	static integrator_t* factory(paraMap_t &params, renderEnvironment_t &render);
 	color_t sampleAmbientOcclusionPass(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const;
 	color_t sampleAmbientOcclusionPassClay(renderState_t &state, const surfacePoint_t &sp, const vector3d_t &wo) const;
@@ -207,6 +207,7 @@ integrator_t* directLighting_t::factory(paraMap_t &params, renderEnvironment_t &
 	params.getParam("raydepth", raydepth);
 	params.getParam("transpShad", transpShad);
 	params.getParam("shadowDepth", shadowDepth);
+	if(transpShad) shadowDepth = clampShadowDepth(shadowDepth);
 	params.getParam("caustics", caustics);
 	params.getParam("photons", photons);
 	params.getParam("caustic_mix", search);
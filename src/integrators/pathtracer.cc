@@ -361,6 +361,7 @@ integrator_t* pathIntegrator_t::factory(paraMap_t &params, renderEnvironment_t &
 	params.getParam("raydepth", raydepth);
 	params.getParam("transpShad", transpShad);
 	params.getParam("shadowDepth", shadowDepth);
+	if(transpShad) shadowDepth = clampShadowDepth(shadowDepth);
 	params.getParam("path_samples", path_samples);
 	params.getParam("bounces", bounces);
 	params.getParam("russian_roulette_min_bounces", russian_roulette_min_bounces);
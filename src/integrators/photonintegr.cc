@@ -407,7 +407,7 @@ void photonIntegrator_t::diffuseWorker(photonMap_t * diffuseMap, int threadID, c
 
 void photonIntegrator_t::photonMapKdTreeWorker(photonMap_t * photonMap)
 {
-	photonMap->updateTree();
+	photonMap->updateTree(&scene->getThreadPool());
 }
 
 bool photonIntegrator_t::preprocess()
@@ -637,9 +637,7 @@ bool photonIntegrator_t::preprocess()
 		
 		if(nThreads >= 2)
 		{
-			std::vector<std::thread> threads;
-			for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&photonIntegrator_t::diffuseWorker, this, session.diffuseMap, i, scene, nDiffusePhotons, lightPowerD, numDLights, std::ref(integratorName), tmplights, pb, pbStep, std::ref(curr), maxBounces, finalGather, std::ref(pgdat)));
-			for(auto& t : threads) t.join();
+			scene->getThreadPool().parallelFor(0, nThreads, [&](int i){ diffuseWorker(session.diffuseMap, i, scene, nDiffusePhotons, lightPowerD, numDLights, integratorName, tmplights, pb, pbStep, curr, maxBounces, finalGather, pgdat); }, nThreads);
 		}
 		else
 		{
@@ -782,14 +780,14 @@ bool photonIntegrator_t::preprocess()
 		Y_INFO << integratorName << ": Diffuse photon mapping disabled, skipping..." << yendl;
 	}
 	
-	std::thread * diffuseMapBuildKdTree_thread = nullptr;
+	taskGroup_t diffuseMapBuildKdTree;
 	
 	if( usePhotonDiffuse && session.diffuseMap->nPhotons() > 0 && scene->getNumThreadsPhotons() >= 2)
 	{
 		Y_INFO << integratorName << ": Building diffuse photons kd-tree:" << yendl;
 		pb->setTag("Building diffuse photons kd-tree...");
 
-		diffuseMapBuildKdTree_thread = new std::thread(&photonIntegrator_t::photonMapKdTreeWorker, this, session.diffuseMap);
+		scene->getThreadPool().run(diffuseMapBuildKdTree, [this]{ photonMapKdTreeWorker(session.diffuseMap); });
 	}
 	else
 
@@ -797,7 +795,7 @@ bool photonIntegrator_t::preprocess()
 	{
 		Y_INFO << integratorName << ": Building diffuse photons kd-tree:" << yendl;
 		pb->setTag("Building diffuse photons kd-tree...");
-		session.diffuseMap->updateTree();
+		session.diffuseMap->updateTree(&scene->getThreadPool());
 		Y_VERBOSE << integratorName << ": Done." << yendl;
 	}
 
@@ -853,9 +851,7 @@ bool photonIntegrator_t::preprocess()
 
 		if(nThreads >= 2)
 		{
-			std::vector<std::thread> threads;
-			for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&photonIntegrator_t::causticWorker, this, session.causticMap, i, scene, nCausPhotons, lightPowerD, numCLights, std::ref(integratorName), tmplights, causDepth, pb, pbStep, std::ref(curr), maxBounces));
-			for(auto& t : threads) t.join();
+			scene->getThreadPool().parallelFor(0, nThreads, [&](int i){ causticWorker(session.causticMap, i, scene, nCausPhotons, lightPowerD, numCLights, integratorName, tmplights, causDepth, pb, pbStep, curr, maxBounces); }, nThreads);
 		}
 		else		
 		{
@@ -988,14 +984,14 @@ bool photonIntegrator_t::preprocess()
 		
 	tmplights.clear();
 
-	std::thread * causticMapBuildKdTree_thread = nullptr;
+	taskGroup_t causticMapBuildKdTree;
 	
 	if(usePhotonCaustics && session.causticMap->nPhotons() > 0 && scene->getNumThreadsPhotons() >= 2)
 	{
 		Y_INFO << integratorName << ": Building caustic photons kd-tree:" << yendl;
 		pb->setTag("Building caustic photons kd-tree...");
 
-		causticMapBuildKdTree_thread = new std::thread(&photonIntegrator_t::photonMapKdTreeWorker, this, session.causticMap);
+		scene->getThreadPool().run(causticMapBuildKdTree, [this]{ photonMapKdTreeWorker(session.causticMap); });
 	}
 	else
 	{
@@ -1003,16 +999,14 @@ bool photonIntegrator_t::preprocess()
 		{
 			Y_INFO << integratorName << ": Building caustic photons kd-tree:" << yendl;
 			pb->setTag("Building caustic photons kd-tree...");
-			session.causticMap->updateTree();
+			session.causticMap->updateTree(&scene->getThreadPool());
 			Y_VERBOSE << integratorName << ": Done." << yendl;
 		}
 	}
 
-	if( usePhotonDiffuse && session.diffuseMap->nPhotons() > 0 && scene->getNumThreadsPhotons() >= 2 && diffuseMapBuildKdTree_thread)
+	if( usePhotonDiffuse && session.diffuseMap->nPhotons() > 0 && scene->getNumThreadsPhotons() >= 2)
 	{
-		diffuseMapBuildKdTree_thread->join();
-		delete diffuseMapBuildKdTree_thread;
-		diffuseMapBuildKdTree_thread = nullptr;
+		scene->getThreadPool().wait(diffuseMapBuildKdTree);
 
 		Y_VERBOSE << integratorName << ": Diffuse photon map: done." << yendl;
 	}
@@ -1022,7 +1016,7 @@ bool photonIntegrator_t::preprocess()
 	if(usePhotonDiffuse && finalGather) //create radiance map:
 	{
 		// == remove too close radiance points ==//
-		kdtree::pointKdTree< radData_t > *rTree = new kdtree::pointKdTree< radData_t >(pgdat.rad_points, "FG Radiance Photon Map", scene->getNumThreadsPhotons());
+		kdtree::pointKdTree< radData_t > *rTree = new kdtree::pointKdTree< radData_t >(pgdat.rad_points, "FG Radiance Photon Map", scene->getNumThreadsPhotons(), &scene->getThreadPool());
 		std::vector< radData_t > cleaned;
 		for(unsigned int i=0; i<pgdat.rad_points.size(); ++i)
 		{
@@ -1043,27 +1037,23 @@ bool photonIntegrator_t::preprocess()
 		pgdat.pbar->init(pgdat.rad_points.size());
 		pgdat.pbar->setTag("Pregathering radiance data for final gathering...");
 
-		std::vector<std::thread> threads;
-		for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&photonIntegrator_t::preGatherWorker, this, &pgdat, dsRadius, nDiffuseSearch));
-		for(auto& t : threads) t.join();
+		scene->getThreadPool().parallelFor(0, nThreads, [&](int){ preGatherWorker(&pgdat, dsRadius, nDiffuseSearch); }, nThreads);
 		
 		session.radianceMap->swapVector(pgdat.radianceVec);
 		pgdat.pbar->done();
 		pgdat.pbar->setTag("Pregathering radiance data done...");
 		if(!intpb) delete pgdat.pbar;
 		Y_VERBOSE << integratorName << ": Radiance tree built... Updating the tree..." << yendl;
-		session.radianceMap->updateTree();
+		session.radianceMap->updateTree(&scene->getThreadPool());
 		Y_VERBOSE << integratorName << ": Done." << yendl;
 		
 		delete rTree;
 		rTree = nullptr;
 	}
 
-	if(usePhotonCaustics && session.causticMap->nPhotons() > 0 && scene->getNumThreadsPhotons() >= 2 && causticMapBuildKdTree_thread)
+	if(usePhotonCaustics && session.causticMap->nPhotons() > 0 && scene->getNumThreadsPhotons() >= 2)
 	{
-		causticMapBuildKdTree_thread->join();
-		delete causticMapBuildKdTree_thread;
-		causticMapBuildKdTree_thread = nullptr;
+		scene->getThreadPool().wait(causticMapBuildKdTree);
 
 		Y_VERBOSE << integratorName << ": Caustic photon map: done." << yendl;
 	}
@@ -1468,6 +1458,7 @@ integrator_t* photonIntegrator_t::factory(paraMap_t &params, renderEnvironment_t
 	
 	params.getParam("transpShad", transpShad);
 	params.getParam("shadowDepth", shadowDepth);
+	if(transpShad) shadowDepth = clampShadowDepth(shadowDepth);
 	params.getParam("raydepth", raydepth);
 	params.getParam("photons", numPhotons);
 	params.getParam("cPhotons", numCPhotons);
@@ -656,9 +656,7 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 
 	if(nThreads >= 2)
 	{
-		std::vector<std::thread> threads;
-		for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&SPPM::photonWorker, this, session.diffuseMap, session.causticMap, i, scene, nPhotons, lightPowerD, numDLights, std::ref(integratorName), tmplights, pb, pbStep, std::ref(curr), maxBounces, std::ref(prng)));
-		for(auto& t : threads) t.join();
+		scene->getThreadPool().parallelFor(0, nThreads, [&](int i){ photonWorker(session.diffuseMap, session.causticMap, i, scene, nPhotons, lightPowerD, numDLights, integratorName, tmplights, pb, pbStep, curr, maxBounces, prng); }, nThreads);
 	}
 	else
 	{
@@ -813,13 +811,13 @@ void SPPM::prePass(int samples, int offset, bool adaptive)
 		if(session.diffuseMap->nPhotons() > 0)
 		{
 			Y_INFO << integratorName << ": Building diffuse photons kd-tree:" << yendl;
-			session.diffuseMap->updateTree();
+			session.diffuseMap->updateTree(&scene->getThreadPool());
 			Y_VERBOSE << integratorName << ": Done." << yendl;
 		}
 		if(session.causticMap->nPhotons() > 0)
 		{
 			Y_INFO << integratorName << ": Building caustic photons kd-tree:" << yendl;
-			session.causticMap->updateTree();
+			session.causticMap->updateTree(&scene->getThreadPool());
 			Y_VERBOSE << integratorName << ": Done." << yendl;
 		}
 		if(session.diffuseMap->nPhotons() < 50)
@@ -1384,6 +1382,7 @@ integrator_t* SPPM::factory(paraMap_t &params, renderEnvironment_t &render)
 
 	params.getParam("transpShad", transpShad);
 	params.getParam("shadowDepth", shadowDepth);
+	if(transpShad) shadowDepth = clampShadowDepth(shadowDepth);
 	params.getParam("raydepth", raydepth);
 	params.getParam("photons", numPhotons);
 	params.getParam("passNums", _passNum);
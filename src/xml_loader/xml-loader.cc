@@ -138,6 +138,9 @@ int main(int argc, char *argv[])
 	parse.setOption("l","log-file-output", false, "Enable log file output(s): \"none\", \"txt\", \"html\" or \"txt+html\". Log file name will be same as selected image name,");
 	parse.setOption("z","z-buffer", true, "Enables the rendering of the depth map (Z-Buffer) (this flag overrides XML setting).");
 	parse.setOption("nz","no-z-buffer", true, "Disables the rendering of the depth map (Z-Buffer) (this flag overrides XML setting).");
+	parse.setOption("n","node", false, "Renders as computer node <value> (from 0) of a multi-computer render, saving its film to be merged with yafaray-film-merge.");
+	parse.setOption("nn","nodes", false, "Number of computer nodes sharing the render.");
+	parse.setOption("ns","node-split", false, "How the render is shared among the computer nodes: \"samples\" (default, each node renders the whole image with its share of the samples) or \"region\" (each node renders a band of rows).");
 	
 	bool parseOk = parse.parseCommandLine();
 	
@@ -171,6 +174,9 @@ int main(int argc, char *argv[])
 	int threads = parse.getOptionInteger("t");
 	bool zbuf = parse.getFlag("z");
 	bool nozbuf = parse.getFlag("nz");
+	int node = parse.getOptionInteger("n");
+	int nodes = parse.getOptionInteger("nn");
+	std::string nodeSplit = parse.getOptionString("ns");
     
 	if(format.empty()) format = "tga";
 	bool formatValid = false;
@@ -240,6 +246,9 @@ int main(int argc, char *argv[])
 	render.getParam("denoiseMix", denoiseMix);
 	
 	if(threads >= -1) render["threads"] = threads;
+	if(node >= 0) render["adv_computer_node"] = node;
+	if(nodes >= 1) render["adv_computer_nodes"] = nodes;
+	if(!nodeSplit.empty()) render["adv_nodes_split"] = nodeSplit;
 
 	std::string logFileTypes = parse.getOptionString("l");
 	if(logFileTypes == "none")
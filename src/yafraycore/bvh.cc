@@ -0,0 +1,579 @@
+/****************************************************************************
+ * 			bvh.cc: a 4-wide bounding volume hierarchy for ray tracing
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <yafraycore/bvh.h>
+#include <yafraycore/kdtree.h>
+#include <core_api/material.h>
+#include <core_api/scene.h>
+#include <limits>
+#include <cstring>
+#include <chrono>
+
+#if defined(__SSE__) || defined(_M_X64)
+	#include <xmmintrin.h>
+	#define BVH_SIMD 1
+#else
+	#define BVH_SIMD 0
+#endif
+
+__BEGIN_YAFRAY
+
+#define BVH_BINS 16
+#define BVH_MAX_DEPTH 64
+#define BVH_MAX_STACK (3*BVH_MAX_DEPTH+4)
+#define BVH_MAX_LEAF_PRIMS 16 //!< SAH may keep leaves up to this size if splitting does not pay off
+#define BVH_ROBUST_FACTOR 1.00001f //!< widen the slab interval a bit to not miss hits on flat boxes
+
+/*! ray data prepared for the slab tests */
+struct bvhRay_t
+{
+	bvhRay_t(const ray_t &ray)
+	{
+		for(int i=0; i<3; ++i)
+		{
+			from[i] = ray.from[i];
+			if(ray.dir[i] == 0.f) invDir[i] = std::numeric_limits<float>::max();
+			else invDir[i] = 1.f/ray.dir[i];
+			//offsets of the near and far planes inside bvhNode4_t::bMin/bMax
+			nearOfs[i] = (invDir[i] < 0.f) ? 12 + 4*i : 4*i;
+			farOfs[i] = (invDir[i] < 0.f) ? 4*i : 12 + 4*i;
+		}
+	}
+	float from[3];
+	float invDir[3];
+	int nearOfs[3], farOfs[3];
+};
+
+/*! Stack elements of the traversal, a node or a leaf to visit */
+struct bvhStack_t
+{
+	u_int32 child;
+	u_int32 nPrims;
+	float t; //!< entry distance
+};
+
+//! test the ray against the 4 children of a node, returns the bit mask of the hit children
+inline int slabTest4(const bvhNode4_t &node, const bvhRay_t &r, float tmin, float tmax, float *tnear)
+{
+	const float *planes = &node.bMin[0][0];
+#if BVH_SIMD > 0
+	__m128 tn = _mm_set1_ps(tmin);
+	__m128 tf = _mm_set1_ps(tmax);
+	for(int axis=0; axis<3; ++axis)
+	{
+		__m128 o = _mm_set1_ps(r.from[axis]);
+		__m128 id = _mm_set1_ps(r.invDir[axis]);
+		tn = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(planes + r.nearOfs[axis]), o), id));
+		tf = _mm_min_ps(tf, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(planes + r.farOfs[axis]), o), id));
+	}
+	_mm_storeu_ps(tnear, tn);
+	return _mm_movemask_ps(_mm_cmple_ps(tn, _mm_mul_ps(tf, _mm_set1_ps(BVH_ROBUST_FACTOR))));
+#else
+	int mask = 0;
+	for(int i=0; i<4; ++i)
+	{
+		float tn = tmin, tf = tmax;
+		for(int axis=0; axis<3; ++axis)
+		{
+			tn = std::max(tn, (planes[r.nearOfs[axis] + i] - r.from[axis]) * r.invDir[axis]);
+			tf = std::min(tf, (planes[r.farOfs[axis] + i] - r.from[axis]) * r.invDir[axis]);
+		}
+		tnear[i] = tn;
+		if(tn <= tf * BVH_ROBUST_FACTOR) mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+//! push the hit children of a node, farthest first so the nearest gets popped next
+inline void pushChildren(const bvhNode4_t &node, int mask, const float *tnear, bvhStack_t *stack, int &stackPtr)
+{
+	int order[4], n = 0;
+	for(int i=0; i<4; ++i)
+	{
+		if(!(mask & (1 << i))) continue;
+		int j = n++;
+		while(j > 0 && tnear[order[j-1]] < tnear[i]) { order[j] = order[j-1]; --j; }
+		order[j] = i;
+	}
+	for(int i=0; i<n; ++i)
+	{
+		bvhStack_t &s = stack[stackPtr++];
+		s.child = node.child[order[i]];
+		s.nPrims = node.nPrims[order[i]];
+		s.t = tnear[order[i]];
+	}
+}
+
+template<class T>
+float bvhTree_t<T>::buildRange_t::area() const
+{
+	float dx = bound.longX(), dy = bound.longY(), dz = bound.longZ();
+	return dx*dy + dy*dz + dz*dx;
+}
+
+template<class T>
+bvhTree_t<T>::bvhTree_t(const T **v, int np, int leafSize, float cost_ratio):
+	costRatio(cost_ratio), nextFreeNode(0), totalPrims(np), nLeaves(0), maxDepthReached(0)
+{
+	Y_INFO << "BVH: Starting build (" << np << " prims, cr:" << costRatio << ")" << yendl;
+	//the trees of the objects are built at the same time, so they are not timed with the global timer
+	const std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+	maxLeafSize = (leafSize > 0) ? leafSize : 1;
+	allocatedNodesCount = 256;
+	nodes = (bvhNode4_t *) y_memalign(64, allocatedNodesCount * sizeof(bvhNode4_t));
+	prims = new const T*[totalPrims];
+
+	primIdx = new u_int32[totalPrims];
+	allBounds = new bound_t[totalPrims];
+	centroids = new point3d_t[totalPrims];
+	for(u_int32 i=0; i<totalPrims; ++i)
+	{
+		primIdx[i] = i;
+		allBounds[i] = v[i]->getBound();
+		centroids[i] = (allBounds[i].a + allBounds[i].g) * 0.5f;
+	}
+
+	buildRange_t root;
+	makeRange(0, totalPrims, root);
+	treeBound = root.bound;
+	buildNode(root, 0);
+
+	for(u_int32 i=0; i<totalPrims; ++i) prims[i] = v[primIdx[i]];
+
+	delete[] primIdx;
+	delete[] allBounds;
+	delete[] centroids;
+
+	//slightly(!) increase tree bound like the kd-trees, the scene bound is derived from it
+	for(int i=0;i<3;i++)
+	{
+		double foo = (treeBound.g[i] - treeBound.a[i])*0.001;
+		treeBound.a[i] -= foo, treeBound.g[i] += foo;
+	}
+
+	Y_VERBOSE << "BVH: Stats (" << std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count() << "s)" << yendl;
+	Y_VERBOSE << "BVH: Nodes: " << nextFreeNode << " (" << nextFreeNode * sizeof(bvhNode4_t) / 1024 << " KB) / leaves: " << nLeaves
+		<< " => " << float(totalPrims) / nLeaves << " prims per leaf, max depth: " << maxDepthReached << yendl;
+}
+
+template<class T>
+bvhTree_t<T>::~bvhTree_t()
+{
+	Y_INFO << "BVH: Freeing nodes..." << yendl;
+	y_free(nodes);
+	delete[] prims;
+	Y_VERBOSE << "BVH: Done" << yendl;
+}
+
+template<class T>
+void bvhTree_t<T>::makeRange(u_int32 begin, u_int32 end, buildRange_t &range) const
+{
+	range.begin = begin;
+	range.end = end;
+	range.bound = allBounds[primIdx[begin]];
+	range.centroidBound.set(centroids[primIdx[begin]], centroids[primIdx[begin]]);
+	for(u_int32 i=begin+1; i<end; ++i)
+	{
+		range.bound = bound_t(range.bound, allBounds[primIdx[i]]);
+		range.centroidBound.include(centroids[primIdx[i]]);
+	}
+}
+
+// ============================================================
+/*!
+	Find the best SAH split of the range among BVH_BINS bins
+	per axis over the centroid bound.
+	returns false if the range should become a leaf
+*/
+
+template<class T>
+bool bvhTree_t<T>::splitRange(const buildRange_t &range, buildRange_t &left, buildRange_t &right)
+{
+	u_int32 nPrims = range.end - range.begin;
+	float leafCost = float(nPrims);
+	float parentArea = range.area();
+	float bestCost = std::numeric_limits<float>::infinity();
+	int bestAxis = -1, bestBin = 0;
+
+	for(int axis=0; axis<3; ++axis)
+	{
+		float cmin = range.centroidBound.a[axis];
+		float ext = range.centroidBound.g[axis] - cmin;
+		if(ext <= 0.f) continue;
+		float s = BVH_BINS / ext;
+
+		int count[BVH_BINS] = {0};
+		bound_t binBound[BVH_BINS];
+		for(u_int32 i=range.begin; i<range.end; ++i)
+		{
+			u_int32 pn = primIdx[i];
+			int b = std::min(BVH_BINS-1, int((centroids[pn][axis] - cmin) * s));
+			if(count[b]) binBound[b] = bound_t(binBound[b], allBounds[pn]);
+			else binBound[b] = allBounds[pn];
+			++count[b];
+		}
+
+		// sweep from the right to get the area and count above each split
+		float rightArea[BVH_BINS];
+		int rightCount[BVH_BINS];
+		bound_t acc;
+		int n = 0;
+		for(int b=BVH_BINS-1; b>0; --b)
+		{
+			if(count[b])
+			{
+				acc = n ? bound_t(acc, binBound[b]) : binBound[b];
+				n += count[b];
+			}
+			rightCount[b] = n;
+			rightArea[b] = n ? acc.longX()*acc.longY() + acc.longY()*acc.longZ() + acc.longZ()*acc.longX() : 0.f;
+		}
+		// sweep from the left and evaluate the cost of splitting after bin b
+		n = 0;
+		for(int b=0; b<BVH_BINS-1; ++b)
+		{
+			if(count[b])
+			{
+				acc = n ? bound_t(acc, binBound[b]) : binBound[b];
+				n += count[b];
+			}
+			if(n == 0 || rightCount[b+1] == 0) continue;
+			float leftArea = acc.longX()*acc.longY() + acc.longY()*acc.longZ() + acc.longZ()*acc.longX();
+			float cost = costRatio + (leftArea * n + rightArea[b+1] * rightCount[b+1]) / parentArea;
+			if(cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
+	}
+
+	u_int32 mid;
+	if(bestAxis == -1)
+	{
+		// all centroids coincide, only a split by count helps
+		if(nPrims <= BVH_MAX_LEAF_PRIMS) return false;
+		mid = range.begin + nPrims / 2;
+	}
+	else
+	{
+		if(bestCost >= leafCost && nPrims <= BVH_MAX_LEAF_PRIMS) return false;
+		float cmin = range.centroidBound.a[bestAxis];
+		float s = BVH_BINS / (range.centroidBound.g[bestAxis] - cmin);
+		const point3d_t *c = centroids;
+		u_int32 *m = std::partition(primIdx + range.begin, primIdx + range.end,
+			[c, cmin, s, bestAxis, bestBin](u_int32 pn) { return std::min(BVH_BINS-1, int((c[pn][bestAxis] - cmin) * s)) <= bestBin; });
+		mid = m - primIdx;
+		if(mid == range.begin || mid == range.end) mid = range.begin + nPrims / 2;
+	}
+
+	makeRange(range.begin, mid, left);
+	makeRange(mid, range.end, right);
+	return true;
+}
+
+// ============================================================
+/*!
+	recursively build the BVH, the children of a node are found
+	by repeatedly splitting the child with the largest surface
+	returns the index of the created node
+*/
+
+template<class T>
+u_int32 bvhTree_t<T>::buildNode(const buildRange_t &range, int depth)
+{
+	if(nextFreeNode == allocatedNodesCount)
+	{
+		u_int32 newCount = 2*allocatedNodesCount;
+		newCount = (newCount > 0x100000) ? allocatedNodesCount+0x80000 : newCount;
+		bvhNode4_t *n = (bvhNode4_t *) y_memalign(64, newCount * sizeof(bvhNode4_t));
+		memcpy(n, nodes, allocatedNodesCount * sizeof(bvhNode4_t));
+		y_free(nodes);
+		nodes = n;
+		allocatedNodesCount = newCount;
+	}
+	u_int32 curNode = nextFreeNode++;
+	if(depth > maxDepthReached) maxDepthReached = depth;
+
+	buildRange_t child[4];
+	bool leaf[4];
+	int nChildren = 1;
+	child[0] = range;
+	leaf[0] = (range.end - range.begin <= maxLeafSize || depth >= BVH_MAX_DEPTH);
+
+	while(nChildren < 4)
+	{
+		int best = -1;
+		float bestArea = -1.f;
+		for(int i=0; i<nChildren; ++i)
+		{
+			if(!leaf[i] && child[i].area() > bestArea)
+			{
+				best = i;
+				bestArea = child[i].area();
+			}
+		}
+		if(best < 0) break;
+		buildRange_t l, r;
+		if(!splitRange(child[best], l, r))
+		{
+			leaf[best] = true;
+			continue;
+		}
+		child[best] = l;
+		child[nChildren] = r;
+		leaf[best] = (l.end - l.begin <= maxLeafSize);
+		leaf[nChildren] = (r.end - r.begin <= maxLeafSize);
+		++nChildren;
+	}
+
+	for(int i=0; i<4; ++i)
+	{
+		bvhNode4_t &node = nodes[curNode];
+		if(i >= nChildren)
+		{
+			// inverted bound, the slab test never hits it
+			for(int axis=0; axis<3; ++axis)
+			{
+				node.bMin[axis][i] = std::numeric_limits<float>::max();
+				node.bMax[axis][i] = -std::numeric_limits<float>::max();
+			}
+			node.child[i] = BVH_EMPTY_CHILD;
+			node.nPrims[i] = 0;
+			continue;
+		}
+		for(int axis=0; axis<3; ++axis)
+		{
+			node.bMin[axis][i] = child[i].bound.a[axis];
+			node.bMax[axis][i] = child[i].bound.g[axis];
+		}
+		if(leaf[i])
+		{
+			node.child[i] = child[i].begin;
+			node.nPrims[i] = child[i].end - child[i].begin;
+			++nLeaves;
+		}
+	}
+
+	for(int i=0; i<nChildren; ++i)
+	{
+		if(leaf[i]) continue;
+		u_int32 c = buildNode(child[i], depth+1);
+		nodes[curNode].child[i] = c;
+		nodes[curNode].nPrims[i] = 0;
+	}
+
+	return curNode;
+}
+
+//============================
+/*! The standard intersect function,
+	returns the closest hit within dist
+*/
+
+template<class T>
+bool bvhTree_t<T>::Intersect(const ray_t &ray, float dist, T **tr, float &Z, intersectData_t &data) const
+{
+	Z=dist;
+	float a, b, t_hit;
+	if( !treeBound.cross(ray, a, b, dist) ) { return false; }
+
+	intersectData_t currentData, tempData;
+	bool hit = false;
+	bvhRay_t r(ray);
+	bvhStack_t stack[BVH_MAX_STACK];
+	float tnear[4];
+	int stackPtr = 0;
+	stack[stackPtr].child = 0;
+	stack[stackPtr].nPrims = 0;
+	stack[stackPtr].t = a;
+	++stackPtr;
+
+	while(stackPtr > 0)
+	{
+		const bvhStack_t &s = stack[--stackPtr];
+		if(s.t > Z) continue;
+		if(s.nPrims == 0)
+		{
+			const bvhNode4_t &node = nodes[s.child];
+			int mask = slabTest4(node, r, 0.f, Z, tnear);
+			if(mask) pushChildren(node, mask, tnear, stack, stackPtr);
+			continue;
+		}
+		// Check for intersections inside leaf
+		const T **leafPrims = prims + s.child;
+		u_int32 nPrimitives = s.nPrims;
+		for(u_int32 i=0; i<nPrimitives; ++i)
+		{
+			const T *mp = leafPrims[i];
+			if (mp->intersect(ray, &t_hit, tempData))
+			{
+				if(t_hit < Z && t_hit >= ray.tmin)
+				{
+					const material_t *mat = mp->getMaterial();
+
+					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == VISIBLE_NO_SHADOWS)
+					{
+						Z = t_hit;
+						*tr = (T *)mp;
+						currentData = tempData;
+						hit = true;
+					}
+				}
+			}
+		}
+	}
+
+	data = currentData;
+
+	return hit;
+}
+
+template<class T>
+bool bvhTree_t<T>::IntersectS(const ray_t &ray, float dist, T **tr, float shadow_bias) const
+{
+	float a, b, t_hit;
+	if( !treeBound.cross(ray, a, b, dist) ) { return false; }
+
+	intersectData_t bary;
+	bvhRay_t r(ray);
+	bvhStack_t stack[BVH_MAX_STACK];
+	float tnear[4];
+	int stackPtr = 0;
+	stack[stackPtr].child = 0;
+	stack[stackPtr].nPrims = 0;
+	stack[stackPtr].t = a;
+	++stackPtr;
+
+	while(stackPtr > 0)
+	{
+		const bvhStack_t &s = stack[--stackPtr];
+		if(s.nPrims == 0)
+		{
+			const bvhNode4_t &node = nodes[s.child];
+			int mask = slabTest4(node, r, 0.f, dist, tnear);
+			if(mask) pushChildren(node, mask, tnear, stack, stackPtr);
+			continue;
+		}
+		const T **leafPrims = prims + s.child;
+		u_int32 nPrimitives = s.nPrims;
+		for(u_int32 i=0; i<nPrimitives; ++i)
+		{
+			const T *mp = leafPrims[i];
+			if (mp->intersect(ray, &t_hit, bary))
+			{
+				if(t_hit < dist && t_hit >= 0.f )
+				{
+					const material_t *mat = mp->getMaterial();
+
+					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
+					{
+						*tr = (T *)mp;
+						return true;
+					}
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+/*=============================================================
+	allow for transparent shadows.
+	every primitive is referenced by exactly one leaf, so unlike
+	the kd-trees no duplicate hits have to be filtered.
+=============================================================*/
+
+static inline color_t hitTransparency(renderState_t &state, const primitive_t *prim, const triangleObjectInstance_t *, const point3d_t &hit, const vector3d_t &dir, intersectData_t &data)
+{
+	surfacePoint_t sp;
+	prim->getSurface(sp, hit, data);
+	return prim->getMaterial()->getTransparency(state, sp, dir);
+}
+
+static inline color_t hitTransparency(renderState_t &state, const triangle_t *tri, const triangleObjectInstance_t *inst, const point3d_t &hit, const vector3d_t &dir, intersectData_t &data)
+{
+	return shadowHitTransparency(state, tri, inst, hit, dir, data);
+}
+
+template<class T>
+bool bvhTree_t<T>::IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, T **tr, color_t &filt, float shadow_bias, const triangleObjectInstance_t *inst) const
+{
+	float a, b, t_hit;
+	if( !treeBound.cross(ray, a, b, dist) ) { return false; }
+
+	intersectData_t bary;
+	bvhRay_t r(ray);
+	bvhStack_t stack[BVH_MAX_STACK];
+	float tnear[4];
+	int stackPtr = 0;
+	int depth = 0;
+	stack[stackPtr].child = 0;
+	stack[stackPtr].nPrims = 0;
+	stack[stackPtr].t = a;
+	++stackPtr;
+
+	while(stackPtr > 0)
+	{
+		const bvhStack_t &s = stack[--stackPtr];
+		if(s.nPrims == 0)
+		{
+			const bvhNode4_t &node = nodes[s.child];
+			int mask = slabTest4(node, r, 0.f, dist, tnear);
+			if(mask) pushChildren(node, mask, tnear, stack, stackPtr);
+			continue;
+		}
+		const T **leafPrims = prims + s.child;
+		u_int32 nPrimitives = s.nPrims;
+		for(u_int32 i=0; i<nPrimitives; ++i)
+		{
+			const T *mp = leafPrims[i];
+			if (mp->intersect(ray, &t_hit, bary))
+			{
+				if(t_hit < dist && t_hit >= ray.tmin)
+				{
+					const material_t *mat = mp->getMaterial();
+
+					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
+					{
+						*tr = (T *)mp;
+
+						if(!mat->isTransparent() ) return true;
+
+						if(depth>=maxDepth) return true;
+						filt *= hitTransparency(state, mp, inst, ray.from + t_hit*ray.dir, ray.dir, bary);
+						if(transmissionExhausted(filt)) return true;
+						++depth;
+					}
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+// explicit instantiation of template:
+template class bvhTree_t<triangle_t>;
+template class bvhTree_t<primitive_t>;
+
+__END_YAFRAY
@@ -38,6 +38,7 @@
 #include <core_api/camera.h>
 #include <core_api/shader.h>
 #include <core_api/imagefilm.h>
+#include <yafraycore/threadpool.h>
 #include <core_api/imagehandler.h>
 #include <core_api/object3d.h>
 #include <core_api/volume.h>
@@ -74,6 +75,7 @@ renderEnvironment_t::renderEnvironment_t()
 	Y_INFO << PACKAGE << " Core (" << session.getYafaRayCoreVersion() << ")" << " " << sysInfoGetOS() << sysInfoGetArchitecture() << sysInfoGetPlatform() << sysInfoGetCompiler() << yendl;
 	object_factory["sphere"] = sphere_factory;
 	output2 = nullptr;
+	threadPool = new threadPool_t(1);
 	session.setDifferentialRaysEnabled(false);	//By default, disable ray differential calculations. Only if at least one texture uses them, then enable differentials.
 
 #ifndef HAVE_OPENCV
@@ -98,6 +100,7 @@ renderEnvironment_t::~renderEnvironment_t()
 	freeMap(integrator_table);
 	freeMap(volume_table);
 	freeMap(volumeregion_table);
+	delete threadPool;
 }
 
 void renderEnvironment_t::clearAll()
@@ -685,7 +688,7 @@ void renderEnvironment_t::setupRenderPasses(const paraMap_t &params)
 	renderPasses.toonEdgeColor[2] = toonEdgeColor.B;
 }
 		
-imageFilm_t* renderEnvironment_t::createImageFilm(const paraMap_t &params, colorOutput_t &output)
+imageFilm_t* renderEnvironment_t::createImageFilm(const paraMap_t &params, colorOutput_t &output, int numViews)
 {
 	const std::string *name = nullptr;
 	const std::string *tiles_order = nullptr;
@@ -706,10 +709,13 @@ imageFilm_t* renderEnvironment_t::createImageFilm(const paraMap_t &params, color
 	std::string film_save_load_string = "none";
 	int film_save_load = FILM_FILE_NONE;
 	bool film_save_binary_format = true;
+	bool film_save_compressed = false;
 	std::string film_autosave_interval_type_string = "none";
 	int film_autosave_interval_type = AUTOSAVE_NONE;
 	int film_autosave_interval_passes = 1;
 	double film_autosave_interval_seconds = 300.0;
+	bool film_out_of_core = false;
+	std::string film_out_of_core_dir = "";
 	
 	params.getParam("color_space", color_space_string);
 	params.getParam("gamma", gamma);
@@ -731,9 +737,12 @@ imageFilm_t* renderEnvironment_t::createImageFilm(const paraMap_t &params, color
 	params.getParam("images_autosave_interval_seconds", images_autosave_interval_seconds);
 	params.getParam("film_save_load", film_save_load_string);
 	params.getParam("film_save_binary_format", film_save_binary_format); // If enabled, it will autosave the Image Film in binary format (faster, smaller, but not portable). Otherwise it will autosave in text format (portable but bigger and slower)
+	params.getParam("film_save_compressed", film_save_compressed); // If enabled, the chunks of binary Image Film files are compressed (smaller, but slower to save and load)
 	params.getParam("film_autosave_interval_type", film_autosave_interval_type_string);
 	params.getParam("film_autosave_interval_passes", film_autosave_interval_passes);
 	params.getParam("film_autosave_interval_seconds", film_autosave_interval_seconds);
+	params.getParam("film_out_of_core", film_out_of_core); // Keep the film passes in memory-mapped files instead of RAM, for resolutions that would not fit in memory
+	params.getParam("film_out_of_core_dir", film_out_of_core_dir); // Directory for the memory-mapped film files, empty = directory of the output image
 	
 	Y_DEBUG << "Images autosave: " << images_autosave_interval_type_string << ", " << images_autosave_interval_passes << ", " << images_autosave_interval_seconds << yendl;
 
@@ -784,7 +793,22 @@ imageFilm_t* renderEnvironment_t::createImageFilm(const paraMap_t &params, color
 	}
 	else Y_VERBOSE_ENV << "Defaulting to Centre tiles order." << yendl; // this is info imho not a warning
 
-	imageFilm_t *film = new imageFilm_t(width, height, xstart, ystart, output, filt_sz, type, this, showSampledPixels, tileSize, tilesOrder, premult);
+	// The default is the directory of the output image, like the film files, and not the system temporary directory:
+	// the passes of a film too big for RAM would not fit in /tmp either where it is a RAM backed tmpfs
+	if(film_out_of_core && film_out_of_core_dir.empty())
+	{
+		film_out_of_core_dir = boost::filesystem::path(session.getPathImageOutput()).parent_path().string();
+		if(film_out_of_core_dir.empty()) film_out_of_core_dir = ".";
+	}
+
+	imageFilm_t *film = new imageFilm_t(width, height, xstart, ystart, output, filt_sz, type, this, showSampledPixels, tileSize, tilesOrder, premult, numViews, film_out_of_core ? film_out_of_core_dir : "");
+
+	if(film->isOutOfCore() && !film_save_binary_format && (film_save_load != FILM_FILE_NONE || film_autosave_interval_type != AUTOSAVE_NONE))
+	{
+		Y_WARN_ENV << "ImageFilm files in text format cannot be saved or loaded with an out of core film, disabling them" << yendl;
+		film_save_load = FILM_FILE_NONE;
+		film_autosave_interval_type = AUTOSAVE_NONE;
+	}
 	
 	if(color_space == RAW_MANUAL_GAMMA)
 	{
@@ -808,6 +832,7 @@ imageFilm_t* renderEnvironment_t::createImageFilm(const paraMap_t &params, color
 
 	film->setFilmFileSaveLoad(film_save_load);
 	film->setFilmFileSaveBinaryFormat(film_save_binary_format);
+	film->setFilmFileSaveCompressed(film_save_compressed);
 	film->setFilmAutoSaveIntervalType(film_autosave_interval_type);
 	film->setFilmAutoSaveIntervalSeconds(film_autosave_interval_seconds);
 	film->setFilmAutoSaveIntervalPasses(film_autosave_interval_passes);
@@ -816,7 +841,7 @@ imageFilm_t* renderEnvironment_t::createImageFilm(const paraMap_t &params, color
 
 	if(images_autosave_interval_type == AUTOSAVE_TIME_INTERVAL) Y_INFO_ENV << "AutoSave partially rendered image every " << images_autosave_interval_seconds << " seconds" << yendl;
 
-	if(film_save_load != FILM_FILE_NONE && film_save_binary_format) Y_INFO_ENV << "Enabling imageFilm file saving feature in binary format (smaller, faster but not portable among systems)" << yendl;
+	if(film_save_load != FILM_FILE_NONE && film_save_binary_format) Y_INFO_ENV << "Enabling imageFilm file saving feature in binary format (smaller, faster but not portable among systems)" << (film_save_compressed ? ", compressed" : "") << yendl;
 	if(film_save_load != FILM_FILE_NONE && !film_save_binary_format) Y_INFO_ENV << "Enabling imageFilm file saving in text format (portable among systems but bigger and slower)" << yendl;
 	if(film_save_load == FILM_FILE_LOAD_SAVE) Y_INFO_ENV << "Enabling imageFilm Loading feature. It will load and combine the ImageFilm files from the currently selected image output folder before start rendering, autodetecting each film format (binary/text) automatically. If they don't match exactly the scene, bad results could happen. Use WITH CARE!" << yendl;
 
@@ -949,6 +974,7 @@ bool renderEnvironment_t::setupScene(scene_t &scene, const paraMap_t &params, co
 	int AA_variance_pixels = 0;
 	float AA_clamp_samples = 0.f;
 	float AA_clamp_indirect = 0.f;
+	float AA_noise_target = 0.f;
 	
 	bool adv_auto_shadow_bias_enabled=true;
 	float adv_shadow_bias_value=YAF_SHADOW_BIAS;
@@ -956,6 +982,19 @@ bool renderEnvironment_t::setupScene(scene_t &scene, const paraMap_t &params, co
 	float adv_min_raydist_value=MIN_RAYDIST;
 	int adv_base_sampling_offset = 0;
 	int adv_computer_node = 0;
+	int adv_computer_nodes = 1;
+	std::string adv_nodes_split = "samples";
+	std::string accelerator_string = "kdtree";
+	std::string accel_cache_dir = "";
+	bool accel_per_object = false;
+	bool threads_pinning = false;
+	bool progressive = false;
+	bool views_interleaved = false;
+	float progressive_time = 0.f;
+	int progressive_samples = 0;
+	float accel_cost_ratio = 0.8f;
+	float accel_empty_bonus = 0.33f;
+	int accel_leaf_size = 1;
     
     bool background_resampling = true;  //If false, the background will not be resampled in subsequent adaptative AA passes
 
@@ -1016,19 +1055,56 @@ bool renderEnvironment_t::setupScene(scene_t &scene, const paraMap_t &params, co
 	params.getParam("AA_variance_pixels", AA_variance_pixels);
 	params.getParam("AA_clamp_samples", AA_clamp_samples);
 	params.getParam("AA_clamp_indirect", AA_clamp_indirect);
+	params.getParam("AA_noise_target", AA_noise_target); // resample only pixels whose relative noise is above this, stop once all are below (0 disables)
 	params.getParam("threads", nthreads); // number of threads, -1 = auto detection
     params.getParam("background_resampling", background_resampling);
+	params.getParam("accelerator", accelerator_string); // ray acceleration structure: "kdtree" or "bvh"
+	params.getParam("accel_cache_dir", accel_cache_dir); // directory to cache built kd-trees in, empty = no cache
+	params.getParam("accel_per_object", accel_per_object); // separate tree per mesh, only changed meshes get rebuilt on updates
+	params.getParam("accel_cost_ratio", accel_cost_ratio); // kd-tree node traversal cost relative to a primitive intersection
+	params.getParam("accel_empty_bonus", accel_empty_bonus); // kd-tree bonus for splits that cut off empty space
+	params.getParam("accel_leaf_size", accel_leaf_size); // kd-tree primitives per leaf, <=0 = auto
 	
 	nthreads_photons = nthreads;	//if no "threads_photons" parameter exists, make "nthreads_photons" equal to render threads
 	
 	params.getParam("threads_photons", nthreads_photons); // number of threads for photon mapping, -1 = auto detection
+	params.getParam("threads_pinning", threads_pinning); // bind each worker thread to its own CPU (Linux only)
+	params.getParam("progressive", progressive); // render the whole frame one sample per pixel at a time instead of tile by tile AA passes
+	params.getParam("progressive_time", progressive_time); // stop a progressive render after this many seconds, 0 = no limit
+	params.getParam("progressive_samples", progressive_samples); // stop a progressive render at this many samples per pixel, 0 = the AA samples of all passes
+	params.getParam("views_interleaved", views_interleaved); // render all camera views in one pass over a shared film instead of one after another
 	params.getParam("adv_auto_shadow_bias_enabled", adv_auto_shadow_bias_enabled);
 	params.getParam("adv_shadow_bias_value", adv_shadow_bias_value);
 	params.getParam("adv_auto_min_raydist_enabled", adv_auto_min_raydist_enabled);
 	params.getParam("adv_min_raydist_value", adv_min_raydist_value);
 	params.getParam("adv_base_sampling_offset", adv_base_sampling_offset); //Base sampling offset, in case of multi-computer rendering each should have a different offset so they don't "repeat" the same samples (user configurable)
 	params.getParam("adv_computer_node", adv_computer_node); //Computer node in multi-computer render environments/render farms
-	imageFilm_t *film = createImageFilm(params, output);
+	params.getParam("adv_computer_nodes", adv_computer_nodes); //Number of computer nodes sharing the render, each one saves its film to be merged afterwards
+	params.getParam("adv_nodes_split", adv_nodes_split); //How the render is shared among the nodes: "samples" (each node renders the whole frame with its share of the samples) or "region" (each node renders a band of rows)
+	if(adv_computer_nodes > 1 && adv_nodes_split != "region")
+	{
+		AA_samples = std::max(1, (AA_samples + adv_computer_nodes - 1) / adv_computer_nodes);
+		AA_inc_samples = std::max(1, (AA_inc_samples + adv_computer_nodes - 1) / adv_computer_nodes);
+		if(progressive_samples > 0) progressive_samples = std::max(1, (progressive_samples + adv_computer_nodes - 1) / adv_computer_nodes);
+	}
+	if(AA_noise_target > 0.f) renderPasses.auxPass_add(PASS_INT_AA_NOISE);	//The film keeps the sample moments for the noise estimation in this auxiliary pass, so it has to exist before the film is created
+	int numViews = 1;
+	if(views_interleaved && camera_table.size() > 1)
+	{
+		const camera_t *firstCam = camera_table.begin()->second;
+		bool sameRes = true;
+		for(auto it = camera_table.begin(); it != camera_table.end(); ++it)
+		{
+			if(it->second->resX() != firstCam->resX() || it->second->resY() != firstCam->resY()) sameRes = false;
+		}
+
+		if(!((surfaceIntegrator_t*)inte)->canRenderViewsInterleaved()) Y_WARN_ENV << "Integrator '" << inte->getName() << "' cannot render views interleaved, rendering them one after another" << yendl;
+		else if(!sameRes) Y_WARN_ENV << "Views have different resolutions, rendering them one after another" << yendl;
+		else numViews = camera_table.size();
+	}
+
+	imageFilm_t *film = createImageFilm(params, output, numViews);
+	film->setProgressive(progressive);
 
 	if (pb)
 	{
@@ -1053,6 +1129,12 @@ bool renderEnvironment_t::setupScene(scene_t &scene, const paraMap_t &params, co
 	scene.setAntialiasing(AA_samples, AA_passes, AA_inc_samples, AA_threshold, AA_resampled_floor, AA_sample_multiplier_factor, AA_light_sample_multiplier_factor, AA_indirect_sample_multiplier_factor, AA_detect_color_noise, AA_dark_detection_type, AA_dark_threshold_factor, AA_variance_edge_size, AA_variance_pixels, AA_clamp_samples, AA_clamp_indirect);
 	scene.setNumThreads(nthreads);
 	scene.setNumThreadsPhotons(nthreads_photons);
+	threadPool->resize(std::max(scene.getNumThreads(), scene.getNumThreadsPhotons()), threads_pinning);
+	scene.setProgressive(progressive, progressive_time, progressive_samples);
+	scene.setAccelerator((accelerator_string == "bvh") ? scene_t::ACCEL_BVH : scene_t::ACCEL_KDTREE);
+	scene.setAccelCacheDir(accel_cache_dir);
+	scene.setAccelPerObject(accel_per_object);
+	scene.setAccelKdParams(accel_cost_ratio, accel_empty_bonus, accel_leaf_size);
 	if(backg) scene.setBackground(backg);
 	scene.shadowBiasAuto = adv_auto_shadow_bias_enabled;
 	scene.shadowBias = adv_shadow_bias_value;
@@ -1062,8 +1144,39 @@ bool renderEnvironment_t::setupScene(scene_t &scene, const paraMap_t &params, co
 	Y_DEBUG << "adv_base_sampling_offset="<<adv_base_sampling_offset<<yendl;
 	film->setBaseSamplingOffset(adv_base_sampling_offset);
 	film->setComputerNode(adv_computer_node);
+	if(adv_computer_nodes > 1)
+	{
+		if(adv_computer_node < 0 || adv_computer_node >= adv_computer_nodes)
+		{
+			Y_ERROR_ENV << "Computer node " << adv_computer_node << " out of range, there are " << adv_computer_nodes << " nodes" << yendl;
+			return false;
+		}
+		if(adv_nodes_split == "region")
+		{
+			//the film keeps its whole size, so the films of the nodes are just added and the filter splats across the band borders are not lost
+			const int h = film->getHeight();
+			film->setRenderRegion(h * adv_computer_node / adv_computer_nodes, h * (adv_computer_node + 1) / adv_computer_nodes);
+			Y_INFO_ENV << "Computer node " << adv_computer_node << " of " << adv_computer_nodes << ", rendering rows " << h * adv_computer_node / adv_computer_nodes << " to " << h * (adv_computer_node + 1) / adv_computer_nodes - 1 << yendl;
+		}
+		else
+		{
+			film->setSamplesNodes(adv_computer_nodes);
+			Y_INFO_ENV << "Computer node " << adv_computer_node << " of " << adv_computer_nodes << ", rendering " << AA_samples << " samples per pixel in the first pass" << yendl;
+		}
+		if(film->getFilmFileSaveLoad() == FILM_FILE_NONE)
+		{
+			Y_INFO_ENV << "Enabling imageFilm file saving, the films of the computer nodes have to be merged afterwards" << yendl;
+			film->setFilmFileSaveLoad(FILM_FILE_SAVE);
+		}
+		if(!film->getFilmFileSaveBinaryFormat())
+		{
+			Y_INFO_ENV << "Saving the imageFilm file in binary format, the film merging only reads the chunked binary films" << yendl;
+			film->setFilmFileSaveBinaryFormat(true);
+		}
+	}
     
     film->setBackgroundResampling(background_resampling);
+    film->setAANoiseTarget(AA_noise_target);
 
 	return true;
 }
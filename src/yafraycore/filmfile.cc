@@ -0,0 +1,339 @@
+#include <yafraycore/filmfile.h>
+#include <yafraycore/threadpool.h>
+#include <utilities/image_buffers.h>
+#include <core_api/logging.h>
+
+#include <zlib.h>
+#include <fstream>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+
+__BEGIN_YAFRAY
+
+static const char filmFileMagic[8] = { 'Y', 'A', 'F', 'F', 'I', 'L', 'M', '\0' };
+static const uint64_t filmFileAlign = 4096;	//!< page alignment of uncompressed chunks
+static const uint64_t filmFileCompressedAlign = 8;
+static const int32_t filmFileMaxSide = 1 << 20;	//!< width or height above this is taken as a damaged header
+static const uint32_t filmFileMaxPasses = 1024;
+
+static inline uint64_t alignUp(uint64_t offset, uint64_t align) { return (offset + align - 1) / align * align; }
+
+static void writeString(std::ostream &os, const std::string &str)
+{
+	uint32_t size = str.size();
+	os.write((const char *) &size, sizeof(size));
+	os.write(str.data(), size);
+}
+
+static bool readString(std::istream &is, std::string &str, uint64_t maxSize)
+{
+	uint32_t size = 0;
+	if(!is.read((char *) &size, sizeof(size)) || size > maxSize) return false;
+	str.resize(size);
+	return (bool) is.read(&str[0], size);
+}
+
+void filmFile_t::tileArea(int t, int w, int h, int &x0, int &y0, int &tw, int &th)
+{
+	const int tilesX = (w + FILM_FILE_TILE_SIZE - 1) / FILM_FILE_TILE_SIZE;
+	x0 = (t % tilesX) * FILM_FILE_TILE_SIZE;
+	y0 = (t / tilesX) * FILM_FILE_TILE_SIZE;
+	tw = std::min(FILM_FILE_TILE_SIZE, w - x0);
+	th = std::min(FILM_FILE_TILE_SIZE, h - y0);
+}
+
+bool filmFile_t::isFilmFile(const std::string &path)
+{
+	std::ifstream ifs(path, std::ios::binary);
+	char magic[sizeof(filmFileMagic)];
+	return ifs.read(magic, sizeof(magic)) && std::memcmp(magic, filmFileMagic, sizeof(magic)) == 0;
+}
+
+bool filmFile_t::save(const std::string &path, header_t header, const params_t &params, const std::vector<const passImage_t*> &passes, bool compress, threadPool_t &pool, int maxTasks)
+{
+	std::vector<passFormat_t> formats;
+	for(auto pass : passes) formats.push_back({ pass->getChannels(), pass->isHalf() });
+	filmFile_t file;
+	return file.create(path, header, params, formats, compress) && file.writeTileRows(passes, 0, file.getTileRows(), pool, maxTasks) && file.finish();
+}
+
+bool filmFile_t::create(const std::string &path, header_t header, const params_t &params, const std::vector<passFormat_t> &formats, bool compress)
+{
+	std::memcpy(header.magic, filmFileMagic, sizeof(filmFileMagic));
+	header.formatVersion = FILM_FILE_FORMAT_VERSION;
+	header.compressed = compress;
+	header.tileSize = FILM_FILE_TILE_SIZE;
+	this->path = path;
+	this->header = header;
+	this->params = params;
+	this->formats = formats;
+
+	const int w = header.w, h = header.h;
+	const int nTiles = ((w + FILM_FILE_TILE_SIZE - 1) / FILM_FILE_TILE_SIZE) * getTileRows();
+	chunks.assign(formats.size() * nTiles, { 0, 0 });
+
+	chunkTableOffset = sizeof(header_t) + formats.size() * sizeof(passFormat_t) + sizeof(uint32_t);
+	for(const auto &param : params) chunkTableOffset += 2 * sizeof(uint32_t) + param.first.size() + param.second.size();
+	const uint64_t tablesEnd = chunkTableOffset + chunks.size() * sizeof(chunk_t);
+	fileEnd = alignUp(tablesEnd, compress ? filmFileCompressedAlign : filmFileAlign);
+	if(!compress)
+	{
+		//the chunks go in order when their sizes are known, so the files of the same film are the same
+		uint64_t offset = fileEnd;
+		for(size_t i = 0; i < chunks.size(); ++i)
+		{
+			int x0, y0, tw, th;
+			tileArea(i % nTiles, w, h, x0, y0, tw, th);
+			chunks[i].offset = offset;
+			chunks[i].bytes = (uint64_t) tw * th * passImage_t::pixelBytes(formats[i / nTiles].channels, formats[i / nTiles].half != 0);
+			offset = alignUp(offset + chunks[i].bytes, filmFileAlign);
+		}
+	}
+
+	std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+	ofs.write((const char *) &header, sizeof(header));
+	ofs.write((const char *) formats.data(), formats.size() * sizeof(passFormat_t));
+	const uint32_t numParams = params.size();
+	ofs.write((const char *) &numParams, sizeof(numParams));
+	for(const auto &param : params)
+	{
+		writeString(ofs, param.first);
+		writeString(ofs, param.second);
+	}
+	if(!ofs)
+	{
+		Y_WARNING << "FilmFile: cannot write \"" << path << "\"" << yendl;
+		return false;
+	}
+	return true;
+}
+
+size_t filmFile_t::tileRowsChunk(size_t k, int tileY0, int tileY1) const
+{
+	const int tilesX = (header.w + FILM_FILE_TILE_SIZE - 1) / FILM_FILE_TILE_SIZE;
+	const size_t nTiles = chunks.size() / formats.size();
+	const size_t rowsTiles = (size_t) (tileY1 - tileY0) * tilesX;
+	return (k / rowsTiles) * nTiles + (size_t) tileY0 * tilesX + k % rowsTiles;
+}
+
+bool filmFile_t::writeTileRows(const std::vector<const passImage_t*> &passes, int tileY0, int tileY1, threadPool_t &pool, int maxTasks)
+{
+	const int w = header.w, h = header.h;
+	const int nTiles = chunks.size() / std::max(formats.size(), (size_t) 1);
+	const int passY0 = tileY0 * FILM_FILE_TILE_SIZE;
+	const size_t nChunks = formats.size() * (tileY1 - tileY0) * ((w + FILM_FILE_TILE_SIZE - 1) / FILM_FILE_TILE_SIZE);
+	const bool compress = header.compressed != 0;
+	if(maxTasks <= 0) maxTasks = pool.size() + 1;
+	std::atomic<size_t> next(0);
+	std::atomic<bool> failed(false);
+	std::atomic<uint64_t> end(fileEnd);
+
+	pool.parallelFor(0, maxTasks, [&](int)
+	{
+		std::fstream fs(path, std::ios::binary | std::ios::in | std::ios::out);
+		std::vector<char> raw, shuffled, packed;
+		for(size_t k = next++; k < nChunks && fs && !failed; k = next++)
+		{
+			const size_t i = tileRowsChunk(k, tileY0, tileY1);
+			const passImage_t *pass = passes[i / nTiles];
+			const size_t pixelBytes = pass->getRecordBytes();
+			int x0, y0, tw, th;
+			tileArea(i % nTiles, w, h, x0, y0, tw, th);
+			const size_t nPixels = (size_t) tw * th;
+
+			raw.resize(nPixels * pixelBytes);
+			for(int j = 0; j < th; ++j) pass->getRecords(x0, y0 - passY0 + j, tw, raw.data() + (size_t) j * tw * pixelBytes);
+
+			const char *chunkData = raw.data();
+			uint64_t chunkBytes = raw.size();
+			if(compress)
+			{
+				shuffled.resize(raw.size());
+				for(size_t p = 0; p < nPixels; ++p)
+					for(size_t b = 0; b < pixelBytes; ++b) shuffled[b * nPixels + p] = raw[p * pixelBytes + b];
+
+				uLongf packedBytes = compressBound(raw.size());
+				packed.resize(packedBytes);
+				//tiles that do not shrink are stored as they are
+				if(compress2((Bytef *) packed.data(), &packedBytes, (const Bytef *) shuffled.data(), shuffled.size(), 1) == Z_OK && packedBytes < raw.size())
+				{
+					chunkData = packed.data();
+					chunkBytes = packedBytes;
+				}
+				chunks[i].bytes = chunkBytes;
+				chunks[i].offset = end.fetch_add(alignUp(chunkBytes, filmFileCompressedAlign));
+			}
+
+			fs.seekp(chunks[i].offset);
+			fs.write(chunkData, chunkBytes);
+		}
+		if(!fs) failed = true;
+	}, maxTasks);
+
+	fileEnd = end;
+	if(failed)
+	{
+		Y_WARNING << "FilmFile: error writing the pixels to \"" << path << "\"" << yendl;
+		return false;
+	}
+	return true;
+}
+
+bool filmFile_t::finish()
+{
+	std::fstream fs(path, std::ios::binary | std::ios::in | std::ios::out);
+	fs.seekp(chunkTableOffset);
+	fs.write((const char *) chunks.data(), chunks.size() * sizeof(chunk_t));
+	if(!fs)
+	{
+		Y_WARNING << "FilmFile: error writing the pixels to \"" << path << "\"" << yendl;
+		return false;
+	}
+	return true;
+}
+
+bool filmFile_t::open(const std::string &path)
+{
+	this->path = path;
+	std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+	const uint64_t fileBytes = ifs.tellg();
+	ifs.seekg(0);
+
+	if(!ifs.read((char *) &header, sizeof(header)) || std::memcmp(header.magic, filmFileMagic, sizeof(filmFileMagic)) != 0)
+	{
+		Y_WARNING << "FilmFile: \"" << path << "\" is not a film file" << yendl;
+		return false;
+	}
+	if(header.formatVersion != FILM_FILE_FORMAT_VERSION || header.tileSize != FILM_FILE_TILE_SIZE)
+	{
+		Y_WARNING << "FilmFile: \"" << path << "\" has format version " << header.formatVersion << " with tiles of " << header.tileSize << " pixels, expected version " << FILM_FILE_FORMAT_VERSION << " with tiles of " << FILM_FILE_TILE_SIZE << yendl;
+		return false;
+	}
+	header.filmStructureVersion[sizeof(header.filmStructureVersion) - 1] = '\0';
+
+	//the sizes bound the tables read next, so a damaged header cannot make them huge
+	bool ok = header.w > 0 && header.h > 0 && header.w <= filmFileMaxSide && header.h <= filmFileMaxSide;
+	ok = ok && header.numPasses <= filmFileMaxPasses && header.numAuxPasses <= filmFileMaxPasses;
+	const uint64_t nTiles = ok ? (uint64_t) ((header.w + FILM_FILE_TILE_SIZE - 1) / FILM_FILE_TILE_SIZE) * ((header.h + FILM_FILE_TILE_SIZE - 1) / FILM_FILE_TILE_SIZE) : 0;
+	const uint64_t numFormats = ok ? header.numPasses + header.numAuxPasses : 0;
+	ok = ok && sizeof(header_t) + numFormats * (sizeof(passFormat_t) + nTiles * sizeof(chunk_t)) + sizeof(uint32_t) <= fileBytes;
+	if(!ok)
+	{
+		Y_WARNING << "FilmFile: \"" << path << "\" has a damaged header, " << header.w << "x" << header.h << " pixels with " << header.numPasses << " passes and " << header.numAuxPasses << " auxiliary passes in " << fileBytes << " bytes" << yendl;
+		return false;
+	}
+
+	formats.resize(numFormats);
+	chunks.resize(numFormats * nTiles);
+	ifs.read((char *) formats.data(), formats.size() * sizeof(passFormat_t));
+	for(size_t i = 0; ok && i < formats.size(); ++i) ok = formats[i].channels >= 0 && formats[i].channels <= 4 && (formats[i].half == 0 || formats[i].half == 1);
+
+	uint32_t numParams = 0;
+	ifs.read((char *) &numParams, sizeof(numParams));
+	params.clear();
+	ok = ok && ifs;
+	for(uint32_t i = 0; ok && i < numParams; ++i)
+	{
+		std::pair<std::string, std::string> param;
+		ok = readString(ifs, param.first, fileBytes) && readString(ifs, param.second, fileBytes);
+		params.push_back(param);
+	}
+	ifs.read((char *) chunks.data(), chunks.size() * sizeof(chunk_t));
+
+	ok = ok && ifs;
+	for(size_t i = 0; ok && i < chunks.size(); ++i) ok = chunks[i].offset <= fileBytes && chunks[i].bytes <= fileBytes - chunks[i].offset;
+	if(!ok)
+	{
+		Y_WARNING << "FilmFile: \"" << path << "\" is truncated or damaged" << yendl;
+		return false;
+	}
+	return true;
+}
+
+std::string filmFile_t::getParam(const std::string &name) const
+{
+	for(const auto &param : params) if(param.first == name) return param.second;
+	return "";
+}
+
+bool filmFile_t::addTileRows(const std::vector<passImage_t*> &passes, int tileY0, int tileY1, threadPool_t &pool, int maxTasks) const
+{
+	const int passY0 = tileY0 * FILM_FILE_TILE_SIZE;
+	bool formatsOk = passes.size() == formats.size() && tileY0 >= 0 && tileY0 <= tileY1 && tileY1 <= getTileRows();
+	for(size_t i = 0; formatsOk && i < passes.size(); ++i)
+	{
+		formatsOk = passes[i]->getWidth() == header.w && passes[i]->getHeight() >= std::min(header.h, tileY1 * FILM_FILE_TILE_SIZE) - passY0;
+		formatsOk = formatsOk && passes[i]->getChannels() == formats[i].channels && passes[i]->isHalf() == (formats[i].half != 0);
+	}
+	if(!formatsOk)
+	{
+		Y_WARNING << "FilmFile: the passes in \"" << path << "\" do not match the film ones" << yendl;
+		return false;
+	}
+
+	const int nTiles = chunks.size() / std::max(formats.size(), (size_t) 1);
+	const size_t nChunks = formats.size() * (tileY1 - tileY0) * ((header.w + FILM_FILE_TILE_SIZE - 1) / FILM_FILE_TILE_SIZE);
+	if(maxTasks <= 0) maxTasks = pool.size() + 1;
+	std::atomic<size_t> next(0);
+	std::atomic<bool> failed(false);
+
+	//nothing is added until every chunk is read, so a damaged file leaves the passes as they were
+	std::vector<std::vector<char>> records(nChunks);
+	pool.parallelFor(0, maxTasks, [&](int)
+	{
+		std::ifstream ifs(path, std::ios::binary);
+		std::vector<char> packed;
+		for(size_t k = next++; k < nChunks && !failed; k = next++)
+		{
+			if(!readChunk(ifs, tileRowsChunk(k, tileY0, tileY1), records[k], packed)) failed = true;
+		}
+	}, maxTasks);
+
+	if(failed)
+	{
+		Y_WARNING << "FilmFile: error reading the pixels of \"" << path << "\", the film was not loaded" << yendl;
+		return false;
+	}
+
+	next = 0;
+	pool.parallelFor(0, maxTasks, [&](int)
+	{
+		for(size_t k = next++; k < nChunks; k = next++)
+		{
+			const size_t i = tileRowsChunk(k, tileY0, tileY1);
+			passImage_t *pass = passes[i / nTiles];
+			const size_t pixelBytes = pass->getRecordBytes();
+			int x0, y0, tw, th;
+			tileArea(i % nTiles, header.w, header.h, x0, y0, tw, th);
+			for(int j = 0; j < th; ++j) pass->addRecords(x0, y0 - passY0 + j, tw, records[k].data() + (size_t) j * tw * pixelBytes);
+			std::vector<char>().swap(records[k]);
+		}
+	}, maxTasks);
+	return true;
+}
+
+bool filmFile_t::readChunk(std::ifstream &ifs, size_t i, std::vector<char> &raw, std::vector<char> &packed) const
+{
+	const int nTiles = chunks.size() / formats.size();
+	const size_t pixelBytes = passImage_t::pixelBytes(formats[i / nTiles].channels, formats[i / nTiles].half != 0);
+	int x0, y0, tw, th;
+	tileArea(i % nTiles, header.w, header.h, x0, y0, tw, th);
+	const size_t nPixels = (size_t) tw * th;
+
+	raw.resize(nPixels * pixelBytes);
+	ifs.seekg(chunks[i].offset);
+	if(chunks[i].bytes == raw.size()) return (bool) ifs.read(raw.data(), raw.size());
+	if(chunks[i].bytes > raw.size()) return false;
+
+	packed.resize(chunks[i].bytes);
+	uLongf rawBytes = raw.size();
+	if(!ifs.read(packed.data(), packed.size()) || uncompress((Bytef *) raw.data(), &rawBytes, (const Bytef *) packed.data(), packed.size()) != Z_OK || rawBytes != raw.size()) return false;
+	std::swap(raw, packed);
+	raw.resize(packed.size());
+	for(size_t p = 0; p < nPixels; ++p)
+		for(size_t b = 0; b < pixelBytes; ++b) raw[p * pixelBytes + b] = packed[b * nPixels + p];
+	return true;
+}
+
+__END_YAFRAY
@@ -25,20 +25,33 @@
 #include <core_api/scene.h>
 #include <yafraycore/monitor.h>
 #include <yafraycore/timer.h>
+#include <yafraycore/threadpool.h>
+#include <yafraycore/mappedfile.h>
+#include <yafraycore/filmfile.h>
 #include <utilities/math_utils.h>
 #include <resources/yafLogoTiny.h>
 
 #include <cstring>
+#include <cstdint>
 #include <string>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <iomanip>
 #include <utility>
+#include <memory>
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp> 
 #include <boost/filesystem.hpp>
 
+#if defined(__SSE__) || defined(_M_X64)
+	#include <xmmintrin.h>
+	#define IMAGE_FILM_SIMD 1
+#else
+	#define IMAGE_FILM_SIMD 0
+#endif
+
 #if HAVE_FREETYPE
 #include <resources/guifont.h>
 #include <ft2build.h>
@@ -50,6 +63,35 @@ __BEGIN_YAFRAY
 
 #define FILTER_TABLE_SIZE 16
 #define MAX_FILTER_SIZE 8
+#define AA_NOISE_MIN_BRIGHTNESS 0.05f //!< pixels darker than this are judged by their absolute noise, so near black pixels do not soak up samples
+#define IMAGE_FILM_RESAMPLE_BAND 8 //!< rows per task of the resample detection, a multiple of the 8x8 pixel blocks of the flags
+#define IMAGE_FILM_RESAMPLE_COLUMNS 64 //!< columns per task for the running sums down the image columns
+
+//! Per pixel results of the resample detection in imageFilm_t::nextPass()
+enum resampleMarks_t
+{
+	RESAMPLE_PIXEL		= 1 << 0,	//!< the pixel itself
+	RESAMPLE_RIGHT		= 1 << 1,	//!< its right neighbour
+	RESAMPLE_DOWN		= 1 << 2,	//!< the neighbour below it
+	RESAMPLE_DOWN_RIGHT	= 1 << 3,
+	RESAMPLE_DOWN_LEFT	= 1 << 4,
+	RESAMPLE_WINDOW		= 1 << 5,	//!< the whole variance window around it
+	RESAMPLE_EDGE_X		= 1 << 6,	//!< color difference to the right neighbour reaches the AA threshold
+	RESAMPLE_EDGE_Y		= 1 << 7,	//!< color difference to the neighbour below reaches the AA threshold
+};
+
+//! Sum of value[clamp(i, 0, n-1)] for i in [lo, hi], prefix holds the running sums of the values with the given stride
+static inline int clampedWindowSum(const uint32_t *prefix, int stride, int n, int lo, int hi)
+{
+	if(hi < lo) return 0;
+	auto rangeSum = [&](int a, int b) { return (int) (prefix[(size_t) b * stride] - (a > 0 ? prefix[(size_t) (a-1) * stride] : 0)); };
+	int sum = 0;
+	if(lo < 0) sum += (std::min(hi, -1) - lo + 1) * rangeSum(0, 0);
+	if(hi > n-1) sum += (hi - std::max(lo, n) + 1) * rangeSum(n-1, n-1);
+	int a = std::max(lo, 0), b = std::min(hi, n-1);
+	if(a <= b) sum += rangeSum(a, b);
+	return sum;
+}
 
 //! Simple alpha blending
 #define alphaBlend(b_bg_col, b_fg_col, b_alpha) (( b_bg_col * (1.f - b_alpha) ) + ( b_fg_col * b_alpha ))
@@ -121,28 +163,53 @@ float Lanczos2(float dx, float dy)
 }
 
 imageFilm_t::imageFilm_t (int width, int height, int xstart, int ystart, colorOutput_t &out, float filterSize, filterType filt,
-						  renderEnvironment_t *e, bool showSamMask, int tSize, imageSpliter_t::tilesOrderType tOrder, bool pmA):
-	w(width), h(height), cx0(xstart), cy0(ystart), filterw(filterSize*0.5), output(&out),
+						  renderEnvironment_t *e, bool showSamMask, int tSize, imageSpliter_t::tilesOrderType tOrder, bool pmA, int views, const std::string &mappedDir):
+	w(width * std::max(1, views)), h(height), cx0(xstart), cy0(ystart), numViews(std::max(1, views)), viewWidth(width), filterw(filterSize*0.5), output(&out),
 	env(e), showMask(showSamMask), tileSize(tSize), tilesOrder(tOrder), premultAlpha(pmA)
 {
-	cx1 = xstart + width;
+	cx1 = xstart + w;
 	cy1 = ystart + height;
+	regionY1 = h;
 	filterTable = new float[FILTER_TABLE_SIZE * FILTER_TABLE_SIZE];
+	for(auto &writers : rowLockFreeWriters) writers = 0;
 
     const renderPasses_t * renderPasses = env->getRenderPasses();
     
-	//Creation of the image buffers for the render passes
+	outOfCoreDir = mappedDir;
+
+	//Creation of the image buffers for the render passes, each with the channels and precision of its internal pass
+	size_t filmBytes = 0;
 	for(int idx = 0; idx < renderPasses->extPassesSize(); ++idx)
 	{
-		imagePasses.push_back(new rgba2DImage_t(width, height));
+		intPassTypes_t intPassType = renderPasses->intPassTypeFromExtPassIndex(idx);
+		imagePasses.push_back(newPass(mappedPasses, renderPasses_t::intPassChannels(intPassType), renderPasses_t::intPassPrecision(intPassType) == PASS_INT_PRECISION_HALF));
+		filmBytes += imagePasses.back()->getBytes();
 	}
 
 	//Creation of the image buffers for the auxiliary render passes
 	for(int idx = 0; idx < renderPasses->auxPassesSize(); ++idx)
 	{
-		auxImagePasses.push_back(new rgba2DImage_t(width, height));
+		intPassTypes_t intPassType = renderPasses->intPassTypeFromAuxPassIndex(idx);
+		auxImagePasses.push_back(newPass(mappedPasses, renderPasses_t::intPassChannels(intPassType), renderPasses_t::intPassPrecision(intPassType) == PASS_INT_PRECISION_HALF));
+		filmBytes += auxImagePasses.back()->getBytes();
+	}
+
+	//Pass plan for addSample(), so the render passes are not looked up for every pixel of every sample
+	for(size_t idx = 0; idx < imagePasses.size() + auxImagePasses.size(); ++idx)
+	{
+		intPassTypes_t intPassType = (idx < imagePasses.size()) ? renderPasses->intPassTypeFromExtPassIndex(idx) : renderPasses->intPassTypeFromAuxPassIndex(idx - imagePasses.size());
+		passSlot_t slot = { ACCUMULATE_FILTERED, renderPasses->intPassIndexFromType(intPassType) };
+		if(intPassType == PASS_INT_AA_SAMPLES) slot.accumulate = ACCUMULATE_AA_SAMPLES;
+		else if(intPassType == PASS_INT_AA_NOISE) slot.accumulate = ACCUMULATE_AA_NOISE;
+		else if(intPassType == PASS_INT_DEBUG_RENDER_TIME) slot.accumulate = ACCUMULATE_RENDER_TIME;
+		else if(std::find(planColors.begin(), planColors.end(), slot.colorIndex) == planColors.end()) planColors.push_back(slot.colorIndex);
+		passPlan.push_back(slot);
 	}
 
+	Y_VERBOSE << "imageFilm: " << imagePasses.size() + auxImagePasses.size() << " passes of " << w << "x" << h << " take " << filmBytes / (1024 * 1024) << "MB, " << (size_t) w * h * sizeof(pixel_t) * (imagePasses.size() + auxImagePasses.size()) / (1024 * 1024) << "MB with full RGBA passes" << yendl;
+
+	if(!mappedPasses.empty()) Y_INFO << "imageFilm: " << mappedPasses.size() << " passes of " << w << "x" << h << " kept out of core in memory-mapped files in \"" << outOfCoreDir << "\"" << yendl;
+
 	densityImage = nullptr;
 	estimateDensity = false;
 	dpimage = nullptr;
@@ -177,6 +244,8 @@ imageFilm_t::imageFilm_t (int width, int height, int xstart, int ystart, colorOu
 
 	pbar = new ConsoleProgressBar_t(80);
 	session.setStatusCurrentPassPercent(pbar->getPercent());
+
+	outputQueue = new serialQueue_t();
 	
 	AA_detect_color_noise = false;
 	AA_dark_threshold_factor = 0.f;
@@ -187,7 +256,11 @@ imageFilm_t::imageFilm_t (int width, int height, int xstart, int ystart, colorOu
 
 imageFilm_t::~imageFilm_t ()
 {
-	
+	delete outputQueue;	//finishes the queued outputs first
+
+	for(size_t idx = 0; idx < snapshotPasses.size(); ++idx) delete snapshotPasses[idx];
+	for(size_t idx = 0; idx < snapshotAuxPasses.size(); ++idx) delete snapshotAuxPasses[idx];
+
 	//Deletion of the image buffers for the additional render passes
 	for(size_t idx = 0; idx < imagePasses.size(); ++idx)
 	{
@@ -208,6 +281,10 @@ imageFilm_t::~imageFilm_t ()
 	}
 	auxImagePasses.clear();
 
+	//The memory-mapped files go after the passes stored in them
+	for(auto &mapped : mappedPasses) delete mapped.second;
+	for(auto &mapped : mappedSnapshotPasses) delete mapped.second;
+
 	if(densityImage) delete densityImage;
 	delete[] filterTable;
 	if(splitter) delete splitter;
@@ -217,10 +294,16 @@ imageFilm_t::~imageFilm_t ()
 
 void imageFilm_t::init(int numPasses)
 {
-	// Clear color buffers
+	waitForOutput();
+
+	// Clear color buffers, the aux passes too as they keep sums of the previous render (like the AA noise moments)
 	for(size_t idx = 0; idx < imagePasses.size(); ++idx)
 	{
-		imagePasses[idx]->clear();
+		clearPass(imagePasses[idx]);
+	}
+	for(size_t idx = 0; idx < auxImagePasses.size(); ++idx)
+	{
+		clearPass(auxImagePasses[idx]);
 	}
 
 	// Clear density image
@@ -233,20 +316,28 @@ void imageFilm_t::init(int numPasses)
 	// Setup the bucket splitter
 	if(split)
 	{
-		next_area = 0;
 		scene_t *scene = env->getScene();
 		int nThreads = 1;
 		if(scene) nThreads = scene->getNumThreads();
-		splitter = new imageSpliter_t(w, h, cx0, cy0, tileSize, tilesOrder, nThreads);
+		if(splitter) delete splitter;
+		if(progressive)
+		{
+			// full scanline blocks handed out round robin, so every thread works all over the frame in each iteration
+			int rows = std::max(1, std::min(tileSize, (regionY1 - regionY0) / (4 * nThreads)));
+			splitter = new imageSpliter_t(viewWidth, regionY1 - regionY0, cx0, cy0 + regionY0, viewWidth, rows, imageSpliter_t::LINEAR, numViews);
+		}
+		else splitter = new imageSpliter_t(viewWidth, regionY1 - regionY0, cx0, cy0 + regionY0, tileSize, tileSize, tilesOrder, numViews);
 		area_cnt = splitter->size();
+		scheduler.reset(*splitter, nThreads, IMAGE_SPLITTER_MIN_TILE_SIZE);
+		tileBuffers.resize(nThreads);
 	}
 	else area_cnt = 1;
 
-	if(pbar) pbar->init(w * h);
+	if(pbar) pbar->init(getTotalPixels());
 	session.setStatusCurrentPassPercent(pbar->getPercent());
 
 	abort = false;
-	completed_cnt = 0;
+	completed_pixels = 0;
 	nPass = 1;
 	nPasses = numPasses;
 
@@ -271,14 +362,18 @@ void imageFilm_t::init(int numPasses)
 
 int imageFilm_t::nextPass(int numView, bool adaptive_AA, std::string integratorName, bool skipNextPass)
 {
-	splitterMutex.lock();
-	next_area = 0;
-	splitterMutex.unlock();
+	if(split)
+	{
+		scene_t *scene = env->getScene();
+		scheduler.reset(*splitter, scene ? scene->getNumThreads() : 1, IMAGE_SPLITTER_MIN_TILE_SIZE);
+	}
 	nPass++;
 	imagesAutoSavePassCounter++;
 	filmAutoSavePassCounter++;
 	
 	if(skipNextPass) return 0;
+
+	if(session.isInteractive()) waitForOutput();	//the areas of the last pass have to be on screen before the resample mask is drawn over them
 	
 	std::stringstream passString;
 
@@ -288,143 +383,259 @@ int imageFilm_t::nextPass(int numView, bool adaptive_AA, std::string integratorN
 	{
 		colorOutput_t *out2 = env->getOutput2();
 
-		if((imagesAutoSaveIntervalType == AUTOSAVE_PASS_INTERVAL) && (imagesAutoSavePassCounter >= imagesAutoSaveIntervalPasses))
-		{
-			if(output && output->isImageOutput()) this->flush(numView, IF_ALL, output);
-			else if(out2 && out2->isImageOutput()) this->flush(numView, IF_ALL, out2);
-			imagesAutoSavePassCounter = 0;
-		}
+		bool saveImages = (imagesAutoSaveIntervalType == AUTOSAVE_PASS_INTERVAL) && (imagesAutoSavePassCounter >= imagesAutoSaveIntervalPasses);
+		bool saveFilm = (filmFileSaveLoad == FILM_FILE_LOAD_SAVE || filmFileSaveLoad == FILM_FILE_SAVE) && (filmAutoSaveIntervalType == AUTOSAVE_PASS_INTERVAL) && (filmAutoSavePassCounter >= filmAutoSaveIntervalPasses);
+		saveFilm = saveFilm && ((output && output->isImageOutput()) || (out2 && out2->isImageOutput()));
 
-		if((filmFileSaveLoad == FILM_FILE_LOAD_SAVE || filmFileSaveLoad == FILM_FILE_SAVE) && (filmAutoSaveIntervalType == AUTOSAVE_PASS_INTERVAL) && (filmAutoSavePassCounter >= filmAutoSaveIntervalPasses))
+		colorOutput_t *imagesOut = nullptr;
+		if(saveImages && output && output->isImageOutput()) imagesOut = output;
+		else if(saveImages && out2 && out2->isImageOutput()) imagesOut = out2;
+
+		// if the previous autosave is still being written the counters keep going and the next pass tries again
+		if(queueAutoSave(numView, imagesOut, saveFilm))
 		{
-			if((output && output->isImageOutput()) || (out2 && out2->isImageOutput()))
-			{
-				imageFilmSave();
-				filmAutoSavePassCounter = 0;
-			}
+			if(saveImages) imagesAutoSavePassCounter = 0;
+			if(saveFilm) filmAutoSavePassCounter = 0;
 		}
 	}
 
 	const renderPasses_t * renderPasses = env->getRenderPasses();
 
-    rgba2DImage_t * samplingFactorImagePass = getImagePassFromIntPassType(PASS_INT_DEBUG_SAMPLING_FACTOR);
+    passImage_t * samplingFactorImagePass = getImagePassFromIntPassType(PASS_INT_DEBUG_SAMPLING_FACTOR);
+    passImage_t * noiseImagePass = (AA_noise_target > 0.f) ? getImagePassFromIntPassType(PASS_INT_AA_NOISE) : nullptr;
 	
     if(flags) flags->clear();
 	else flags = new tiledBitArray2D_t<3>(w, h, true);
     std::vector<colorA_t> colExtPasses(imagePasses.size(), colorA_t(0.f));
 	int variance_half_edge = AA_variance_edge_size / 2;
-	
-	float AA_thresh_scaled = AA_thesh;
 
 	int n_resample=0;
 	
-	if(adaptive_AA && AA_thesh > 0.f)
+	if(adaptive_AA && (AA_thesh > 0.f || noiseImagePass))
 	{
-		for(int y=0; y<h-1; ++y)
+		scene_t *scene = env->getScene();
+		threadPool_t &pool = env->getThreadPool();
+		const int nThreads = scene ? scene->getNumThreads() : 1;
+		// flags are stored in blocks of 8x8 pixels, threads setting them must not share a row of blocks
+		const int nBands = (h + IMAGE_FILM_RESAMPLE_BAND - 1) / IMAGE_FILM_RESAMPLE_BAND;
+		//only the rows of the render region are looked at, the pixels around it are left empty for the other computer nodes and are not neighbours of the region ones
+		auto forBandRows = [&](int band, const std::function<void(int)> &rowFunc)
+		{
+			for(int y = std::max(regionY0, band * IMAGE_FILM_RESAMPLE_BAND); y < std::min(regionY1, (band + 1) * IMAGE_FILM_RESAMPLE_BAND); ++y) rowFunc(y);
+		};
+		auto skipPixel = [&](int x, int y)
+		{
+			return samplingFactorImagePass && !backgroundResampling && (*samplingFactorImagePass)(x, y).normalized().R == 0.f;
+		};
+
+		if(noiseImagePass)
 		{
-			for(int x = 0; x < w-1; ++x)
+			//Resample the pixels whose estimated noise is still above the target, instead of looking at the neighbour colors
+			std::vector<double> bandNoise(nBands, 0.0);
+
+			pool.parallelFor(0, nBands, [&](int band)
 			{
-				flags->clearBit(x, y);
-			}
+				forBandRows(band, [&](int y)
+				{
+					for(int x = 0; x < w; ++x)
+					{
+						const pixel_t &moments = (*noiseImagePass)(x, y);
+						float noise = pixelNoise(moments);
+						bandNoise[band] += noise;
+
+						if(skipPixel(x, y)) continue;
+
+						if(moments.weight < 2.f || noise > AA_noise_target) flags->setBit(x, y);
+					}
+				});
+			}, nThreads);
+
+			double noiseSum = 0.0;
+			for(int band = 0; band < nBands; ++band) noiseSum += bandNoise[band];
+
+			Y_VERBOSE << integratorName << ": average relative noise " << 100.0 * noiseSum / ((double) w * (regionY1 - regionY0)) << "%, target " << 100.f * AA_noise_target << "%" << yendl;
 		}
-		        
-		for(int y=0; y<h-1; ++y)
+		else
 		{
-			for(int x = 0; x < w-1; ++x)
+			//We will only consider the Combined Pass (pass 0) for the AA additional sampling calculations.
+			const passImage_t &combined = *imagePasses.at(0);
+			const bool variance = AA_variance_pixels > 0 && variance_half_edge > 0;
+			//Without dark detection all pixels share the threshold, so the color edges inside the variance windows can be counted with prefix sums
+			const bool uniformThreshold = !(AA_dark_detection_type == DARK_DETECTION_LINEAR && AA_dark_threshold_factor > 0.f) && AA_dark_detection_type != DARK_DETECTION_CURVE;
+
+			auto pixelThreshold = [&](float pixColBri)
+			{
+				if(AA_dark_detection_type == DARK_DETECTION_LINEAR && AA_dark_threshold_factor > 0.f) return AA_thesh*((1.f-AA_dark_threshold_factor) + (pixColBri*AA_dark_threshold_factor));
+				else if(AA_dark_detection_type == DARK_DETECTION_CURVE) return dark_threshold_curve_interpolate(pixColBri);
+				else return AA_thesh;
+			};
+			auto isEdge = [&](int x0, int y0, int x1, int y1, float threshold)
 			{
-                //We will only consider the Combined Pass (pass 0) for the AA additional sampling calculations.
+				return combined(x0, y0).normalized().colorDifference(combined(x1, y1).normalized(), AA_detect_color_noise) >= threshold;
+			};
+			//with the views side by side the variance windows end at the border of the view of their pixel, as at the film border
+			auto viewX0 = [&](int x) { return viewOffset(viewOfColumn(x, 0)); };
+			auto viewX1 = [&](int x) { return (numViews > 1) ? viewX0(x) + viewWidth : w; };
 
-				if((*imagePasses.at(0))(x, y).weight <= 0.f) flags->setBit(x, y);	//If after reloading ImageFiles there are pixels that were not yet rendered at all, make sure they are marked to be rendered in the next AA pass
+			std::vector<unsigned char> marks((size_t) w * h, 0);
+			std::vector<uint32_t> sums;
 
-                float matSampleFactor = 1.f;
-                if(samplingFactorImagePass)
+			//Color differences to the neighbours of each pixel
+			pool.parallelFor(0, nBands, [&](int band)
+			{
+				forBandRows(band, [&](int y)
 				{
-					matSampleFactor = (*samplingFactorImagePass)(x, y).normalized().R;
-					if(!backgroundResampling && matSampleFactor == 0.f) continue;
-				}
+					for(int x = 0; x < w; ++x)
+					{
+						unsigned char m = 0;
+						//pixels of different views side by side are not compared across the seam between them
+						const bool seamRight = numViews > 1 && (x+1) % viewWidth == 0;
+						const bool seamLeft = numViews > 1 && x % viewWidth == 0;
 
-				colorA_t pixCol = (*imagePasses.at(0))(x, y).normalized();
-				float pixColBri = pixCol.abscol2bri();
+						if(variance && uniformThreshold)
+						{
+							if(x < w-1 && !seamRight && isEdge(x, y, x+1, y, AA_thesh)) m |= RESAMPLE_EDGE_X;
+							if(y < regionY1-1 && isEdge(x, y, x, y+1, AA_thesh)) m |= RESAMPLE_EDGE_Y;
+						}
 
-				if(AA_dark_detection_type == DARK_DETECTION_LINEAR && AA_dark_threshold_factor > 0.f)
-				{
-					if(AA_dark_threshold_factor > 0.f) AA_thresh_scaled = AA_thesh*((1.f-AA_dark_threshold_factor) + (pixColBri*AA_dark_threshold_factor));
-				}
-				else if(AA_dark_detection_type == DARK_DETECTION_CURVE)
-				{
-					AA_thresh_scaled = dark_threshold_curve_interpolate(pixColBri);
-				}
-				
-				if(pixCol.colorDifference((*imagePasses.at(0))(x+1, y).normalized(), AA_detect_color_noise) >= AA_thresh_scaled)
-				{
-					flags->setBit(x, y); flags->setBit(x+1, y);
-				}
-				if(pixCol.colorDifference((*imagePasses.at(0))(x, y+1).normalized(), AA_detect_color_noise) >= AA_thresh_scaled)
-				{
-					flags->setBit(x, y); flags->setBit(x, y+1);
-				}
-				if(pixCol.colorDifference((*imagePasses.at(0))(x+1, y+1).normalized(), AA_detect_color_noise) >= AA_thresh_scaled)
-				{
-					flags->setBit(x, y); flags->setBit(x+1, y+1);
-				}
-				if(x > 0 && pixCol.colorDifference((*imagePasses.at(0))(x-1, y+1).normalized(), AA_detect_color_noise) >= AA_thresh_scaled)
-				{
-					flags->setBit(x, y); flags->setBit(x-1, y+1);
-				}
-				
-				if(AA_variance_pixels > 0)
-				{
-					int variance_x = 0, variance_y = 0;//, pixelcount = 0;
-					
-					//float window_accum = 0.f, window_avg = 0.f;
-					
-					for(int xd = -variance_half_edge; xd < variance_half_edge - 1 ; ++xd)
-					{
-						int xi = x + xd;
-						if(xi<0) xi = 0;
-						else if(xi>=w-1) xi = w-2;
-						
-						colorA_t cx0 = (*imagePasses.at(0))(xi, y).normalized();
-						colorA_t cx1 = (*imagePasses.at(0))(xi+1, y).normalized();
-						
-						if(cx0.colorDifference(cx1, AA_detect_color_noise) >= AA_thresh_scaled) ++variance_x;
+						if(x < w-1 && y < regionY1-1)
+						{
+							if(combined(x, y).weight <= 0.f) m |= RESAMPLE_PIXEL;	//If after reloading ImageFiles there are pixels that were not yet rendered at all, make sure they are marked to be rendered in the next AA pass
+
+							if(!skipPixel(x, y))
+							{
+								float threshold = pixelThreshold(combined(x, y).normalized().abscol2bri());
+
+								if(!seamRight && isEdge(x, y, x+1, y, threshold)) m |= RESAMPLE_PIXEL | RESAMPLE_RIGHT;
+								if(isEdge(x, y, x, y+1, threshold)) m |= RESAMPLE_PIXEL | RESAMPLE_DOWN;
+								if(!seamRight && isEdge(x, y, x+1, y+1, threshold)) m |= RESAMPLE_PIXEL | RESAMPLE_DOWN_RIGHT;
+								if(x > 0 && !seamLeft && isEdge(x, y, x-1, y+1, threshold)) m |= RESAMPLE_PIXEL | RESAMPLE_DOWN_LEFT;
+							}
+						}
+						marks[(size_t) y * w + x] = m;
 					}
-					
-					for(int yd = -variance_half_edge; yd < variance_half_edge - 1 ; ++yd)
+				});
+			}, nThreads);
+
+			if(variance)
+			{
+				const int nColumnBands = (w + IMAGE_FILM_RESAMPLE_COLUMNS - 1) / IMAGE_FILM_RESAMPLE_COLUMNS;
+				//Running sums down the columns of the render region, either of a mark bit or of the rows sums already in place
+				auto columnPrefixSums = [&](int band, unsigned char bit)
+				{
+					int xEnd = std::min(w, (band + 1) * IMAGE_FILM_RESAMPLE_COLUMNS);
+					for(int y = regionY0; y < regionY1-1; ++y)
 					{
-						int yi = y + yd;
-						if(yi<0) yi = 0;
-						else if(yi>=h-1) yi = h-2;
-						
-						colorA_t cy0 = (*imagePasses.at(0))(x, yi).normalized();
-						colorA_t cy1 = (*imagePasses.at(0))(x, yi+1).normalized();
-						
-						if(cy0.colorDifference(cy1, AA_detect_color_noise) >= AA_thresh_scaled) ++variance_y;
+						for(int x = band * IMAGE_FILM_RESAMPLE_COLUMNS; x < xEnd; ++x)
+						{
+							size_t i = (size_t) y * w + x;
+							if(bit) sums[i] = (marks[i] & bit) ? 1 : 0;
+							if(y > regionY0) sums[i] += sums[i - w];
+						}
 					}
+				};
+
+				sums.resize((size_t) w * h);
 
-					if(variance_x + variance_y >= AA_variance_pixels)
+				if(uniformThreshold) pool.parallelFor(0, nColumnBands, [&](int band) { columnPrefixSums(band, RESAMPLE_EDGE_Y); }, nThreads);
+
+				//Count the color edges in the variance window of each pixel
+				pool.parallelFor(0, nBands, [&](int band)
+				{
+					std::vector<uint32_t> rowSums(w);
+					forBandRows(band, [&](int y)
 					{
-						for(int xd = -variance_half_edge; xd < variance_half_edge; ++xd)
+						if(y >= regionY1-1) return;
+
+						if(uniformThreshold)
 						{
-							for(int yd = -variance_half_edge; yd < variance_half_edge; ++yd)
-							{
-								int xi = x + xd;
-								if(xi<0) xi = 0;
-								else if(xi>=w) xi = w-1;
+							for(int x = 0; x < w-1; ++x) rowSums[x] = (x > viewX0(x) ? rowSums[x-1] : 0) + ((marks[(size_t) y * w + x] & RESAMPLE_EDGE_X) ? 1 : 0);
+						}
 
-								int yi = y + yd;
-								if(yi<0) yi = 0;
-								else if(yi>=h) yi = h-1;
+						for(int x = 0; x < w-1; ++x)
+						{
+							const int vx0 = viewX0(x), vx1 = viewX1(x);
+							if(x >= vx1-1 || skipPixel(x, y)) continue;
 
-								flags->setBit(xi, yi);
+							int variance_x = 0, variance_y = 0;
+
+							if(uniformThreshold)
+							{
+								variance_x = clampedWindowSum(rowSums.data() + vx0, 1, vx1-vx0-1, x - vx0 - variance_half_edge, x - vx0 + variance_half_edge - 2);
+								variance_y = clampedWindowSum(sums.data() + (size_t) regionY0 * w + x, w, regionY1-regionY0-1, y - regionY0 - variance_half_edge, y - regionY0 + variance_half_edge - 2);
 							}
+							else
+							{
+								float threshold = pixelThreshold(combined(x, y).normalized().abscol2bri());
+
+								for(int xd = -variance_half_edge; xd < variance_half_edge - 1 ; ++xd)
+								{
+									int xi = std::min(std::max(x + xd, vx0), vx1-2);
+									if(isEdge(xi, y, xi+1, y, threshold)) ++variance_x;
+								}
+
+								for(int yd = -variance_half_edge; yd < variance_half_edge - 1 ; ++yd)
+								{
+									int yi = std::min(std::max(y + yd, regionY0), regionY1-2);
+									if(isEdge(x, yi, x, yi+1, threshold)) ++variance_y;
+								}
+							}
+
+							if(variance_x + variance_y >= AA_variance_pixels) marks[(size_t) y * w + x] |= RESAMPLE_WINDOW;
 						}
-					}
-				}
+					});
+				}, nThreads);
+
+				//Summed area table of the window centers, a pixel is resampled if any center of a window covering it is set
+				pool.parallelFor(0, nBands, [&](int band)
+				{
+					forBandRows(band, [&](int y)
+					{
+						if(y >= regionY1-1) return;
+						size_t row = (size_t) y * w;
+						for(int x = 0; x < w-1; ++x) sums[row + x] = (x > 0 ? sums[row + x - 1] : 0) + ((marks[row + x] & RESAMPLE_WINDOW) ? 1 : 0);
+					});
+				}, nThreads);
+				pool.parallelFor(0, nColumnBands, [&](int band) { columnPrefixSums(band, 0); }, nThreads);
 			}
+
+			auto windowCenters = [&](int x0, int y0, int x1, int y1, int vx0, int vx1) -> uint32_t
+			{
+				x0 = std::max(x0, vx0); y0 = std::max(y0, regionY0);
+				x1 = std::min(x1, vx1-2); y1 = std::min(y1, regionY1-2);
+				if(x0 > x1 || y0 > y1) return 0;
+				uint32_t s = sums[(size_t) y1 * w + x1];
+				if(x0 > 0) s -= sums[(size_t) y1 * w + x0 - 1];
+				if(y0 > regionY0) s -= sums[(size_t) (y0 - 1) * w + x1];
+				if(x0 > 0 && y0 > regionY0) s += sums[(size_t) (y0 - 1) * w + x0 - 1];
+				return s;
+			};
+
+			pool.parallelFor(0, nBands, [&](int band)
+			{
+				forBandRows(band, [&](int y)
+				{
+					const unsigned char *row = &marks[(size_t) y * w];
+					const unsigned char *above = (y > regionY0) ? row - w : nullptr;
+					for(int x = 0; x < w; ++x)
+					{
+						bool resample = (row[x] & RESAMPLE_PIXEL)
+							|| (x > 0 && (row[x-1] & RESAMPLE_RIGHT))
+							|| (above && (above[x] & RESAMPLE_DOWN))
+							|| (above && x > 0 && (above[x-1] & RESAMPLE_DOWN_RIGHT))
+							|| (above && x < w-1 && (above[x+1] & RESAMPLE_DOWN_LEFT))
+							|| (variance && windowCenters(x - variance_half_edge + 1, y - variance_half_edge + 1, x + variance_half_edge, y + variance_half_edge, viewX0(x), viewX1(x)) > 0);
+
+						if(resample) flags->setBit(x, y);
+					}
+				});
+			}, nThreads);
 		}
 
-		for(int y=0; y<h; ++y)
+		std::unique_lock<std::mutex> outLock(outMutex, std::defer_lock);	//autosaves may be writing to the outputs
+		if(session.isInteractive() && showMask) outLock.lock();
+
+		for(int y = regionY0; y < regionY1; ++y)
 		{
 			for(int x = 0; x < w; ++x)
 			{
@@ -451,7 +662,8 @@ int imageFilm_t::nextPass(int numView, bool adaptive_AA, std::string integratorN
 							else
 								colExtPasses[idx].set(pixColBri, 0.7f, matSampleFactor > 1.f ? 0.7f : pixColBri);
 						}
-						output->putPixel(numView, x, y, renderPasses, colExtPasses, false);
+						int view = viewOfColumn(x, numView);
+						output->putPixel(view, x - viewOffset(view), y, renderPasses, colExtPasses, false);
 					}
 				}
 			}
@@ -459,10 +671,17 @@ int imageFilm_t::nextPass(int numView, bool adaptive_AA, std::string integratorN
 	}
 	else
 	{
-		n_resample = h*w;
+		n_resample = getTotalPixels();
 	}
 
-	if(session.isInteractive())	output->flush(numView, renderPasses);
+	if(session.isInteractive())
+	{
+		std::lock_guard<std::mutex> lk(outMutex);
+		if(numViews > 1) for(int view = 0; view < numViews; ++view) output->flush(view, renderPasses);
+		else output->flush(numView, renderPasses);
+	}
+
+	releasePasses(mappedPasses);	//the resample detection went over the whole film, the new pass pages in what it samples
 
 	if(session.renderResumed()) passString << "Film loaded + ";
 	
@@ -472,16 +691,16 @@ int imageFilm_t::nextPass(int numView, bool adaptive_AA, std::string integratorN
 
 	if(pbar)
 	{
-		pbar->init(w * h);
+		pbar->init(getTotalPixels());
 		session.setStatusCurrentPassPercent(pbar->getPercent());
 		pbar->setTag(passString.str().c_str());
 	}
-	completed_cnt = 0;
+	completed_pixels = 0;
 	
 	return n_resample;
 }
 
-bool imageFilm_t::nextArea(int numView, renderArea_t &a)
+bool imageFilm_t::nextArea(int numView, renderArea_t &a, int threadID)
 {
 	if(abort) return false;
 
@@ -489,23 +708,26 @@ bool imageFilm_t::nextArea(int numView, renderArea_t &a)
 
 	if(split)
 	{
-		int n;
-		splitterMutex.lock();
-		n = next_area++;
-		splitterMutex.unlock();
-
-		if(	splitter->getArea(n, a) )
+		if(scheduler.nextArea(threadID, a))
 		{
 			a.sx0 = a.X + ifilterw;
 			a.sx1 = a.X + a.W - ifilterw;
 			a.sy0 = a.Y + ifilterw;
 			a.sy1 = a.Y + a.H - ifilterw;
 
+			a.accum = nullptr;
+			if(threadID >= 0 && threadID < (int)tileBuffers.size())
+			{
+				a.accum = &tileBuffers[threadID];
+				a.accum->reset(std::max(cx0, a.X - ifilterw), std::max(cy0, a.Y - ifilterw), std::min(cx1, a.X + a.W + ifilterw), std::min(cy1, a.Y + a.H + ifilterw), imagePasses.size() + auxImagePasses.size());
+			}
+
 			if(session.isInteractive())
 			{
 				outMutex.lock();
+				int view = viewOfColumn(a.X-cx0, numView), viewX0 = viewOffset(view);
 				int end_x = a.X+a.W, end_y = a.Y+a.H;
-				output->highliteArea(numView, a.X, a.Y, end_x, end_y);
+				output->highliteArea(view, a.X-viewX0, a.Y, end_x-viewX0, end_y);
 				outMutex.unlock();
 			}
 
@@ -523,6 +745,7 @@ bool imageFilm_t::nextArea(int numView, renderArea_t &a)
 		a.sx1 = a.X + a.W - ifilterw;
 		a.sy0 = a.Y + ifilterw;
 		a.sy1 = a.Y + a.H - ifilterw;
+		a.accum = nullptr;
 		++area_cnt;
 		return true;
 	}
@@ -531,38 +754,87 @@ bool imageFilm_t::nextArea(int numView, renderArea_t &a)
 
 void imageFilm_t::finishArea(int numView, renderArea_t &a)
 {
-	outMutex.lock();
+	const int x0 = a.X-cx0, y0 = a.Y-cy0, areaW = a.W, areaH = a.H;
+	const size_t nPasses = imagePasses.size();
+
+	// the next areas are merged into the film while the output thread works, so it gets a copy of this one
+	std::shared_ptr<std::vector<pixel_t>> pixels = std::make_shared<std::vector<pixel_t>>((size_t)areaW * areaH * nPasses);
+
+	for(size_t idx = 0; idx < nPasses; ++idx)
+	{
+		pixel_t *dst = &(*pixels)[idx * areaW * areaH];
+		for(int j=0; j<areaH; ++j)
+		{
+			for(int i=0; i<areaW; ++i) *dst++ = (*imagePasses[idx])(x0+i, y0+j);
+		}
+	}
+
+	outputQueue->push([=]{ outputArea(numView, x0, y0, areaW, areaH, *pixels); });
+
+	std::lock_guard<std::mutex> lk(statusMutex);
+
+	if(session.renderInProgress() && !output->isPreview())	//avoid saving images/film if we are just rendering material/world/lights preview windows, etc
+	{
+		gTimer.stop("imagesAutoSaveTimer");
+		imagesAutoSaveTimer += gTimer.getTime("imagesAutoSaveTimer");
+		if(imagesAutoSaveTimer < 0.f) resetImagesAutoSaveTimer(); //to solve some strange very negative value when using yafaray-xml, race condition somewhere?
+		gTimer.start("imagesAutoSaveTimer");
+
+		gTimer.stop("filmAutoSaveTimer");
+		filmAutoSaveTimer += gTimer.getTime("filmAutoSaveTimer");
+		if(filmAutoSaveTimer < 0.f) resetFilmAutoSaveTimer(); //to solve some strange very negative value when using yafaray-xml, race condition somewhere?
+		gTimer.start("filmAutoSaveTimer");
+
+		colorOutput_t *out2 = env->getOutput2();
+
+		bool saveImages = (imagesAutoSaveIntervalType == AUTOSAVE_TIME_INTERVAL) && (imagesAutoSaveTimer > imagesAutoSaveIntervalSeconds);
+		bool saveFilm = (filmFileSaveLoad == FILM_FILE_LOAD_SAVE || filmFileSaveLoad == FILM_FILE_SAVE) && (filmAutoSaveIntervalType == AUTOSAVE_TIME_INTERVAL) && (filmAutoSaveTimer > filmAutoSaveIntervalSeconds);
+
+		if(saveImages || saveFilm)
+		{
+			Y_DEBUG << "imagesAutoSaveTimer="<<imagesAutoSaveTimer<<" filmAutoSaveTimer="<<filmAutoSaveTimer<<yendl;
+			colorOutput_t *imagesOut = nullptr;
+			if(saveImages && output && output->isImageOutput()) imagesOut = output;
+			else if(saveImages && out2 && out2->isImageOutput()) imagesOut = out2;
+
+			// the timers keep running while the previous autosave is still being written
+			if(queueAutoSave(numView, imagesOut, saveFilm && ((output && output->isImageOutput()) || (out2 && out2->isImageOutput()))))
+			{
+				if(saveImages) resetImagesAutoSaveTimer();
+				if(saveFilm) resetFilmAutoSaveTimer();
+			}
+		}
+	}
+
+	if(pbar)
+	{
+		completed_pixels += a.W * a.H;
+		if(completed_pixels >= getTotalPixels()) pbar->done();
+		else pbar->update(a.W * a.H);
+		session.setStatusCurrentPassPercent(pbar->getPercent());
+	}
+}
+
+void imageFilm_t::outputArea(int numView, int x0, int y0, int areaW, int areaH, const std::vector<pixel_t> &pixels)
+{
+	std::lock_guard<std::mutex> lk(outMutex);
 
     const renderPasses_t * renderPasses = env->getRenderPasses();
     
-	int end_x = a.X+a.W-cx0, end_y = a.Y+a.H-cy0;
+	int end_x = x0+areaW, end_y = y0+areaH;
+	const int view = viewOfColumn(x0, numView), viewX0 = viewOffset(view);
 
     std::vector<colorA_t> colExtPasses(imagePasses.size(), colorA_t(0.f));
 
-	for(int j=a.Y-cy0; j<end_y; ++j)
+	for(int j=y0; j<end_y; ++j)
 	{
-		for(int i=a.X-cx0; i<end_x; ++i)
+		for(int i=x0; i<end_x; ++i)
 		{
 			for(size_t idx = 0; idx < imagePasses.size(); ++idx)
 			{
-				if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_AA_SAMPLES)
-				{
-					colExtPasses[idx] = (*imagePasses[idx])(i, j).weight;
-				}
-				else if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_OBJ_INDEX_ABS ||
-                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_OBJ_INDEX_AUTO_ABS ||
-                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_MAT_INDEX_ABS ||
-                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_MAT_INDEX_AUTO_ABS
-                        )
-				{
-					colExtPasses[idx] = (*imagePasses[idx])(i, j).normalized();
-                    colExtPasses[idx].ceil(); //To correct the antialiasing and ceil the "mixed" values to the upper integer
-				}
-                else
-                {
-                    colExtPasses[idx] = (*imagePasses[idx])(i, j).normalized();
-                }
+				const pixel_t &pixel = pixels[(idx * areaH + j - y0) * areaW + i - x0];
 
+				colExtPasses[idx] = passColor(renderPasses->intPassTypeFromExtPassIndex(idx), pixel);
 				colExtPasses[idx].clampRGB0();
 				colExtPasses[idx].ColorSpace_from_linearRGB(colorSpace, gamma);//FIXME DAVID: what passes must be corrected and what do not?
 				if(premultAlpha && idx == 0) colExtPasses[idx].alphaPremultiply();
@@ -572,7 +844,7 @@ void imageFilm_t::finishArea(int numView, renderArea_t &a)
 				else if(colExtPasses[idx].A > 1.f) colExtPasses[idx].A = 1.f;
 			}
 
-			if( !output->putPixel(numView, i, j, renderPasses, colExtPasses) ) abort=true;
+			if( !output->putPixel(view, i-viewX0, j, renderPasses, colExtPasses) ) abort=true;
 		}
 	}
 
@@ -580,69 +852,89 @@ void imageFilm_t::finishArea(int numView, renderArea_t &a)
 	{
 		if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_DEBUG_FACES_EDGES)
 		{
-			generateDebugFacesEdges(numView, idx, a.X-cx0, end_x, a.Y-cy0, end_y, true, output);
+			generateDebugFacesEdges(view, idx, x0, end_x, y0, end_y, true, output);
 		}
 		
 		if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_DEBUG_OBJECTS_EDGES || renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_TOON)
 		{
-			generateToonAndDebugObjectEdges(numView, idx, a.X-cx0, end_x, a.Y-cy0, end_y, true, output);
+			generateToonAndDebugObjectEdges(view, idx, x0, end_x, y0, end_y, true, output);
 		}
 	}
 
-	if(session.isInteractive()) output->flushArea(numView, a.X, a.Y, end_x+cx0, end_y+cy0, renderPasses);
-	
-	if(session.renderInProgress() && !output->isPreview())	//avoid saving images/film if we are just rendering material/world/lights preview windows, etc
-	{
-		gTimer.stop("imagesAutoSaveTimer");
-		imagesAutoSaveTimer += gTimer.getTime("imagesAutoSaveTimer");
-		if(imagesAutoSaveTimer < 0.f) resetImagesAutoSaveTimer(); //to solve some strange very negative value when using yafaray-xml, race condition somewhere?
-		gTimer.start("imagesAutoSaveTimer");
-
-		gTimer.stop("filmAutoSaveTimer");
-		filmAutoSaveTimer += gTimer.getTime("filmAutoSaveTimer");
-		if(filmAutoSaveTimer < 0.f) resetFilmAutoSaveTimer(); //to solve some strange very negative value when using yafaray-xml, race condition somewhere?
-		gTimer.start("filmAutoSaveTimer");
+	if(session.isInteractive()) output->flushArea(view, x0+cx0-viewX0, y0+cy0, end_x+cx0-viewX0, end_y+cy0, renderPasses);
 
-		colorOutput_t *out2 = env->getOutput2();
+	//the area was merged into the film together with its filter border
+	const int ifilterw = (int) ceil(filterw);
+	releaseArea(x0 - ifilterw, y0 - ifilterw, end_x + ifilterw, end_y + ifilterw);
+}
 
-		if((imagesAutoSaveIntervalType == AUTOSAVE_TIME_INTERVAL) && (imagesAutoSaveTimer > imagesAutoSaveIntervalSeconds))
+colorA_t imageFilm_t::passColor(intPassTypes_t intPassType, const pixel_t &pixel, bool image)
+{
+	switch(intPassType)
+	{
+		case PASS_INT_AA_SAMPLES:
+		case PASS_INT_DEBUG_RENDER_TIME:
+			return colorA_t(pixel.weight);
+		case PASS_INT_AA_NOISE:
+			return colorA_t(pixelNoise(pixel));
+		case PASS_INT_OBJ_INDEX_ABS:
+		case PASS_INT_OBJ_INDEX_AUTO_ABS:
+		case PASS_INT_MAT_INDEX_ABS:
+		case PASS_INT_MAT_INDEX_AUTO_ABS:
 		{
-			Y_DEBUG << "imagesAutoSaveTimer="<<imagesAutoSaveTimer<<yendl;
-			if(output && output->isImageOutput()) this->flush(numView, IF_ALL, output);
-			else if(out2 && out2->isImageOutput()) this->flush(numView, IF_ALL, out2);
-			resetImagesAutoSaveTimer();
+			colorA_t col = pixel.normalized();
+			col.ceil(); //To correct the antialiasing and ceil the "mixed" values to the upper integer
+			return col;
 		}
+		default:
+			return image ? pixel.normalized() : colorA_t(0.f);
+	}
+}
+
+void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
+{
+	waitForOutput();
+
+	if(session.renderFinished())
+	{
+		outMutex.lock();
+		Y_INFO << "imageFilm: Flushing buffer (View number " << numView << ")..." << yendl;
+	}
+
+	flushPasses(numView, flags, out, imagePasses);
+	releasePasses(mappedPasses);
 
-		if((filmFileSaveLoad == FILM_FILE_LOAD_SAVE || filmFileSaveLoad == FILM_FILE_SAVE) && (filmAutoSaveIntervalType == AUTOSAVE_TIME_INTERVAL) && (filmAutoSaveTimer > filmAutoSaveIntervalSeconds))
+	if(session.renderFinished())
+	{
+		colorOutput_t *out2 = (out ? out : output)->isPreview() ? nullptr : env->getOutput2();
+
+		if(!output->isPreview() && (filmFileSaveLoad == FILM_FILE_LOAD_SAVE || filmFileSaveLoad == FILM_FILE_SAVE) && (numViews == 1 || numView == numViews-1))	//views rendered together share the film, it is saved with the last one
 		{
-			Y_DEBUG << "filmAutoSaveTimer="<<filmAutoSaveTimer<<yendl;
 			if((output && output->isImageOutput()) || (out2 && out2->isImageOutput()))
 			{
 				imageFilmSave();
 			}
-			resetFilmAutoSaveTimer();
 		}
+
+		gTimer.stop("imagesAutoSaveTimer");
+		gTimer.stop("filmAutoSaveTimer");
+
+		yafLog.clearMemoryLog();
+		outMutex.unlock();
+		Y_VERBOSE << "imageFilm: Done." << yendl;
 	}
+}
 
-    if(pbar)
-    {
-        if(++completed_cnt == area_cnt) pbar->done();
-        else pbar->update(a.W * a.H);
-        session.setStatusCurrentPassPercent(pbar->getPercent());
-    }
-    
-	outMutex.unlock();
+void imageFilm_t::waitForOutput()
+{
+	if(!outputQueue->inWorker()) outputQueue->wait();
 }
 
-void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
+/*! Writes passes, the film or its autosave snapshot, to the outputs. The caller holds outMutex */
+void imageFilm_t::flushPasses(int numView, int flags, colorOutput_t *out, const std::vector<passImage_t*> &passes)
 {
     const renderPasses_t * renderPasses = env->getRenderPasses();
-    
-	if(session.renderFinished())
-	{
-		outMutex.lock();
-		Y_INFO << "imageFilm: Flushing buffer (View number " << numView << ")..." << yendl;
-	}
+	const int viewX0 = viewOffset(numView);
 
 	colorOutput_t *out1 = out ? out : output;
 	colorOutput_t *out2 = env->getOutput2();
@@ -668,7 +960,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 	if(session.renderFinished()) times = gTimer.getTime("rendert");
 	int timem, timeh;
 	gTimer.splitTime(times, &times, &timem, &timeh);
-	ssBadge << " | " << w << "x" << h;
+	ssBadge << " | " << viewWidth << "x" << h;
 	if(session.renderInProgress()) ssBadge << " | " << (session.renderResumed() ? "film loaded + " : "") << "in progress " << std::fixed << std::setprecision(1) << session.currentPassPercent() << "% of pass: " << session.currentPass() << " / " << session.totalPasses();
 	else if(session.renderAborted()) ssBadge << " | " << (session.renderResumed() ? "film loaded + " : "") << "stopped at " << std::fixed << std::setprecision(1) << session.currentPassPercent() << "% of pass: " << session.currentPass() << " / " << session.totalPasses();
 	else 
@@ -739,28 +1031,11 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 
 	for(int j = 0; j < h; j++)
 	{
-		for(int i = 0; i < w; i++)
+		for(int i = viewX0; i < viewX0 + viewWidth; i++)
 		{
 			for(size_t idx = 0; idx < imagePasses.size(); ++idx)
 			{
-				if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_AA_SAMPLES)
-				{
-					colExtPasses[idx] = (*imagePasses[idx])(i, j).weight;
-				}
-				else if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_OBJ_INDEX_ABS ||
-                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_OBJ_INDEX_AUTO_ABS ||
-                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_MAT_INDEX_ABS ||
-                        renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_MAT_INDEX_AUTO_ABS
-                        )
-				{
-					colExtPasses[idx] = (*imagePasses[idx])(i, j).normalized();
-                    colExtPasses[idx].ceil(); //To correct the antialiasing and ceil the "mixed" values to the upper integer
-				}
-                else
-                {
-                    if(flags & IF_IMAGE) colExtPasses[idx] = (*imagePasses[idx])(i, j).normalized();
-                    else colExtPasses[idx] = colorA_t(0.f);
-                }
+				colExtPasses[idx] = passColor(renderPasses->intPassTypeFromExtPassIndex(idx), (*passes[idx])(i, j), flags & IF_IMAGE);
 								
 				if(estimateDensity && (flags & IF_DENSITYIMAGE) && idx == 0 && densityFactor > 0.f) colExtPasses[idx] += colorA_t((*densityImage)(i, j) * densityFactor, 0.f);
                 
@@ -793,8 +1068,8 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 				}
 			}
 
-			if(out1) out1->putPixel(numView, i, j+outputDisplaceRenderedImageBadgeHeight, renderPasses, colExtPasses);
-			if(out2) out2->putPixel(numView, i, j+out2DisplaceRenderedImageBadgeHeight, renderPasses, colExtPasses2);
+			if(out1) out1->putPixel(numView, i-viewX0, j+outputDisplaceRenderedImageBadgeHeight, renderPasses, colExtPasses);
+			if(out2) out2->putPixel(numView, i-viewX0, j+out2DisplaceRenderedImageBadgeHeight, renderPasses, colExtPasses2);
 		}
 	}
 
@@ -802,12 +1077,12 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 	{
 		if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_DEBUG_FACES_EDGES)
 		{
-			generateDebugFacesEdges(numView, idx, 0, w, 0, h, false, out1, outputDisplaceRenderedImageBadgeHeight, out2, out2DisplaceRenderedImageBadgeHeight);
+			generateDebugFacesEdges(numView, idx, viewX0, viewX0 + viewWidth, 0, h, false, out1, outputDisplaceRenderedImageBadgeHeight, out2, out2DisplaceRenderedImageBadgeHeight);
 		}
 		
 		if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_DEBUG_OBJECTS_EDGES || renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_TOON)
 		{
-			generateToonAndDebugObjectEdges(numView, idx, 0, w, 0, h, false, out1, outputDisplaceRenderedImageBadgeHeight, out2, out2DisplaceRenderedImageBadgeHeight);
+			generateToonAndDebugObjectEdges(numView, idx, viewX0, viewX0 + viewWidth, 0, h, false, out1, outputDisplaceRenderedImageBadgeHeight, out2, out2DisplaceRenderedImageBadgeHeight);
 		}
 	}
 	
@@ -822,7 +1097,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 			
 			for(int j = badgeStartY; j < badgeStartY+dpHeight; j++)
 			{
-				for(int i = 0; i < w; i++)
+				for(int i = 0; i < viewWidth; i++)
 				{
 					for(size_t idx = 0; idx < imagePasses.size(); ++idx)
 					{
@@ -842,7 +1117,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 			
 			for(int j = badgeStartY; j < badgeStartY+dpHeight; j++)
 			{
-				for(int i = 0; i < w; i++)
+				for(int i = 0; i < viewWidth; i++)
 				{
 					for(size_t idx = 0; idx < imagePasses.size(); ++idx)
 					{
@@ -865,7 +1140,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 
 		std::string oldTag;
 
-		if(pbar)
+		if(pbar && !outputQueue->inWorker())
 		{
 			oldTag = pbar->getTag();
 			pbar->setTag(passString.str().c_str());
@@ -873,7 +1148,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 
 		out1->flush(numView, renderPasses);
 		
-		if(pbar) pbar->setTag(oldTag);
+		if(pbar && !outputQueue->inWorker()) pbar->setTag(oldTag);
 	}
 	
 	if(out2 && out2->isImageOutput())
@@ -885,7 +1160,7 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 
 		std::string oldTag;
 
-		if(pbar)
+		if(pbar && !outputQueue->inWorker())
 		{
 			oldTag = pbar->getTag();
 			pbar->setTag(passString.str().c_str());
@@ -893,31 +1168,49 @@ void imageFilm_t::flush(int numView, int flags, colorOutput_t *out)
 
 		out2->flush(numView, renderPasses);
 
-		if(pbar) pbar->setTag(oldTag);
+		if(pbar && !outputQueue->inWorker()) pbar->setTag(oldTag);
 	}
+}
 
-	if(session.renderFinished())
-	{
-		if(!output->isPreview() && (filmFileSaveLoad == FILM_FILE_LOAD_SAVE || filmFileSaveLoad == FILM_FILE_SAVE))
-		{
-			if((output && output->isImageOutput()) || (out2 && out2->isImageOutput()))
-			{
-				imageFilmSave();
-			}
-		}
+bool imageFilm_t::doMoreSamples(int x, int y) const
+{
+	return (AA_thesh>0.f || AA_noise_target>0.f) ? flags->getBit(x-cx0, y-cy0) : true;
+}
 
-		gTimer.stop("imagesAutoSaveTimer");
-		gTimer.stop("filmAutoSaveTimer");
+float imageFilm_t::pixelNoise(const pixel_t &moments)
+{
+	// col.R and col.G hold the sum of the sample brightness and of its square, weight the number of samples
+	float n = moments.weight;
+	if(n < 2.f) return 1.f;
+	float mean = moments.col.R / n;
+	float variance = std::max(0.f, (moments.col.G - moments.col.R * mean) / (n - 1.f));
+	return std::sqrt(variance / n) / std::max(std::fabs(mean), AA_NOISE_MIN_BRIGHTNESS);
+}
 
-		yafLog.clearMemoryLog();
-		outMutex.unlock();
-		Y_VERBOSE << "imageFilm: Done." << yendl;
-	}
+//! The noise estimation moments are not filtered, each sample only counts for the pixel it was taken in
+static inline void addNoiseMoments(pixel_t &pixel, colorPasses_t &colorPasses, bool premultAlpha, float clampSamples)
+{
+	colorA_t col = colorPasses(PASS_INT_COMBINED);
+	col.clampProportionalRGB(clampSamples);
+	if(premultAlpha) col.alphaPremultiply();
+	float bri = col.col2bri();
+	pixel.col.R += bri;
+	pixel.col.G += bri * bri;
+	pixel.weight += 1.f;
 }
 
-bool imageFilm_t::doMoreSamples(int x, int y) const
+//! Adds the color col (RGBA) with the filter weight wt to a pixel
+static inline void splatPixel(pixel_t &pixel, const float *col, float wt)
 {
-	return (AA_thesh>0.f) ? flags->getBit(x-cx0, y-cy0) : true;
+#if IMAGE_FILM_SIMD > 0
+	_mm_storeu_ps(&pixel.col.R, _mm_add_ps(_mm_loadu_ps(&pixel.col.R), _mm_mul_ps(_mm_loadu_ps(col), _mm_set1_ps(wt))));
+#else
+	pixel.col.R += col[0] * wt;
+	pixel.col.G += col[1] * wt;
+	pixel.col.B += col[2] * wt;
+	pixel.col.A += col[3] * wt;
+#endif
+	pixel.weight += wt;
 }
 
 /* CAUTION! Implemantation of this function needs to be thread safe for samples that
@@ -925,14 +1218,14 @@ bool imageFilm_t::doMoreSamples(int x, int y) const
 	contributions from outside area a! (yes, really!) */
 void imageFilm_t::addSample(colorPasses_t &colorPasses, int x, int y, float dx, float dy, const renderArea_t *a, int numSample, int AA_pass_number, float inv_AA_max_possible_samples)
 {
-    const renderPasses_t * renderPasses = env->getRenderPasses();
-    
 	int dx0, dx1, dy0, dy1, x0, x1, y0, y1;
 
-	// get filter extent and make sure we don't leave image area:
+	// get filter extent and make sure we don't leave image area (or the view the sample belongs to):
+	const int vx0 = cx0 + viewOffset(viewOfColumn(x - cx0, 0));
+	const int vx1 = (numViews > 1) ? vx0 + viewWidth : cx1;
 
-	dx0 = std::max(cx0-x,   Round2Int( (double)dx - filterw));
-	dx1 = std::min(cx1-x-1, Round2Int( (double)dx + filterw - 1.0));
+	dx0 = std::max(vx0-x,   Round2Int( (double)dx - filterw));
+	dx1 = std::min(vx1-x-1, Round2Int( (double)dx + filterw - 1.0));
 	dy0 = std::max(cy0-y,   Round2Int( (double)dy - filterw));
 	dy1 = std::min(cy1-y-1, Round2Int( (double)dy + filterw - 1.0));
 
@@ -958,61 +1251,269 @@ void imageFilm_t::addSample(colorPasses_t &colorPasses, int x, int y, float dx,
 	x0 = x+dx0; x1 = x+dx1;
 	y0 = y+dy0; y1 = y+dy1;
 
-	imageMutex.lock();
-
-	for (int j = y0; j <= y1; ++j)
+	// filter weights of the footprint, row by row
+	const int fw = x1 - x0 + 1, fh = y1 - y0 + 1;
+	float filterWt[(MAX_FILTER_SIZE+1) * (MAX_FILTER_SIZE+1)];
+	for(int j = 0; j < fh; ++j)
 	{
-		for (int i = x0; i <= x1; ++i)
-		{
-			// get filter value at pixel (x,y)
-			int offset = yIndex[j-y0]*FILTER_TABLE_SIZE + xIndex[i-x0];
-			float filterWt = filterTable[offset];
-
-			// update pixel values with filtered sample contribution
-			for(size_t idx = 0; idx < imagePasses.size(); ++idx)
-			{
-				colorA_t col = colorPasses(renderPasses->intPassTypeFromExtPassIndex(idx));
-				
-				col.clampProportionalRGB(AA_clamp_samples);
+		const float *tableRow = filterTable + yIndex[j] * FILTER_TABLE_SIZE;
+		for(int i = 0; i < fw; ++i) filterWt[j * fw + i] = tableRow[xIndex[i]];
+	}
+	const float samplesWt = inv_AA_max_possible_samples / (fw * fh);
 
-				pixel_t &pixel = (*imagePasses[idx])(i - cx0, j - cy0);
+	// the sample colors are clamped and premultiplied once for all the pixels they are splatted to
+	float sampleCol[4 * PASS_INT_TOTAL_PASSES];
+	for(int colorIndex : planColors)
+	{
+		colorA_t col = colorPasses(colorIndex);
+		col.clampProportionalRGB(AA_clamp_samples);
+		if(premultAlpha) col.alphaPremultiply();
+		float *dst = sampleCol + 4 * colorIndex;
+		dst[0] = col.R; dst[1] = col.G; dst[2] = col.B; dst[3] = col.A;
+	}
 
-				if(premultAlpha) col.alphaPremultiply();
+	tileBuffer_t *tile = a ? a->accum : nullptr;
+	const size_t nImagePasses = imagePasses.size();
 
-				if(renderPasses->intPassTypeFromExtPassIndex(idx) == PASS_INT_AA_SAMPLES)
-				{
-					pixel.weight += inv_AA_max_possible_samples / ((x1-x0+1)*(y1-y0+1));
-				}
-				else
+	if(tile)
+	{
+		for(size_t idx = 0; idx < passPlan.size(); ++idx)
+		{
+			const passSlot_t &slot = passPlan[idx];
+			switch(slot.accumulate)
+			{
+				case ACCUMULATE_FILTERED:
 				{
-					pixel.col += (col * filterWt);
-					pixel.weight += filterWt;
+					const float *col = sampleCol + 4 * slot.colorIndex;
+					for(int j = 0; j < fh; ++j)
+					{
+						pixel_t *row = &(*tile)(idx, x0, y0 + j);
+						const float *rowWt = filterWt + j * fw;
+						for(int i = 0; i < fw; ++i) splatPixel(row[i], col, rowWt[i]);
+					}
+					break;
 				}
+				case ACCUMULATE_AA_SAMPLES:
+					for(int j = y0; j <= y1; ++j)
+					{
+						pixel_t *row = &(*tile)(idx, x0, j);
+						for(int i = 0; i < fw; ++i) row[i].weight += samplesWt;
+					}
+					break;
+				case ACCUMULATE_AA_NOISE: addNoiseMoments((*tile)(idx, x, y), colorPasses, premultAlpha, AA_clamp_samples); break;
+				case ACCUMULATE_RENDER_TIME: (*tile)(idx, x, y).weight += colorPasses(slot.colorIndex).R; break;	//milliseconds, summed up over all samples of the pixel
 			}
-			for(size_t idx = 0; idx < auxImagePasses.size(); ++idx)
-			{
-				colorA_t col = colorPasses(renderPasses->intPassTypeFromAuxPassIndex(idx));
-				
-				col.clampProportionalRGB(AA_clamp_samples);
-
-				pixel_t &pixel = (*auxImagePasses[idx])(i - cx0, j - cy0);
+		}
+		return;
+	}
 
-				if(premultAlpha) col.alphaPremultiply();
+	for (int j = y0; j <= y1; ++j)
+	{
+		std::lock_guard<std::mutex> lk(rowMutex[rowStripe(j - cy0)]);
+		preserveRow(j - cy0);
 
-				if(renderPasses->intPassTypeFromAuxPassIndex(idx) == PASS_INT_AA_SAMPLES)
-				{
-					pixel.weight += inv_AA_max_possible_samples / ((x1-x0+1)*(y1-y0+1));
-				}
-				else
+		for(size_t idx = 0; idx < passPlan.size(); ++idx)
+		{
+			const passSlot_t &slot = passPlan[idx];
+			passImage_t *pass = (idx < nImagePasses) ? imagePasses[idx] : auxImagePasses[idx - nImagePasses];
+			for (int i = x0; i <= x1; ++i)
+			{
+				pixel_t pixel;
+				switch(slot.accumulate)
 				{
-					pixel.col += (col * filterWt);
-					pixel.weight += filterWt;
+					case ACCUMULATE_FILTERED: splatPixel(pixel, sampleCol + 4 * slot.colorIndex, filterWt[(j - y0) * fw + i - x0]); break;
+					case ACCUMULATE_AA_SAMPLES: pixel.weight += samplesWt; break;
+					case ACCUMULATE_AA_NOISE: if(i == x && j == y) addNoiseMoments(pixel, colorPasses, premultAlpha, AA_clamp_samples); break;
+					case ACCUMULATE_RENDER_TIME: if(i == x && j == y) pixel.weight += colorPasses(slot.colorIndex).R; break;
 				}
+				pass->add(i - cx0, j - cy0, pixel);
 			}
 		}
 	}
+}
+
+void imageFilm_t::mergeArea(renderArea_t &a)
+{
+	tileBuffer_t *tile = a.accum;
+	if(!tile) return;
+	a.accum = nullptr;
+
+	const size_t nImagePasses = imagePasses.size();
+	const int tx1 = tile->x0 + tile->w;
+
+	auto mergeRow = [&](int y, int xBegin, int xEnd)
+	{
+		for(size_t idx = 0; idx < (size_t)tile->nPasses; ++idx)
+		{
+			passImage_t &img = (idx < nImagePasses) ? *imagePasses[idx] : *auxImagePasses[idx - nImagePasses];
+			for(int x = xBegin; x < xEnd; ++x) img.add(x - cx0, y - cy0, (*tile)(idx, x, y));
+		}
+	};
+
+	for(int y = tile->y0; y < tile->y0 + tile->h; ++y)
+	{
+		const int stripe = rowStripe(y - cy0);
+
+		// pixels of the safe area only get samples from inside a, the rest is shared with the neighbouring areas
+		int ix0 = tx1, ix1 = tx1;
+		if(y >= a.sy0 && y < a.sy1 && a.sx0 < a.sx1)
+		{
+			ix0 = a.sx0;
+			ix1 = a.sx1;
+		}
+
+		// the safe area goes without the row lock, unless the row still has to be copied to an autosave snapshot.
+		// Registering as writer first makes the snapshot copy wait for us if it started after our check
+		rowLockFreeWriters[stripe].fetch_add(1);
+		if(!rowNeedsSnapshot(y - cy0))
+		{
+			mergeRow(y, ix0, ix1);
+			rowLockFreeWriters[stripe].fetch_sub(1, std::memory_order_release);
+			std::lock_guard<std::mutex> lk(rowMutex[stripe]);
+			mergeRow(y, tile->x0, ix0);
+			mergeRow(y, ix1, tx1);
+		}
+		else
+		{
+			rowLockFreeWriters[stripe].fetch_sub(1, std::memory_order_release);
+			std::lock_guard<std::mutex> lk(rowMutex[stripe]);
+			preserveRow(y - cy0);
+			mergeRow(y, tile->x0, tx1);
+		}
+	}
+}
+
+void imageFilm_t::preserveRow(int y)
+{
+	if(rowNeedsSnapshot(y)) copyRowToSnapshot(y);
+}
+
+/*! The caller holds the rowMutex stripe of y, which keeps out the locked writers.
+	Safe area merges that passed their check before the snapshot started may still be writing
+	to rows of the stripe without it, they are only a row long so we wait for them */
+void imageFilm_t::copyRowToSnapshot(int y)
+{
+	if(snapshotRowCopied[y].load(std::memory_order_relaxed)) return;
+	const int stripe = rowStripe(y);
+	while(rowLockFreeWriters[stripe] > 0) std::this_thread::yield();
+
+	for(size_t idx = 0; idx < imagePasses.size(); ++idx)
+	{
+		for(int x = 0; x < w; ++x) snapshotPasses[idx]->set(x, y, (*imagePasses[idx])(x, y));
+	}
+	for(size_t idx = 0; idx < auxImagePasses.size(); ++idx)
+	{
+		for(int x = 0; x < w; ++x) snapshotAuxPasses[idx]->set(x, y, (*auxImagePasses[idx])(x, y));
+	}
+	snapshotRowCopied[y].store(true, std::memory_order_release);
+}
+
+/*! New w x h pass buffer, in a memory-mapped file added to mapped when the film is out of core.
+	If the file cannot be created the pass and all later ones are kept in RAM */
+passImage_t* imageFilm_t::newPass(std::vector<std::pair<passImage_t*, mappedFile_t*>> &mapped, int channels, bool halfPrecision)
+{
+	if(!outOfCoreDir.empty())
+	{
+		mappedFile_t *file = new mappedFile_t(outOfCoreDir, passImage_t::tiledStorageBytes(w, h, channels, IMAGE_FILM_MAPPED_TILE_BITS));
+		if(file->isMapped())
+		{
+			passImage_t *pass = new passImage_t(w, h, channels, halfPrecision, file->getData(), IMAGE_FILM_MAPPED_TILE_BITS);
+			mapped.push_back(std::make_pair(pass, file));
+			return pass;
+		}
+		delete file;
+		Y_WARNING << "imageFilm: cannot keep the film out of core, using RAM" << yendl;
+		outOfCoreDir.clear();
+	}
+	return new passImage_t(w, h, channels, halfPrecision);
+}
+
+void imageFilm_t::clearPass(passImage_t *pass)
+{
+	for(auto &mapped : mappedPasses)
+	{
+		if(mapped.first == pass)
+		{
+			mapped.second->zero();	//instead of writing zeros to every page
+			return;
+		}
+	}
+	pass->clear();
+}
+
+/*! Page out the tiles of the out of core passes overlapping the film area [x0, x1) x [y0, y1).
+	Tiles still being rendered only hold samples in the tile buffers of their threads, so paging them out costs nothing */
+void imageFilm_t::releaseArea(int x0, int y0, int x1, int y1)
+{
+	if(mappedPasses.empty()) return;
+
+	const int tileSide = 1 << IMAGE_FILM_MAPPED_TILE_BITS;
+	const int tx0 = std::max(x0, 0) / tileSide, ty0 = std::max(y0, 0) / tileSide;
+	const int tx1 = (std::min(x1, w) + tileSide - 1) / tileSide, ty1 = (std::min(y1, h) + tileSide - 1) / tileSide;
+	if(tx1 <= tx0 || ty1 <= ty0) return;
+
+	for(auto &mapped : mappedPasses)
+	{
+		//the tiles of a tile row follow each other in the file
+		for(int ty = ty0; ty < ty1; ++ty) mapped.second->release(mapped.first->getTile(tx0 * tileSide, ty * tileSide), (tx1 - tx0) * mapped.first->getTileBytes());
+	}
+}
+
+void imageFilm_t::releasePasses(const std::vector<std::pair<passImage_t*, mappedFile_t*>> &mapped)
+{
+	for(auto &pass : mapped) pass.second->releaseAll();
+}
+
+/*!	Takes a copy on write snapshot of the film and queues writing it to imagesOut and/or the film file.
+	Rows are copied by the threads merging into them or by the output thread, whichever comes first,
+	so the render threads never wait for the file writes.
+	\return false if the previous autosave is still in progress, nothing is queued then */
+bool imageFilm_t::queueAutoSave(int numView, colorOutput_t *imagesOut, bool saveFilm)
+{
+	if(!imagesOut && !saveFilm) return true;
+	if(autoSaveQueued) return false;
+
+	if(snapshotPasses.empty() && snapshotAuxPasses.empty())
+	{
+		for(auto pass : imagePasses) snapshotPasses.push_back(newPass(mappedSnapshotPasses, pass->getChannels(), pass->isHalf()));
+		for(auto pass : auxImagePasses) snapshotAuxPasses.push_back(newPass(mappedSnapshotPasses, pass->getChannels(), pass->isHalf()));
+		snapshotRowCopied = std::vector<std::atomic<bool>>(h);
+	}
+
+	for(int y = 0; y < h; ++y) snapshotRowCopied[y].store(false, std::memory_order_relaxed);
+	snapshotSamplingOffset = samplingOffset;
+	autoSaveQueued = true;
+	snapshotActive = true; //sequentially consistent, see mergeArea()
 
-	imageMutex.unlock();
+	outputQueue->push([=]
+	{
+		for(int y = 0; y < h; ++y)
+		{
+			std::lock_guard<std::mutex> lk(rowMutex[rowStripe(y)]);
+			copyRowToSnapshot(y);
+		}
+		snapshotActive = false;
+
+		if(imagesOut)
+		{
+			std::lock_guard<std::mutex> lk(outMutex);
+			//with the views side by side every view has its own images
+			if(numViews > 1) for(int view = 0; view < numViews; ++view) flushPasses(view, IF_ALL, imagesOut, snapshotPasses);
+			else flushPasses(numView, IF_ALL, imagesOut, snapshotPasses);
+		}
+
+		if(saveFilm)
+		{
+			filmSaveFromSnapshot = true;
+			imageFilmSave();
+			filmSaveFromSnapshot = false;
+		}
+
+		releasePasses(mappedSnapshotPasses);
+		autoSaveQueued = false;
+	});
+
+	return true;
 }
 
 void imageFilm_t::addDensitySample(const color_t& c, int x, int y, float dx, float dy, const renderArea_t *a)
@@ -1021,10 +1522,12 @@ void imageFilm_t::addDensitySample(const color_t& c, int x, int y, float dx, flo
 
 	int dx0, dx1, dy0, dy1, x0, x1, y0, y1;
 
-	// get filter extent and make sure we don't leave image area:
+	// get filter extent and make sure we don't leave image area (or the view the sample belongs to):
+	const int vx0 = cx0 + viewOffset(viewOfColumn(x - cx0, 0));
+	const int vx1 = (numViews > 1) ? vx0 + viewWidth : cx1;
 
-	dx0 = std::max(cx0-x,   Round2Int( (double)dx - filterw));
-	dx1 = std::min(cx1-x-1, Round2Int( (double)dx + filterw - 1.0));
+	dx0 = std::max(vx0-x,   Round2Int( (double)dx - filterw));
+	dx1 = std::min(vx1-x-1, Round2Int( (double)dx + filterw - 1.0));
 	dy0 = std::max(cy0-y,   Round2Int( (double)dy - filterw));
 	dy1 = std::min(cy1-y-1, Round2Int( (double)dy + filterw - 1.0));
 
@@ -1048,22 +1551,19 @@ void imageFilm_t::addDensitySample(const color_t& c, int x, int y, float dx, flo
 	x0 = x+dx0; x1 = x+dx1;
 	y0 = y+dy0; y1 = y+dy1;
 
-	densityImageMutex.lock();
-
+	//only the rows of the splat are locked, so the light paths of different threads rarely wait for each other
 	for (int j = y0; j <= y1; ++j)
 	{
+		const float *tableRow = filterTable + yIndex[j-y0]*FILTER_TABLE_SIZE;
+		std::lock_guard<std::mutex> lk(densityRowMutex[j % IMAGE_FILM_LOCK_STRIPES]);
 		for (int i = x0; i <= x1; ++i)
 		{
-			int offset = yIndex[j-y0]*FILTER_TABLE_SIZE + xIndex[i-x0];
-
 			color_t &pixel = (*densityImage)(i - cx0, j - cy0);
-			pixel += c * filterTable[offset];
+			pixel += c * tableRow[xIndex[i-x0]];
 		}
 	}
 
 	++numDensitySamples;
-
-	densityImageMutex.unlock();
 }
 
 void imageFilm_t::setDensityEstimation(bool enable)
@@ -1126,7 +1626,7 @@ void imageFilm_t::drawFontBitmap( FT_Bitmap* bitmap, int x, int y)
 	{
 		for ( j = y, q = 0; j < y_max; j++, q++ )
 		{
-			if ( i >= w || j >= h ) continue;
+			if ( i >= viewWidth || j >= h ) continue;
 
 			int tmpBuf = bitmap->buffer[q * bitmap->width + p];
 
@@ -1152,7 +1652,7 @@ void imageFilm_t::drawRenderSettings(std::stringstream & ss)
 
 	dpHeight = yafLog.getBadgeHeight();
 
-	dpimage = new rgba2DImage_nw_t(w, dpHeight);
+	dpimage = new rgba2DImage_nw_t(viewWidth, dpHeight);
 #ifdef HAVE_FREETYPE
 	FT_Library library;
 	FT_Face face;
@@ -1295,13 +1795,13 @@ void imageFilm_t::drawRenderSettings(std::stringstream & ss)
 	{
 		if(logo->getWidth() > 80 || logo->getHeight() > 45) Y_WARNING << "imageFilm: custom params badge logo is quite big (" << logo->getWidth() << " x " << logo->getHeight() << "). It could invade other areas in the badge. Please try to keep logo size smaller than 80 x 45, for example." << yendl;
 		int lx, ly;
-		int imWidth = std::min(logo->getWidth(), w);
+		int imWidth = std::min(logo->getWidth(), viewWidth);
 		int imHeight = std::min(logo->getHeight(), dpHeight);
 
 		for ( lx = 0; lx < imWidth; lx++ )
 			for ( ly = 0; ly < imHeight; ly++ )
-				if(yafLog.isParamsBadgeTop()) (*dpimage)(w-imWidth+lx, ly) = logo->getPixel(lx, ly);
-				else (*dpimage)(w-imWidth+lx, dpHeight-imHeight+ly) = logo->getPixel(lx, ly);
+				if(yafLog.isParamsBadgeTop()) (*dpimage)(viewWidth-imWidth+lx, ly) = logo->getPixel(lx, ly);
+				else (*dpimage)(viewWidth-imWidth+lx, dpHeight-imHeight+ly) = logo->getPixel(lx, ly);
 
 		delete logo;
 	}
@@ -1341,6 +1841,36 @@ bool imageFilm_t::imageFilmLoad(const std::string &filename)
 {
 	bool debugXMLformat = false;	//Enable only for debugging purposes
 
+	if(!debugXMLformat && filmFile_t::isFilmFile(filename))
+	{
+		//Chunked films are added straight into the passes, the sampling continues after the highest offsets loaded
+		Y_INFO << "imageFilm: Loading film from: \"" << filename << "\" in chunked binary (non portable) format" << yendl;
+		filmFile_t file;
+		if(!file.open(filename)) return false;
+
+		const filmFile_t::header_t &header = file.getHeader();
+		filmload_check.filmStructureVersion = header.filmStructureVersion;
+		filmload_check.w = header.w;
+		filmload_check.h = header.h;
+		filmload_check.cx0 = header.cx0;
+		filmload_check.cx1 = header.cx1;
+		filmload_check.cy0 = header.cy0;
+		filmload_check.cy1 = header.cy1;
+		filmload_check.numPasses = header.numPasses;
+		if(!imageFilmLoadCheckOk()) return false;
+
+		std::vector<passImage_t*> passes(imagePasses);
+		passes.insert(passes.end(), auxImagePasses.begin(), auxImagePasses.end());
+		if(!file.addTo(passes, env->getThreadPool())) return false;
+
+		samplingOffset = std::max(samplingOffset, header.samplingOffset);
+		baseSamplingOffset = std::max(baseSamplingOffset, header.baseSamplingOffset);
+		session.setStatusRenderResumed();
+		Y_DEBUG<<"FilmLoad computerNode="<<header.computerNode<<" baseSamplingOffset="<<header.baseSamplingOffset<<" samplingOffset="<<header.samplingOffset<<yendl;
+		Y_VERBOSE << "imageFilm: Film loaded from file." << yendl;
+		return true;
+	}
+
 	try
 	{
 		std::ifstream ifs(filename, std::fstream::binary);
@@ -1421,31 +1951,40 @@ void imageFilm_t::imageFilmLoadAllInFolder()
 
 		for(auto filmFile: filmFilesList)
 		{
-			imageFilm_t *loadedFilm = new imageFilm_t(w, h, cx0, cy0, *output, 1.0, BOX, env);
-			loadedFilm->imageFilmLoad(filmFile);
+			if(filmFile_t::isFilmFile(filmFile))
+			{
+				if(!imageFilmLoad(filmFile)) Y_WARNING << "imageFilm: skipping the film file \"" << filmFile << "\"" << yendl;
+				continue;
+			}
+
+			imageFilm_t *loadedFilm = new imageFilm_t(viewWidth, h, cx0, cy0, *output, 1.0, BOX, env, false, 32, imageSpliter_t::LINEAR, false, numViews);
+			if(!loadedFilm->imageFilmLoad(filmFile))
+			{
+				Y_WARNING << "imageFilm: skipping the film file \"" << filmFile << "\"" << yendl;
+				delete loadedFilm;
+				continue;
+			}
 			
 			for(size_t idx=0; idx<imagePasses.size(); ++idx)
 			{
-				for(int i=0; i<w; ++i)
+				for(int j=0; j<h; ++j)
 				{
-					for(int j=0; j<h; ++j)
+					for(int i=0; i<w; ++i)
 					{
-						rgba2DImage_t *loadedImageBuffer = loadedFilm->imagePasses[idx];
-						(*imagePasses[idx])(i,j).col += (*loadedImageBuffer)(i,j).col;
-						(*imagePasses[idx])(i,j).weight += (*loadedImageBuffer)(i,j).weight;
+						passImage_t *loadedImageBuffer = loadedFilm->imagePasses[idx];
+						imagePasses[idx]->add(i, j, (*loadedImageBuffer)(i,j));
 					}
 				}
 			}
 			
 			for(size_t idx=0; idx<auxImagePasses.size(); ++idx)
 			{
-				for(int i=0; i<w; ++i)
+				for(int j=0; j<h; ++j)
 				{
-					for(int j=0; j<h; ++j)
+					for(int i=0; i<w; ++i)
 					{
-						rgba2DImage_t *loadedImageBuffer = loadedFilm->auxImagePasses[idx];
-						(*auxImagePasses[idx])(i,j).col += (*loadedImageBuffer)(i,j).col;
-						(*auxImagePasses[idx])(i,j).weight += (*loadedImageBuffer)(i,j).weight;
+						passImage_t *loadedImageBuffer = loadedFilm->auxImagePasses[idx];
+						auxImagePasses[idx]->add(i, j, (*loadedImageBuffer)(i,j));
 					}
 				}
 			}
@@ -1475,8 +2014,9 @@ bool imageFilm_t::imageFilmSave()
 	Y_INFO << passString.str() << yendl;
 
 	std::string oldTag;
+	bool tagProgress = pbar && !outputQueue->inWorker();	//the progress bar belongs to the render thread
 
-	if(pbar)
+	if(tagProgress)
 	{
 		oldTag = pbar->getTag();
 		pbar->setTag(passString.str().c_str());
@@ -1486,25 +2026,67 @@ bool imageFilm_t::imageFilmSave()
 
 	try
 	{
-		std::ofstream ofs(filmPath+".tmp", std::fstream::binary);
-
 		if(debugXMLformat)
 		{
 			Y_INFO << "imageFilm: Saving film to: \"" << filmPath << "\" in XML format" << yendl;
+			std::ofstream ofs(filmPath+".tmp", std::fstream::binary);
 			boost::archive::xml_oarchive oa(ofs);
 			oa << BOOST_SERIALIZATION_NVP(*this);
 			ofs.close();
 		}
 		else if(filmFileSaveBinaryFormat)
 		{
-			Y_INFO << "imageFilm: Saving film to: \"" << filmPath << "\" in Binary (non portable) format" << yendl;
-			boost::archive::binary_oarchive oa(ofs);
-			oa << BOOST_SERIALIZATION_NVP(*this);
-			ofs.close();
+			Y_INFO << "imageFilm: Saving film to: \"" << filmPath << "\" in chunked binary (non portable) format" << yendl;
+			filmFile_t::header_t header = {};
+			std::strncpy(header.filmStructureVersion, FILM_STRUCTURE_VERSION, sizeof(header.filmStructureVersion) - 1);
+			header.w = w;
+			header.h = h;
+			header.cx0 = cx0;
+			header.cx1 = cx1;
+			header.cy0 = cy0;
+			header.cy1 = cy1;
+			header.numPasses = imagePasses.size();
+			header.numAuxPasses = auxImagePasses.size();
+			header.samplingOffset = filmSaveFromSnapshot ? snapshotSamplingOffset : samplingOffset;
+			header.baseSamplingOffset = baseSamplingOffset;
+			header.computerNode = computerNode;
+
+			//what the film merging needs to write the images like flush() does, without the scene
+			const renderPasses_t *renderPasses = env->getRenderPasses();
+			filmFile_t::params_t params;
+			for(int idx = 0; idx < renderPasses->extPassesSize(); ++idx)
+			{
+				params.push_back({ "pass_" + renderPasses->extPassTypeStringFromIndex(idx), renderPasses->intPassTypeStringFromType(renderPasses->intPassTypeFromExtPassIndex(idx)) });
+			}
+			params.push_back({ "views", std::to_string(numViews) });
+			for(int view = 0; view < numViews && numViews > 1 && view < (int) renderPasses->view_names.size(); ++view)
+			{
+				params.push_back({ "view_" + std::to_string(view), renderPasses->view_names[view] });
+			}
+			switch(colorSpace)
+			{
+				case SRGB: params.push_back({ "color_space", "sRGB" }); break;
+				case XYZ_D65: params.push_back({ "color_space", "XYZ" }); break;
+				case LINEAR_RGB: params.push_back({ "color_space", "LinearRGB" }); break;
+				default: params.push_back({ "color_space", "Raw_Manual_Gamma" }); break;
+			}
+			params.push_back({ "gamma", std::to_string(gamma) });
+			params.push_back({ "premult", premultAlpha ? "true" : "false" });
+
+			std::vector<const passImage_t*> passes;
+			for(auto pass : (filmSaveFromSnapshot ? snapshotPasses : imagePasses)) passes.push_back(pass);
+			for(auto pass : (filmSaveFromSnapshot ? snapshotAuxPasses : auxImagePasses)) passes.push_back(pass);
+			//autosaves run on the output thread while the render threads keep the pool busy
+			if(!filmFile_t::save(filmPath+".tmp", header, params, passes, filmFileSaveCompressed, env->getThreadPool(), outputQueue->inWorker() ? 1 : 0))
+			{
+				if(tagProgress) pbar->setTag(oldTag);
+				return false;
+			}
 		}
 		else
 		{
 			Y_INFO << "imageFilm: Saving film to: \"" << filmPath << "\" in Text format" << yendl;
+			std::ofstream ofs(filmPath+".tmp", std::fstream::binary);
 			boost::archive::text_oarchive oa(ofs);
 			oa << BOOST_SERIALIZATION_NVP(*this);
 			ofs.close();
@@ -1513,21 +2095,20 @@ bool imageFilm_t::imageFilmSave()
 	}
 	catch(std::exception& ex){
         Y_WARNING << "imageFilm: error '" << ex.what() << "' while saving ImageFilm file: '" << filmPath << "'" << yendl;
-		if(pbar) pbar->setTag(oldTag);
+		if(tagProgress) pbar->setTag(oldTag);
 		return false;
     }
     
 	try
 	{
-		boost::filesystem::copy_file(filmPath+".tmp", filmPath, boost::filesystem::copy_option::overwrite_if_exists);
-		boost::filesystem::remove(filmPath+".tmp");
+		boost::filesystem::rename(filmPath+".tmp", filmPath);
 	}
 	catch(const boost::filesystem::filesystem_error& e)
 	{
 		Y_WARNING << "imageFilm: file operation error \"" << e.what() << yendl;
 	}
 
-	if(pbar) pbar->setTag(oldTag);
+	if(tagProgress) pbar->setTag(oldTag);
 	
 	return true;
 }
@@ -1669,8 +2250,8 @@ void imageFilm_t::generateDebugFacesEdges(int numView, int idxPass, int xstart,
 	const float facesEdgeThreshold = renderPasses->facesEdgeThreshold;
 	const float facesEdgeSmoothness = renderPasses->facesEdgeSmoothness;
 
-    rgba2DImage_t * normalImagePass = getImagePassFromIntPassType(PASS_INT_NORMAL_GEOM);
-    rgba2DImage_t * zDepthImagePass = getImagePassFromIntPassType(PASS_INT_Z_DEPTH_NORM);
+    passImage_t * normalImagePass = getImagePassFromIntPassType(PASS_INT_NORMAL_GEOM);
+    passImage_t * zDepthImagePass = getImagePassFromIntPassType(PASS_INT_Z_DEPTH_NORM);
 
 	if(normalImagePass && zDepthImagePass)
 	{
@@ -1701,8 +2282,8 @@ void imageFilm_t::generateDebugFacesEdges(int numView, int idxPass, int xstart,
 
 				if(drawborder && (i <= xstart+1 || j <= ystart+1 || i >= width-1-1 || j >= height-1-1)) colEdge = colorA_t(0.5f,0.f,0.f,1.f);
 
-				if(out1) out1->putPixel(numView, i, j+out1displacement, renderPasses, idxPass, colEdge);
-				if(out2) out2->putPixel(numView, i, j+out2displacement, renderPasses, idxPass, colEdge);
+				if(out1) out1->putPixel(numView, i-viewOffset(numView), j+out1displacement, renderPasses, idxPass, colEdge);
+				if(out2) out2->putPixel(numView, i-viewOffset(numView), j+out2displacement, renderPasses, idxPass, colEdge);
 			}
 		}
 	}
@@ -1719,8 +2300,8 @@ void imageFilm_t::generateToonAndDebugObjectEdges(int numView, int idxPass, int
 	const float objectEdgeThreshold = renderPasses->objectEdgeThreshold;
 	const float objectEdgeSmoothness = renderPasses->objectEdgeSmoothness;
 	
-    rgba2DImage_t * normalImagePass = getImagePassFromIntPassType(PASS_INT_NORMAL_SMOOTH);
-    rgba2DImage_t * zDepthImagePass = getImagePassFromIntPassType(PASS_INT_Z_DEPTH_NORM);
+    passImage_t * normalImagePass = getImagePassFromIntPassType(PASS_INT_NORMAL_SMOOTH);
+    passImage_t * zDepthImagePass = getImagePassFromIntPassType(PASS_INT_Z_DEPTH_NORM);
 	
 	if(normalImagePass && zDepthImagePass)
 	{
@@ -1786,8 +2367,8 @@ void imageFilm_t::generateToonAndDebugObjectEdges(int numView, int idxPass, int
 
 				if(drawborder && (i <= xstart+1 || j <= ystart+1 || i >= width-1-1 || j >= height-1-1)) colEdge = colorA_t(0.5f,0.f,0.f,1.f);
 				
-				if(out1) out1->putPixel(numView, i, j+out1displacement, renderPasses, idxPass, colEdge);
-				if(out2) out2->putPixel(numView, i, j+out2displacement, renderPasses, idxPass, colEdge);
+				if(out1) out1->putPixel(numView, i-viewOffset(numView), j+out1displacement, renderPasses, idxPass, colEdge);
+				if(out2) out2->putPixel(numView, i-viewOffset(numView), j+out2displacement, renderPasses, idxPass, colEdge);
 				
 				color_t colToon(imageMatCombinedVec(j, i)[2], imageMatCombinedVec(j, i)[1], imageMatCombinedVec(j, i)[0]);
 				colToon.blend(toonEdgeColor, edgeValue);
@@ -1799,12 +2380,12 @@ void imageFilm_t::generateToonAndDebugObjectEdges(int numView, int idxPass, int
 					if(out1)
 					{
 						colToon.ColorSpace_from_linearRGB(colorSpace, gamma);
-						out1->putPixel(numView, i, j+out1displacement, renderPasses, idxToon, colToon);
+						out1->putPixel(numView, i-viewOffset(numView), j+out1displacement, renderPasses, idxToon, colToon);
 					}
 					if(out2)
 					{
 						colToon.ColorSpace_from_linearRGB(colorSpace2, gamma2);
-						out2->putPixel(numView, i, j+out2displacement, renderPasses, idxToon, colToon);
+						out2->putPixel(numView, i-viewOffset(numView), j+out2displacement, renderPasses, idxToon, colToon);
 					}
 				}
 			}
@@ -1821,7 +2402,7 @@ void imageFilm_t::generateDebugFacesEdges(int numView, int idxPass, int xstart,
 #endif
 
 
-rgba2DImage_t * imageFilm_t::getImagePassFromIntPassType(int intPassType)
+passImage_t * imageFilm_t::getImagePassFromIntPassType(int intPassType)
 {
     for(size_t idx = 1; idx < imagePasses.size(); ++idx)
 	{
@@ -9,89 +9,57 @@ __BEGIN_YAFRAY
 // shuffling would of course be easy, but i don't find that too usefull really,
 // it does maximum damage to the coherency gain and visual feedback is medicore too
 
-imageSpliter_t::imageSpliter_t(int w, int h, int x0,int y0, int bsize, tilesOrderType torder, int nthreads): blocksize(bsize), tilesorder(torder)
+imageSpliter_t::imageSpliter_t(int w, int h, int x0,int y0, int bw, int bh, tilesOrderType torder, int views): width(w), height(h), blocksize(bw), tilesorder(torder)
 {
 	int nx, ny;
-	nx = (w+blocksize-1)/blocksize;
-	ny = (h+blocksize-1)/blocksize;
-
-	std::vector<region_t> regions_raw;
+	nx = (w+bw-1)/bw;
+	ny = (h+bh-1)/bh;
 
 	for(int j=0; j<ny; ++j)
 	{
 		for(int i=0; i<nx; ++i)
 		{
 			region_t r;
-			r.x = x0 + i*blocksize;
-			r.y = y0 + j*blocksize;
-			r.w = std::min(blocksize, x0+w-r.x);
-			r.h = std::min(blocksize, y0+h-r.y);
-			regions_raw.push_back(r);
+			r.x = x0 + i*bw;
+			r.y = y0 + j*bh;
+			r.w = std::min(bw, x0+w-r.x);
+			r.h = std::min(bh, y0+h-r.y);
+			regions.push_back(r);
 		}
 	}
 
+	// the last tiles of a pass are no longer subdivided here, tileScheduler_t splits them when the threads run out of work
 	switch(tilesorder)
 	{
-		case RANDOM:		std::random_shuffle( regions_raw.begin(), regions_raw.end() );
+		case RANDOM:		std::random_shuffle( regions.begin(), regions.end() );
+							break;
 		case CENTRE_RANDOM:	std::random_shuffle( regions.begin(), regions.end() );
 							std::sort( regions.begin(), regions.end(), imageSpliterCentreSorter_t(w, h, x0, y0) );
-		case LINEAR:		break;
+							break;				
+		case LINEAR: 		break;
 		default:			break;
 	}
 
-	std::vector<region_t> regions_subdivided;
-
-	for(size_t rn=0; rn<regions_raw.size(); ++rn)
+	if(views > 1)
 	{
-		if(nthreads == 1 || blocksize <= 4 || rn<regions_raw.size()-2*nthreads)	//If blocksize is more than 4, resubdivide the last (2 x nunber of threads) so their block size is progressively smaller (better CPU/thread usage in the last tiles to avoid/mitigate having one big tile at the end with only 1 CPU thread)
-		{
-			regions.push_back(regions_raw[rn]);
-		}
-		else
+		std::vector<region_t> viewRegions;
+		viewRegions.reserve(regions.size() * views);
+		for(const region_t &r : regions)
 		{
-			int blocksize2 = blocksize;
-			if(rn>regions_raw.size()-nthreads) blocksize2 = std::max(4, blocksize / 4);
-			else if(rn<=regions_raw.size()-nthreads) blocksize2 = std::max(4, blocksize / 2);
-			int nx2, ny2;
-			nx2 = (regions_raw[rn].w+blocksize2-1)/blocksize2;
-			ny2 = (regions_raw[rn].h+blocksize2-1)/blocksize2;
-
-			for(int j=0; j<ny2; ++j)
+			for(int v=0; v<views; ++v)
 			{
-				for(int i=0; i<nx2; ++i)
-				{
-					region_t r;
-					r.x = regions_raw[rn].x + i*blocksize2;
-					r.y = regions_raw[rn].y + j*blocksize2;
-					r.w = std::min(blocksize2, regions_raw[rn].x+regions_raw[rn].w-r.x);
-					r.h = std::min(blocksize2, regions_raw[rn].y+regions_raw[rn].h-r.y);
-					regions_subdivided.push_back(r);
-				}
+				viewRegions.push_back(r);
+				viewRegions.back().x += v*w;
 			}
 		}
+		regions.swap(viewRegions);
 	}
-
-	switch(tilesorder)
-	{
-		case RANDOM:		std::random_shuffle( regions.begin(), regions.end() );
-							std::random_shuffle( regions_subdivided.begin(), regions_subdivided.end() );
-							break;
-		case CENTRE_RANDOM:	std::random_shuffle( regions.begin(), regions.end() );
-							std::sort( regions.begin(), regions.end(), imageSpliterCentreSorter_t(w, h, x0, y0) );
-							std::random_shuffle( regions_subdivided.begin(), regions_subdivided.end() );
-							std::sort( regions_subdivided.begin(), regions_subdivided.end(), imageSpliterCentreSorter_t(w, h, x0, y0) );
-							break;				
-		case LINEAR: 		break;
-		default:			break;
-	}
-
-	regions.insert(regions.end(), regions_subdivided.begin(), regions_subdivided.end());
 }
 
-bool imageSpliter_t::getArea(int n, renderArea_t &area)
+bool imageSpliter_t::getArea(int n, renderArea_t &area) const
 {
 	if(n<0 || n>=(int)regions.size()) return false;
-	region_t &r = regions[n];
+	const region_t &r = regions[n];
 	area.X = r.x;
 	area.Y = r.y;
 	area.W = r.w;
@@ -99,4 +67,106 @@ bool imageSpliter_t::getArea(int n, renderArea_t &area)
 	return true;
 }
 
+void tileScheduler_t::reset(const imageSpliter_t &splitter, int threads, int minTileSize)
+{
+	nThreads = std::max(1, threads);
+	minSize = std::max(1, minTileSize);
+	if((int)queues.size() != nThreads)
+	{
+		queues.clear();
+		for(int i=0; i<nThreads; ++i) queues.emplace_back(new queue_t);
+	}
+	for(int i=0; i<nThreads; ++i)
+	{
+		queues[i]->tiles.clear();
+		queues[i]->count = 0;
+	}
+	// round robin keeps the tiles handed out at the same time close to the order of the splitter
+	renderArea_t area;
+	for(int n=0; splitter.getArea(n, area); ++n)
+	{
+		queue_t &q = *queues[n % nThreads];
+		q.tiles.push_back({area.X, area.Y, area.W, area.H});
+		++q.count;
+	}
+	remaining = splitter.size();
+}
+
+bool tileScheduler_t::take(int threadID, tile_t &t)
+{
+	queue_t &q = *queues[threadID];
+	std::lock_guard<std::mutex> lk(q.m);
+	if(q.tiles.empty()) return false;
+	t = q.tiles.front();
+	q.tiles.pop_front();
+	--q.count;
+	--remaining;
+	return true;
+}
+
+bool tileScheduler_t::steal(int threadID, tile_t &t)
+{
+	// every other queue is tried once at most, so we never spin on queues other threads are emptying
+	std::vector<bool> tried(nThreads, false);
+	for(int attempt=1; attempt<nThreads && remaining > 0; ++attempt)
+	{
+		// the fullest queue is the one least likely to run empty while we lock it
+		int victim = -1, most = 0;
+		for(int i=1; i<nThreads; ++i)
+		{
+			int v = (threadID + i) % nThreads;
+			int c = queues[v]->count;
+			if(!tried[v] && c > most) { most = c; victim = v; }
+		}
+		if(victim < 0) return false;
+		tried[victim] = true;
+		queue_t &q = *queues[victim];
+		std::lock_guard<std::mutex> lk(q.m);
+		if(q.tiles.empty()) continue;
+		t = q.tiles.back();
+		q.tiles.pop_back();
+		--q.count;
+		--remaining;
+		return true;
+	}
+	return false;
+}
+
+void tileScheduler_t::split(int threadID, tile_t &t)
+{
+	int nx = (t.w >= 2*minSize) ? 2 : 1;
+	int ny = (t.h >= 2*minSize) ? 2 : 1;
+	if(nx*ny == 1) return;
+	int w0 = t.w / nx, h0 = t.h / ny;
+	queue_t &q = *queues[threadID];
+	std::lock_guard<std::mutex> lk(q.m);
+	// keep the first sub-tile, the others go to the back of our queue where idle threads steal from
+	for(int j=0; j<ny; ++j)
+	{
+		for(int i=0; i<nx; ++i)
+		{
+			if(i == 0 && j == 0) continue;
+			tile_t s = { t.x + i*w0, t.y + j*h0, (i == nx-1) ? t.w - i*w0 : w0, (j == ny-1) ? t.h - j*h0 : h0 };
+			q.tiles.push_back(s);
+			++q.count;
+			++remaining;
+		}
+	}
+	t.w = w0;
+	t.h = h0;
+}
+
+bool tileScheduler_t::nextArea(int threadID, renderArea_t &area)
+{
+	if(threadID < 0 || threadID >= nThreads) threadID = 0;
+	tile_t t;
+	if(!take(threadID, t) && !steal(threadID, t)) return false;
+	if(nThreads > 1 && remaining < nThreads) split(threadID, t);
+	area.X = t.x;
+	area.Y = t.y;
+	area.W = t.w;
+	area.H = t.h;
+	return true;
+}
+
 __END_YAFRAY
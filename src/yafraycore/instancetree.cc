@@ -0,0 +1,340 @@
+/****************************************************************************
+ * 			instancetree.cc: two level acceleration structure for instances
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <yafraycore/instancetree.h>
+#include <yafraycore/kdtree.h>
+#include <yafraycore/bvh.h>
+#include <yafraycore/timer.h>
+#include <algorithm>
+
+__BEGIN_YAFRAY
+
+#define INST_MAX_LEAF 2
+#define INST_MAX_STACK 64
+
+const instanceBlas_t *triBlasCache_t::get(triangleObject_t *obj, bool useBvh, int leafSize, float costRatio, float emptyBonus,
+	int numThreads, threadPool_t *pool, bool &built)
+{
+	built = false;
+	auto b = blasList.find(obj);
+	if(b != blasList.end())
+	{
+		const instanceBlas_t *blas = b->second;
+		if(useBvh && blas->bvh) return blas;
+		if(!useBvh && blas->tree && blas->leafSize == leafSize && blas->costRatio == costRatio && blas->emptyBonus == emptyBonus) return blas;
+		remove(obj);
+	}
+
+	int nprims = obj->numPrimitives();
+	const triangle_t **tris = new const triangle_t*[nprims];
+	obj->getPrimitives(tris);
+	instanceBlas_t *blas = new instanceBlas_t();
+	if(useBvh)
+	{
+		blas->bvh = new bvhTree_t<triangle_t>(tris, nprims);
+		blas->bound = blas->bvh->getBound();
+	}
+	else
+	{
+		blas->tree = new triKdTree_t(tris, nprims, -1, leafSize, costRatio, emptyBonus, numThreads, pool);
+		blas->bound = blas->tree->getBound();
+		blas->leafSize = leafSize;
+		blas->costRatio = costRatio;
+		blas->emptyBonus = emptyBonus;
+	}
+	delete [] tris;
+	blasList[obj] = blas;
+	built = true;
+	return blas;
+}
+
+void triBlasCache_t::remove(const triangleObject_t *obj)
+{
+	auto b = blasList.find(obj);
+	if(b == blasList.end()) return;
+	if(b->second->tree) delete b->second->tree;
+	if(b->second->bvh) delete b->second->bvh;
+	delete b->second;
+	blasList.erase(b);
+}
+
+void triBlasCache_t::clear()
+{
+	for(auto i=blasList.begin(); i!=blasList.end(); ++i)
+	{
+		if(i->second->tree) delete i->second->tree;
+		if(i->second->bvh) delete i->second->bvh;
+		delete i->second;
+	}
+	blasList.clear();
+}
+
+triInstanceTree_t::triInstanceTree_t(const std::vector<const triangleObjectInstance_t *> &instances, const std::vector<triangleObject_t *> &objects,
+	triBlasCache_t &blasCache, bool useBvh, int leafSize, float costRatio, float emptyBonus, int numThreads, threadPool_t *pool)
+{
+	Y_INFO << "Instances: Starting build (" << instances.size() << " instances, " << objects.size() << " meshes)" << yendl;
+	gTimer.addEvent("instances");
+	gTimer.start("instances");
+
+	size_t instancedPrims = 0;
+	int nBuilt = 0;
+	records.reserve(instances.size() + objects.size());
+
+	for(size_t i=0; i<instances.size(); ++i)
+	{
+		const triangleObjectInstance_t *inst = instances[i];
+		triangleObject_t *base = inst->getBase();
+		int nprims = base->numPrimitives();
+		if(nprims <= 0) continue;
+
+		instanceRecord_t rec;
+		rec.obj = inst;
+		rec.transformed = true;
+		rec.worldToObj = inst->getObjToWorld();
+		rec.worldToObj.inverse();
+		if(rec.worldToObj.invalid())
+		{
+			Y_WARNING << "Instances: Instance transform is not invertible, skipping instance" << yendl;
+			continue;
+		}
+
+		// bottom level tree, built once per base mesh in its object space
+		bool built;
+		rec.blas = blasCache.get(base, useBvh, leafSize, costRatio, emptyBonus, numThreads, pool, built);
+		if(built) ++nBuilt;
+
+		// world space bound from the transformed corners of the object space bound
+		const bound_t &ob = rec.blas->bound;
+		const matrix4x4_t &m = inst->getObjToWorld();
+		for(int c=0; c<8; ++c)
+		{
+			point3d_t p((c & 1) ? ob.g.x : ob.a.x, (c & 2) ? ob.g.y : ob.a.y, (c & 4) ? ob.g.z : ob.a.z);
+			p = m * p;
+			if(c == 0) rec.bound.set(p, p);
+			else rec.bound.include(p);
+		}
+
+		instancedPrims += nprims;
+		records.push_back(rec);
+	}
+
+	// untransformed meshes, each with its own bottom level tree
+	for(size_t i=0; i<objects.size(); ++i)
+	{
+		if(objects[i]->numPrimitives() <= 0) continue;
+		instanceRecord_t rec;
+		rec.obj = objects[i];
+		rec.transformed = false;
+		bool built;
+		rec.blas = blasCache.get(objects[i], useBvh, leafSize, costRatio, emptyBonus, numThreads, pool, built);
+		if(built) ++nBuilt;
+		rec.bound = rec.blas->bound;
+		records.push_back(rec);
+	}
+
+	if(!records.empty())
+	{
+		nodes.reserve(2 * records.size());
+		buildNode(0, records.size());
+		treeBound = nodes[0].bound;
+	}
+
+	gTimer.stop("instances");
+	Y_VERBOSE << "Instances: Stats (" << gTimer.getTime("instances") << "s)" << yendl;
+	Y_VERBOSE << "Instances: " << records.size() << " records, top level nodes: " << nodes.size()
+		<< ", instanced triangles: " << instancedPrims << yendl;
+	Y_VERBOSE << "Instances: Bottom level trees built: " << nBuilt << ", kept from previous updates: " << blasCache.size() - nBuilt << yendl;
+}
+
+/*! top level build, median split along the largest extent of the instance centers */
+u_int32 triInstanceTree_t::buildNode(u_int32 first, u_int32 count)
+{
+	u_int32 idx = nodes.size();
+	nodes.push_back(instanceNode_t());
+
+	bound_t bound = records[first].bound;
+	bound_t centers(records[first].bound.center(), records[first].bound.center());
+	for(u_int32 i=first+1; i<first+count; ++i)
+	{
+		bound = bound_t(bound, records[i].bound);
+		centers.include(records[i].bound.center());
+	}
+	nodes[idx].bound = bound;
+
+	if(count <= INST_MAX_LEAF)
+	{
+		nodes[idx].first = first;
+		nodes[idx].count = count;
+		nodes[idx].rightChild = 0;
+		return idx;
+	}
+
+	int axis = centers.largestAxis();
+	u_int32 half = count / 2;
+	std::nth_element(records.begin() + first, records.begin() + first + half, records.begin() + first + count,
+		[axis](const instanceRecord_t &a, const instanceRecord_t &b) { return a.bound.center()[axis] < b.bound.center()[axis]; });
+
+	nodes[idx].first = 0;
+	nodes[idx].count = 0;
+	buildNode(first, half);
+	u_int32 right = buildNode(first + half, count - half);
+	nodes[idx].rightChild = right;
+	return idx;
+}
+
+inline const ray_t &triInstanceTree_t::transformRay(const instanceRecord_t &rec, const ray_t &ray, ray_t &localRay) const
+{
+	if(!rec.transformed) return ray;
+	localRay = ray;
+	localRay.from = rec.worldToObj * ray.from;
+	localRay.dir = rec.worldToObj * ray.dir;
+	return localRay;
+}
+
+bool triInstanceTree_t::Intersect(const ray_t &ray, float dist, const triangle_t **tr, const triangleObjectInstance_t **inst, float &Z, intersectData_t &data) const
+{
+	Z = dist;
+	if(nodes.empty()) return false;
+
+	bool hit = false;
+	u_int32 stack[INST_MAX_STACK];
+	int stackPtr = 0;
+	stack[stackPtr++] = 0;
+	ray_t localRay;
+
+	while(stackPtr > 0)
+	{
+		u_int32 cur = stack[--stackPtr];
+		const instanceNode_t &node = nodes[cur];
+		float a, b;
+		if(!node.bound.cross(ray, a, b, Z)) continue;
+		if(node.count == 0)
+		{
+			stack[stackPtr++] = node.rightChild;
+			stack[stackPtr++] = cur + 1;
+			continue;
+		}
+		for(u_int32 i=node.first; i<node.first+node.count; ++i)
+		{
+			const instanceRecord_t &rec = records[i];
+			const ray_t &r = transformRay(rec, ray, localRay);
+			triangle_t *hitt = nullptr;
+			intersectData_t tempData;
+			float z;
+			bool h;
+			if(rec.blas->bvh) h = rec.blas->bvh->Intersect(r, Z, &hitt, z, tempData);
+			else h = rec.blas->tree->Intersect(r, Z, &hitt, z, tempData);
+			if(h && z < Z)
+			{
+				Z = z;
+				*tr = hitt;
+				*inst = instanceOf(rec);
+				data = tempData;
+				hit = true;
+			}
+		}
+	}
+
+	return hit;
+}
+
+bool triInstanceTree_t::IntersectS(const ray_t &ray, float dist, const triangle_t **tr, const triangleObjectInstance_t **inst, float shadow_bias) const
+{
+	if(nodes.empty()) return false;
+
+	u_int32 stack[INST_MAX_STACK];
+	int stackPtr = 0;
+	stack[stackPtr++] = 0;
+	ray_t localRay;
+
+	while(stackPtr > 0)
+	{
+		u_int32 cur = stack[--stackPtr];
+		const instanceNode_t &node = nodes[cur];
+		float a, b;
+		if(!node.bound.cross(ray, a, b, dist)) continue;
+		if(node.count == 0)
+		{
+			stack[stackPtr++] = node.rightChild;
+			stack[stackPtr++] = cur + 1;
+			continue;
+		}
+		for(u_int32 i=node.first; i<node.first+node.count; ++i)
+		{
+			const instanceRecord_t &rec = records[i];
+			const ray_t &r = transformRay(rec, ray, localRay);
+			triangle_t *hitt = nullptr;
+			bool h;
+			if(rec.blas->bvh) h = rec.blas->bvh->IntersectS(r, dist, &hitt, shadow_bias);
+			else h = rec.blas->tree->IntersectS(r, dist, &hitt, shadow_bias);
+			if(h)
+			{
+				*tr = hitt;
+				*inst = instanceOf(rec);
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool triInstanceTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, const triangle_t **tr, const triangleObjectInstance_t **inst, color_t &filt, float shadow_bias) const
+{
+	if(nodes.empty()) return false;
+
+	u_int32 stack[INST_MAX_STACK];
+	int stackPtr = 0;
+	stack[stackPtr++] = 0;
+	ray_t localRay;
+
+	while(stackPtr > 0)
+	{
+		u_int32 cur = stack[--stackPtr];
+		const instanceNode_t &node = nodes[cur];
+		float a, b;
+		if(!node.bound.cross(ray, a, b, dist)) continue;
+		if(node.count == 0)
+		{
+			stack[stackPtr++] = node.rightChild;
+			stack[stackPtr++] = cur + 1;
+			continue;
+		}
+		for(u_int32 i=node.first; i<node.first+node.count; ++i)
+		{
+			const instanceRecord_t &rec = records[i];
+			const ray_t &r = transformRay(rec, ray, localRay);
+			triangle_t *hitt = nullptr;
+			bool h;
+			//the materials are evaluated back in world space
+			if(rec.blas->bvh) h = rec.blas->bvh->IntersectTS(state, r, maxDepth, dist, &hitt, filt, shadow_bias, instanceOf(rec));
+			else h = rec.blas->tree->IntersectTS(state, r, maxDepth, dist, &hitt, filt, shadow_bias, instanceOf(rec));
+			if(hitt)
+			{
+				*tr = hitt;
+				*inst = instanceOf(rec);
+			}
+			if(h) return true;
+		}
+	}
+
+	return false;
+}
+
+__END_YAFRAY
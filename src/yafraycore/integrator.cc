@@ -26,6 +26,8 @@
 #include <yafraycore/timer.h>
 #include <yafraycore/scr_halton.h>
 #include <yafraycore/spectrum.h>
+#include <yafraycore/threadpool.h>
+#include <yafraycore/kdtree.h>
 
 #include <core_api/tiledintegrator.h>
 #include <core_api/imagefilm.h>
@@ -38,10 +40,17 @@
 #include <boost/filesystem.hpp>
 
 #include <sstream>
+#include <chrono>
 #include <boost/filesystem.hpp>
 
 __BEGIN_YAFRAY
 
+int surfaceIntegrator_t::clampShadowDepth(int shadowDepth)
+{
+	if(shadowDepth <= KD_MAX_SHADOW_HITS) return shadowDepth;
+	Y_WARNING << "Integrator: Transparent shadow depth " << shadowDepth << " is above the maximum of " << KD_MAX_SHADOW_HITS << ", using " << KD_MAX_SHADOW_HITS << yendl;
+	return KD_MAX_SHADOW_HITS;
+}
 
 std::vector<int> tiledIntegrator_t::correlativeSampleNumber(0);
 
@@ -49,11 +58,12 @@ void tiledIntegrator_t::renderWorker(int mNumView, tiledIntegrator_t *integrator
 {
 	renderArea_t a;
 
-	while(imageFilm->nextArea(mNumView, a))
+	while(imageFilm->nextArea(mNumView, a, threadID))
 	{
 		if(scene->getSignals() & Y_SIG_ABORT) break;
 		integrator->preTile(a, samples, offset, adaptive, threadID);
 		integrator->renderTile(mNumView, a, samples, offset, adaptive, threadID, AA_pass);
+		imageFilm->mergeArea(a);
 		
 		std::unique_lock<std::mutex> lk(control->m);
 		control->areas.push_back(a);
@@ -82,33 +92,39 @@ void tiledIntegrator_t::preTile(renderArea_t &a, int n_samples, int offset, bool
 
 void tiledIntegrator_t::precalcDepths()
 {
-	const camera_t* camera = scene->getCamera();
+	//views rendered side by side share one normalization, so the depth passes match across the views
+	const int numViews = imageFilm ? imageFilm->getNumViews() : 1;
 
-	if(camera->getFarClip() > -1)
-    {
-        minDepth = camera->getNearClip();
-        maxDepth = camera->getFarClip();
-    }
-    else
-    {
-        diffRay_t ray;
-        // We sample the scene at render resolution to get the precision required for AA
-        int w = camera->resX();
-        int h = camera->resY();
-        float wt = 0.f; // Dummy variable
-        surfacePoint_t sp;
-        for(int i=0; i<h; ++i)
-        {
-            for(int j=0; j<w; ++j)
-            {
-                ray.tmax = -1.f;
-                ray = camera->shootRay(i, j, 0.5f, 0.5f, wt);
-                scene->intersect(ray, sp);
-                if(ray.tmax > maxDepth) maxDepth = ray.tmax;
-                if(ray.tmax < minDepth && ray.tmax >= 0.f) minDepth = ray.tmax;
-            }
-        }
-    }
+	for(int view = 0; view < numViews; ++view)
+	{
+		const camera_t* camera = scene->getViewCamera(view);
+
+		if(camera->getFarClip() > -1)
+		{
+			if(view == 0 || camera->getNearClip() < minDepth) minDepth = camera->getNearClip();
+			if(view == 0 || camera->getFarClip() > maxDepth) maxDepth = camera->getFarClip();
+		}
+		else
+		{
+			diffRay_t ray;
+			// We sample the scene at render resolution to get the precision required for AA
+			int w = camera->resX();
+			int h = camera->resY();
+			float wt = 0.f; // Dummy variable
+			surfacePoint_t sp;
+			for(int i=0; i<h; ++i)
+			{
+				for(int j=0; j<w; ++j)
+				{
+					ray.tmax = -1.f;
+					ray = camera->shootRay(i, j, 0.5f, 0.5f, wt);
+					scene->intersect(ray, sp);
+					if(ray.tmax > maxDepth) maxDepth = ray.tmax;
+					if(ray.tmax < minDepth && ray.tmax >= 0.f) minDepth = ray.tmax;
+				}
+			}
+		}
+	}
 	// we use the inverse multiplicative of the value aquired
 	if(maxDepth > 0.f) maxDepth = 1.f / (maxDepth - minDepth);
 }
@@ -118,6 +134,26 @@ bool tiledIntegrator_t::render(int numView, imageFilm_t *image)
 	std::stringstream passString;
 	imageFilm = image;
 	scene->getAAParameters(AA_samples, AA_passes, AA_inc_samples, AA_threshold, AA_resampled_floor, AA_sample_multiplier_factor, AA_light_sample_multiplier_factor, AA_indirect_sample_multiplier_factor, AA_detect_color_noise, AA_dark_detection_type, AA_dark_threshold_factor, AA_variance_edge_size, AA_variance_pixels, AA_clamp_samples, AA_clamp_indirect);
+
+	bool progressive = false;
+	float progressiveTime = 0.f;
+	int progressiveSamples = 0;
+	scene->getProgressiveParameters(progressive, progressiveTime, progressiveSamples);
+
+	if(progressive)
+	{
+		// a progressive render is an AA pass per sample over the whole frame without adaptive resampling,
+		// so it takes the same samples as a tiled render with AA_samples=1, AA_inc_samples=1 and as many passes
+		if(progressiveSamples <= 0) progressiveSamples = AA_samples + std::max(0, AA_passes-1) * AA_inc_samples;
+		AA_samples = 1;
+		AA_passes = progressiveSamples;
+		AA_inc_samples = 1;
+		AA_threshold = 0.f;
+		AA_sample_multiplier_factor = 1.f;
+		AA_light_sample_multiplier_factor = 1.f;
+		AA_indirect_sample_multiplier_factor = 1.f;
+		Y_PARAMS << integratorName << ": Progressive render, up to " << progressiveSamples << " samples per pixel" << (progressiveTime > 0.f ? " or " + std::to_string(progressiveTime) + "s" : "") << yendl;
+	}
 	
 	std::stringstream aaSettings;
 	aaSettings << " passes=" << AA_passes;
@@ -126,6 +162,8 @@ bool tiledIntegrator_t::render(int numView, imageFilm_t *image)
 	if(AA_dark_detection_type == DARK_DETECTION_LINEAR) aaSettings << " AA thr(lin)=" << AA_threshold << ",dark_fac=" << AA_dark_threshold_factor;
 	else if(AA_dark_detection_type == DARK_DETECTION_CURVE) aaSettings << " AA.thr(curve)";
 	else aaSettings << " AA thr=" << AA_threshold;
+
+	if(imageFilm->getAANoiseTarget() > 0.f) aaSettings << " noise.target=" << imageFilm->getAANoiseTarget();
  
 	aaSettings << " var.edge=" << AA_variance_edge_size << " var.pix=" << AA_variance_pixels << " clamp=" << AA_clamp_samples << " ind.clamp=" << AA_clamp_indirect;
 
@@ -153,6 +191,8 @@ bool tiledIntegrator_t::render(int numView, imageFilm_t *image)
 	if(AA_dark_detection_type == DARK_DETECTION_LINEAR)	Y_VERBOSE << "AA_threshold (linear): " << AA_threshold << ", dark factor: "<< AA_dark_threshold_factor << yendl;
 	else if(AA_dark_detection_type == DARK_DETECTION_CURVE)	Y_VERBOSE << "AA_threshold (curve)" << yendl;
 	else Y_VERBOSE << "AA threshold:" << AA_threshold << yendl;
+
+	if(imageFilm->getAANoiseTarget() > 0.f) Y_PARAMS << "Noise target: " << imageFilm->getAANoiseTarget() << ", resampling pixels above it until all converged or " << AA_passes << " passes" << yendl;
 	
 	Y_VERBOSE << "AA_variance_edge_size: "<< AA_variance_edge_size << yendl;
 	Y_VERBOSE << "AA_variance_pixels: "<< AA_variance_pixels << yendl;
@@ -209,6 +249,12 @@ bool tiledIntegrator_t::render(int numView, imageFilm_t *image)
 	{
 		if(scene->getSignals() & Y_SIG_ABORT) break;
 
+		if(progressive && progressiveTime > 0.f && gTimer.getTimeNotStopping("rendert") >= progressiveTime)
+		{
+			Y_INFO << integratorName << ": Progressive render time budget of " << progressiveTime << "s reached after " << i << " samples per pixel." << yendl;
+			break;
+		}
+
 		//scene->getSurfIntegrator()->setSampleMultiplier(scene->getSurfIntegrator()->getSampleMultiplier() * AA_sample_multiplier_factor);
 		
 		AA_sample_multiplier *= AA_sample_multiplier_factor;
@@ -229,6 +275,12 @@ bool tiledIntegrator_t::render(int numView, imageFilm_t *image)
 			imageFilm->setAAThreshold(AA_threshold);
 			resampled_pixels = imageFilm->nextPass(numView, true, integratorName);
 			AAthresholdChanged = false;
+
+			if(resampled_pixels <= 0 && imageFilm->getAANoiseTarget() > 0.f)
+			{
+				Y_INFO << integratorName << ": all pixels reached the noise target of " << imageFilm->getAANoiseTarget() << " after " << i << " passes." << yendl;
+				break;
+			}
 		}		
 		
 		int AA_samples_mult = (int) ceilf(AA_inc_samples * AA_sample_multiplier);
@@ -272,24 +324,32 @@ bool tiledIntegrator_t::renderPass(int numView, int samples, int offset, bool ad
 	if(nthreads>1)
 	{
 		threadControl_t tc;
-		std::vector<std::thread> threads;
+		taskGroup_t workers;
+		threadPool_t &pool = scene->getThreadPool();
+		int passOffset = offset + imageFilm->getBaseSamplingOffset();
 		for(int i=0;i<nthreads;++i)
 		{
-			threads.push_back(std::thread(&tiledIntegrator_t::renderWorker, this, numView, this, scene, imageFilm, &tc, i, samples, (offset + imageFilm->getBaseSamplingOffset()), adaptive, AA_pass_number));
+			pool.run(workers, [=, &tc]{ renderWorker(numView, this, scene, imageFilm, &tc, i, samples, passOffset, adaptive, AA_pass_number); });
 		}
 
+		std::vector<renderArea_t> finished;
 		std::unique_lock<std::mutex> lk(tc.m);
-		while(tc.finishedThreads < nthreads)
+		while(true)
 		{
-			tc.c.wait(lk);
-			for(size_t i=0; i<tc.areas.size(); ++i)
-			{				
-				imageFilm->finishArea(numView, tc.areas[i]);
+			tc.c.wait(lk, [&]{ return !tc.areas.empty() || tc.finishedThreads >= nthreads; });
+			finished.swap(tc.areas);
+			bool allFinished = tc.finishedThreads >= nthreads;
+			lk.unlock();	//workers must not wait for finishArea to hand in their areas
+			for(size_t i=0; i<finished.size(); ++i)
+			{
+				imageFilm->finishArea(numView, finished[i]);
 			}
-			tc.areas.clear();
+			finished.clear();
+			if(allFinished) break;
+			lk.lock();
 		}
 
-		for(auto& t : threads) t.join();	//join all threads (although they probably have exited already, but not necessarily):
+		pool.wait(workers);	//all workers reported back already, but they may not have returned yet
 	}
 	else
 	{
@@ -299,6 +359,7 @@ bool tiledIntegrator_t::renderPass(int numView, int samples, int offset, bool ad
 			if(scene->getSignals() & Y_SIG_ABORT) break;
 			preTile(a, samples, (offset + imageFilm->getBaseSamplingOffset()), adaptive, 0);
 			renderTile(numView, a, samples, (offset + imageFilm->getBaseSamplingOffset()), adaptive, 0);
+			imageFilm->mergeArea(a);
 			imageFilm->finishArea(numView, a);
 		}
 	}
@@ -309,7 +370,10 @@ bool tiledIntegrator_t::renderPass(int numView, int samples, int offset, bool ad
 bool tiledIntegrator_t::renderTile(int numView, renderArea_t &a, int n_samples, int offset, bool adaptive, int threadID, int AA_pass_number)
 {
 	int x;
-	const camera_t* camera = scene->getCamera();
+	//with the views side by side in one film every tile lies within a single view, shot by the camera of that view
+	const int view = (imageFilm->getNumViews() > 1) ? imageFilm->getViewOfColumn(a.X - imageFilm->getCX0()) : 0;
+	const int viewX0 = view * ((imageFilm->getNumViews() > 1) ? imageFilm->getViewWidth() : 0);
+	const camera_t* camera = scene->getViewCamera(view);
 	x=camera->resX();
 	diffRay_t c_ray;
 	ray_t d_ray;
@@ -339,7 +403,10 @@ bool tiledIntegrator_t::renderTile(int numView, renderArea_t &a, int n_samples,
 	colorPasses_t colorPasses(renderPasses);
 	colorPasses_t tmpPassesZero(renderPasses);
 	
-    rgba2DImage_t * samplingFactorImagePass = imageFilm->getImagePassFromIntPassType(PASS_INT_DEBUG_SAMPLING_FACTOR);
+    passImage_t * samplingFactorImagePass = imageFilm->getImagePassFromIntPassType(PASS_INT_DEBUG_SAMPLING_FACTOR);
+
+	bool timeSamples = colorPasses.enabled(PASS_INT_DEBUG_RENDER_TIME);	//wall clock time of every sample for the render cost heatmap, the clock is not read otherwise
+	std::chrono::steady_clock::time_point sampleStart;
 	
     int filmCX0 = imageFilm->getCX0();
     int filmCY0 = imageFilm->getCY0();
@@ -375,8 +442,9 @@ bool tiledIntegrator_t::renderTile(int numView, renderArea_t &a, int n_samples,
 
 			//Y_DEBUG << "idxSamplingFactorExtPass="<<idxSamplingFactorExtPass<<" idxSamplingFactorAuxPass="<<idxSamplingFactorAuxPass<<" matSampleFactor="<<matSampleFactor<<" n_samples_adjusted="<<n_samples_adjusted<<" n_samples="<<n_samples<<yendl;
 
-			rstate.pixelNumber = x*i+j;
-			rstate.samplingOffs = fnv_32a_buf(i*fnv_32a_buf(j));//fnv_32a_buf(rstate.pixelNumber);
+			const int camX = j - viewX0;
+			rstate.pixelNumber = x*i+camX;
+			rstate.samplingOffs = fnv_32a_buf(i*fnv_32a_buf(camX));//fnv_32a_buf(rstate.pixelNumber);
 			float toff = scrHalton(5, pass_offs+rstate.samplingOffs); // **shall be just the pass number...**
 
 			halU.setStart(pass_offs+rstate.samplingOffs);
@@ -384,14 +452,16 @@ bool tiledIntegrator_t::renderTile(int numView, renderArea_t &a, int n_samples,
 
 			for(int sample=0; sample<n_samples_adjusted; ++sample)
 			{
+				if(timeSamples) sampleStart = std::chrono::steady_clock::now();
+
 				colorPasses.reset_colors();
 				rstate.setDefaults();
 				rstate.pixelSample = pass_offs+sample;
 				rstate.time = addMod1((float)sample*d1, toff);//(0.5+(float)sample)*d1;
 
 				// the (1/n, Larcher&Pillichshammer-Seq.) only gives good coverage when total sample count is known
-				// hence we use scrambled (Sobol, van-der-Corput) for multipass AA
-				if(AA_passes>1)
+				// hence we use scrambled (Sobol, van-der-Corput) for multipass AA and for the samples shared among computer nodes
+				if(AA_passes>1 || imageFilm->getSamplesNodes() > 1)
 				{
 					dx = RI_vdC(rstate.pixelSample, rstate.samplingOffs);
 					dy = RI_S(rstate.pixelSample, rstate.samplingOffs);
@@ -407,7 +477,7 @@ bool tiledIntegrator_t::renderTile(int numView, renderArea_t &a, int n_samples,
 					lens_u = halU.getNext();
 					lens_v = halV.getNext();
 				}
-				c_ray = camera->shootRay(j+dx, i+dy, lens_u, lens_v, wt);
+				c_ray = camera->shootRay(camX+dx, i+dy, lens_u, lens_v, wt);
 				
 				if(wt==0.0)
 				{
@@ -417,10 +487,10 @@ bool tiledIntegrator_t::renderTile(int numView, renderArea_t &a, int n_samples,
 				if(diffRaysEnabled)
 				{
 					//setup ray differentials
-					d_ray = camera->shootRay(j+1+dx, i+dy, lens_u, lens_v, wt_dummy);
+					d_ray = camera->shootRay(camX+1+dx, i+dy, lens_u, lens_v, wt_dummy);
 					c_ray.xfrom = d_ray.from;
 					c_ray.xdir = d_ray.dir;
-					d_ray = camera->shootRay(j+dx, i+1+dy, lens_u, lens_v, wt_dummy);
+					d_ray = camera->shootRay(camX+dx, i+1+dy, lens_u, lens_v, wt_dummy);
 					c_ray.yfrom = d_ray.from;
 					c_ray.ydir = d_ray.dir;
 					c_ray.hasDifferentials = true;
@@ -513,6 +583,8 @@ bool tiledIntegrator_t::renderTile(int numView, renderArea_t &a, int n_samples,
 					}
 				}
 
+				if(timeSamples) colorPasses(PASS_INT_DEBUG_RENDER_TIME) = colorA_t(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - sampleStart).count());
+
 				imageFilm->addSample(colorPasses, j, i, dx, dy, &a, sample, AA_pass_number, inv_AA_max_possible_samples);
 			}
 		}
@@ -3,13 +3,23 @@
 #include <yafraycore/kdtree.h>
 #include <core_api/material.h>
 #include <core_api/scene.h>
+#include <yafraycore/threadpool.h>
 #include <stdexcept>
 //#include <math.h>
 #include <limits>
-#include <set>
+#include <chrono>
+#include <sstream>
+#include <deque>
 
 #include <time.h>
 
+#if defined(__SSE__) || defined(_M_X64)
+	#include <xmmintrin.h>
+	#define KD_SIMD 1
+#else
+	#define KD_SIMD 0
+#endif
+
 __BEGIN_YAFRAY
 
 #define LOWER_B 0
@@ -21,7 +31,8 @@ __BEGIN_YAFRAY
 #define CLIP_DATA_SIZE (3*12*sizeof(double))
 #define KD_BINS 1024
 
-#define KD_MAX_STACK 64
+#define KD_PARALLEL_MIN_PRIMS 4096 //minimum node size to spread its build over several threads
+#define KD_LAYOUT_BLOCK_BYTES 4096 //nodes get packed into blocks of one memory page
 
 #if (defined(_M_IX86) || defined(i386) || defined(_X86_))
 	#define Y_FAST_INT 1
@@ -50,21 +61,86 @@ inline int Y_Float2Int(double val) {
 #endif
 }
 
-int Kd_inodes=0, Kd_leaves=0, _emptyKd_leaves=0, Kd_prims=0, _clip=0, _bad_clip=0, _null_clip=0, _early_out=0;
+static inline double elapsedSince(const std::chrono::steady_clock::time_point &start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*! Per-thread state of the tree construction. Each thread builds its subtree
+	into its own node array and leaf arena, the parent appends the node arrays
+	in depth-first order once its children are done, so the final node layout
+	is the same as the one of a sequential build. */
+struct kdBuildContext_t
+{
+	kdBuildContext_t(int maxDepth, MemoryArena *primsArena): nextFreeNode(0), allocatedNodesCount(256), arena(primsArena)
+	{
+		nodes = (kdTreeNode*)y_memalign(64, allocatedNodesCount * sizeof(kdTreeNode));
+		if(!arena)
+		{
+			arena = new MemoryArena;
+			ownedArenas.push_back(arena);
+		}
+		for (int i = 0; i < 3; ++i) edges[i] = new boundEdge[514/*2*totalPrims*/];
+		clip = new int[maxDepth+2];
+		cdata = (char*)y_memalign(64, (maxDepth+2)*TRI_CLIP_THRESH*CLIP_DATA_SIZE);
+		for (int i = 0; i < maxDepth+2; i++) clip[i] = -1;
+	}
+	~kdBuildContext_t()
+	{
+		if(nodes) y_free(nodes);
+		for (int i = 0; i < 3; ++i) delete[] edges[i];
+		delete[] clip;
+		y_free(cdata);
+	}
+	//! make room for at least n more nodes
+	void reserve(u_int32 n)
+	{
+		if(nextFreeNode + n <= allocatedNodesCount) return;
+		u_int32 newCount = 2*allocatedNodesCount;
+		newCount = (newCount > 0x100000) ? allocatedNodesCount+0x80000 : newCount;
+		if(newCount < nextFreeNode + n) newCount = nextFreeNode + n;
+		kdTreeNode 	*n_nodes = (kdTreeNode *) y_memalign(64, newCount * sizeof(kdTreeNode));
+		memcpy(n_nodes, nodes, nextFreeNode * sizeof(kdTreeNode));
+		y_free(nodes);
+		nodes = n_nodes;
+		allocatedNodesCount = newCount;
+	}
+	//! append the nodes of a subtree, relocating its right child indices
+	void append(kdBuildContext_t &sub)
+	{
+		reserve(sub.nextFreeNode);
+		u_int32 offset = nextFreeNode;
+		for(u_int32 i=0; i<sub.nextFreeNode; ++i)
+		{
+			nodes[offset + i] = sub.nodes[i];
+			if(!nodes[offset + i].IsLeaf()) nodes[offset + i].setRightChild(sub.nodes[i].getRightChild() + offset);
+		}
+		nextFreeNode += sub.nextFreeNode;
+		ownedArenas.insert(ownedArenas.end(), sub.ownedArenas.begin(), sub.ownedArenas.end());
+		sub.ownedArenas.clear();
+		stats.addBuildCounters(sub.stats);
+	}
+
+	kdTreeNode *nodes;
+	u_int32 nextFreeNode, allocatedNodesCount;
+	MemoryArena *arena;
+	std::vector<MemoryArena *> ownedArenas;
+	boundEdge *edges[3];
+	bound_t clipBounds[TRI_CLIP_THRESH+1]; //!< bounds of the clipped triangles
+	int *clip; // indicate clip plane(s) for current level
+	char *cdata; // clipping data...
+	kdTreeStats_t stats; //!< only the build counters are used
+};
 
 triKdTree_t::triKdTree_t(const triangle_t **v, int np, int depth, int leafSize,
-			float cost_ratio, float emptyBonus)
-	: costRatio(cost_ratio), eBonus(emptyBonus), maxDepth(depth)
+			float cost_ratio, float emptyBonus, int numThreads, threadPool_t *pool)
+	: costRatio(cost_ratio), eBonus(emptyBonus), maxDepth(depth), threadPool(pool)
 {
-	Y_INFO << "Kd-Tree: Starting build (" << np << " prims, cr:" << costRatio << " eb:" << eBonus << ")" << yendl;
-	clock_t c_start, c_end;
-	c_start = clock();
-	Kd_inodes=0, Kd_leaves=0, _emptyKd_leaves=0, Kd_prims=0, depthLimitReached=0, NumBadSplits=0,
-		_clip=0, _bad_clip=0, _null_clip=0, _early_out=0;
+	if(numThreads < 1 || !threadPool) numThreads = 1;
+	maxParallelDepth = (int) std::ceil(std::log2((float) numThreads)); //in how many tree levels we will split the work into tasks, as in pointKdTree
+	Y_INFO << "Kd-Tree: Starting build (" << np << " prims, cr:" << costRatio << " eb:" << eBonus << ") [using " << numThreads << " threads]" << yendl;
+	auto phaseStart = std::chrono::steady_clock::now();
 	totalPrims = np;
-	nextFreeNode = 0;
-	allocatedNodesCount = 256;
-	nodes = (kdTreeNode*)y_memalign(64, 256 * sizeof(kdTreeNode));
 	if(maxDepth <= 0) maxDepth = int( 7.0f + 1.66f * log(float(totalPrims)) );
 	double logLeaves = 1.442695f * log(double(totalPrims)); // = base2 log
 	if(leafSize <= 0)
@@ -77,7 +153,7 @@ triKdTree_t::triKdTree_t(const triangle_t **v, int np, int depth, int leafSize,
 	if(maxDepth>KD_MAX_STACK) maxDepth = KD_MAX_STACK; //to prevent our stack to overflow
 	//experiment: add penalty to cost ratio to reduce memory usage on huge scenes
 	if( logLeaves > 16.0 ) costRatio += 0.25*( logLeaves - 16.0 );
-	allBounds = new bound_t[totalPrims + TRI_CLIP_THRESH+1];
+	allBounds = new bound_t[totalPrims];
 	Y_VERBOSE << "Kd-Tree: Getting triangle bounds..." << yendl;
 	for(u_int32 i=0; i<totalPrims; i++)
 	{
@@ -94,62 +170,213 @@ triKdTree_t::triKdTree_t(const triangle_t **v, int np, int depth, int leafSize,
 		treeBound.a[i] -= foo, treeBound.g[i] += foo;
 	}
 	Y_VERBOSE << "Kd-Tree: Done." << yendl;
+	stats.boundsTime = elapsedSince(phaseStart);
 	// get working memory for tree construction
-	boundEdge *edges[3];
 	u_int32 rMemSize = 3*totalPrims; // (maxDepth+1)*totalPrims;
 	u_int32 *leftPrims = new u_int32[std::max( (u_int32)2*TRI_CLIP_THRESH, totalPrims )];
 	u_int32 *rightPrims = new u_int32[rMemSize]; //just a rough guess, allocating worst case is insane!
-	for (int i = 0; i < 3; ++i) edges[i] = new boundEdge[514/*2*totalPrims*/];
-	clip = new int[maxDepth+2];
-	cdata = (char*)y_memalign(64, (maxDepth+2)*TRI_CLIP_THRESH*CLIP_DATA_SIZE);
+	kdBuildContext_t ctx(maxDepth, &primsArena);
 	
 	// prepare data
 	for (u_int32 i = 0; i < totalPrims; i++) leftPrims[i] = i;//primNums[i] = i;
-	for (int i = 0; i < maxDepth+2; i++) clip[i] = -1;
 	
 	/* build tree */
 	prims = v;
 	Y_VERBOSE << "Kd-Tree: Starting recursive build..." << yendl;
-	buildTree(totalPrims, treeBound, leftPrims,
-			  leftPrims, rightPrims, edges, // <= working memory
+	buildTree(ctx, totalPrims, treeBound, leftPrims,
+			  leftPrims, rightPrims, // <= working memory
 			  rMemSize, 0, 0 );
 	
+	// take over the nodes and leaf lists
+	nodes = ctx.nodes;
+	nextFreeNode = ctx.nextFreeNode;
+	allocatedNodesCount = ctx.allocatedNodesCount;
+	ctx.nodes = nullptr;
+	subtreeArenas.swap(ctx.ownedArenas);
+	
 	// free working memory
 	delete[] leftPrims;
 	delete[] rightPrims;
 	delete[] allBounds;
-	for (int i = 0; i < 3; ++i) delete[] edges[i];
-	delete[] clip;
-	y_free(cdata);
+	stats.buildTime = elapsedSince(phaseStart) - stats.boundsTime;
+	
+	auto layoutStart = std::chrono::steady_clock::now();
+	optimizeLayout();
+	stats.layoutTime = elapsedSince(layoutStart);
+	
 	//print some stats:
-	c_end = clock() - c_start;
-	Y_VERBOSE << "Kd-Tree: Stats ("<< float(c_end) / (float)CLOCKS_PER_SEC <<"s)" << yendl;
-	Y_VERBOSE << "Kd-Tree: used/allocated nodes: " << nextFreeNode << "/" << allocatedNodesCount
-		<< " (" << 100.f * float(nextFreeNode)/allocatedNodesCount << "%)" << yendl;
-	Y_VERBOSE << "Kd-Tree: Primitives in tree: " << totalPrims << yendl;
-	Y_VERBOSE << "Kd-Tree: Interior nodes: " << Kd_inodes << " / " << "leaf nodes: " << Kd_leaves
-		<< " (empty: " << _emptyKd_leaves << " = " << 100.f * float(_emptyKd_leaves)/Kd_leaves << "%)" << yendl;
-	Y_VERBOSE << "Kd-Tree: Leaf prims: " << Kd_prims << " (" << float(Kd_prims) / totalPrims << " x prims in tree, leaf size: " << maxLeafSize << ")" << yendl;
-	Y_VERBOSE << "Kd-Tree: => " << float(Kd_prims)/ (Kd_leaves-_emptyKd_leaves) << " prims per non-empty leaf" << yendl;
-	Y_VERBOSE << "Kd-Tree: Leaves due to depth limit/bad splits: " << depthLimitReached << "/" << NumBadSplits << yendl;
-	Y_VERBOSE << "Kd-Tree: clipped triangles: " << _clip << " (" <<_bad_clip << " bad clips, " << _null_clip << " null clips)" << yendl;
+	stats.addBuildCounters(ctx.stats);
+	collectStats(emptyBonus);
+	stats.print("Kd-Tree");
+}
+
+/*! Reorder the nodes of the finished tree for fewer cache and TLB misses.
+	The build leaves them in depth-first order, so the right subtree of a
+	node ends up far away from it. Here the tree is cut into treelets of one
+	page each, filled with the nodes a ray most likely visits next (largest
+	surface area first), which also packs cache lines with probable nodes.
+	The below child of a node has to stay right after it, so nodes are
+	placed together with their chain of below children. Treelets are laid
+	out in breadth-first order, so the top levels share the first pages.
+	The final array has the exact size and uses huge pages when it is big. */
+
+void triKdTree_t::optimizeLayout()
+{
+	struct pending_t
+	{
+		u_int32 node;
+		bound_t bound;
+		float area;
+		bool operator<(const pending_t &p) const { return area < p.area; }
+	};
+	const u_int32 blockNodes = std::max((u_int32)1, (u_int32)(KD_LAYOUT_BLOCK_BYTES / sizeof(kdTreeNode)));
+	kdTreeNode *newNodes = (kdTreeNode *) y_memalign_huge(64, nextFreeNode * sizeof(kdTreeNode));
+	std::vector<u_int32> newIndex(nextFreeNode);
+	std::deque<pending_t> treelets;
+	std::vector<pending_t> heap;
+	u_int32 next = 0;
+	treelets.push_back({0, treeBound, 0.f});
+	while(!treelets.empty())
+	{
+		heap.assign(1, treelets.front());
+		treelets.pop_front();
+		u_int32 blockEnd = (next / blockNodes + 1) * blockNodes;
+		while(!heap.empty() && next < blockEnd)
+		{
+			std::pop_heap(heap.begin(), heap.end());
+			pending_t p = heap.back();
+			heap.pop_back();
+			u_int32 n = p.node;
+			bound_t below = p.bound;
+			while(true)
+			{
+				newIndex[n] = next;
+				newNodes[next++] = nodes[n];
+				if(nodes[n].IsLeaf()) break;
+				int axis = nodes[n].SplitAxis();
+				bound_t above = below;
+				above.a[axis] = below.g[axis] = nodes[n].SplitPos();
+				heap.push_back({nodes[n].getRightChild(), above, kdTreeStats_t::halfArea(above)});
+				std::push_heap(heap.begin(), heap.end());
+				++n;
+			}
+		}
+		// the rest starts new treelets, most probable first
+		std::sort_heap(heap.begin(), heap.end());
+		treelets.insert(treelets.end(), heap.rbegin(), heap.rend());
+	}
+	for(u_int32 i=0; i<nextFreeNode; ++i)
+	{
+		if(!newNodes[i].IsLeaf()) newNodes[i].setRightChild(newIndex[newNodes[i].getRightChild()]);
+	}
+	y_free(nodes);
+	nodes = newNodes;
+	allocatedNodesCount = nextFreeNode;
+}
+
+void triKdTree_t::collectStats(float emptyBonus)
+{
+	auto start = std::chrono::steady_clock::now();
+	stats.totalPrims = totalPrims;
+	stats.costRatio = costRatio;
+	stats.eBonus = emptyBonus;
+	stats.maxDepth = maxDepth;
+	stats.maxLeafSize = maxLeafSize;
+	stats.collect(nodes, treeBound, costRatio);
+	stats.statsTime = elapsedSince(start);
 }
 
 triKdTree_t::~triKdTree_t()
 {
 	Y_INFO << "Kd-Tree: Freeing nodes..." << yendl;
 	y_free(nodes);
+	for(unsigned int i=0; i<subtreeArenas.size(); ++i) delete subtreeArenas[i];
 	Y_VERBOSE << "Kd-Tree: Done" << yendl;
 }
 
+kdTreeStats_t::kdTreeStats_t(): totalPrims(0), interiorNodes(0), leaves(0), emptyLeaves(0), leafPrims(0), treeDepth(0),
+	sahCost(0.f), sahCostRatio(0.f), nodeBytes(0), leafBytes(0), costRatio(0.f), eBonus(0.f), maxDepth(0), maxLeafSize(0),
+	clipped(0), nullClipped(0), earlyOut(0), depthLimitReached(0), badSplits(0),
+	boundsTime(0.0), buildTime(0.0), layoutTime(0.0), statsTime(0.0), fromCache(false)
+{
+	for(int i=0; i<KD_STATS_LEAF_SIZES; ++i) leafSizeHistogram[i] = 0;
+}
+
+void kdTreeStats_t::addBuildCounters(const kdTreeStats_t &s)
+{
+	clipped += s.clipped; nullClipped += s.nullClipped; earlyOut += s.earlyOut;
+	depthLimitReached += s.depthLimitReached; badSplits += s.badSplits;
+}
+
+void kdTreeStats_t::print(const std::string &name) const
+{
+	u_int32 nonEmpty = leaves - emptyLeaves;
+	u_int32 nodes = interiorNodes + leaves;
+	Y_VERBOSE << name << ": Stats (" << (fromCache ? "loaded from cache" : "built") << " in " << (boundsTime + buildTime + layoutTime) << "s: bounds " << boundsTime << "s, recursive build " << buildTime << "s, node layout " << layoutTime << "s, report " << statsTime << "s)" << yendl;
+	if(fromCache) Y_VERBOSE << name << ": Primitives in tree: " << totalPrims << yendl;
+	else Y_VERBOSE << name << ": Primitives in tree: " << totalPrims << ", cost ratio: " << costRatio << ", empty bonus: " << eBonus << ", max depth: " << maxDepth << ", leaf size: " << maxLeafSize << yendl;
+	Y_VERBOSE << name << ": SAH cost: " << sahCost << " (traversal cost ratio " << sahCostRatio << ")" << yendl;
+	Y_VERBOSE << name << ": Interior nodes: " << interiorNodes << " / " << "leaf nodes: " << leaves
+		<< " (empty: " << emptyLeaves << " = " << (leaves ? 100.f * float(emptyLeaves)/leaves : 0.f) << "%), depth: " << treeDepth << yendl;
+	Y_VERBOSE << name << ": Leaf prims: " << leafPrims << " (" << (totalPrims ? float(leafPrims) / totalPrims : 0.f) << " x prims in tree)"
+		<< " => " << (nonEmpty ? float(leafPrims) / nonEmpty : 0.f) << " prims per non-empty leaf" << yendl;
+	Y_VERBOSE << name << ": Memory: " << nodeBytes << " bytes of nodes (" << (nodes ? float(nodeBytes) / nodes : 0.f) << " per node), "
+		<< leafBytes << " bytes of leaf data (" << (nonEmpty ? float(leafBytes) / nonEmpty : 0.f) << " per non-empty leaf)" << yendl;
+	if(!fromCache)
+	{
+		u_int32 clipTests = clipped + nullClipped;
+		Y_VERBOSE << name << ": Leaves due to depth limit/bad splits: " << depthLimitReached << "/" << badSplits << yendl;
+		Y_VERBOSE << name << ": Clipped triangles: " << clipped << " (" << nullClipped << " null clips, "
+			<< (clipTests ? 100.f * float(clipped) / clipTests : 100.f) << "% kept)" << yendl;
+	}
+	std::stringstream sizes;
+	for(int i=0; i<KD_STATS_LEAF_SIZES; ++i) sizes << " " << i << (i == KD_STATS_LEAF_SIZES-1 ? "+:" : ":") << leafSizeHistogram[i];
+	Y_VERBOSE << name << ": Leaves per size:" << sizes.str() << yendl;
+	std::stringstream depths;
+	for(size_t i=0; i<depthHistogram.size(); ++i) if(depthHistogram[i]) depths << " " << i << ":" << depthHistogram[i];
+	Y_VERBOSE << name << ": Leaves per depth:" << depths.str() << yendl;
+}
+
 // ============================================================
 /*!
 	Faster cost function: Find the optimal split with SAH
 	and binning => O(n)
+	The three axes are independent, with parallel=true the
+	y and z axes are evaluated by tasks of the thread pool.
 */
 
+void triKdTree_t::pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, float emptyBonus, bool parallel, splitCost_t &split) const
+{
+	splitCost_t axisSplit[3];
+	
+	if(parallel)
+	{
+		taskGroup_t axisWorkers;
+		threadPool->run(axisWorkers, [&]{ pigeonAxisCost(1, nPrims, nodeBound, primIdx, emptyBonus, axisSplit[1]); });
+		threadPool->run(axisWorkers, [&]{ pigeonAxisCost(2, nPrims, nodeBound, primIdx, emptyBonus, axisSplit[2]); });
+		pigeonAxisCost(0, nPrims, nodeBound, primIdx, emptyBonus, axisSplit[0]);
+		threadPool->wait(axisWorkers);
+	}
+	else for(int axis=0;axis<3;axis++) pigeonAxisCost(axis, nPrims, nodeBound, primIdx, emptyBonus, axisSplit[axis]);
+	
+	// merge in axis order, so ties are resolved as in a single sweep over all axes
+	split.oldCost = float(nPrims);
+	split.bestCost = std::numeric_limits<float>::infinity();
+	for(int axis=0;axis<3;axis++)
+	{
+		if(axisSplit[axis].bestCost < split.bestCost)
+		{
+			split.t = axisSplit[axis].t;
+			split.bestCost = axisSplit[axis].bestCost;
+			split.bestAxis = axisSplit[axis].bestAxis;
+			split.bestOffset = axisSplit[axis].bestOffset;
+			split.nBelow = axisSplit[axis].nBelow;
+			split.nAbove = axisSplit[axis].nAbove;
+		}
+	}
+}
 
-void triKdTree_t::pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, splitCost_t &split)
+void triKdTree_t::pigeonAxisCost(int axis, u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx, float emptyBonus, splitCost_t &split) const
 {
 	bin_t bin[ KD_BINS+1 ];
 	float d[3];
@@ -162,135 +389,131 @@ void triKdTree_t::pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *pri
 	float t_low, t_up;
 	int b_left, b_right;
 	
-	for(int axis=0;axis<3;axis++)
+	float s = KD_BINS/d[axis];
+	float min = nodeBound.a[axis];
+	// pigeonhole sort:
+	for(unsigned int i=0; i<nPrims; ++i)
 	{
-		float s = KD_BINS/d[axis];
-		float min = nodeBound.a[axis];
-		// pigeonhole sort:
-		for(unsigned int i=0; i<nPrims; ++i)
+		const bound_t &bbox = allBounds[ primIdx[i] ];
+		t_low = bbox.a[axis];
+		t_up  = bbox.g[axis];
+		b_left = (int)((t_low - min)*s);
+		b_right = (int)((t_up - min)*s);
+
+		if(b_left<0) b_left=0;
+		else if(b_left > KD_BINS) b_left = KD_BINS;
+		
+		if(b_right<0) b_right=0;
+		else if(b_right > KD_BINS) b_right = KD_BINS;
+		
+		if(t_low == t_up)
 		{
-			const bound_t &bbox = allBounds[ primIdx[i] ];
-			t_low = bbox.a[axis];
-			t_up  = bbox.g[axis];
-			b_left = (int)((t_low - min)*s);
-			b_right = (int)((t_up - min)*s);
-
-			if(b_left<0) b_left=0;
-			else if(b_left > KD_BINS) b_left = KD_BINS;
-			
-			if(b_right<0) b_right=0;
-			else if(b_right > KD_BINS) b_right = KD_BINS;
-			
-			if(t_low == t_up)
+			if(bin[b_left].empty() || (t_low >= bin[b_left].t && !bin[b_left].empty() ) )
 			{
-				if(bin[b_left].empty() || (t_low >= bin[b_left].t && !bin[b_left].empty() ) )
-				{
-					bin[b_left].t = t_low;
-					bin[b_left].c_both++;
-				}
-				else
-				{
-					bin[b_left].c_left++;
-					bin[b_left].c_right++;
-				}
-				bin[b_left].n += 2;
+				bin[b_left].t = t_low;
+				bin[b_left].c_both++;
 			}
 			else
-			{	
-				if(bin[b_left].empty() || (t_low > bin[b_left].t  && !bin[b_left].empty() ) )
-				{
-					bin[b_left].t = t_low;
-					bin[b_left].c_left += bin[b_left].c_both + bin[b_left].c_bleft;
-					bin[b_left].c_right += bin[b_left].c_both;
-					bin[b_left].c_both = bin[b_left].c_bleft = 0;
-					bin[b_left].c_bleft++;
-				}
-				else if(t_low == bin[b_left].t)
-				{
-					bin[b_left].c_bleft++;
-				}
-				else bin[b_left].c_left++;
-				bin[b_left].n++;
-				
-				bin[b_right].c_right++;
-				if(bin[b_right].empty() || t_up > bin[b_right].t)
-				{
-					bin[b_right].t = t_up;
-					bin[b_right].c_left += bin[b_right].c_both + bin[b_right].c_bleft;
-					bin[b_right].c_right += bin[b_right].c_both;
-					bin[b_right].c_both = bin[b_right].c_bleft = 0;
-				}
-				bin[b_right].n++;
+			{
+				bin[b_left].c_left++;
+				bin[b_left].c_right++;
 			}
-
+			bin[b_left].n += 2;
 		}
-		
-		const int axisLUT[3][3] = { {0,1,2}, {1,2,0}, {2,0,1} };
-		float capArea = d[ axisLUT[1][axis] ] * d[ axisLUT[2][axis] ];
-		float capPerim = d[ axisLUT[1][axis] ] + d[ axisLUT[2][axis] ];
-		
-		unsigned int nBelow=0, nAbove=nPrims;
-		// cumulate prims and evaluate cost
-		for(int i=0; i<KD_BINS+1; ++i)
-		{
-			if(!bin[i].empty())
-			{	
-				nBelow += bin[i].c_left;
-				nAbove -= bin[i].c_right;
-				// cost:
-				float edget = bin[i].t;
-				if (edget > nodeBound.a[axis] && edget < nodeBound.g[axis])
+		else
+		{	
+			if(bin[b_left].empty() || (t_low > bin[b_left].t  && !bin[b_left].empty() ) )
+			{
+				bin[b_left].t = t_low;
+				bin[b_left].c_left += bin[b_left].c_both + bin[b_left].c_bleft;
+				bin[b_left].c_right += bin[b_left].c_both;
+				bin[b_left].c_both = bin[b_left].c_bleft = 0;
+				bin[b_left].c_bleft++;
+			}
+			else if(t_low == bin[b_left].t)
+			{
+				bin[b_left].c_bleft++;
+			}
+			else bin[b_left].c_left++;
+			bin[b_left].n++;
+			
+			bin[b_right].c_right++;
+			if(bin[b_right].empty() || t_up > bin[b_right].t)
+			{
+				bin[b_right].t = t_up;
+				bin[b_right].c_left += bin[b_right].c_both + bin[b_right].c_bleft;
+				bin[b_right].c_right += bin[b_right].c_both;
+				bin[b_right].c_both = bin[b_right].c_bleft = 0;
+			}
+			bin[b_right].n++;
+		}
+
+	}
+	
+	const int axisLUT[3][3] = { {0,1,2}, {1,2,0}, {2,0,1} };
+	float capArea = d[ axisLUT[1][axis] ] * d[ axisLUT[2][axis] ];
+	float capPerim = d[ axisLUT[1][axis] ] + d[ axisLUT[2][axis] ];
+	
+	unsigned int nBelow=0, nAbove=nPrims;
+	// cumulate prims and evaluate cost
+	for(int i=0; i<KD_BINS+1; ++i)
+	{
+		if(!bin[i].empty())
+		{	
+			nBelow += bin[i].c_left;
+			nAbove -= bin[i].c_right;
+			// cost:
+			float edget = bin[i].t;
+			if (edget > nodeBound.a[axis] && edget < nodeBound.g[axis])
+			{
+				// Compute cost for split at _i_th edge
+				float l1 = edget - nodeBound.a[axis];
+				float l2 = nodeBound.g[axis] - edget;
+				float belowSA = capArea + l1*capPerim;
+				float aboveSA = capArea + l2*capPerim;
+				float rawCosts = (belowSA * nBelow + aboveSA * nAbove);
+				float eb;
+
+				if(nAbove == 0) eb = (0.1f + l2/d[axis])*emptyBonus*rawCosts;
+				else if(nBelow == 0) eb = (0.1f + l1/d[axis])*emptyBonus*rawCosts;
+				else eb = 0.0f;
+
+				float cost = costRatio + invTotalSA * (rawCosts - eb);
+
+				// Update best split if this is lowest cost so far
+				if (cost < split.bestCost)
 				{
-					// Compute cost for split at _i_th edge
-					float l1 = edget - nodeBound.a[axis];
-					float l2 = nodeBound.g[axis] - edget;
-					float belowSA = capArea + l1*capPerim;
-					float aboveSA = capArea + l2*capPerim;
-					float rawCosts = (belowSA * nBelow + aboveSA * nAbove);
-					float eb;
-
-					if(nAbove == 0) eb = (0.1f + l2/d[axis])*eBonus*rawCosts;
-					else if(nBelow == 0) eb = (0.1f + l1/d[axis])*eBonus*rawCosts;
-					else eb = 0.0f;
-
-					float cost = costRatio + invTotalSA * (rawCosts - eb);
-
-					// Update best split if this is lowest cost so far
-					if (cost < split.bestCost)
-					{
-						split.t = edget;
-						split.bestCost = cost;
-						split.bestAxis = axis;
-						split.bestOffset = i; // kinda useless...
-						split.nBelow = nBelow;
-						split.nAbove = nAbove;
-					}
+					split.t = edget;
+					split.bestCost = cost;
+					split.bestAxis = axis;
+					split.bestOffset = i; // kinda useless...
+					split.nBelow = nBelow;
+					split.nAbove = nAbove;
 				}
-				nBelow += bin[i].c_both + bin[i].c_bleft;
-				nAbove -= bin[i].c_both;
 			}
-		} // for all bins
-		if(nBelow != nPrims || nAbove != 0)
-		{
-			int c1=0, c2=0, c3=0, c4=0, c5=0;
-			std::cout << "SCREWED!!\n";
-			for(int i=0;i<KD_BINS+1;i++){ c1+= bin[i].n; std::cout << bin[i].n << " ";}
-			std::cout << "\nn total: "<< c1 << "\n";
-			for(int i=0;i<KD_BINS+1;i++){ c2+= bin[i].c_left; std::cout << bin[i].c_left << " ";}
-			std::cout << "\nc_left total: "<< c2 << "\n";
-			for(int i=0;i<KD_BINS+1;i++){ c3+= bin[i].c_bleft; std::cout << bin[i].c_bleft << " ";}
-			std::cout << "\nc_bleft total: "<< c3 << "\n";
-			for(int i=0;i<KD_BINS+1;i++){ c4+= bin[i].c_both; std::cout << bin[i].c_both << " ";}
-			std::cout << "\nc_both total: "<< c4 << "\n";
-			for(int i=0;i<KD_BINS+1;i++){ c5+= bin[i].c_right; std::cout << bin[i].c_right << " ";}
-			std::cout << "\nc_right total: "<< c5 << "\n";
-			std::cout << "\nnPrims: "<<nPrims<<" nBelow: "<<nBelow<<" nAbove: "<<nAbove<<"\n";
-			std::cout << "total left: " << c2 + c3 + c4 << "\ntotal right: " << c4 + c5 << "\n";
-			std::cout << "n/2: " << c1/2 << "\n";
-			throw std::logic_error("cost function mismatch");
+			nBelow += bin[i].c_both + bin[i].c_bleft;
+			nAbove -= bin[i].c_both;
 		}
-		for(int i=0;i<KD_BINS+1;i++) bin[i].reset();
-	} // for all axis
+	} // for all bins
+	if(nBelow != nPrims || nAbove != 0)
+	{
+		int c1=0, c2=0, c3=0, c4=0, c5=0;
+		std::cout << "SCREWED!!\n";
+		for(int i=0;i<KD_BINS+1;i++){ c1+= bin[i].n; std::cout << bin[i].n << " ";}
+		std::cout << "\nn total: "<< c1 << "\n";
+		for(int i=0;i<KD_BINS+1;i++){ c2+= bin[i].c_left; std::cout << bin[i].c_left << " ";}
+		std::cout << "\nc_left total: "<< c2 << "\n";
+		for(int i=0;i<KD_BINS+1;i++){ c3+= bin[i].c_bleft; std::cout << bin[i].c_bleft << " ";}
+		std::cout << "\nc_bleft total: "<< c3 << "\n";
+		for(int i=0;i<KD_BINS+1;i++){ c4+= bin[i].c_both; std::cout << bin[i].c_both << " ";}
+		std::cout << "\nc_both total: "<< c4 << "\n";
+		for(int i=0;i<KD_BINS+1;i++){ c5+= bin[i].c_right; std::cout << bin[i].c_right << " ";}
+		std::cout << "\nc_right total: "<< c5 << "\n";
+		std::cout << "\nnPrims: "<<nPrims<<" nBelow: "<<nBelow<<" nAbove: "<<nAbove<<"\n";
+		std::cout << "total left: " << c2 + c3 + c4 << "\ntotal right: " << c4 + c5 << "\n";
+		std::cout << "n/2: " << c1/2 << "\n";
+		throw std::logic_error("cost function mismatch");
+	}
 }
 
 // ============================================================
@@ -298,9 +521,10 @@ void triKdTree_t::pigeonMinCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *pri
 	Cost function: Find the optimal split with SAH
 */
 
-void triKdTree_t::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx,
-		const bound_t *pBounds, boundEdge *edges[3], splitCost_t &split)
+void triKdTree_t::minimalCost(kdBuildContext_t &ctx, u_int32 nPrims, bound_t &nodeBound, u_int32 *primIdx,
+		const bound_t *pBounds, float emptyBonus, splitCost_t &split) const
 {
+	boundEdge **edges = ctx.edges;
 	float d[3];
 	d[0] = nodeBound.longX();
 	d[1] = nodeBound.longY();
@@ -363,14 +587,14 @@ void triKdTree_t::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primI
 			if(l1 > l2*float(nPrims) && l2 > 0.f)
 			{
 				float rawCosts = (capArea + l2*capPerim) * nPrims;
-				float cost = costRatio + invTotalSA * (rawCosts - eBonus); //todo: use proper ebonus...
+				float cost = costRatio + invTotalSA * (rawCosts - emptyBonus); //todo: use proper ebonus...
 				//optimal cost is definitely here, and nowhere else!
 				if (cost < split.bestCost)  {
 					split.bestCost = cost;
 					split.bestAxis = axis;
 					split.bestOffset = 0;
 					split.nEdge = nEdge;
-					++_early_out;
+					++ctx.stats.earlyOut;
 				}
 				continue;
 			}
@@ -380,13 +604,13 @@ void triKdTree_t::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primI
 			if(l2 > l1*float(nPrims) && l1 > 0.f)
 			{
 				float rawCosts = (capArea + l1*capPerim) * nPrims;
-				float cost = costRatio + invTotalSA * (rawCosts - eBonus); //todo: use proper ebonus...
+				float cost = costRatio + invTotalSA * (rawCosts - emptyBonus); //todo: use proper ebonus...
 				if (cost < split.bestCost)  {
 					split.bestCost = cost;
 					split.bestAxis = axis;
 					split.bestOffset = nEdge-1;
 					split.nEdge = nEdge;
-					++_early_out;
+					++ctx.stats.earlyOut;
 				}
 				continue;
 			}
@@ -405,8 +629,8 @@ void triKdTree_t::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primI
 				float rawCosts = (belowSA * nBelow + aboveSA * nAbove);
 				float eb;
 
-				if(nAbove == 0) eb = (0.1f + l2/d[axis])*eBonus*rawCosts;
-				else if(nBelow == 0) eb = (0.1f + l1/d[axis])*eBonus*rawCosts;
+				if(nAbove == 0) eb = (0.1f + l2/d[axis])*emptyBonus*rawCosts;
+				else if(nBelow == 0) eb = (0.1f + l1/d[axis])*emptyBonus*rawCosts;
 				else eb = 0.0f;
 
 				float cost = costRatio + invTotalSA * (rawCosts - eb);
@@ -439,19 +663,13 @@ void triKdTree_t::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primI
 				2 when neither current nor subsequent split reduced cost
 */
 
-int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
-		u_int32 *leftPrims, u_int32 *rightPrims, boundEdge *edges[3], //working memory
+int triKdTree_t::buildTree(kdBuildContext_t &ctx, u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums,
+		u_int32 *leftPrims, u_int32 *rightPrims, //working memory
 		u_int32 rightMemSize, int depth, int badRefines ) // status
 {
-	if (nextFreeNode == allocatedNodesCount) {
-		int newCount = 2*allocatedNodesCount;
-		newCount = (newCount > 0x100000) ? allocatedNodesCount+0x80000 : newCount;
-		kdTreeNode 	*n = (kdTreeNode *) y_memalign(64, newCount * sizeof(kdTreeNode));
-		memcpy(n, nodes, allocatedNodesCount * sizeof(kdTreeNode));
-		y_free(nodes);
-		nodes = n;
-		allocatedNodesCount = newCount;
-	}	
+	ctx.reserve(1);
+	kdTreeNode *nodes = ctx.nodes;
+	boundEdge **edges = ctx.edges;
 
 #if _TRI_CLIP > 0
 	if(nPrims <= TRI_CLIP_THRESH)
@@ -466,20 +684,20 @@ int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 			b_ext[0][i] = nodeBound.a[i] - 0.021*bHalfSize[i] - 0.00001*temp;
 			b_ext[1][i] = nodeBound.g[i] + 0.021*bHalfSize[i] + 0.00001*temp;
 		}
-		char *c_old = cdata + (TRI_CLIP_THRESH * CLIP_DATA_SIZE * depth);
-		char *c_new = cdata + (TRI_CLIP_THRESH * CLIP_DATA_SIZE * (depth+1));
+		char *c_old = ctx.cdata + (TRI_CLIP_THRESH * CLIP_DATA_SIZE * depth);
+		char *c_new = ctx.cdata + (TRI_CLIP_THRESH * CLIP_DATA_SIZE * (depth+1));
 		for(unsigned int i=0; i<nPrims; ++i)
 		{
 			const triangle_t *ct = prims[ primNums[i] ];
 			u_int32 old_idx=0;
-			if(clip[depth] >= 0) old_idx = primNums[i+nPrims];
-			if( ct->clipToBound(b_ext, clip[depth], allBounds[totalPrims+nOverl],
+			if(ctx.clip[depth] >= 0) old_idx = primNums[i+nPrims];
+			if( ct->clipToBound(b_ext, ctx.clip[depth], ctx.clipBounds[nOverl],
 				c_old + old_idx*CLIP_DATA_SIZE, c_new + nOverl*CLIP_DATA_SIZE) )
 			{
-				++_clip;
+				++ctx.stats.clipped;
 				oPrims[nOverl] = primNums[i]; nOverl++;
 			}
-			else ++_null_clip;
+			else ++ctx.stats.nullClipped;
 		}
 		//copy back
 		memcpy(primNums, oPrims, nOverl*sizeof(u_int32));
@@ -489,31 +707,32 @@ int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 	//	<< check if leaf criteria met >>
 	if(nPrims <= maxLeafSize || depth >= maxDepth)
 	{
-		nodes[nextFreeNode].createLeaf(primNums, nPrims, prims, primsArena);
-		nextFreeNode++;
-		if( depth >= maxDepth ) depthLimitReached++; //stat
+		nodes[ctx.nextFreeNode].createLeaf(primNums, nPrims, prims, *ctx.arena);
+		ctx.nextFreeNode++;
+		if( depth >= maxDepth ) ctx.stats.depthLimitReached++; //stat
 		return 0;
 	}
 	
+	//do the top levels in parallel, like pointKdTree we split the work into tasks in the first levels only
+	bool parallel = (depth < maxParallelDepth && nPrims >= KD_PARALLEL_MIN_PRIMS);
+	
 	//<< calculate cost for all axes and chose minimum >>
 	splitCost_t split;
-	float baseBonus=eBonus;
-	eBonus *= 1.1 - (float)depth/(float)maxDepth;
-	if(nPrims > 128) pigeonMinCost(nPrims, nodeBound, primNums, split);
+	float depthBonus = eBonus * (1.1 - (float)depth/(float)maxDepth);
+	if(nPrims > 128) pigeonMinCost(nPrims, nodeBound, primNums, depthBonus, parallel, split);
 #if _TRI_CLIP > 0
-	else if (nPrims > TRI_CLIP_THRESH) minimalCost(nPrims, nodeBound, primNums, allBounds, edges, split);
-	else minimalCost(nPrims, nodeBound, primNums, allBounds+totalPrims, edges, split);
+	else if (nPrims > TRI_CLIP_THRESH) minimalCost(ctx, nPrims, nodeBound, primNums, allBounds, depthBonus, split);
+	else minimalCost(ctx, nPrims, nodeBound, primNums, ctx.clipBounds, depthBonus, split);
 #else
-	else minimalCost(nPrims, nodeBound, primNums, allBounds, edges, split);
+	else minimalCost(ctx, nPrims, nodeBound, primNums, allBounds, depthBonus, split);
 #endif
-	eBonus=baseBonus; //restore eBonus
 	//<< if (minimum > leafcost) increase bad refines >>
 	if (split.bestCost > split.oldCost) ++badRefines;
 	if ((split.bestCost > 1.6f * split.oldCost && nPrims < 16) ||
 		split.bestAxis == -1 || badRefines == 2) {
-		nodes[nextFreeNode].createLeaf(primNums, nPrims, prims, primsArena);
-		nextFreeNode++;
-		if( badRefines == 2) ++NumBadSplits; //stat
+		nodes[ctx.nextFreeNode].createLeaf(primNums, nPrims, prims, *ctx.arena);
+		ctx.nextFreeNode++;
+		if( badRefines == 2) ++ctx.stats.badSplits; //stat
 		return 0;
 	}
 	
@@ -606,9 +825,9 @@ int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 	//advance right prims pointer
 	remainingMem -= n1;
 	
-	u_int32 curNode = nextFreeNode;
+	u_int32 curNode = ctx.nextFreeNode;
 	nodes[curNode].createInterior(split.bestAxis, splitPos);
-	++nextFreeNode;
+	++ctx.nextFreeNode;
 	bound_t boundL = nodeBound, boundR = nodeBound;
 	switch(split.bestAxis){
 		case 0: boundL.setMaxX(splitPos); boundR.setMinX(splitPos); break;
@@ -621,25 +840,47 @@ int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 	{
 		remainingMem -= n1;
 		//<< recurse below child >>
-		clip[depth+1] = split.bestAxis;
-		buildTree(n0, boundL, leftPrims, leftPrims, nRightPrims+2*n1, edges, remainingMem, depth+1, badRefines);
-		clip[depth+1] |= 1<<2;
+		ctx.clip[depth+1] = split.bestAxis;
+		buildTree(ctx, n0, boundL, leftPrims, leftPrims, nRightPrims+2*n1, remainingMem, depth+1, badRefines);
+		ctx.clip[depth+1] |= 1<<2;
 		//<< recurse above child >>
-		nodes[curNode].setRightChild (nextFreeNode);
-		buildTree(n1, boundR, nRightPrims, leftPrims, nRightPrims+2*n1, edges, remainingMem, depth+1, badRefines);
-		clip[depth+1] = -1;
+		ctx.nodes[curNode].setRightChild (ctx.nextFreeNode);
+		buildTree(ctx, n1, boundR, nRightPrims, leftPrims, nRightPrims+2*n1, remainingMem, depth+1, badRefines);
+		ctx.clip[depth+1] = -1;
 	}
 	else
-	{
 #endif
+	if(parallel)
+	{
+		//<< build below child in a pool task and above child in this thread, each with own working memory >>
+		kdBuildContext_t ctxL(maxDepth, nullptr), ctxR(maxDepth, nullptr);
+		u_int32 *primsL = new u_int32[std::max( (u_int32)2*TRI_CLIP_THRESH, (u_int32)n0 )];
+		u_int32 *primsR = new u_int32[std::max( (u_int32)2*TRI_CLIP_THRESH, (u_int32)n1 )];
+		u_int32 *rightL = new u_int32[3*n0];
+		u_int32 *rightR = new u_int32[3*n1];
+		memcpy(primsL, leftPrims, n0*sizeof(u_int32));
+		memcpy(primsR, nRightPrims, n1*sizeof(u_int32));
+		taskGroup_t belowWorker;
+		threadPool->run(belowWorker, [&]{ buildTree(ctxL, n0, boundL, primsL, primsL, rightL, 3*n0, depth+1, badRefines); });
+		buildTree(ctxR, n1, boundR, primsR, primsR, rightR, 3*n1, depth+1, badRefines);
+		threadPool->wait(belowWorker);
+		delete[] primsL;
+		delete[] primsR;
+		delete[] rightL;
+		delete[] rightR;
+		//<< append both subtrees in the same order a sequential build would have created them >>
+		ctx.append(ctxL);
+		ctx.nodes[curNode].setRightChild (ctx.nextFreeNode);
+		ctx.append(ctxR);
+	}
+	else
+	{
 		//<< recurse below child >>
-		buildTree(n0, boundL, leftPrims, leftPrims, nRightPrims+n1, edges, remainingMem, depth+1, badRefines);
+		buildTree(ctx, n0, boundL, leftPrims, leftPrims, nRightPrims+n1, remainingMem, depth+1, badRefines);
 		//<< recurse above child >>
-		nodes[curNode].setRightChild (nextFreeNode);
-		buildTree(n1, boundR, nRightPrims, leftPrims, nRightPrims+n1, edges, remainingMem, depth+1, badRefines);
-#if _TRI_CLIP > 0
+		ctx.nodes[curNode].setRightChild (ctx.nextFreeNode);
+		buildTree(ctx, n1, boundR, nRightPrims, leftPrims, nRightPrims+n1, remainingMem, depth+1, badRefines);
 	}
-#endif
 	// free additional working memory, if present
 	if(morePrims) delete[] morePrims;
 	return 1;
@@ -647,6 +888,77 @@ int triKdTree_t::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 	
 
 
+//============================
+/*! Möller-Trumbore test of one ray against the 4 triangles of a leaf group,
+	same operations and tolerances as triangle_t::intersect.
+	slots is the mask of the used slots, see groupSlots().
+	Returns the mask of the hit triangles, t, u (b1) and v (b2) are written for all slots.
+*/
+
+static inline int leafIntersect(const kdTriangle4_t &g, const ray_t &ray, int slots, float *t, float *u, float *v)
+{
+#if KD_SIMD > 0
+	const __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+	const __m128 e1x = _mm_load_ps(g.edge1[0]), e1y = _mm_load_ps(g.edge1[1]), e1z = _mm_load_ps(g.edge1[2]);
+	const __m128 e2x = _mm_load_ps(g.edge2[0]), e2y = _mm_load_ps(g.edge2[1]), e2z = _mm_load_ps(g.edge2[2]);
+	const __m128 eps = _mm_load_ps(g.epsilon);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 valid = _mm_or_ps(_mm_cmple_ps(det, _mm_sub_ps(zero, eps)), _mm_cmpge_ps(det, eps));
+	if(!(_mm_movemask_ps(valid) & slots)) return 0;
+
+	__m128 invDet = _mm_div_ps(one, det);
+	__m128 tx = _mm_sub_ps(_mm_set1_ps(ray.from.x), _mm_load_ps(g.v0[0]));
+	__m128 ty = _mm_sub_ps(_mm_set1_ps(ray.from.y), _mm_load_ps(g.v0[1]));
+	__m128 tz = _mm_sub_ps(_mm_set1_ps(ray.from.z), _mm_load_ps(g.v0[2]));
+	__m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+	if(!(_mm_movemask_ps(valid) & slots)) return 0;
+
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+	__m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+	__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(tt, eps));
+
+	_mm_storeu_ps(t, tt);
+	_mm_storeu_ps(u, uu);
+	_mm_storeu_ps(v, vv);
+	return _mm_movemask_ps(valid) & slots;
+#else
+	int hits = 0;
+	for(int i=0; i<4; ++i)
+	{
+		if(!(slots & (1 << i))) continue;
+		vector3d_t edge1(g.edge1[0][i], g.edge1[1][i], g.edge1[2][i]);
+		vector3d_t edge2(g.edge2[0][i], g.edge2[1][i], g.edge2[2][i]);
+		vector3d_t pvec = ray.dir ^ edge2;
+		float det = edge1 * pvec;
+		if(det > -g.epsilon[i] && det < g.epsilon[i]) continue;
+		float inv_det = 1.f / det;
+		vector3d_t tvec(ray.from.x - g.v0[0][i], ray.from.y - g.v0[1][i], ray.from.z - g.v0[2][i]);
+		u[i] = (tvec*pvec) * inv_det;
+		if (u[i] < 0.f || u[i] > 1.f) continue;
+		vector3d_t qvec = tvec^edge1;
+		v[i] = (ray.dir*qvec) * inv_det;
+		if ((v[i]<0.f) || ((u[i]+v[i])>1.f) ) continue;
+		t[i] = edge2 * qvec * inv_det;
+		if(t[i] < g.epsilon[i]) continue;
+		hits |= 1 << i;
+	}
+	return hits;
+#endif
+}
+
+//! mask of the used slots of the next group of a leaf with left primitives still to test
+static inline int groupSlots(int left) { return (left >= 4) ? 0xF : (1 << left) - 1; }
+
 //============================
 /*! The standard intersect function,
 	returns the closest hit within dist
@@ -656,7 +968,7 @@ bool triKdTree_t::Intersect(const ray_t &ray, float dist, triangle_t **tr, float
 {
 	Z=dist;
 	float a, b, t; // entry/exit/splitting plane signed distance
-	float t_hit;
+	float t_hit[4], u[4], v[4];
 	
 	if( !treeBound.cross(ray, a, b, dist) ) { return false; }
 	
@@ -747,15 +1059,15 @@ bool triKdTree_t::Intersect(const ray_t &ray, float dist, triangle_t **tr, float
 		{
 			triangle_t *mp = currNode->onePrimitive;
 
-			if (mp->intersect(ray, &t_hit, tempData))
+			if (mp->intersect(ray, t_hit, tempData))
 			{
-				if(t_hit < Z && t_hit >= ray.tmin)
+				if(t_hit[0] < Z && t_hit[0] >= ray.tmin)
 				{
 					const material_t *mat = mp->getMaterial();
 					
 					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == VISIBLE_NO_SHADOWS)
 					{
-						Z = t_hit;
+						Z = t_hit[0];
 						*tr = mp;
 						currentData = tempData;
 						hit = true;
@@ -763,27 +1075,25 @@ bool triKdTree_t::Intersect(const ray_t &ray, float dist, triangle_t **tr, float
 				}
 			}
 		}
-		else
+		
+		const kdTriangle4_t *group = currNode->triangles;
+		for(int g = currNode->nGroups(), left = nPrimitives; g > 0; --g, ++group, left -= 4)
 		{
-			triangle_t **prims = currNode->primitives;
-			
-			for (u_int32 i = 0; i < nPrimitives; ++i)
+			int hits = leafIntersect(*group, ray, groupSlots(left), t_hit, u, v);
+			for(int k = 0; hits; ++k, hits >>= 1)
 			{
-				triangle_t *mp = prims[i];
-
-				if (mp->intersect(ray, &t_hit, tempData))
+				if(!(hits & 1)) continue;
+				if(t_hit[k] < Z && t_hit[k] >= ray.tmin)
 				{
-					if(t_hit < Z && t_hit >= ray.tmin)
+					triangle_t *mp = group->tri[k];
+					const material_t *mat = mp->getMaterial();
+					
+					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == VISIBLE_NO_SHADOWS)
 					{
-						const material_t *mat = mp->getMaterial();
-						
-						if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == VISIBLE_NO_SHADOWS)
-						{
-							Z = t_hit;
-							*tr = mp;
-							currentData = tempData;
-							hit = true;
-						}
+						Z = t_hit[k];
+						*tr = mp;
+						mp->setIntersectData(u[k], v[k], currentData);
+						hit = true;
 					}
 				}
 			}
@@ -810,7 +1120,7 @@ bool triKdTree_t::Intersect(const ray_t &ray, float dist, triangle_t **tr, float
 bool triKdTree_t::IntersectS(const ray_t &ray, float dist, triangle_t **tr, float shadow_bias) const
 {
 	float a, b, t; // entry/exit/splitting plane signed distance
-	float t_hit;
+	float t_hit[4], u[4], v[4];
 	
 	if (!treeBound.cross(ray, a, b, dist))
 		return false;
@@ -901,13 +1211,13 @@ bool triKdTree_t::IntersectS(const ray_t &ray, float dist, triangle_t **tr, floa
 		if (nPrimitives == 1)
 		{
 			triangle_t *mp = currNode->onePrimitive;
-			if (mp->intersect(ray, &t_hit, bary))
+			if (mp->intersect(ray, t_hit, bary))
 			{
-				if(t_hit < dist && t_hit >= 0.f ) // '>=' ?
+				if(t_hit[0] < dist && t_hit[0] >= 0.f )
 				{
 					const material_t *mat = mp->getMaterial();
 					
-					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY) // '>=' ?
+					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
 					{
 						*tr = mp;
 						return true;
@@ -915,23 +1225,23 @@ bool triKdTree_t::IntersectS(const ray_t &ray, float dist, triangle_t **tr, floa
 				}
 			}
 		}
-		else
+		
+		const kdTriangle4_t *group = currNode->triangles;
+		for(int g = currNode->nGroups(), left = nPrimitives; g > 0; --g, ++group, left -= 4)
 		{
-			triangle_t **prims = currNode->primitives;
-			for (u_int32 i = 0; i < nPrimitives; ++i)
+			int hits = leafIntersect(*group, ray, groupSlots(left), t_hit, u, v);
+			for(int k = 0; hits; ++k, hits >>= 1)
 			{
-				triangle_t *mp = prims[i];
-				if (mp->intersect(ray, &t_hit, bary))
+				if(!(hits & 1)) continue;
+				if(t_hit[k] < dist && t_hit[k] >= 0.f )
 				{
-					if(t_hit < dist && t_hit >= 0.f )
+					triangle_t *mp = group->tri[k];
+					const material_t *mat = mp->getMaterial();
+					
+					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
 					{
-						const material_t *mat = mp->getMaterial();
-						
-						if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
-						{
-							*tr = mp;
-							return true;
-						}
+						*tr = mp;
+						return true;
 					}
 				}
 			}
@@ -950,10 +1260,23 @@ bool triKdTree_t::IntersectS(const ray_t &ray, float dist, triangle_t **tr, floa
 	allow for transparent shadows.
 =============================================================*/
 
-bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, color_t &filt, float shadow_bias) const
+color_t shadowHitTransparency(renderState_t &state, const triangle_t *tri, const triangleObjectInstance_t *inst, const point3d_t &hit, const vector3d_t &dir, intersectData_t &data)
+{
+	surfacePoint_t sp;
+	if(!inst)
+	{
+		tri->getSurface(sp, hit, data);
+		return tri->getMaterial()->getTransparency(state, sp, dir);
+	}
+	const matrix4x4_t &objToWorld = inst->getObjToWorld();
+	inst->getSurface(sp, tri, objToWorld * hit, data);
+	return tri->getMaterial()->getTransparency(state, sp, objToWorld * dir);
+}
+
+bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDepth, float dist, triangle_t **tr, color_t &filt, float shadow_bias, const triangleObjectInstance_t *inst) const
 {
 	float a, b, t; // entry/exit/splitting plane signed distance
-	float t_hit;
+	float t_hit[4], u[4], v[4];
 	
 	if (!treeBound.cross(ray, a, b, dist))
 		return false;
@@ -973,13 +1296,7 @@ bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 	else invDirZ = 1.f/ray.dir.z;
 	
 	vector3d_t invDir(invDirX, invDirY, invDirZ);
-	int depth=0;
-
-#if ( HAVE_PTHREAD && defined (__GNUC__) && !defined (__clang__) )
-	std::set<const triangle_t *, std::less<const triangle_t *>, __gnu_cxx::__mt_alloc<const triangle_t *> > filtered;
-#else
-	std::set<const triangle_t *> filtered;
-#endif
+	shadowHits_t<triangle_t> filtered;
 
 	KdStack stack[KD_MAX_STACK];
 	const kdTreeNode *farChild, *currNode;
@@ -1063,58 +1380,55 @@ bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 		if (nPrimitives == 1)
 		{
 			triangle_t *mp = currNode->onePrimitive;
-			if (mp->intersect(ray, &t_hit, bary))
+			if (mp->intersect(ray, t_hit, bary))
 			{
-				if(t_hit < dist && t_hit >= ray.tmin ) // '>=' ?
+				if(t_hit[0] < dist && t_hit[0] >= ray.tmin )
 				{
 					const material_t *mat = mp->getMaterial();
 					
-					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY) // '>=' ?
+					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
 					{
 						*tr = mp;
 						
 						if(!mat->isTransparent() ) return true;
 						
-						if(filtered.insert(mp).second)
+						if(!filtered.contains(mp))
 						{
-							if(depth>=maxDepth) return true;
-							point3d_t h=ray.from + t_hit*ray.dir;
-							surfacePoint_t sp;
-							mp->getSurface(sp, h, bary);
-							filt *= mat->getTransparency(state, sp, ray.dir);
-							++depth;
+							if(filtered.full(maxDepth)) return true;
+							filtered.add(mp);
+							filt *= shadowHitTransparency(state, mp, inst, ray.from + t_hit[0]*ray.dir, ray.dir, bary);
+							if(transmissionExhausted(filt)) return true;
 						}
 					}
 				}
 			}
 		}
-		else
+		
+		const kdTriangle4_t *group = currNode->triangles;
+		for(int g = currNode->nGroups(), left = nPrimitives; g > 0; --g, ++group, left -= 4)
 		{
-			triangle_t **prims = currNode->primitives;
-			for (u_int32 i = 0; i < nPrimitives; ++i)
+			int hits = leafIntersect(*group, ray, groupSlots(left), t_hit, u, v);
+			for(int k = 0; hits; ++k, hits >>= 1)
 			{
-				triangle_t *mp = prims[i];
-				if (mp->intersect(ray, &t_hit, bary))
+				if(!(hits & 1)) continue;
+				if(t_hit[k] < dist && t_hit[k] >= ray.tmin)
 				{
-					if(t_hit < dist && t_hit >= ray.tmin)
+					triangle_t *mp = group->tri[k];
+					const material_t *mat = mp->getMaterial();
+					
+					if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
 					{
-						const material_t *mat = mp->getMaterial();
+						*tr = mp;
 						
-						if(mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY)
+						if(!mat->isTransparent() ) return true;
+						
+						if(!filtered.contains(mp))
 						{
-							*tr = mp;
-							
-							if(!mat->isTransparent() ) return true;
-
-							if(filtered.insert(mp).second)
-							{
-								if(depth>=maxDepth) return true;
-								point3d_t h=ray.from + t_hit*ray.dir;
-								surfacePoint_t sp;
-								mp->getSurface(sp, h, bary);
-								filt *= mat->getTransparency(state, sp, ray.dir);
-								++depth;
-							}
+							if(filtered.full(maxDepth)) return true;
+							filtered.add(mp);
+							mp->setIntersectData(u[k], v[k], bary);
+							filt *= shadowHitTransparency(state, mp, inst, ray.from + t_hit[k]*ray.dir, ray.dir, bary);
+							if(transmissionExhausted(filt)) return true;
 						}
 					}
 				}
@@ -1130,5 +1444,155 @@ bool triKdTree_t::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 	return false;
 }
 
+/*=============================================================
+	packet traversal of 4 coherent rays, each ray keeps its own
+	[tmin, tmax] interval, a node is visited if any ray enters it.
+=============================================================*/
+
+static inline ray_t packetLane(const rayPacket4_t &rays, int i)
+{
+	return ray_t(point3d_t(rays.from[0][i], rays.from[1][i], rays.from[2][i]),
+				vector3d_t(rays.dir[0][i], rays.dir[1][i], rays.dir[2][i]), rays.tmin[i]);
+}
+
+//! split plane distances of the lanes, sets the masks of the lanes crossing the plane after entering (lower) and before leaving (upper) the cell
+static inline void splitLanes(const rayPacket4_t &rays, int axis, float split, const float *tmin, const float *tmax, float *t, int &lower, int &upper)
+{
+#if KD_SIMD > 0
+	__m128 ts = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(split), _mm_loadu_ps(rays.from[axis])), _mm_loadu_ps(rays.invDir[axis]));
+	lower = _mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(tmin), ts));
+	upper = _mm_movemask_ps(_mm_cmple_ps(ts, _mm_loadu_ps(tmax)));
+	_mm_storeu_ps(t, ts);
+#else
+	lower = upper = 0;
+	for(int i=0; i<4; ++i)
+	{
+		t[i] = (split - rays.from[axis][i]) * rays.invDir[axis][i];
+		if(tmin[i] <= t[i]) lower |= 1 << i;
+		if(t[i] <= tmax[i]) upper |= 1 << i;
+	}
+#endif
+}
+
+int triKdTree_t::IntersectS4(const rayPacket4_t &rays, int mask, const float *dist, triangle_t **tr, float shadow_bias) const
+{
+	KdPacketToDo cur;
+	cur.node = nodes;
+	cur.active = 0;
+	for(int i=0; i<4; ++i)
+	{
+		if(!(mask & (1 << i))) continue;
+		float a, b;
+		if(treeBound.cross(packetLane(rays, i), a, b, dist[i]))
+		{
+			cur.tmin[i] = a;
+			cur.tmax[i] = std::min(b, dist[i]);
+			cur.active |= 1 << i;
+		}
+	}
+	if(!cur.active) return 0;
+	int alive = cur.active;
+
+	// the near/far order of the children has to be the same for all rays
+	int dirNeg[3];
+	for(int axis=0; axis<3; ++axis)
+	{
+		int neg = 0;
+		for(int i=0; i<4; ++i) if(rays.dir[axis][i] < 0.f) neg |= 1 << i;
+		neg &= cur.active;
+		if(neg != 0 && neg != cur.active)
+		{
+			int hits = 0;
+			for(int i=0; i<4; ++i)
+			{
+				if(!(cur.active & (1 << i))) continue;
+				ray_t ray = packetLane(rays, i);
+				if(IntersectS(ray, dist[i], &tr[i], shadow_bias)) hits |= 1 << i;
+			}
+			return hits;
+		}
+		dirNeg[axis] = (neg != 0);
+	}
+
+	KdPacketToDo stack[KD_MAX_STACK];
+	int stackPtr = 0;
+	int hits = 0, done = 0;
+	float t[4], t_hit[4], u[4], v[4];
+
+	while(true)
+	{
+		// loop until leaf is found
+		while(!cur.node->IsLeaf())
+		{
+			int axis = cur.node->SplitAxis();
+			int lower, upper;
+			splitLanes(rays, axis, cur.node->SplitPos(), cur.tmin, cur.tmax, t, lower, upper);
+			const kdTreeNode *nearChild = cur.node + 1, *farChild = &nodes[cur.node->getRightChild()];
+			// lanes entering the cell before/after the split plane, whatever side that is
+			int needNear = cur.active & lower, needFar = cur.active & upper;
+			if(dirNeg[axis]) std::swap(nearChild, farChild);
+			if(!needFar) { cur.node = nearChild; continue; }
+			if(!needNear) { cur.node = farChild; continue; }
+
+			KdPacketToDo &far = stack[stackPtr++];
+			far.node = farChild;
+			far.active = needFar;
+			for(int i=0; i<4; ++i)
+			{
+				far.tmin[i] = std::max(cur.tmin[i], t[i]);
+				far.tmax[i] = cur.tmax[i];
+				cur.tmax[i] = std::min(cur.tmax[i], t[i]);
+			}
+			cur.node = nearChild;
+			cur.active = needNear;
+		}
+
+		// Check for intersections inside leaf node
+		int nPrimitives = cur.node->nPrimitives();
+		for(int k = 0; k < nPrimitives && (cur.active & ~done); ++k)
+		{
+			triangle_t *mp = cur.node->primitive(k);
+			point3d_t v0;
+			vector3d_t edge1, edge2;
+			float epsilon;
+			if(nPrimitives == 1) mp->getIntersectionData(v0, edge1, edge2, epsilon);
+			else
+			{
+				const kdTriangle4_t &group = cur.node->triangles[k/4];
+				const int s = k%4;
+				v0.set(group.v0[0][s], group.v0[1][s], group.v0[2][s]);
+				edge1.set(group.edge1[0][s], group.edge1[1][s], group.edge1[2][s]);
+				edge2.set(group.edge2[0][s], group.edge2[1][s], group.edge2[2][s]);
+				epsilon = group.epsilon[s];
+			}
+			int primHits = triIntersect4(v0, edge1, edge2, epsilon, rays, cur.active & ~done, t_hit, u, v);
+			if(!primHits) continue;
+			const material_t *mat = mp->getMaterial();
+			for(int i=0; i<4; ++i)
+			{
+				if(!(primHits & (1 << i))) continue;
+				if(t_hit[i] < dist[i] && t_hit[i] >= 0.f && (mat->getVisibility() == NORMAL_VISIBLE || mat->getVisibility() == INVISIBLE_SHADOWS_ONLY))
+				{
+					tr[i] = mp;
+					hits |= 1 << i;
+					done |= 1 << i;
+				}
+			}
+		}
+		if((alive & ~done) == 0) break;
+
+		// pop the next node that is still entered by a ray
+		bool found = false;
+		while(stackPtr > 0)
+		{
+			cur = stack[--stackPtr];
+			cur.active &= ~done;
+			if(cur.active) { found = true; break; }
+		}
+		if(!found) break;
+	}
+
+	return hits;
+}
 
 __END_YAFRAY
@@ -0,0 +1,314 @@
+/****************************************************************************
+ * 			kdtree_cache.cc: on-disk cache of triangle kd-trees
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <yafraycore/kdtree.h>
+#include <fstream>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+#include <boost/filesystem.hpp>
+
+#ifndef WIN32
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+__BEGIN_YAFRAY
+
+#define KD_CACHE_VERSION 1
+
+/*! Cache file layout: the header, then nNodes nodes of two 32 bit words
+	(flags, split position or index of the first leaf triangle) and then
+	nIndices triangle indices of the leaves.
+	The file is in native byte order, the header tells whether it fits. */
+struct kdCacheHeader_t
+{
+	char magic[8];
+	u_int32 version;
+	u_int32 byteOrder; //!< 0x01020304 written natively
+	uint64_t key;
+	u_int32 nPrims, nNodes, nIndices;
+	float bound[6];
+};
+
+struct kdCacheNode_t
+{
+	u_int32 flags;
+	union
+	{
+		float division;
+		u_int32 firstIndex;
+	};
+};
+
+static const char kdCacheMagic[8] = { 'Y', 'A', 'F', 'K', 'D', 'T', 'R', 'E' };
+
+/*! read-only view of a whole file, memory mapped where possible */
+class cacheFileView_t
+{
+public:
+	cacheFileView_t(const std::string &fileName): data(nullptr), size(0)
+	{
+#ifdef WIN32
+		std::ifstream ifs(fileName, std::ios::binary | std::ios::ate);
+		if(!ifs) return;
+		buffer.resize(ifs.tellg());
+		ifs.seekg(0);
+		if(!ifs.read(buffer.data(), buffer.size())) return;
+		data = buffer.data();
+		size = buffer.size();
+#else
+		int fd = open(fileName.c_str(), O_RDONLY);
+		if(fd < 0) return;
+		struct stat st;
+		if(fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(m != MAP_FAILED)
+			{
+				data = (const char *)m;
+				size = st.st_size;
+			}
+		}
+		close(fd);
+#endif
+	}
+	~cacheFileView_t()
+	{
+#ifndef WIN32
+		if(data) munmap((void *)data, size);
+#endif
+	}
+	const char *data;
+	size_t size;
+private:
+#ifdef WIN32
+	std::vector<char> buffer;
+#endif
+};
+
+//! 64 bit FNV-1a over 32 bit words
+static inline void hashWord(uint64_t &h, u_int32 w)
+{
+	h ^= w;
+	h *= 0x100000001b3ULL;
+}
+
+static inline void hashFloat(uint64_t &h, float f)
+{
+	u_int32 w;
+	memcpy(&w, &f, sizeof(w));
+	hashWord(h, w);
+}
+
+uint64_t triKdTree_t::cacheKey(const triangle_t **v, int np, int depth, int leafSize, float cost_ratio, float emptyBonus)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	hashWord(h, KD_CACHE_VERSION);
+	hashWord(h, np);
+	hashWord(h, depth);
+	hashWord(h, leafSize);
+	hashFloat(h, cost_ratio);
+	hashFloat(h, emptyBonus);
+	for(int i=0; i<np; ++i)
+	{
+		point3d_t a;
+		vector3d_t e1, e2;
+		float eps;
+		v[i]->getIntersectionData(a, e1, e2, eps);
+		for(int axis=0; axis<3; ++axis)
+		{
+			hashFloat(h, a[axis]);
+			hashFloat(h, e1[axis]);
+			hashFloat(h, e2[axis]);
+		}
+	}
+	return h;
+}
+
+/*! check that the nodes of a cache file form a tree the traversal can walk safely:
+	interior nodes have the below child right after them and the above child behind it,
+	leaves only reference existing triangles and the depth stays within the stack */
+static bool validCacheNodes(const kdCacheHeader_t &header, const kdCacheNode_t *cNodes, const u_int32 *indices)
+{
+	if(header.nNodes == 0) return false;
+	struct todo_t { u_int32 node; int depth; };
+	std::vector<todo_t> stack(1, {0, 0});
+	u_int32 visited = 0;
+	while(!stack.empty())
+	{
+		todo_t td = stack.back();
+		stack.pop_back();
+		if(td.depth > KD_MAX_STACK || ++visited > header.nNodes) return false;
+		const kdCacheNode_t &n = cNodes[td.node];
+		if((n.flags & 3) == 3)
+		{
+			uint64_t first = n.firstIndex, count = n.flags >> 2;
+			if(first + count > header.nIndices) return false;
+			for(uint64_t k=first; k<first+count; ++k) if(indices[k] >= header.nPrims) return false;
+			continue;
+		}
+		u_int32 right = n.flags >> 2;
+		if(td.node + 1 >= header.nNodes || right <= td.node + 1 || right >= header.nNodes) return false;
+		stack.push_back({right, td.depth + 1});
+		stack.push_back({td.node + 1, td.depth + 1});
+	}
+	return visited == header.nNodes;
+}
+
+triKdTree_t *triKdTree_t::loadCache(const std::string &fileName, uint64_t key, const triangle_t **v, int np, float cost_ratio)
+{
+	cacheFileView_t file(fileName);
+	if(!file.data) return nullptr;
+
+	kdCacheHeader_t header;
+	if(file.size < sizeof(header)) return nullptr;
+	memcpy(&header, file.data, sizeof(header));
+	if(memcmp(header.magic, kdCacheMagic, sizeof(kdCacheMagic)) != 0 || header.version != KD_CACHE_VERSION || header.byteOrder != 0x01020304)
+	{
+		Y_WARNING << "Kd-Tree: Cache file \"" << fileName << "\" has an unknown format, ignoring it" << yendl;
+		return nullptr;
+	}
+	if(header.key != key || header.nPrims != (u_int32)np) return nullptr;
+	if(file.size != sizeof(header) + header.nNodes * sizeof(kdCacheNode_t) + header.nIndices * sizeof(u_int32))
+	{
+		Y_WARNING << "Kd-Tree: Cache file \"" << fileName << "\" is truncated, ignoring it" << yendl;
+		return nullptr;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	const kdCacheNode_t *cNodes = (const kdCacheNode_t *)(file.data + sizeof(header));
+	const u_int32 *indices = (const u_int32 *)(cNodes + header.nNodes);
+	if(!validCacheNodes(header, cNodes, indices))
+	{
+		Y_WARNING << "Kd-Tree: Cache file \"" << fileName << "\" is corrupt, ignoring it" << yendl;
+		return nullptr;
+	}
+
+	triKdTree_t *tree = new triKdTree_t();
+	tree->totalPrims = np;
+	tree->nextFreeNode = tree->allocatedNodesCount = header.nNodes;
+	tree->nodes = (kdTreeNode *)y_memalign_huge(64, header.nNodes * sizeof(kdTreeNode)); // already in the optimized layout
+	tree->treeBound.a.set(header.bound[0], header.bound[1], header.bound[2]);
+	tree->treeBound.g.set(header.bound[3], header.bound[4], header.bound[5]);
+
+	for(u_int32 i=0; i<header.nNodes; ++i)
+	{
+		kdTreeNode &node = tree->nodes[i];
+		node.flags = cNodes[i].flags;
+		if(!node.IsLeaf())
+		{
+			node.division = cNodes[i].division;
+			continue;
+		}
+		node.createLeaf(indices + cNodes[i].firstIndex, node.nPrimitives(), v, tree->primsArena);
+	}
+
+	tree->stats.buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	Y_INFO << "Kd-Tree: Loaded " << header.nNodes << " nodes from cache \"" << fileName << "\" (" << tree->stats.buildTime << "s)" << yendl;
+	tree->stats.fromCache = true;
+	tree->costRatio = cost_ratio;
+	tree->maxDepth = 0;
+	tree->maxLeafSize = 0;
+	tree->collectStats(0.f);
+	tree->stats.print("Kd-Tree");
+	return tree;
+}
+
+bool triKdTree_t::saveCache(const std::string &fileName, uint64_t key, const triangle_t **v) const
+{
+	std::unordered_map<const triangle_t *, u_int32> primIndex;
+	primIndex.reserve(totalPrims);
+	for(u_int32 i=0; i<totalPrims; ++i) primIndex[v[i]] = i;
+
+	std::vector<kdCacheNode_t> cNodes(nextFreeNode);
+	std::vector<u_int32> indices;
+	for(u_int32 i=0; i<nextFreeNode; ++i)
+	{
+		const kdTreeNode &node = nodes[i];
+		cNodes[i].flags = node.flags;
+		if(!node.IsLeaf())
+		{
+			cNodes[i].division = node.division;
+			continue;
+		}
+		cNodes[i].firstIndex = indices.size();
+		int n = node.nPrimitives();
+		for(int k=0; k<n; ++k)
+		{
+			auto p = primIndex.find(node.primitive(k));
+			if(p == primIndex.end()) return false;
+			indices.push_back(p->second);
+		}
+	}
+
+	kdCacheHeader_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kdCacheMagic, sizeof(kdCacheMagic));
+	header.version = KD_CACHE_VERSION;
+	header.byteOrder = 0x01020304;
+	header.key = key;
+	header.nPrims = totalPrims;
+	header.nNodes = nextFreeNode;
+	header.nIndices = indices.size();
+	for(int i=0; i<3; ++i)
+	{
+		header.bound[i] = treeBound.a[i];
+		header.bound[3+i] = treeBound.g[i];
+	}
+
+	// write to a temporary file of our own first, other renders may read or write the cache at the same time
+	boost::system::error_code ec;
+	const std::string tempName = boost::filesystem::unique_path(fileName + ".%%%%-%%%%-%%%%.tmp", ec).string();
+	if(ec)
+	{
+		Y_WARNING << "Kd-Tree: Could not write cache file \"" << fileName << "\": " << ec.message() << yendl;
+		return false;
+	}
+	{
+		std::ofstream ofs(tempName, std::ios::binary);
+		if(ofs)
+		{
+			ofs.write((const char *)&header, sizeof(header));
+			ofs.write((const char *)cNodes.data(), cNodes.size() * sizeof(kdCacheNode_t));
+			ofs.write((const char *)indices.data(), indices.size() * sizeof(u_int32));
+			ofs.close();
+		}
+		if(!ofs)
+		{
+			Y_WARNING << "Kd-Tree: Could not write cache file \"" << fileName << "\"" << yendl;
+			boost::filesystem::remove(tempName, ec);
+			return false;
+		}
+	}
+	boost::filesystem::rename(tempName, fileName, ec);
+	if(ec)
+	{
+		Y_WARNING << "Kd-Tree: Could not write cache file \"" << fileName << "\": " << ec.message() << yendl;
+		boost::filesystem::remove(tempName, ec);
+		return false;
+	}
+	Y_VERBOSE << "Kd-Tree: Saved to cache \"" << fileName << "\"" << yendl;
+	return true;
+}
+
+__END_YAFRAY
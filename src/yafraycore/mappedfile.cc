@@ -0,0 +1,104 @@
+#include <yafraycore/mappedfile.h>
+#include <core_api/logging.h>
+
+#if !defined(_WIN32)
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <cstdlib>
+	#include <cstring>
+	#include <cerrno>
+	#include <vector>
+#endif
+
+__BEGIN_YAFRAY
+
+#if !defined(_WIN32)
+
+mappedFile_t::mappedFile_t(const std::string &dir, size_t bytes): size(bytes)
+{
+	std::string path = (dir.empty() ? std::string(".") : dir) + "/yafaray_film_XXXXXX";
+	std::vector<char> name(path.begin(), path.end());
+	name.push_back('\0');
+
+	fd = mkstemp(name.data());
+	if(fd < 0)
+	{
+		Y_WARNING << "MappedFile: cannot create a file in \"" << dir << "\": " << strerror(errno) << yendl;
+		return;
+	}
+	unlink(name.data());	//nobody else needs to open it, the space is freed when the mapping goes away, even after a crash
+
+	if(ftruncate(fd, size) != 0)
+	{
+		Y_WARNING << "MappedFile: cannot make a file of " << size << " bytes in \"" << dir << "\": " << strerror(errno) << yendl;
+		close(fd);
+		fd = -1;
+		return;
+	}
+
+	void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(ptr == MAP_FAILED)
+	{
+		Y_WARNING << "MappedFile: cannot map " << size << " bytes: " << strerror(errno) << yendl;
+		close(fd);
+		fd = -1;
+		return;
+	}
+	data = ptr;
+	madvise(data, size, MADV_RANDOM);	//no readahead, it would bring back pages released just before
+}
+
+mappedFile_t::~mappedFile_t()
+{
+	if(data) munmap(data, size);
+	if(fd >= 0) close(fd);
+}
+
+void mappedFile_t::release(const void *ptr, size_t bytes)
+{
+	if(!data) return;
+
+	static const size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t begin = (const char *) ptr - (const char *) data;
+	size_t end = begin + bytes;
+	begin = (begin + pageSize - 1) / pageSize * pageSize;
+	end = end / pageSize * pageSize;
+	if(end <= begin) return;
+
+	//dirty pages would stay in the page cache and get mapped again by the fault-around of nearby reads,
+	//so write them back first, then unmap them and drop them from the page cache
+	msync((char *) data + begin, end - begin, MS_SYNC);
+	madvise((char *) data + begin, end - begin, MADV_DONTNEED);
+#if defined(POSIX_FADV_DONTNEED)
+	posix_fadvise(fd, begin, end - begin, POSIX_FADV_DONTNEED);
+#endif
+}
+
+void mappedFile_t::zero()
+{
+	if(!data) return;
+
+	//truncating drops all pages and disk blocks, the mapping stays at the same address
+	madvise(data, size, MADV_DONTNEED);
+	if(ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)
+	{
+		Y_WARNING << "MappedFile: cannot reset the file, clearing it in memory" << yendl;
+		memset(data, 0, size);
+	}
+}
+
+#else
+
+mappedFile_t::mappedFile_t(const std::string &dir, size_t bytes): size(bytes)
+{
+	Y_WARNING << "MappedFile: memory-mapped buffers are not supported on this system" << yendl;
+}
+
+mappedFile_t::~mappedFile_t() {}
+void mappedFile_t::release(const void *ptr, size_t bytes) {}
+void mappedFile_t::zero() {}
+
+#endif
+
+__END_YAFRAY
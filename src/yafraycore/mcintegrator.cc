@@ -154,22 +154,61 @@ inline color_t mcIntegrator_t::doLightEstimation(renderState_t &state, light_t *
 		color_t ccol(0.0);
 		lSample_t ls;
 
+		lSample_t lsPacket[4];
+		ray_t rayPacket[4], shadowRays[4];
+		bool sampled[4];
+		int rayIdx[4];
+		float objIndexPacket[4], matIndexPacket[4];
+
 		hal2.setStart(offs-1);
 		hal3.setStart(offs-1);
 
-		for(int i=0; i<n; ++i)
+		for(int i=0; i<n; i+=4)
 		{
-			// ...get sample val...
-			ls.s1 = hal2.getNext();
-			ls.s2 = hal3.getNext();
+			// take up to 4 samples at once, their shadow rays all start at sp.P and get traced as one packet
+			int nPacket = std::min(4, n - i);
+			int nRays = 0;
+			for(int k=0; k<nPacket; ++k)
+			{
+				// ...get sample val...
+				lsPacket[k].s1 = hal2.getNext();
+				lsPacket[k].s2 = hal3.getNext();
+				rayPacket[k] = lightRay;
+
+				sampled[k] = light->illumSample(sp, lsPacket[k], rayPacket[k]);
+				if(!sampled[k]) continue;
+
+				if(scene->shadowBiasAuto) rayPacket[k].tmin = scene->shadowBias * std::max(1.f, vector3d_t(sp.P).length());
+				else  rayPacket[k].tmin = scene->shadowBias;
+
+				if(castShadows && !trShad)
+				{
+					rayIdx[k] = nRays;
+					shadowRays[nRays] = rayPacket[k];
+					objIndexPacket[nRays] = mask_obj_index;
+					matIndexPacket[nRays] = mask_mat_index;
+					++nRays;
+				}
+			}
+			int packetShadowed = (nRays > 0) ? scene->isShadowed4(state, shadowRays, nRays, objIndexPacket, matIndexPacket) : 0;
 
-			if( light->illumSample (sp, ls, lightRay) )
+			for(int k=0; k<nPacket; ++k)
 			{
+				if(!sampled[k]) continue;
+				ls = lsPacket[k];
+				lightRay = rayPacket[k];
+
 				// ...shadowed...
-				if(scene->shadowBiasAuto) lightRay.tmin = scene->shadowBias * std::max(1.f, vector3d_t(sp.P).length());
-				else  lightRay.tmin = scene->shadowBias;
-				
-				if (castShadows) shadowed = (trShad) ? scene->isShadowed(state, lightRay, sDepth, scol, mask_obj_index, mask_mat_index) : scene->isShadowed(state, lightRay, mask_obj_index, mask_mat_index);
+				if (castShadows && trShad) shadowed = scene->isShadowed(state, lightRay, sDepth, scol, mask_obj_index, mask_mat_index);
+				else if (castShadows)
+				{
+					shadowed = packetShadowed & (1 << rayIdx[k]);
+					if(shadowed)
+					{
+						mask_obj_index = objIndexPacket[rayIdx[k]];
+						mask_mat_index = matIndexPacket[rayIdx[k]];
+					}
+				}
 				else shadowed = false;
 
 				if((!shadowed && ls.pdf > 1e-6f) || colorPasses.enabled(PASS_INT_DIFFUSE_NO_SHADOW))
@@ -577,9 +616,7 @@ bool mcIntegrator_t::createCausticMap()
 
 		if(nThreads >= 2)
 		{
-			std::vector<std::thread> threads;
-			for(int i=0; i<nThreads; ++i) threads.push_back(std::thread(&mcIntegrator_t::causticWorker, this, session.causticMap, i, scene, nCausPhotons, lightPowerD, numLights, std::ref(integratorName), causLights, causDepth, pb, pbStep, std::ref(curr)));		
-			for(auto& t : threads) t.join();
+			scene->getThreadPool().parallelFor(0, nThreads, [&](int i){ causticWorker(session.causticMap, i, scene, nCausPhotons, lightPowerD, numLights, integratorName, causLights, causDepth, pb, pbStep, curr); }, nThreads);
 		}
 		else		
 		{
@@ -715,7 +752,7 @@ bool mcIntegrator_t::createCausticMap()
 		if(session.causticMap->nPhotons() > 0)
 		{
 			pb->setTag("Building caustic photons kd-tree...");
-			session.causticMap->updateTree();
+			session.causticMap->updateTree(&scene->getThreadPool());
 			Y_VERBOSE << integratorName << ": Done." << yendl;
 		}
 
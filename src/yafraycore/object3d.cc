@@ -62,17 +62,20 @@ triangleObjectInstance_t::triangleObjectInstance_t(triangleObject_t *base, matri
 	normals_exported = mBase->normals_exported;
 	visible = true;
 	is_base_mesh = false;
-
-	triangles.reserve(mBase->triangles.size());
-
-	for(size_t i = 0; i < mBase->triangles.size(); i++)
-	{
-		triangles.push_back(triangleInstance_t(&mBase->triangles[i], this));
-	}
 }
 
 int triangleObjectInstance_t::getPrimitives(const triangle_t **prims)
 {
+	if(triangles.empty())
+	{
+		triangles.reserve(mBase->triangles.size());
+
+		for(size_t i = 0; i < mBase->triangles.size(); i++)
+		{
+			triangles.push_back(triangleInstance_t(&mBase->triangles[i], this));
+		}
+	}
+
 	for(size_t i = 0; i < triangles.size(); i++)
 	{
 		prims[i] = &triangles[i];
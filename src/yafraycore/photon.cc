@@ -104,12 +104,12 @@ bool photonMapSave(const photonMap_t * map, const std::string &filename, bool de
     }
 }
 
-void photonMap_t::updateTree()
+void photonMap_t::updateTree(threadPool_t *pool)
 {
 	if(tree) delete tree;
 	if(photons.size() > 0)
 	{
-		tree = new kdtree::pointKdTree<photon_t>(photons, name, threadsPKDtree);
+		tree = new kdtree::pointKdTree<photon_t>(photons, name, threadsPKDtree, pool);
 		updated = true;
 	}
 	else tree=0;
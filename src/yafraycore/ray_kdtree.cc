@@ -1,15 +1,13 @@
 // search for "todo" and "IMPLEMENT" and "<<" or ">>"...
 
 #include <yafraycore/ray_kdtree.h>
+#include <yafraycore/kdtree.h>
 #include <core_api/material.h>
 #include <core_api/scene.h>
 #include <stdexcept>
 //#include <math.h>
 #include <limits>
-#include <set>
-#if (defined (__GNUC__) && !defined (__clang__))
-#include <ext/mt_allocator.h>
-#endif
+#include <chrono>
 #include <time.h>
 
 __BEGIN_YAFRAY
@@ -23,8 +21,6 @@ __BEGIN_YAFRAY
 #define CLIP_DATA_SIZE (3*12*sizeof(double))
 #define KD_BINS 1024
 
-#define KD_MAX_STACK 64
-
 // #define Y_MIN3(a,b,c) ( ((a)>(b)) ? ( ((b)>(c))?(c):(b)):( ((a)>(c))?(c):(a)) )
 // #define Y_MAX3(a,b,c) ( ((a)<(b)) ? ( ((b)>(c))?(b):(c)):( ((a)>(c))?(a):(c)) )
 
@@ -55,9 +51,6 @@ inline int Y_Float2Int(double val) {
 #endif
 }
 
-//still in old file...
-//int Kd_inodes=0, Kd_leaves=0, _emptyKd_leaves=0, Kd_prims=0, _clip=0, _bad_clip=0, _null_clip=0, _early_out=0;
-
 //bound_t getTriBound(const triangle_t tri);
 //int triBoxOverlap(double boxcenter[3],double boxhalfsize[3],double triverts[3][3]);
 //int triBoxClip(const double b_min[3], const double b_max[3], const double triverts[3][3], bound_t &box);
@@ -67,11 +60,8 @@ kdTree_t<T>::kdTree_t(const T **v, int np, int depth, int leafSize,
 			float cost_ratio, float emptyBonus)
 	: costRatio(cost_ratio), eBonus(emptyBonus), maxDepth(depth)
 {
-	std::cout << "starting build of kd-tree ("<<np<<" prims, cr:"<<costRatio<<" eb:"<<eBonus<<")\n";
-	clock_t c_start, c_end;
-	c_start = clock();
-	Kd_inodes=0, Kd_leaves=0, _emptyKd_leaves=0, Kd_prims=0, depthLimitReached=0, NumBadSplits=0,
-		_clip=0, _bad_clip=0, _null_clip=0, _early_out=0;
+	Y_INFO << "Kd-Tree (universal): Starting build (" << np << " prims, cr:" << costRatio << " eb:" << eBonus << ")" << yendl;
+	auto phaseStart = std::chrono::steady_clock::now();
 	totalPrims = np;
 	nextFreeNode = 0;
 	allocatedNodesCount = 256;
@@ -90,7 +80,7 @@ kdTree_t<T>::kdTree_t(const T **v, int np, int depth, int leafSize,
 	//experiment: add penalty to cost ratio to reduce memory usage on huge scenes
 	if( logLeaves > 16.0 ) costRatio += 0.25*( logLeaves - 16.0 );
 	allBounds = new bound_t[totalPrims + TRI_CLIP_THRESH+1];
-	std::cout << "getting triangle bounds...";
+	Y_VERBOSE << "Kd-Tree (universal): Getting primitive bounds..." << yendl;
 	for(u_int32 i=0; i<totalPrims; i++)
 	{
 		allBounds[i] = v[i]->getBound();
@@ -105,7 +95,8 @@ kdTree_t<T>::kdTree_t(const T **v, int np, int depth, int leafSize,
 		double foo = (treeBound.g[i] - treeBound.a[i])*0.001;
 		treeBound.a[i] -= foo, treeBound.g[i] += foo;
 	}
-	std::cout << "done!\n";
+	Y_VERBOSE << "Kd-Tree (universal): Done." << yendl;
+	stats.boundsTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - phaseStart).count();
 	// get working memory for tree construction
 	boundEdge *edges[3];
 	u_int32 rMemSize = 3*totalPrims; // (maxDepth+1)*totalPrims;
@@ -122,7 +113,7 @@ kdTree_t<T>::kdTree_t(const T **v, int np, int depth, int leafSize,
 	
 	/* build tree */
 	prims = v;
-	std::cout << "starting recursive build...\n";
+	Y_VERBOSE << "Kd-Tree (universal): Starting recursive build..." << yendl;
 	buildTree(totalPrims, treeBound, leftPrims,
 			  leftPrims, rightPrims, edges, // <= working memory
 			  rMemSize, 0, 0 );
@@ -134,20 +125,18 @@ kdTree_t<T>::kdTree_t(const T **v, int np, int depth, int leafSize,
 	for (int i = 0; i < 3; ++i) delete[] edges[i];
 	delete[] clip;
 	y_free(cdata);
+	stats.buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - phaseStart).count() - stats.boundsTime;
+	
 	//print some stats:
-	c_end = clock() - c_start;
-	std::cout << "\n=== kd-tree stats ("<< float(c_end) / (float)CLOCKS_PER_SEC <<"s) ===\n";
-	std::cout << "used/allocated kd-tree nodes: " << nextFreeNode << "/" << allocatedNodesCount
-		<< " (" << 100.f * float(nextFreeNode)/allocatedNodesCount << "%)\n";
-	std::cout << "primitives in tree: " << totalPrims << std::endl;
-	std::cout << "interior nodes: " << Kd_inodes << " / " << "leaf nodes: " << Kd_leaves
-		<< " (empty: " << _emptyKd_leaves << " = " << 100.f * float(_emptyKd_leaves)/Kd_leaves << "%)\n";
-	std::cout << "leaf prims: " << Kd_prims << " (" << float(Kd_prims)/totalPrims << "x prims in tree, leaf size:"<< maxLeafSize<<")\n";
-	std::cout << "   => " << float(Kd_prims)/ (Kd_leaves-_emptyKd_leaves) << " prims per non-empty leaf\n";
-	std::cout << "leaves due to depth limit/bad splits: " << depthLimitReached << "/" << NumBadSplits << "\n";
-	std::cout << "clipped triangles: " << _clip << " (" <<_bad_clip << " bad clips, "<<_null_clip
-		<<" null clips)\n";
-	//std::cout << "early outs: " << _early_out << "\n\n";
+	auto statsStart = std::chrono::steady_clock::now();
+	stats.totalPrims = totalPrims;
+	stats.costRatio = costRatio;
+	stats.eBonus = eBonus;
+	stats.maxDepth = maxDepth;
+	stats.maxLeafSize = maxLeafSize;
+	stats.collect(nodes, treeBound, costRatio);
+	stats.statsTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - statsStart).count();
+	stats.print("Kd-Tree (universal)");
 }
 
 template<class T>
@@ -383,7 +372,7 @@ void kdTree_t<T>::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primI
 					split.bestAxis = axis;
 					split.bestOffset = 0;
 					split.nEdge = nEdge;
-					++_early_out;
+					++stats.earlyOut;
 				}
 				continue;
 			}
@@ -399,7 +388,7 @@ void kdTree_t<T>::minimalCost(u_int32 nPrims, bound_t &nodeBound, u_int32 *primI
 					split.bestAxis = axis;
 					split.bestOffset = nEdge-1;
 					split.nEdge = nEdge;
-					++_early_out;
+					++stats.earlyOut;
 				}
 				continue;
 			}
@@ -497,10 +486,10 @@ int kdTree_t<T>::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 				if( ct->clipToBound(b_ext, clip[depth], allBounds[totalPrims+nOverl],
 					c_old + old_idx*CLIP_DATA_SIZE, c_new + nOverl*CLIP_DATA_SIZE) )
 				{
-					++_clip;
+					++stats.clipped;
 					oPrims[nOverl] = primNums[i]; nOverl++;
 				}
-				else ++_null_clip;
+				else ++stats.nullClipped;
 			}
 			else
 			{
@@ -520,7 +509,7 @@ int kdTree_t<T>::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 //		std::cout << "leaf\n";
 		nodes[nextFreeNode].createLeaf(primNums, nPrims, prims, primsArena);
 		nextFreeNode++;
-		if( depth >= maxDepth ) depthLimitReached++; //stat
+		if( depth >= maxDepth ) stats.depthLimitReached++; //stat
 		return 0;
 	}
 	
@@ -542,7 +531,7 @@ int kdTree_t<T>::buildTree(u_int32 nPrims, bound_t &nodeBound, u_int32 *primNums
 		split.bestAxis == -1 || badRefines == 2) {
 		nodes[nextFreeNode].createLeaf(primNums, nPrims, prims, primsArena);
 		nextFreeNode++;
-		if( badRefines == 2) ++NumBadSplits; //stat
+		if( badRefines == 2) ++stats.badSplits; //stat
 		return 0;
 	}
 	
@@ -973,12 +962,7 @@ bool kdTree_t<T>::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 	intersectData_t bary;
 	vector3d_t invDir(1.f/ray.dir.x, 1.f/ray.dir.y, 1.f/ray.dir.z);
 
-	int depth=0;
-#if (defined (__GNUC__)  && !defined (__clang__))
-	std::set<const T *, std::less<const T *>, __gnu_cxx::__mt_alloc<const T *> > filtered;
-#else
-	std::set<const T *> filtered;
-#endif
+	shadowHits_t<T> filtered;
 	rKdStack<T> stack[KD_MAX_STACK];
 	const rkdTreeNode<T> *farChild, *currNode;
 	currNode = nodes;
@@ -1066,14 +1050,15 @@ bool kdTree_t<T>::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 				{
 					const material_t *mat = mp->getMaterial();
 					if(!mat->isTransparent() ) return true;
-					if(filtered.insert(mp).second)
+					if(!filtered.contains(mp))
 					{
-						if(depth>=maxDepth) return true;
+						if(filtered.full(maxDepth)) return true;
+						filtered.add(mp);
 						point3d_t h=ray.from + t_hit*ray.dir;
 						surfacePoint_t sp;
 						mp->getSurface(sp, h, bary);
 						filt *= mat->getTransparency(state, sp, ray.dir);
-						++depth;
+						if(transmissionExhausted(filt)) return true;
 					}
 				}
 			}
@@ -1089,14 +1074,15 @@ bool kdTree_t<T>::IntersectTS(renderState_t &state, const ray_t &ray, int maxDep
 					{
 						const material_t *mat = mp->getMaterial();
 						if(!mat->isTransparent() ) return true;
-						if(filtered.insert(mp).second)
+						if(!filtered.contains(mp))
 						{
-							if(depth>=maxDepth) return true;
+							if(filtered.full(maxDepth)) return true;
+							filtered.add(mp);
 							point3d_t h=ray.from + t_hit*ray.dir;
 							surfacePoint_t sp;
 							mp->getSurface(sp, h, bary);
 							filt *= mat->getTransparency(state, sp, ray.dir);
-							++depth;
+							if(transmissionExhausted(filt)) return true;
 						}
 					}
 				}
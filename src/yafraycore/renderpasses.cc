@@ -199,6 +199,8 @@ void renderPasses_t::generate_pass_maps()
 	intPassMapStringInt["debug-dudx-dvdx"] = PASS_INT_DEBUG_DUDX_DVDX;
 	intPassMapStringInt["debug-dudy-dvdy"] = PASS_INT_DEBUG_DUDY_DVDY;
 	intPassMapStringInt["debug-dudxy-dvdxy"] = PASS_INT_DEBUG_DUDXY_DVDXY;
+	intPassMapStringInt["debug-aa-noise"] = PASS_INT_AA_NOISE;
+	intPassMapStringInt["debug-render-time"] = PASS_INT_DEBUG_RENDER_TIME;
 	
 	//Generation of reverse map (pass type -> pass_string)
 	for(auto it = intPassMapStringInt.begin(); it != intPassMapStringInt.end(); ++it)
@@ -396,6 +398,80 @@ void renderPasses_t::set_pass_mask_mat_index(float new_mat_index) { pass_mask_ma
 void renderPasses_t::set_pass_mask_invert(bool mask_invert) { pass_mask_invert = mask_invert; }
 void renderPasses_t::set_pass_mask_only(bool mask_only) { pass_mask_only = mask_only; }
 
+int renderPasses_t::intPassChannels(intPassTypes_t intPassType)
+{
+	switch(intPassType)	//Only the channels each pass really has are stored in the image film. Gray and RGB passes are read back opaque
+	{
+		case PASS_INT_AA_SAMPLES:
+		case PASS_INT_DEBUG_RENDER_TIME:		return 0;	//Only the weight is accumulated
+		
+		case PASS_INT_Z_DEPTH_NORM:
+		case PASS_INT_Z_DEPTH_ABS:
+		case PASS_INT_MIST:
+		case PASS_INT_OBJ_INDEX_ABS:
+		case PASS_INT_OBJ_INDEX_NORM:
+		case PASS_INT_OBJ_INDEX_AUTO_ABS:
+		case PASS_INT_MAT_INDEX_ABS:
+		case PASS_INT_MAT_INDEX_NORM:
+		case PASS_INT_MAT_INDEX_AUTO_ABS:
+		case PASS_INT_DEBUG_SAMPLING_FACTOR:	return 1;
+		
+		case PASS_INT_AA_NOISE:					return 2;	//Sum of the sample brightness and of its square
+		
+		case PASS_INT_NORMAL_SMOOTH:
+		case PASS_INT_NORMAL_GEOM:
+		case PASS_INT_UV:
+		case PASS_INT_AO:
+		case PASS_INT_AO_CLAY:
+		case PASS_INT_OBJ_INDEX_AUTO:
+		case PASS_INT_MAT_INDEX_AUTO:
+		case PASS_INT_DEBUG_NU:
+		case PASS_INT_DEBUG_NV:
+		case PASS_INT_DEBUG_DPDU:
+		case PASS_INT_DEBUG_DPDV:
+		case PASS_INT_DEBUG_DSDU:
+		case PASS_INT_DEBUG_DSDV:
+		case PASS_INT_DEBUG_DP_LENGTHS:
+		case PASS_INT_DEBUG_DPDX:
+		case PASS_INT_DEBUG_DPDY:
+		case PASS_INT_DEBUG_DPDXY:
+		case PASS_INT_DEBUG_DUDX_DVDX:
+		case PASS_INT_DEBUG_DUDY_DVDY:
+		case PASS_INT_DEBUG_DUDXY_DVDXY:		return 3;
+		
+		default:								return 4;	//Combined, light and mask passes can be transparent
+	}
+}
+
+intPassPrecision_t renderPasses_t::intPassPrecision(intPassTypes_t intPassType)
+{
+	switch(intPassType)	//Depths, indexes and light can go far beyond 1, so they keep full precision
+	{
+		case PASS_INT_NORMAL_SMOOTH:
+		case PASS_INT_NORMAL_GEOM:
+		case PASS_INT_OBJ_INDEX_MASK:
+		case PASS_INT_OBJ_INDEX_MASK_SHADOW:
+		case PASS_INT_OBJ_INDEX_MASK_ALL:
+		case PASS_INT_MAT_INDEX_MASK:
+		case PASS_INT_MAT_INDEX_MASK_SHADOW:
+		case PASS_INT_MAT_INDEX_MASK_ALL:
+		case PASS_INT_DEBUG_NU:
+		case PASS_INT_DEBUG_NV:
+		case PASS_INT_DEBUG_DPDU:
+		case PASS_INT_DEBUG_DPDV:
+		case PASS_INT_DEBUG_DSDU:
+		case PASS_INT_DEBUG_DSDV:
+		case PASS_INT_DEBUG_DPDX:
+		case PASS_INT_DEBUG_DPDY:
+		case PASS_INT_DEBUG_DPDXY:
+		case PASS_INT_DEBUG_DUDX_DVDX:
+		case PASS_INT_DEBUG_DUDY_DVDY:
+		case PASS_INT_DEBUG_DUDXY_DVDXY:		return PASS_INT_PRECISION_HALF;
+		
+		default:								return PASS_INT_PRECISION_FLOAT;
+	}
+}
+
 
 
 ////////////////////////////
@@ -30,7 +30,11 @@
 #include <yafraycore/triangle.h>
 #include <yafraycore/kdtree.h>
 #include <yafraycore/ray_kdtree.h>
+#include <yafraycore/bvh.h>
+#include <yafraycore/instancetree.h>
 #include <yafraycore/timer.h>
+#include <yafraycore/threadpool.h>
+#include <core_api/environment.h>
 #include <yafraycore/scr_halton.h>
 #include <utilities/mcqmc.h>
 #include <utilities/sample_utils.h>
@@ -46,7 +50,7 @@
 
 __BEGIN_YAFRAY
 
-scene_t::scene_t(const renderEnvironment_t *render_environment):  volIntegrator(nullptr), camera(nullptr), imageFilm(nullptr), tree(nullptr), vtree(nullptr), background(nullptr), surfIntegrator(nullptr),	AA_samples(1), AA_passes(1), AA_threshold(0.05), nthreads(1), nthreads_photons(1), mode(1), signals(0), env(render_environment)
+scene_t::scene_t(const renderEnvironment_t *render_environment):  volIntegrator(nullptr), camera(nullptr), imageFilm(nullptr), tree(nullptr), vtree(nullptr), bvh(nullptr), vbvh(nullptr), itree(nullptr), blasCache(new triBlasCache_t()), background(nullptr), surfIntegrator(nullptr),	AA_samples(1), AA_passes(1), AA_threshold(0.05), nthreads(1), nthreads_photons(1), mode(1), accelerator(ACCEL_KDTREE), accelPerObject(false), kdCostRatio(0.8f), kdEmptyBonus(0.33f), kdLeafSize(1), signals(0), env(render_environment)
 {
 	state.changes = C_ALL;
 	state.stack.push_front(READY);
@@ -69,6 +73,10 @@ scene_t::~scene_t()
 {
 	if(tree) delete tree;
 	if(vtree) delete vtree;
+	if(bvh) delete bvh;
+	if(vbvh) delete vbvh;
+	if(itree) delete itree;
+	delete blasCache;
 	for(auto i = meshes.begin(); i != meshes.end(); ++i)
 	{
 		if(i->second.type == TRIM)
@@ -113,6 +121,13 @@ void scene_t::getAAParameters(int &samples, int &passes, int &inc_samples, float
 	clamp_indirect = AA_clamp_indirect;
 }
 
+void scene_t::getProgressiveParameters(bool &enable, float &timeBudget, int &maxSamples) const
+{
+	enable = progressive;
+	timeBudget = progressiveTime;
+	maxSamples = progressiveSamples;
+}
+
 bool scene_t::startGeometry()
 {
 	if(state.stack.front() != READY) return false;
@@ -291,6 +306,8 @@ bool scene_t::startTriMesh(objID_t id, int vertices, int triangles, bool hasOrco
 	if(ptype != TRIM && type != VTRIM && type != MTRIM) return false;
 
 	objData_t &nObj = meshes[id];
+	// a mesh sent again replaces the old one, so its tree is outdated
+	if(ptype == TRIM && nObj.obj) blasCache->remove(nObj.obj);
 	switch(ptype)
 	{
 		case TRIM:	nObj.obj = new triangleObject_t(triangles, hasUV, hasOrco);
@@ -341,6 +358,41 @@ bool scene_t::endTriMesh()
 	return true;
 }
 
+void scene_t::setAccelerator(int a)
+{
+	if(a == accelerator) return;
+	accelerator = a;
+	state.changes |= C_GEOM;
+}
+
+void scene_t::setAccelPerObject(bool perObject)
+{
+	if(perObject == accelPerObject) return;
+	accelPerObject = perObject;
+	state.changes |= C_GEOM;
+}
+
+void scene_t::setAccelKdParams(float costRatio, float emptyBonus, int leafSize)
+{
+	if(costRatio == kdCostRatio && emptyBonus == kdEmptyBonus && leafSize == kdLeafSize) return;
+	kdCostRatio = costRatio;
+	kdEmptyBonus = emptyBonus;
+	kdLeafSize = leafSize;
+	state.changes |= C_GEOM;
+}
+
+const kdTreeStats_t* scene_t::getAccelStats() const
+{
+	if(tree) return &tree->getStats();
+	if(vtree) return &vtree->getStats();
+	return nullptr;
+}
+
+threadPool_t &scene_t::getThreadPool() const
+{
+	return env->getThreadPool();
+}
+
 void scene_t::setNumThreads(int threads)
 {
 	nthreads = threads;
@@ -837,30 +889,48 @@ void scene_t::setAntialiasing(int numSamples, int numPasses, int incSamples, dou
 	AA_clamp_indirect = clamp_indirect;
 }
 
+void scene_t::setProgressive(bool enable, float timeBudget, int maxSamples)
+{
+	progressive = enable;
+	progressiveTime = timeBudget;
+	progressiveSamples = maxSamples;
+}
+
 /*! update scene state to prepare for rendering.
 	\return false if something vital to render the scene is missing
 			true otherwise
 */
 bool scene_t::update()
 {
-	Y_VERBOSE << "Scene: Mode \"" << ((mode == 0) ? "Triangle" : "Universal" ) << "\"" << yendl;
+	Y_VERBOSE << "Scene: Mode \"" << ((mode == 0) ? "Triangle" : "Universal" ) << "\", Accelerator \"" << ((accelerator == ACCEL_BVH) ? "BVH" : "kd-tree") << "\"" << yendl;
 	if(!camera || !imageFilm) return false;
 	if(state.changes & C_GEOM)
 	{
 		if(tree) delete tree;
 		if(vtree) delete vtree;
+		if(bvh) delete bvh;
+		if(vbvh) delete vbvh;
+		if(itree) delete itree;
 		tree = nullptr, vtree = nullptr;
+		bvh = nullptr, vbvh = nullptr;
+		itree = nullptr;
 		int nprims=0;
 		if(mode==0)
 		{
+			// instances are not flattened into the scene tree, they get a two level tree
+			std::vector<const triangleObjectInstance_t *> instances;
+			std::vector<triangleObject_t *> objects;
 			for(auto i=meshes.begin(); i!=meshes.end(); ++i)
 			{
                 objData_t &dat = (*i).second;
 
                 if (!dat.obj->isVisible()) continue;
                 if (dat.obj->isBaseObject()) continue;
+				if (dat.type != TRIM) continue;
 
-				if(dat.type == TRIM) nprims += dat.obj->numPrimitives();
+				if(dat.obj->isInstance()) instances.push_back((const triangleObjectInstance_t *)dat.obj);
+				else if(accelPerObject) objects.push_back(dat.obj);
+				else nprims += dat.obj->numPrimitives();
 			}
 			if(nprims > 0)
 			{
@@ -873,11 +943,42 @@ bool scene_t::update()
 					if (!dat.obj->isVisible()) continue;
 					if (dat.obj->isBaseObject()) continue;
 
-					if(dat.type == TRIM) insert += dat.obj->getPrimitives(insert);
+					if(dat.type == TRIM && !dat.obj->isInstance()) insert += dat.obj->getPrimitives(insert);
+				}
+				if(accelerator == ACCEL_BVH)
+				{
+					bvh = new bvhTree_t<triangle_t>(tris, nprims);
+					sceneBound = bvh->getBound();
+				}
+				else
+				{
+					if(!accelCacheDir.empty())
+					{
+						// static sets of animations get the tree of the previous frames
+						uint64_t key = triKdTree_t::cacheKey(tris, nprims, -1, kdLeafSize, kdCostRatio, kdEmptyBonus);
+						std::stringstream cacheFile;
+						cacheFile << accelCacheDir << "/yafaray_kdtree_" << std::hex << key << ".cache";
+						tree = triKdTree_t::loadCache(cacheFile.str(), key, tris, nprims, kdCostRatio);
+						if(!tree)
+						{
+							tree = new triKdTree_t(tris, nprims, -1, kdLeafSize, kdCostRatio, kdEmptyBonus, nthreads, &getThreadPool());
+							tree->saveCache(cacheFile.str(), key, tris);
+						}
+					}
+					else tree = new triKdTree_t(tris, nprims, -1, kdLeafSize, kdCostRatio, kdEmptyBonus, nthreads, &getThreadPool());
+					sceneBound = tree->getBound();
 				}
-				tree = new triKdTree_t(tris, nprims, -1, 1, 0.8, 0.33 /* -1, 1.2, 0.40 */ );
 				delete [] tris;
-				sceneBound = tree->getBound();
+			}
+			if(!instances.empty() || !objects.empty())
+			{
+				itree = new triInstanceTree_t(instances, objects, *blasCache, accelerator == ACCEL_BVH,
+					kdLeafSize, kdCostRatio, kdEmptyBonus, nthreads, &getThreadPool());
+				if(nprims > 0) sceneBound = bound_t(sceneBound, itree->getBound());
+				else sceneBound = itree->getBound();
+			}
+			if(nprims > 0 || itree)
+			{
 				Y_VERBOSE << "Scene: New scene bound is:" <<
 				"(" << sceneBound.a.x << ", " << sceneBound.a.y << ", " << sceneBound.a.z << "), (" <<
 				sceneBound.g.x << ", " << sceneBound.g.y << ", " << sceneBound.g.z << ")" << yendl;
@@ -914,9 +1015,17 @@ bool scene_t::update()
 				{
 					insert += i->second->getPrimitives(insert);
 				}
-				vtree = new kdTree_t<primitive_t>(tris, nprims, -1, 1, 0.8, 0.33 /* -1, 1.2, 0.40 */ );
+				if(accelerator == ACCEL_BVH)
+				{
+					vbvh = new bvhTree_t<primitive_t>(tris, nprims);
+					sceneBound = vbvh->getBound();
+				}
+				else
+				{
+					vtree = new kdTree_t<primitive_t>(tris, nprims, -1, kdLeafSize, kdCostRatio, kdEmptyBonus);
+					sceneBound = vtree->getBound();
+				}
 				delete [] tris;
-				sceneBound = vtree->getBound();
 				Y_VERBOSE << "Scene: New scene bound is:" << yendl <<
 				"(" << sceneBound.a.x << ", " << sceneBound.a.y << ", " << sceneBound.a.z << "), (" <<
 				sceneBound.g.x << ", " << sceneBound.g.y << ", " << sceneBound.g.z << ")" << yendl;
@@ -929,6 +1038,15 @@ bool scene_t::update()
 			}
 			else Y_ERROR << "Scene: Scene is empty..." << yendl;
 		}
+
+		if(const kdTreeStats_t *accelStats = getAccelStats())
+		{
+			std::stringstream set;
+			set << "Kd-tree: prims=" << accelStats->totalPrims << " depth=" << accelStats->treeDepth << " SAH cost=" << accelStats->sahCost;
+			if(accelStats->fromCache) set << " (cached)";
+			set << std::endl;
+			yafLog.appendRenderSettings(set.str());
+		}
 	}
 
 	for(unsigned int i=0; i<lights.size(); ++i) lights[i]->init(*this);
@@ -962,20 +1080,45 @@ bool scene_t::intersect(const ray_t &ray, surfacePoint_t &sp) const
 	// intersect with tree:
 	if(mode == 0)
 	{
-		if(!tree) return false;
 		triangle_t *hitt = nullptr;
-		if( ! tree->Intersect(ray, dis, &hitt, Z, data) ){ return false; }
+		bool hit = false;
+		if(bvh) hit = bvh->Intersect(ray, dis, &hitt, Z, data);
+		else if(tree) hit = tree->Intersect(ray, dis, &hitt, Z, data);
+		const triangleObjectInstance_t *hitInst = nullptr;
+		if(itree)
+		{
+			const triangle_t *instTri = nullptr;
+			float instZ;
+			intersectData_t instData;
+			if(itree->Intersect(ray, hit ? Z : dis, &instTri, &hitInst, instZ, instData))
+			{
+				hitt = (triangle_t *)instTri;
+				Z = instZ;
+				data = instData;
+				hit = true;
+			}
+			else hitInst = nullptr;
+		}
+		if(!hit) return false;
 		point3d_t h=ray.from + Z*ray.dir;
-		hitt->getSurface(sp, h, data);
+		if(hitInst) hitInst->getSurface(sp, hitt, h, data);
+		else hitt->getSurface(sp, h, data);
 		sp.origin = hitt;
 		sp.data = data;
 		sp.ray = nullptr;
 	}
 	else
 	{
-		if(!vtree) return false;
 		primitive_t *hitprim = nullptr;
-		if( ! vtree->Intersect(ray, dis, &hitprim, Z, data) ){ return false; }
+		if(vbvh)
+		{
+			if( ! vbvh->Intersect(ray, dis, &hitprim, Z, data) ){ return false; }
+		}
+		else
+		{
+			if(!vtree) return false;
+			if( ! vtree->Intersect(ray, dis, &hitprim, Z, data) ){ return false; }
+		}
 		point3d_t h=ray.from + Z*ray.dir;
 		hitprim->getSurface(sp, h, data);
 		sp.origin = hitprim;
@@ -995,20 +1138,45 @@ bool scene_t::intersect(const diffRay_t &ray, surfacePoint_t &sp) const
 	// intersect with tree:
 	if(mode == 0)
 	{
-		if(!tree) return false;
 		triangle_t *hitt = nullptr;
-		if( ! tree->Intersect(ray, dis, &hitt, Z, data) ){ return false; }
+		bool hit = false;
+		if(bvh) hit = bvh->Intersect(ray, dis, &hitt, Z, data);
+		else if(tree) hit = tree->Intersect(ray, dis, &hitt, Z, data);
+		const triangleObjectInstance_t *hitInst = nullptr;
+		if(itree)
+		{
+			const triangle_t *instTri = nullptr;
+			float instZ;
+			intersectData_t instData;
+			if(itree->Intersect(ray, hit ? Z : dis, &instTri, &hitInst, instZ, instData))
+			{
+				hitt = (triangle_t *)instTri;
+				Z = instZ;
+				data = instData;
+				hit = true;
+			}
+			else hitInst = nullptr;
+		}
+		if(!hit) return false;
 		point3d_t h=ray.from + Z*ray.dir;
-		hitt->getSurface(sp, h, data);
+		if(hitInst) hitInst->getSurface(sp, hitt, h, data);
+		else hitt->getSurface(sp, h, data);
 		sp.origin = hitt;
 		sp.data = data;
 		sp.ray = &ray;
 	}
 	else
 	{
-		if(!vtree) return false;
 		primitive_t *hitprim = nullptr;
-		if( ! vtree->Intersect(ray, dis, &hitprim, Z, data) ){ return false; }
+		if(vbvh)
+		{
+			if( ! vbvh->Intersect(ray, dis, &hitprim, Z, data) ){ return false; }
+		}
+		else
+		{
+			if(!vtree) return false;
+			if( ! vtree->Intersect(ray, dis, &hitprim, Z, data) ){ return false; }
+		}
 		point3d_t h=ray.from + Z*ray.dir;
 		hitprim->getSurface(sp, h, data);
 		sp.origin = hitprim;
@@ -1031,11 +1199,15 @@ bool scene_t::isShadowed(renderState_t &state, const ray_t &ray, float &obj_inde
 	if(mode==0)
 	{
 		triangle_t *hitt = nullptr;
-		if(!tree) return false;
-		bool shadowed = tree->IntersectS(sray, dis, &hitt, shadowBias);
+		const triangleObjectInstance_t *hitInst = nullptr;
+		bool shadowed = false;
+		if(bvh) shadowed = bvh->IntersectS(sray, dis, &hitt, shadowBias);
+		else if(tree) shadowed = tree->IntersectS(sray, dis, &hitt, shadowBias);
+		if(!shadowed && itree) shadowed = itree->IntersectS(sray, dis, (const triangle_t **)&hitt, &hitInst, shadowBias);
 		if(hitt)
 		{
-			if(hitt->getMesh()) obj_index = hitt->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
+			if(hitInst) obj_index = hitInst->getAbsObjectIndex();
+			else if(hitt->getMesh()) obj_index = hitt->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
 			if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
 		}
 		return shadowed;
@@ -1043,8 +1215,10 @@ bool scene_t::isShadowed(renderState_t &state, const ray_t &ray, float &obj_inde
 	else
 	{
 		primitive_t *hitt = nullptr;
-		if(!vtree) return false;
-		bool shadowed = vtree->IntersectS(sray, dis, &hitt, shadowBias);
+		bool shadowed;
+		if(vbvh) shadowed = vbvh->IntersectS(sray, dis, &hitt, shadowBias);
+		else if(vtree) shadowed = vtree->IntersectS(sray, dis, &hitt, shadowBias);
+		else return false;
 		if(hitt)
 		{
 			if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
@@ -1053,6 +1227,47 @@ bool scene_t::isShadowed(renderState_t &state, const ray_t &ray, float &obj_inde
 	}
 }
 
+int scene_t::isShadowed4(renderState_t &state, const ray_t *rays, int nRays, float *obj_index, float *mat_index) const
+{
+	int shadowMask = 0;
+	if(mode != 0 || bvh || !tree)
+	{
+		for(int i=0; i<nRays; ++i) if(isShadowed(state, rays[i], obj_index[i], mat_index[i])) shadowMask |= 1 << i;
+		return shadowMask;
+	}
+
+	ray_t srays[4];
+	float dis[4];
+	triangle_t *hitt[4];
+	for(int i=0; i<nRays; ++i)
+	{
+		srays[i] = rays[i];
+		srays[i].from += srays[i].dir * srays[i].tmin;
+		srays[i].time = state.time;
+		if(rays[i].tmax<0) dis[i]=std::numeric_limits<float>::infinity();
+		else dis[i] = srays[i].tmax - 2*srays[i].tmin;
+		hitt[i] = nullptr;
+	}
+	rayPacket4_t packet(srays, nRays);
+	shadowMask = tree->IntersectS4(packet, (1 << nRays) - 1, dis, hitt, shadowBias);
+
+	for(int i=0; i<nRays; ++i)
+	{
+		const triangleObjectInstance_t *hitInst = nullptr;
+		if(!(shadowMask & (1 << i)) && itree)
+		{
+			if(itree->IntersectS(srays[i], dis[i], (const triangle_t **)&hitt[i], &hitInst, shadowBias)) shadowMask |= 1 << i;
+		}
+		if(hitt[i])
+		{
+			if(hitInst) obj_index[i] = hitInst->getAbsObjectIndex();
+			else if(hitt[i]->getMesh()) obj_index[i] = hitt[i]->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
+			if(hitt[i]->getMaterial()) mat_index[i] = hitt[i]->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
+		}
+	}
+	return shadowMask;
+}
+
 bool scene_t::isShadowed(renderState_t &state, const ray_t &ray, int maxDepth, color_t &filt, float &obj_index, float &mat_index) const
 {
 	ray_t sray(ray);
@@ -1068,12 +1283,16 @@ bool scene_t::isShadowed(renderState_t &state, const ray_t &ray, int maxDepth, c
 	if(mode==0)
 	{
 		triangle_t *hitt = nullptr;
-		if(tree) 
+		const triangleObjectInstance_t *hitInst = nullptr;
+		if(tree || bvh || itree)
 		{
-			isect = tree->IntersectTS(state, sray, maxDepth, dis, &hitt, filt, shadowBias);
+			if(bvh) isect = bvh->IntersectTS(state, sray, maxDepth, dis, &hitt, filt, shadowBias);
+			else if(tree) isect = tree->IntersectTS(state, sray, maxDepth, dis, &hitt, filt, shadowBias);
+			if(!isect && itree) isect = itree->IntersectTS(state, sray, maxDepth, dis, (const triangle_t **)&hitt, &hitInst, filt, shadowBias);
 			if(hitt)
 			{
-				if(hitt->getMesh()) obj_index = hitt->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
+				if(hitInst) obj_index = hitInst->getAbsObjectIndex();
+				else if(hitt->getMesh()) obj_index = hitt->getMesh()->getAbsObjectIndex();	//Object index of the object casting the shadow
 				if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
 			}
 		}
@@ -1081,9 +1300,10 @@ bool scene_t::isShadowed(renderState_t &state, const ray_t &ray, int maxDepth, c
 	else
 	{
 		primitive_t *hitt = nullptr;
-		if(vtree)
+		if(vtree || vbvh)
 		{
-			isect = vtree->IntersectTS(state, sray, maxDepth, dis, &hitt, filt, shadowBias);
+			if(vbvh) isect = vbvh->IntersectTS(state, sray, maxDepth, dis, &hitt, filt, shadowBias);
+			else isect = vtree->IntersectTS(state, sray, maxDepth, dis, &hitt, filt, shadowBias);
 			if(hitt)
 			{
 				if(hitt->getMaterial()) mat_index = hitt->getMaterial()->getAbsMaterialIndex();	//Material index of the object casting the shadow
@@ -1110,6 +1330,23 @@ bool scene_t::render()
 		return false;
 	}
 
+	views.clear();
+
+	if(imageFilm->getNumViews() > 1)
+	{
+		//all views side by side in one film: the scene is updated and lights/integrator preprocessed only once
+		for(auto cam_table_entry = camera_table->begin(); cam_table_entry != camera_table->end(); ++cam_table_entry) views.push_back(cam_table_entry->second);
+		setCamera(views.front());
+		if(!update()) { views.clear(); return false; }
+
+		success = surfIntegrator->render(0, imageFilm);
+
+		surfIntegrator->cleanup();
+		for(int numView = 0; numView < (int) views.size(); ++numView) imageFilm->flush(numView);
+		views.clear();
+		return success;
+	}
+
 	for(auto cam_table_entry = camera_table->begin(); cam_table_entry != camera_table->end(); ++cam_table_entry)
     {
 		int numView = distance(camera_table->begin(), cam_table_entry);
@@ -1180,6 +1417,7 @@ bool scene_t::addInstance(objID_t baseObjectId, matrix4x4_t objToWorld)
 		objData_t &base = meshes[baseObjectId];
 
 		od.obj = new triangleObjectInstance_t(base.obj, objToWorld);
+		od.type = TRIM;
 
 		return true;
 	}
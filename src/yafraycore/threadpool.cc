@@ -0,0 +1,189 @@
+#include <yafraycore/threadpool.h>
+#include <algorithm>
+
+#if defined(__linux__)
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+__BEGIN_YAFRAY
+
+threadPool_t::threadPool_t(int threads)
+{
+	resize(threads);
+}
+
+threadPool_t::~threadPool_t()
+{
+	stop();
+}
+
+void threadPool_t::stop()
+{
+	{
+		std::lock_guard<std::mutex> lk(m);
+		quit = true;
+	}
+	taskAvailable.notify_all();
+	for(auto& t : workers) t.join();
+	workers.clear();
+	quit = false;
+}
+
+void threadPool_t::resize(int threads, bool pin)
+{
+	threads = std::max(1, threads);
+	if(threads == size() && pin == pinned) return;
+
+	stop();
+	pinned = pin;
+	for(int i=0; i<threads; ++i) workers.push_back(std::thread(&threadPool_t::workerLoop, this, i));
+
+#if defined(__linux__)
+	if(pinned)
+	{
+		int nCpus = std::max(1, (int)std::thread::hardware_concurrency());
+		for(int i=0; i<threads; ++i)
+		{
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(i % nCpus, &cpus);
+			if(pthread_setaffinity_np(workers[i].native_handle(), sizeof(cpu_set_t), &cpus) != 0) Y_WARNING << "ThreadPool: could not pin worker " << i << " to CPU " << (i % nCpus) << yendl;
+		}
+	}
+#else
+	if(pinned) Y_WARNING << "ThreadPool: thread pinning is not supported on this platform" << yendl;
+#endif
+
+	Y_VERBOSE << "ThreadPool: " << threads << " worker threads" << (pinned ? " pinned to CPUs" : "") << yendl;
+}
+
+void threadPool_t::run(taskGroup_t &group, std::function<void()> task)
+{
+	++group.pending;
+	{
+		std::lock_guard<std::mutex> lk(m);
+		tasks.push_back({std::move(task), &group});
+	}
+	taskAvailable.notify_one();
+}
+
+bool threadPool_t::runOne(std::unique_lock<std::mutex> &lk, const taskGroup_t *group)
+{
+	auto it = tasks.begin();
+	if(group) it = std::find_if(tasks.begin(), tasks.end(), [group](const task_t &t){ return t.group == group; });
+	if(it == tasks.end()) return false;
+	task_t task = std::move(*it);
+	tasks.erase(it);
+	lk.unlock();
+	std::exception_ptr error;
+	try { task.func(); }
+	catch(...) { error = std::current_exception(); }
+	lk.lock();
+	if(error && !task.group->error) task.group->error = error;
+	// decremented with m held so wait() cannot miss the notification
+	--task.group->pending;
+	taskDone.notify_all();
+	return true;
+}
+
+void threadPool_t::workerLoop(int id)
+{
+	std::unique_lock<std::mutex> lk(m);
+	while(true)
+	{
+		taskAvailable.wait(lk, [this]{ return quit || !tasks.empty(); });
+		if(tasks.empty()) return;
+		runOne(lk);
+	}
+}
+
+void threadPool_t::wait(taskGroup_t &group)
+{
+	std::unique_lock<std::mutex> lk(m);
+	while(group.pending > 0)
+	{
+		if(!runOne(lk, &group)) taskDone.wait(lk);
+	}
+	if(group.error)
+	{
+		std::exception_ptr error = group.error;
+		group.error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void threadPool_t::parallelFor(int begin, int end, const std::function<void(int)> &body, int maxTasks)
+{
+	if(end <= begin) return;
+	if(maxTasks <= 0) maxTasks = size() + 1;
+	int nTasks = std::min(end - begin, maxTasks);
+
+	std::atomic<int> next(begin);
+	auto loop = [&]()
+	{
+		for(int i = next++; i < end; i = next++) body(i);
+	};
+
+	taskGroup_t group;
+	for(int i=1; i<nTasks; ++i) run(group, loop);
+	// the tasks use next and body, so they have to finish before an exception of ours leaves
+	try { loop(); }
+	catch(...)
+	{
+		next = end;
+		try { wait(group); } catch(...) {}
+		throw;
+	}
+	wait(group);
+}
+
+serialQueue_t::serialQueue_t()
+{
+	worker = std::thread(&serialQueue_t::workerLoop, this);
+}
+
+serialQueue_t::~serialQueue_t()
+{
+	{
+		std::lock_guard<std::mutex> lk(m);
+		quit = true;
+	}
+	taskAvailable.notify_one();
+	worker.join();
+}
+
+void serialQueue_t::push(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lk(m);
+		tasks.push_back(std::move(task));
+	}
+	taskAvailable.notify_one();
+}
+
+void serialQueue_t::wait()
+{
+	std::unique_lock<std::mutex> lk(m);
+	idle.wait(lk, [this]{ return tasks.empty() && !busy; });
+}
+
+void serialQueue_t::workerLoop()
+{
+	std::unique_lock<std::mutex> lk(m);
+	while(true)
+	{
+		taskAvailable.wait(lk, [this]{ return quit || !tasks.empty(); });
+		if(tasks.empty()) return;
+		std::function<void()> task = std::move(tasks.front());
+		tasks.pop_front();
+		busy = true;
+		lk.unlock();
+		task();
+		lk.lock();
+		busy = false;
+		if(tasks.empty()) idle.notify_all();
+	}
+}
+
+__END_YAFRAY
@@ -367,6 +367,14 @@ inline void triangleInstance_t::sample(float s1, float s2, point3d_t &p, vector3
 	n = getNormal();
 }
 
+// triangleObjectInstance_t surface, needs the inlined triangleInstance_t methods
+
+void triangleObjectInstance_t::getSurface(surfacePoint_t &sp, const triangle_t *baseTri, const point3d_t &hit, intersectData_t &data) const
+{
+	triangleInstance_t tri(baseTri, this);
+	tri.getSurface(sp, hit, data);
+}
+
 //==========================================
 // vTriangle_t methods, mosty c&p...
 //==========================================